@@ -76,7 +76,8 @@ int stopwatch_hardirq_show(struct seq_file *f, void *v)
 	int cpu;
 
 	if (irq == 0)
-		seq_printf(f, "%20s\tCPU\tmin(us)\tavg(us)\tmax(us)\n\n", "");
+		seq_printf(f, "%20s\tCPU\tmin(us)\tavg(us)\tp50(us)\tp99(us)"
+			"\tmax(us)\n\n", "");
 
 	if (irq == NR_IRQS)
 		seq_printf(f, "%-20s", "softirq");
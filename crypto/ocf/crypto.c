@@ -143,20 +143,20 @@ struct cryptocap {
 	int		cc_qblocked;		/* (q) symmetric q blocked */
 	int		cc_kqblocked;		/* (q) asymmetric q blocked */
 
-	int		cc_unqblocked;		/* (q) symmetric q blocked */
+	u_int32_t	cc_unqblocked;		/* (q) crypto_unblock() count */
 	int		cc_unkqblocked;		/* (q) asymmetric q blocked */
 };
 static struct cryptocap *crypto_drivers = NULL;
 static int crypto_drivers_num = 0;
 
 /*
- * There are two queues for crypto requests; one for symmetric (e.g.
- * cipher) operations and one for asymmetric (e.g. MOD)operations.
- * A single mutex is used to lock access to both queues.  We could
- * have one per-queue but having one simplifies handling of block/unblock
- * operations.
+ * There are two kinds of queue for crypto requests; one for symmetric
+ * (e.g. cipher) operations and one for asymmetric (e.g. MOD)operations.
+ * Symmetric requests are queued on the submitting CPU and dispatched by
+ * that CPU's thread (see struct crypto_cpu_queue below).  Asymmetric
+ * requests are rare and share a single queue.  CRYPTO_Q_LOCK() covers
+ * the asymmetric queue and the driver block/unblock state.
  */
-static LIST_HEAD(crp_q);		/* crypto request queue */
 static LIST_HEAD(crp_kq);		/* asym request queue */
 
 static spinlock_t crypto_q_lock;
@@ -169,7 +169,7 @@ int cpu_begin = 0;  /* protect with Q_LOCK */
 module_param(cpu_begin, int, 0444);
 MODULE_PARM_DESC(cpu_begin, "begin cpu");
 
-int cpu_end = 1;  /* protect with Q_LOCK */
+int cpu_end = CONFIG_NR_CPUS;  /* protect with Q_LOCK */
 module_param(cpu_end, int, 0444);
 MODULE_PARM_DESC(cpu_end, "end cpu");
 
@@ -189,28 +189,55 @@ MODULE_PARM_DESC(crypto_all_kqblocked, "Are all asym crypto queues blocked");
 			 })
 
 /*
+ * Per-CPU request and completion queues, each served by its own pair of
+ * threads bound to that CPU.
+ *
  * There are two queues for processing completed crypto requests; one
  * for the symmetric and one for the asymmetric ops.  We only need one
- * but have two to avoid type futzing (cryptop vs. cryptkop).  A single
- * mutex is used to lock access to both queues.  Note that this lock
- * must be separate from the lock on request queues to insure driver
- * callbacks don't generate lock order reversals.
+ * but have two to avoid type futzing (cryptop vs. cryptkop).  Note that
+ * the return lock must be separate from the request queue lock to insure
+ * driver callbacks don't generate lock order reversals.
+ *
+ * Synchronization:
+ * (c) - protected by CRYPTO_CPUQ_LOCK()
+ * (r) - protected by CRYPTO_RETQ_LOCK()
  */
-static LIST_HEAD(crp_ret_q);		/* callback queues */
-static LIST_HEAD(crp_ret_kq);
-
-static spinlock_t crypto_ret_q_lock;
-#define	CRYPTO_RETQ_LOCK() \
+struct crypto_cpu_queue {
+	spinlock_t		cq_lock;
+	struct list_head	cq_q;		/* (c) symmetric requests */
+	int			cq_qblocked;	/* (c) all of cq_q is blocked */
+	wait_queue_head_t	cq_wait;
+	struct task_struct	*cq_proc;
+
+	spinlock_t		cq_ret_lock;
+	struct list_head	cq_ret_q;	/* (r) completed requests */
+	struct list_head	cq_ret_kq;	/* (r) completed asym requests */
+	wait_queue_head_t	cq_ret_wait;
+	struct task_struct	*cq_retproc;
+} ____cacheline_aligned_in_smp;
+
+#define	CRYPTO_CPUQ_LOCK(cq) \
+			({ \
+				spin_lock_irqsave(&(cq)->cq_lock, c_flags); \
+				dprintk("%s,%d: CPUQ_LOCK\n", __FILE__, __LINE__); \
+			 })
+#define	CRYPTO_CPUQ_UNLOCK(cq) \
 			({ \
-				spin_lock_irqsave(&crypto_ret_q_lock, r_flags); \
+			 	dprintk("%s,%d: CPUQ_UNLOCK\n", __FILE__, __LINE__); \
+				spin_unlock_irqrestore(&(cq)->cq_lock, c_flags); \
+			 })
+#define	CRYPTO_RETQ_LOCK(cq) \
+			({ \
+				spin_lock_irqsave(&(cq)->cq_ret_lock, r_flags); \
 				dprintk("%s,%d: RETQ_LOCK\n", __FILE__, __LINE__); \
 			 })
-#define	CRYPTO_RETQ_UNLOCK() \
+#define	CRYPTO_RETQ_UNLOCK(cq) \
 			({ \
 			 	dprintk("%s,%d: RETQ_UNLOCK\n", __FILE__, __LINE__); \
-				spin_unlock_irqrestore(&crypto_ret_q_lock, r_flags); \
+				spin_unlock_irqrestore(&(cq)->cq_ret_lock, r_flags); \
 			 })
-#define	CRYPTO_RETQ_EMPTY()	(list_empty(&crp_ret_q) && list_empty(&crp_ret_kq))
+#define	CRYPTO_RETQ_EMPTY(cq) \
+			(list_empty(&(cq)->cq_ret_q) && list_empty(&(cq)->cq_ret_kq))
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 static kmem_cache_t *cryptop_zone;
@@ -237,8 +264,38 @@ EXPORT_SYMBOL(crypto_debug);
  * slow,  printing anything will just kill us
  */
 
-static int crypto_q_cnt = 0;
-module_param(crypto_q_cnt, int, 0444);
+static atomic_t crypto_q_cnt = ATOMIC_INIT(0);
+
+/* crypto_q_cnt is read-only, the setter only exists to refuse writes */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+static int crypto_q_cnt_set(const char *val, const struct kernel_param *kp)
+{
+	return -EPERM;
+}
+
+static int crypto_q_cnt_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%d", atomic_read(&crypto_q_cnt));
+}
+
+static struct kernel_param_ops crypto_q_cnt_ops = {
+	.set = crypto_q_cnt_set,
+	.get = crypto_q_cnt_get,
+};
+module_param_cb(crypto_q_cnt, &crypto_q_cnt_ops, NULL, 0444);
+#else
+static int crypto_q_cnt_set(const char *val, struct kernel_param *kp)
+{
+	return -EPERM;
+}
+
+static int crypto_q_cnt_get(char *buffer, struct kernel_param *kp)
+{
+	return sprintf(buffer, "%d", atomic_read(&crypto_q_cnt));
+}
+
+module_param_call(crypto_q_cnt, crypto_q_cnt_set, crypto_q_cnt_get, NULL, 0444);
+#endif
 MODULE_PARM_DESC(crypto_q_cnt,
 		"Current number of outstanding crypto requests");
 
@@ -280,14 +337,23 @@ module_param(crypto_max_loopcount, int, 0644);
 MODULE_PARM_DESC(crypto_max_loopcount,
 	   "Maximum number of crypto ops to do before yielding to other processes");
 
+/*
+ * The most requests handed back to back to a driver that registered
+ * with CRYPTOCAP_F_BATCH, all but the last carrying CRYPTO_HINT_MORE.
+ */
+static int crypto_batch_max = 32;
+module_param(crypto_batch_max, int, 0644);
+MODULE_PARM_DESC(crypto_batch_max,
+	   "Maximum number of crypto ops to submit to a batching driver at once");
+
 #ifndef CONFIG_NR_CPUS
 #define CONFIG_NR_CPUS 1
 #endif
 
-static struct task_struct *cryptoproc[CONFIG_NR_CPUS];
-static struct task_struct *cryptoretproc[CONFIG_NR_CPUS];
-static DECLARE_WAIT_QUEUE_HEAD(cryptoproc_wait);
-static DECLARE_WAIT_QUEUE_HEAD(cryptoretproc_wait);
+static struct crypto_cpu_queue crypto_queues[CONFIG_NR_CPUS];
+static int crypto_queue_cpus[CONFIG_NR_CPUS];	/* CPUs with threads */
+static int crypto_nqueues;
+static u_int32_t crypto_unblock_seq;		/* (q) */
 
 static	int crypto_proc(void *arg);
 static	int crypto_ret_proc(void *arg);
@@ -772,6 +838,46 @@ crypto_unregister_all(u_int32_t driverid)
 	return err;
 }
 
+/*
+ * The queue for requests submitted or completed on this CPU.  CPUs
+ * outside cpu_begin..cpu_end share the queues of those that are.  The
+ * choice only affects locality, so preemption doesn't matter here.
+ */
+static struct crypto_cpu_queue *
+crypto_this_queue(void)
+{
+	int cpu = raw_smp_processor_id();
+
+	if (crypto_queues[cpu].cq_proc == NULL)
+		cpu = crypto_queue_cpus[cpu % crypto_nqueues];
+	return &crypto_queues[cpu];
+}
+
+/*
+ * Asymmetric requests are run by the first CPU's dispatch thread.
+ */
+static inline struct crypto_cpu_queue *
+crypto_kq_queue(void)
+{
+	return &crypto_queues[crypto_queue_cpus[0]];
+}
+
+/*
+ * A driver returned ERESTART for a request handed to it when its unblock
+ * count was gen.  Mark it blocked for cryptop's unless crypto_unblock()
+ * has run since, in which case the request is simply retried.
+ */
+static void
+crypto_driver_blocked(u_int32_t hid, u_int32_t gen)
+{
+	unsigned long q_flags;
+
+	CRYPTO_Q_LOCK();
+	if (crypto_drivers[hid].cc_unqblocked == gen)
+		crypto_drivers[hid].cc_qblocked = 1;
+	CRYPTO_Q_UNLOCK();
+}
+
 /*
  * Clear blockage on a driver.  The what parameter indicates whether
  * the driver is now ready for cryptop's and/or cryptokop's.
@@ -779,16 +885,18 @@ crypto_unregister_all(u_int32_t driverid)
 int
 crypto_unblock(u_int32_t driverid, int what)
 {
+	struct crypto_cpu_queue *cq;
 	struct cryptocap *cap;
-	int err;
-	unsigned long q_flags;
+	int err, i;
+	unsigned long q_flags, c_flags;
 
 	CRYPTO_Q_LOCK();
 	cap = crypto_checkdriver(driverid);
 	if (cap != NULL) {
 		if (what & CRYPTO_SYMQ) {
 			cap->cc_qblocked = 0;
-			cap->cc_unqblocked = 0;
+			cap->cc_unqblocked++;
+			crypto_unblock_seq++;
 			crypto_all_qblocked = 0;
 		}
 		if (what & CRYPTO_ASYMQ) {
@@ -796,12 +904,21 @@ crypto_unblock(u_int32_t driverid, int what)
 			cap->cc_unkqblocked = 0;
 			crypto_all_kqblocked = 0;
 		}
-		wake_up_interruptible(&cryptoproc_wait);
 		err = 0;
 	} else
 		err = EINVAL;
 	CRYPTO_Q_UNLOCK(); //DAVIDM should this be a driver lock
 
+	if (err == 0) {
+		for (i = 0; i < crypto_nqueues; i++) {
+			cq = &crypto_queues[crypto_queue_cpus[i]];
+			CRYPTO_CPUQ_LOCK(cq);
+			cq->cq_qblocked = 0;
+			CRYPTO_CPUQ_UNLOCK(cq);
+			wake_up_interruptible(&cq->cq_wait);
+		}
+	}
+
 	return err;
 }
 
@@ -811,21 +928,21 @@ crypto_unblock(u_int32_t driverid, int what)
 int
 crypto_dispatch(struct cryptop *crp)
 {
+	struct crypto_cpu_queue *cq;
 	struct cryptocap *cap;
+	u_int32_t hid, gen;
 	int result = -1;
-	unsigned long q_flags;
+	unsigned long c_flags;
 
 	dprintk("%s()\n", __FUNCTION__);
 
 	cryptostats.cs_ops++;
 
-	CRYPTO_Q_LOCK();
-	if (crypto_q_cnt >= crypto_q_max) {
+	if (atomic_inc_return(&crypto_q_cnt) > crypto_q_max) {
+		atomic_dec(&crypto_q_cnt);
 		cryptostats.cs_drops++;
-		CRYPTO_Q_UNLOCK();
 		return ENOMEM;
 	}
-	crypto_q_cnt++;
 
 	/* make sure we are starting a fresh run on this crp. */
 	crp->crp_flags &= ~CRYPTO_F_DONE;
@@ -836,22 +953,23 @@ crypto_dispatch(struct cryptop *crp)
 	 * it directly to the driver unless the driver is currently blocked.
 	 */
 	if ((crp->crp_flags & CRYPTO_F_BATCH) == 0) {
-		int hid = CRYPTO_SESID2HID(crp->crp_sid);
+		hid = CRYPTO_SESID2HID(crp->crp_sid);
 		cap = crypto_checkdriver(hid);
 		/* Driver cannot disappear when there is an active session. */
 		KASSERT(cap != NULL, ("%s: Driver disappeared.", __func__));
 		if (!cap->cc_qblocked) {
-			crypto_all_qblocked = 0;
-			crypto_drivers[hid].cc_unqblocked = 1;
-			CRYPTO_Q_UNLOCK();
+			gen = cap->cc_unqblocked;
+			smp_rmb();
 			result = crypto_invoke(cap, crp, 0);
-			CRYPTO_Q_LOCK();
 			if (result == ERESTART)
-				if (crypto_drivers[hid].cc_unqblocked)
-					crypto_drivers[hid].cc_qblocked = 1;
-			crypto_drivers[hid].cc_unqblocked = 0;
+				crypto_driver_blocked(hid, gen);
 		}
 	}
+	if (result != ERESTART && result != -1)
+		return result;
+
+	cq = crypto_this_queue();
+	CRYPTO_CPUQ_LOCK(cq);
 	if (result == ERESTART) {
 		/*
 		 * The driver ran out of resources, mark the
@@ -862,16 +980,14 @@ crypto_dispatch(struct cryptop *crp)
 		 * at the front.  This should be ok; putting
 		 * it at the end does not work.
 		 */
-		list_add(&crp->crp_next, &crp_q);
+		list_add(&crp->crp_next, &cq->cq_q);
 		cryptostats.cs_blocks++;
-		result = 0;
-	} else if (result == -1) {
-		TAILQ_INSERT_TAIL(&crp_q, crp, crp_next);
-		result = 0;
-	}
-	wake_up_interruptible(&cryptoproc_wait);
-	CRYPTO_Q_UNLOCK();
-	return result;
+	} else
+		list_add_tail(&crp->crp_next, &cq->cq_q);
+	cq->cq_qblocked = 0;
+	CRYPTO_CPUQ_UNLOCK(cq);
+	wake_up_interruptible(&cq->cq_wait);
+	return 0;
 }
 
 /*
@@ -890,8 +1006,8 @@ crypto_kdispatch(struct cryptkop *krp)
 	if (error == ERESTART) {
 		CRYPTO_Q_LOCK();
 		TAILQ_INSERT_TAIL(&crp_kq, krp, krp_next);
-		wake_up_interruptible(&cryptoproc_wait);
 		CRYPTO_Q_UNLOCK();
+		wake_up_interruptible(&crypto_kq_queue()->cq_wait);
 		error = 0;
 	}
 	return error;
@@ -1092,23 +1208,28 @@ crypto_freereq(struct cryptop *crp)
 
 #ifdef DIAGNOSTIC
 	{
+		struct crypto_cpu_queue *cq;
 		struct cryptop *crp2;
-		unsigned long q_flags;
-
-		CRYPTO_Q_LOCK();
-		TAILQ_FOREACH(crp2, &crp_q, crp_next) {
-			KASSERT(crp2 != crp,
-			    ("Freeing cryptop from the crypto queue (%p).",
-			    crp));
-		}
-		CRYPTO_Q_UNLOCK();
-		CRYPTO_RETQ_LOCK();
-		TAILQ_FOREACH(crp2, &crp_ret_q, crp_next) {
-			KASSERT(crp2 != crp,
-			    ("Freeing cryptop from the return queue (%p).",
-			    crp));
+		unsigned long c_flags, r_flags;
+		int i;
+
+		for (i = 0; i < crypto_nqueues; i++) {
+			cq = &crypto_queues[crypto_queue_cpus[i]];
+			CRYPTO_CPUQ_LOCK(cq);
+			TAILQ_FOREACH(crp2, &cq->cq_q, crp_next) {
+				KASSERT(crp2 != crp,
+				    ("Freeing cryptop from the crypto queue (%p).",
+				    crp));
+			}
+			CRYPTO_CPUQ_UNLOCK(cq);
+			CRYPTO_RETQ_LOCK(cq);
+			TAILQ_FOREACH(crp2, &cq->cq_ret_q, crp_next) {
+				KASSERT(crp2 != crp,
+				    ("Freeing cryptop from the return queue (%p).",
+				    crp));
+			}
+			CRYPTO_RETQ_UNLOCK(cq);
 		}
-		CRYPTO_RETQ_UNLOCK();
 	}
 #endif
 
@@ -1153,14 +1274,10 @@ crypto_getreq(int num)
 void
 crypto_done(struct cryptop *crp)
 {
-	unsigned long q_flags;
-
 	dprintk("%s()\n", __FUNCTION__);
 	if ((crp->crp_flags & CRYPTO_F_DONE) == 0) {
 		crp->crp_flags |= CRYPTO_F_DONE;
-		CRYPTO_Q_LOCK();
-		crypto_q_cnt--;
-		CRYPTO_Q_UNLOCK();
+		atomic_dec(&crypto_q_cnt);
 	} else
 		printk("crypto: crypto_done op already done, flags 0x%x",
 				crp->crp_flags);
@@ -1183,14 +1300,20 @@ crypto_done(struct cryptop *crp)
 		 */
 		crp->crp_callback(crp);
 	} else {
+		struct crypto_cpu_queue *cq = crypto_this_queue();
 		unsigned long r_flags;
+		int wake;
 		/*
-		 * Normal case; queue the callback for the thread.
+		 * Normal case; queue the callback for this CPU's thread.
+		 * Only the first completion needs to wake it, it takes
+		 * everything queued by the time it runs.
 		 */
-		CRYPTO_RETQ_LOCK();
-		wake_up_interruptible(&cryptoretproc_wait);/* shared wait channel */
-		TAILQ_INSERT_TAIL(&crp_ret_q, crp, crp_next);
-		CRYPTO_RETQ_UNLOCK();
+		CRYPTO_RETQ_LOCK(cq);
+		wake = CRYPTO_RETQ_EMPTY(cq);
+		TAILQ_INSERT_TAIL(&cq->cq_ret_q, crp, crp_next);
+		CRYPTO_RETQ_UNLOCK(cq);
+		if (wake)
+			wake_up_interruptible(&cq->cq_ret_wait);
 	}
 }
 
@@ -1233,14 +1356,18 @@ crypto_kdone(struct cryptkop *krp)
 		 */
 		krp->krp_callback(krp);
 	} else {
+		struct crypto_cpu_queue *cq = crypto_this_queue();
 		unsigned long r_flags;
+		int wake;
 		/*
 		 * Normal case; queue the callback for the thread.
 		 */
-		CRYPTO_RETQ_LOCK();
-		wake_up_interruptible(&cryptoretproc_wait);/* shared wait channel */
-		TAILQ_INSERT_TAIL(&crp_ret_kq, krp, krp_next);
-		CRYPTO_RETQ_UNLOCK();
+		CRYPTO_RETQ_LOCK(cq);
+		wake = CRYPTO_RETQ_EMPTY(cq);
+		TAILQ_INSERT_TAIL(&cq->cq_ret_kq, krp, krp_next);
+		CRYPTO_RETQ_UNLOCK(cq);
+		if (wake)
+			wake_up_interruptible(&cq->cq_ret_wait);
 	}
 }
 
@@ -1268,39 +1395,131 @@ crypto_getfeat(int *featp)
 }
 
 /*
- * Crypto thread, dispatches crypto requests.
+ * Run the first asymmetric request that can be processed.  Returns
+ * non-zero if one was handed to a driver.
  */
 static int
-crypto_proc(void *arg)
+crypto_kproc(void)
 {
-	struct cryptop *crp, *submit;
 	struct cryptkop *krp, *krpp;
 	struct cryptocap *cap;
-	u_int32_t hid;
-	int result, hint;
+	int result;
 	unsigned long q_flags;
+
+	CRYPTO_Q_LOCK();
+	crypto_all_kqblocked = !list_empty(&crp_kq);
+
+	krp = NULL;
+	list_for_each_entry(krpp, &crp_kq, krp_next) {
+		cap = crypto_checkdriver(krpp->krp_hid);
+		if (cap == NULL || cap->cc_dev == NULL) {
+			/*
+			 * Operation needs to be migrated, invalidate
+			 * the assigned device so it will reselect a
+			 * new one below.  Propagate the original
+			 * crid selection flags if supplied.
+			 */
+			krpp->krp_hid = krpp->krp_crid &
+			    (CRYPTOCAP_F_SOFTWARE|CRYPTOCAP_F_HARDWARE);
+			if (krpp->krp_hid == 0)
+				krpp->krp_hid =
+				    CRYPTOCAP_F_SOFTWARE|CRYPTOCAP_F_HARDWARE;
+			krp = krpp;
+			break;
+		}
+		if (!cap->cc_kqblocked) {
+			krp = krpp;
+			break;
+		}
+	}
+	if (krp != NULL) {
+		crypto_all_kqblocked = 0;
+		list_del(&krp->krp_next);
+		crypto_drivers[krp->krp_hid].cc_kqblocked = 1;
+		CRYPTO_Q_UNLOCK();
+		result = crypto_kinvoke(krp, krp->krp_hid);
+		CRYPTO_Q_LOCK();
+		if (result == ERESTART) {
+			/*
+			 * The driver ran out of resources, mark the
+			 * driver ``blocked'' for cryptkop's and put
+			 * the request back in the queue.  It would
+			 * best to put the request back where we got
+			 * it but that's hard so for now we put it
+			 * at the front.  This should be ok; putting
+			 * it at the end does not work.
+			 */
+			/* XXX validate sid again? */
+			list_add(&krp->krp_next, &crp_kq);
+			cryptostats.cs_kblocks++;
+		} else
+			crypto_drivers[krp->krp_hid].cc_kqblocked = 0;
+	}
+	CRYPTO_Q_UNLOCK();
+	return krp != NULL;
+}
+
+/*
+ * Pull the next run of requests for one driver off run and onto batch.
+ * Drivers that registered with CRYPTOCAP_F_BATCH get every queued
+ * request for them, up to crypto_batch_max, in submission order.
+ * Everyone else gets one at a time.
+ */
+static void
+crypto_take_batch(struct list_head *run, struct list_head *batch,
+		struct cryptocap *cap, u_int32_t hid)
+{
+	struct cryptop *crp, *next;
+	int n = 0;
+
+	if (cap->cc_dev == NULL || (cap->cc_flags & CRYPTOCAP_F_BATCH) == 0) {
+		list_move_tail(run->next, batch);
+		return;
+	}
+	list_for_each_entry_safe(crp, next, run, crp_next) {
+		if (CRYPTO_SESID2HID(crp->crp_sid) != hid)
+			continue;
+		list_move_tail(&crp->crp_next, batch);
+		if (++n >= crypto_batch_max)
+			break;
+	}
+}
+
+/*
+ * Crypto thread, dispatches crypto requests.  There is one per CPU,
+ * each taking everything queued on its CPU in one go and handing it
+ * to the drivers without holding any lock.  Requests for blocked
+ * drivers are put back at the front of the queue, in order.
+ */
+static int
+crypto_proc(void *arg)
+{
+	struct crypto_cpu_queue *cq = arg;
+	struct cryptop *crp;
+	struct cryptocap *cap;
+	struct list_head run, batch, blocked;
+	u_int32_t hid, gen, seq;
+	int result, hint, dispatched, arrived, kq;
+	unsigned long c_flags;
 	int loopcount = 0;
 
-	set_current_state(TASK_INTERRUPTIBLE);
+	INIT_LIST_HEAD(&run);
+	INIT_LIST_HEAD(&batch);
+	INIT_LIST_HEAD(&blocked);
+
+	kq = (cq == crypto_kq_queue());
 
-	CRYPTO_Q_LOCK();
 	for (;;) {
-		/*
-		 * we need to make sure we don't get into a busy loop with nothing
-		 * to do,  the two crypto_all_*blocked vars help us find out when
-		 * we are all full and can do nothing on any driver or Q.  If so we
-		 * wait for an unblock.
-		 */
-		crypto_all_qblocked  = !list_empty(&crp_q);
+		seq = crypto_unblock_seq;
+		smp_rmb();
 
-		/*
-		 * Find the first element in the queue that can be
-		 * processed and look-ahead to see if multiple ops
-		 * are ready for the same driver.
-		 */
-		submit = NULL;
-		hint = 0;
-		list_for_each_entry(crp, &crp_q, crp_next) {
+		CRYPTO_CPUQ_LOCK(cq);
+		list_splice_init(&cq->cq_q, &run);
+		CRYPTO_CPUQ_UNLOCK(cq);
+
+		dispatched = 0;
+		while (!list_empty(&run)) {
+			crp = list_first_entry(&run, struct cryptop, crp_next);
 			hid = CRYPTO_SESID2HID(crp->crp_sid);
 			cap = crypto_checkdriver(hid);
 			/*
@@ -1309,114 +1528,81 @@ crypto_proc(void *arg)
 			 */
 			KASSERT(cap != NULL, ("%s:%u Driver disappeared.",
 			    __func__, __LINE__));
-			if (cap == NULL || cap->cc_dev == NULL) {
-				/* Op needs to be migrated, process it. */
-				if (submit == NULL)
-					submit = crp;
-				break;
+			/* Ops for a departed driver get migrated by crypto_invoke */
+			if (cap->cc_dev != NULL && cap->cc_qblocked) {
+				list_move_tail(&crp->crp_next, &blocked);
+				continue;
 			}
-			if (!cap->cc_qblocked) {
-				if (submit != NULL) {
+
+			crypto_take_batch(&run, &batch, cap, hid);
+			gen = cap->cc_unqblocked;
+			smp_rmb();
+			while (!list_empty(&batch)) {
+				crp = list_first_entry(&batch, struct cryptop,
+						crp_next);
+				list_del_init(&crp->crp_next);
+				/*
+				 * Tell the driver more ops are coming if the
+				 * rest of the batch is for it, or, as before,
+				 * if the caller asked for batching and the
+				 * next queued op happens to be for it too.
+				 */
+				hint = 0;
+				if (!list_empty(&batch))
+					hint = CRYPTO_HINT_MORE;
+				else if ((crp->crp_flags & CRYPTO_F_BATCH) &&
+						!list_empty(&run) &&
+						CRYPTO_SESID2HID(list_first_entry(&run,
+						struct cryptop, crp_next)->crp_sid) == hid)
+					hint = CRYPTO_HINT_MORE;
+				result = crypto_invoke(cap, crp, hint);
+				if (result == ERESTART) {
 					/*
-					 * We stop on finding another op,
-					 * regardless whether its for the same
-					 * driver or not.  We could keep
-					 * searching the queue but it might be
-					 * better to just use a per-driver
-					 * queue instead.
+					 * The driver ran out of resources, mark
+					 * it ``blocked'' for cryptop's and hold
+					 * this op and the rest of its batch.
 					 */
-					if (CRYPTO_SESID2HID(submit->crp_sid) == hid)
-						hint = CRYPTO_HINT_MORE;
+					/* XXX validate sid again? */
+					crypto_driver_blocked(hid, gen);
+					cryptostats.cs_blocks++;
+					list_add(&crp->crp_next, &batch);
+					list_splice_tail_init(&batch, &blocked);
 					break;
-				} else {
-					submit = crp;
-					if ((submit->crp_flags & CRYPTO_F_BATCH) == 0)
-						break;
-					/* keep scanning for more are q'd */
 				}
+				dispatched++;
 			}
-		}
-		if (submit != NULL) {
-			hid = CRYPTO_SESID2HID(submit->crp_sid);
-			crypto_all_qblocked = 0;
-			list_del(&submit->crp_next);
-			crypto_drivers[hid].cc_unqblocked = 1;
-			cap = crypto_checkdriver(hid);
-			CRYPTO_Q_UNLOCK();
-			KASSERT(cap != NULL, ("%s:%u Driver disappeared.",
-			    __func__, __LINE__));
-			result = crypto_invoke(cap, submit, hint);
-			CRYPTO_Q_LOCK();
-			if (result == ERESTART) {
+
+			if (++loopcount > crypto_max_loopcount) {
 				/*
-				 * The driver ran out of resources, mark the
-				 * driver ``blocked'' for cryptop's and put
-				 * the request back in the queue.  It would
-				 * best to put the request back where we got
-				 * it but that's hard so for now we put it
-				 * at the front.  This should be ok; putting
-				 * it at the end does not work.
+				 * Give other processes a chance to run if
+				 * we've been using the CPU exclusively for
+				 * a while.
 				 */
-				/* XXX validate sid again? */
-				list_add(&submit->crp_next, &crp_q);
-				cryptostats.cs_blocks++;
-				if (crypto_drivers[hid].cc_unqblocked)
-					crypto_drivers[hid].cc_qblocked=0;
-				crypto_drivers[hid].cc_unqblocked=0;
+				loopcount = 0;
+				cond_resched();
 			}
-			crypto_drivers[hid].cc_unqblocked = 0;
 		}
 
-		crypto_all_kqblocked = !list_empty(&crp_kq);
-
 		/* As above, but for key ops */
-		krp = NULL;
-		list_for_each_entry(krpp, &crp_kq, krp_next) {
-			cap = crypto_checkdriver(krpp->krp_hid);
-			if (cap == NULL || cap->cc_dev == NULL) {
-				/*
-				 * Operation needs to be migrated, invalidate
-				 * the assigned device so it will reselect a
-				 * new one below.  Propagate the original
-				 * crid selection flags if supplied.
-				 */
-				krp->krp_hid = krp->krp_crid &
-				    (CRYPTOCAP_F_SOFTWARE|CRYPTOCAP_F_HARDWARE);
-				if (krp->krp_hid == 0)
-					krp->krp_hid =
-				    CRYPTOCAP_F_SOFTWARE|CRYPTOCAP_F_HARDWARE;
-				break;
-			}
-			if (!cap->cc_kqblocked) {
-				krp = krpp;
-				break;
-			}
-		}
-		if (krp != NULL) {
-			crypto_all_kqblocked = 0;
-			list_del(&krp->krp_next);
-			crypto_drivers[krp->krp_hid].cc_kqblocked = 1;
-			CRYPTO_Q_UNLOCK();
-			result = crypto_kinvoke(krp, krp->krp_hid);
-			CRYPTO_Q_LOCK();
-			if (result == ERESTART) {
-				/*
-				 * The driver ran out of resources, mark the
-				 * driver ``blocked'' for cryptkop's and put
-				 * the request back in the queue.  It would
-				 * best to put the request back where we got
-				 * it but that's hard so for now we put it
-				 * at the front.  This should be ok; putting
-				 * it at the end does not work.
-				 */
-				/* XXX validate sid again? */
-				list_add(&krp->krp_next, &crp_kq);
-				cryptostats.cs_kblocks++;
-			} else
-				crypto_drivers[krp->krp_hid].cc_kqblocked = 0;
+		if (kq)
+			dispatched += crypto_kproc();
+
+		/*
+		 * Put blocked requests back ahead of anything that arrived
+		 * meanwhile.  The queue only counts as blocked if nothing
+		 * new arrived and no driver was unblocked during the pass.
+		 */
+		CRYPTO_CPUQ_LOCK(cq);
+		arrived = !list_empty(&cq->cq_q);
+		list_splice_init(&blocked, &cq->cq_q);
+		if (!arrived && !list_empty(&cq->cq_q) &&
+				seq == crypto_unblock_seq) {
+			cq->cq_qblocked = 1;
+			crypto_all_qblocked = 1;
 		}
+		CRYPTO_CPUQ_UNLOCK(cq);
 
-		if (submit == NULL && krp == NULL) {
+		if (dispatched == 0 && !arrived) {
 			/*
 			 * Nothing more to be processed.  Sleep until we're
 			 * woken because there are more ops to process.
@@ -1431,13 +1617,13 @@ crypto_proc(void *arg)
 			 */
 			dprintk("%s - sleeping (qe=%d qb=%d kqe=%d kqb=%d)\n",
 					__FUNCTION__,
-					list_empty(&crp_q), crypto_all_qblocked,
+					list_empty(&cq->cq_q), cq->cq_qblocked,
 					list_empty(&crp_kq), crypto_all_kqblocked);
 			loopcount = 0;
-			CRYPTO_Q_UNLOCK();
-			wait_event_interruptible(cryptoproc_wait,
-					!(list_empty(&crp_q) || crypto_all_qblocked) ||
-					!(list_empty(&crp_kq) || crypto_all_kqblocked) ||
+			wait_event_interruptible(cq->cq_wait,
+					!(list_empty(&cq->cq_q) || cq->cq_qblocked) ||
+					(kq && !(list_empty(&crp_kq) ||
+						crypto_all_kqblocked)) ||
 					kthread_should_stop());
 			if (signal_pending (current)) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
@@ -1448,24 +1634,12 @@ crypto_proc(void *arg)
 				spin_unlock_irq(&current->sigmask_lock);
 #endif
 			}
-			CRYPTO_Q_LOCK();
 			dprintk("%s - awake\n", __FUNCTION__);
 			if (kthread_should_stop())
 				break;
 			cryptostats.cs_intrs++;
-		} else if (loopcount > crypto_max_loopcount) {
-			/*
-			 * Give other processes a chance to run if we've
-			 * been using the CPU exclusively for a while.
-			 */
-			loopcount = 0;
-			CRYPTO_Q_UNLOCK();
-			schedule();
-			CRYPTO_Q_LOCK();
 		}
-		loopcount++;
 	}
-	CRYPTO_Q_UNLOCK();
 	return 0;
 }
 
@@ -1473,51 +1647,49 @@ crypto_proc(void *arg)
  * Crypto returns thread, does callbacks for processed crypto requests.
  * Callbacks are done here, rather than in the crypto drivers, because
  * callbacks typically are expensive and would slow interrupt handling.
+ * Each wakeup runs every callback queued on this CPU by then.
  */
 static int
 crypto_ret_proc(void *arg)
 {
-	struct cryptop *crpt;
-	struct cryptkop *krpt;
+	struct crypto_cpu_queue *cq = arg;
+	struct cryptop *crpt, *crpn;
+	struct cryptkop *krpt, *krpn;
+	struct list_head crps, krps;
 	unsigned long  r_flags;
 
-	set_current_state(TASK_INTERRUPTIBLE);
+	INIT_LIST_HEAD(&crps);
+	INIT_LIST_HEAD(&krps);
 
-	CRYPTO_RETQ_LOCK();
 	for (;;) {
 		/* Harvest return q's for completed ops */
-		crpt = NULL;
-		if (!list_empty(&crp_ret_q))
-			crpt = list_entry(crp_ret_q.next, typeof(*crpt), crp_next);
-		if (crpt != NULL)
-			list_del(&crpt->crp_next);
-
-		krpt = NULL;
-		if (!list_empty(&crp_ret_kq))
-			krpt = list_entry(crp_ret_kq.next, typeof(*krpt), krp_next);
-		if (krpt != NULL)
-			list_del(&krpt->krp_next);
-
-		if (crpt != NULL || krpt != NULL) {
-			CRYPTO_RETQ_UNLOCK();
+		CRYPTO_RETQ_LOCK(cq);
+		list_splice_init(&cq->cq_ret_q, &crps);
+		list_splice_init(&cq->cq_ret_kq, &krps);
+		CRYPTO_RETQ_UNLOCK(cq);
+
+		if (!list_empty(&crps) || !list_empty(&krps)) {
 			/*
-			 * Run callbacks unlocked.
+			 * Run callbacks unlocked.  A callback may free or
+			 * resubmit its request, so unlink it first.
 			 */
-			if (crpt != NULL)
+			list_for_each_entry_safe(crpt, crpn, &crps, crp_next) {
+				list_del_init(&crpt->crp_next);
 				crpt->crp_callback(crpt);
-			if (krpt != NULL)
+			}
+			list_for_each_entry_safe(krpt, krpn, &krps, krp_next) {
+				list_del_init(&krpt->krp_next);
 				krpt->krp_callback(krpt);
-			CRYPTO_RETQ_LOCK();
+			}
+			cond_resched();
 		} else {
 			/*
 			 * Nothing more to be processed.  Sleep until we're
 			 * woken because there are more returns to process.
 			 */
 			dprintk("%s - sleeping\n", __FUNCTION__);
-			CRYPTO_RETQ_UNLOCK();
-			wait_event_interruptible(cryptoretproc_wait,
-					!list_empty(&crp_ret_q) ||
-					!list_empty(&crp_ret_kq) ||
+			wait_event_interruptible(cq->cq_ret_wait,
+					!CRYPTO_RETQ_EMPTY(cq) ||
 					kthread_should_stop());
 			if (signal_pending (current)) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
@@ -1528,7 +1700,6 @@ crypto_ret_proc(void *arg)
 				spin_unlock_irq(&current->sigmask_lock);
 #endif
 			}
-			CRYPTO_RETQ_LOCK();
 			dprintk("%s - awake\n", __FUNCTION__);
 			if (kthread_should_stop()) {
 				dprintk("%s - EXITING!\n", __FUNCTION__);
@@ -1537,7 +1708,6 @@ crypto_ret_proc(void *arg)
 			cryptostats.cs_rets++;
 		}
 	}
-	CRYPTO_RETQ_UNLOCK();
 	return 0;
 }
 
@@ -1643,6 +1813,7 @@ DB_SHOW_COMMAND(kcrypto, db_show_kcrypto)
 static int
 crypto_init(void)
 {
+	struct crypto_cpu_queue *cq;
 	int error;
 	unsigned long cpu;
 
@@ -1654,7 +1825,17 @@ crypto_init(void)
 
 	spin_lock_init(&crypto_drivers_lock);
 	spin_lock_init(&crypto_q_lock);
-	spin_lock_init(&crypto_ret_q_lock);
+
+	for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+		cq = &crypto_queues[cpu];
+		spin_lock_init(&cq->cq_lock);
+		INIT_LIST_HEAD(&cq->cq_q);
+		init_waitqueue_head(&cq->cq_wait);
+		spin_lock_init(&cq->cq_ret_lock);
+		INIT_LIST_HEAD(&cq->cq_ret_q);
+		INIT_LIST_HEAD(&cq->cq_ret_kq);
+		init_waitqueue_head(&cq->cq_ret_wait);
+	}
 
 	cryptop_zone = kmem_cache_create("cryptop", sizeof(struct cryptop),
 				       0, SLAB_HWCACHE_ALIGN, NULL
@@ -1687,33 +1868,51 @@ crypto_init(void)
 
 	memset(crypto_drivers, 0, crypto_drivers_num * sizeof(struct cryptocap));
 
-#if 0
-	ocf_for_each_cpu(cpu) {
-#else
-	for (cpu = cpu_begin; cpu < cpu_end; cpu++) {
-#endif
-
-		cryptoproc[cpu] = kthread_create(crypto_proc, (void *) cpu,
-									"ocf_%d", (int) cpu);
-		if (IS_ERR(cryptoproc[cpu])) {
-			error = PTR_ERR(cryptoproc[cpu]);
+	/*
+	 * Start a dispatch and a return thread on each CPU from cpu_begin
+	 * up to cpu_end.  The queues must all be known before any thread
+	 * runs, as crypto_this_queue() maps other CPUs onto them.
+	 */
+	if (cpu_end > CONFIG_NR_CPUS)
+		cpu_end = CONFIG_NR_CPUS;
+	if (cpu_begin < 0 || cpu_begin >= cpu_end)
+		cpu_begin = 0;
+	for (cpu = cpu_begin; cpu < cpu_end; cpu++)
+		if (cpu_possible(cpu))
+			crypto_queue_cpus[crypto_nqueues++] = cpu;
+	if (crypto_nqueues == 0)
+		crypto_queue_cpus[crypto_nqueues++] = 0;
+
+	for (cpu = 0; cpu < crypto_nqueues; cpu++) {
+		int qcpu = crypto_queue_cpus[cpu];
+
+		cq = &crypto_queues[qcpu];
+		cq->cq_proc = kthread_create(crypto_proc, cq, "ocf_%d", qcpu);
+		if (IS_ERR(cq->cq_proc)) {
+			error = PTR_ERR(cq->cq_proc);
+			cq->cq_proc = NULL;
 			printk("crypto: crypto_init cannot start crypto thread; error %d",
 				error);
 			goto bad;
 		}
-		kthread_bind(cryptoproc[cpu], cpu);
-		wake_up_process(cryptoproc[cpu]);
+		kthread_bind(cq->cq_proc, qcpu);
 
-		cryptoretproc[cpu] = kthread_create(crypto_ret_proc, (void *) cpu,
-									"ocf_ret_%d", (int) cpu);
-		if (IS_ERR(cryptoretproc[cpu])) {
-			error = PTR_ERR(cryptoretproc[cpu]);
+		cq->cq_retproc = kthread_create(crypto_ret_proc, cq,
+				"ocf_ret_%d", qcpu);
+		if (IS_ERR(cq->cq_retproc)) {
+			error = PTR_ERR(cq->cq_retproc);
+			cq->cq_retproc = NULL;
 			printk("crypto: crypto_init cannot start cryptoret thread; error %d",
 					error);
 			goto bad;
 		}
-		kthread_bind(cryptoretproc[cpu], cpu);
-		wake_up_process(cryptoretproc[cpu]);
+		kthread_bind(cq->cq_retproc, qcpu);
+	}
+
+	for (cpu = 0; cpu < crypto_nqueues; cpu++) {
+		cq = &crypto_queues[crypto_queue_cpus[cpu]];
+		wake_up_process(cq->cq_proc);
+		wake_up_process(cq->cq_retproc);
 	}
 
 	return 0;
@@ -1726,6 +1925,7 @@ bad:
 static void
 crypto_exit(void)
 {
+	struct crypto_cpu_queue *cq;
 	int cpu;
 
 	dprintk("%s()\n", __FUNCTION__);
@@ -1733,10 +1933,15 @@ crypto_exit(void)
 	/*
 	 * Terminate any crypto threads.
 	 */
-	ocf_for_each_cpu(cpu) {
-		kthread_stop(cryptoproc[cpu]);
-		kthread_stop(cryptoretproc[cpu]);
+	for (cpu = 0; cpu < crypto_nqueues; cpu++) {
+		cq = &crypto_queues[crypto_queue_cpus[cpu]];
+		if (cq->cq_proc)
+			kthread_stop(cq->cq_proc);
+		if (cq->cq_retproc)
+			kthread_stop(cq->cq_retproc);
+		cq->cq_proc = cq->cq_retproc = NULL;
 	}
+	crypto_nqueues = 0;
 
 	/*
 	 * Reclaim dynamically allocated resources.
@@ -1254,7 +1254,7 @@ cryptosoft_init(void)
 	softc_device_init(&swcr_softc, "cryptosoft", 0, swcr_methods);
 
 	swcr_id = crypto_get_driverid(softc_get_device(&swcr_softc),
-			CRYPTOCAP_F_SOFTWARE | CRYPTOCAP_F_SYNC);
+			CRYPTOCAP_F_SOFTWARE | CRYPTOCAP_F_SYNC | CRYPTOCAP_F_BATCH);
 	if (swcr_id < 0) {
 		printk("cryptosoft: Software crypto device cannot initialize!");
 		return -ENODEV;
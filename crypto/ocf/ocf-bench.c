@@ -42,6 +42,10 @@
 #include <linux/sched.h>
 #include <linux/spinlock.h>
 #include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
 #include <cryptodev.h>
 
 #ifdef I_HAVE_AN_XSCALE_WITH_INTEL_SDK
@@ -99,6 +103,25 @@ static int request_cbimm = 1;
 module_param(request_cbimm, int, 0);
 MODULE_PARM_DESC(request_cbimm, "enable OCF immediate callback on completion");
 
+/*
+ * submit from this many threads, each bound to its own CPU, rather than
+ * resubmitting from the completion path
+ */
+static int request_threads = 0;
+module_param(request_threads, int, 0);
+MODULE_PARM_DESC(request_threads, "number of submitting threads (0 = none)");
+
+/*
+ * a submitting thread and the requests it is responsible for
+ */
+typedef struct {
+	spinlock_t lock;
+	struct list_head ready;		/* completed, to be resubmitted */
+	int outstanding;		/* requests not yet retired */
+	wait_queue_head_t wait;
+	struct completion done;
+} bench_thread_t;
+
 /*
  * a structure for each request
  */
@@ -108,14 +131,24 @@ typedef struct  {
 	IX_MBUF mbuf;
 #endif
 	unsigned char *buffer;
+	struct list_head list;
+	bench_thread_t *thread;
+	ktime_t start;
 } request_t;
 
 static request_t *requests;
+static bench_thread_t *threads;
 
 static spinlock_t ocfbench_counter_lock;
 static int outstanding;
 static int total;
 
+/*
+ * per-request latencies in usecs, the first request_num are kept
+ */
+static u32 *latency;
+static atomic_t latency_cnt;
+
 /*************************************************************************/
 /*
  * OCF benchmark routines
@@ -127,6 +160,8 @@ static unsigned long jstart, jstop;
 static int ocf_init(void);
 static int ocf_cb(struct cryptop *crp);
 static void ocf_request(void *arg);
+static void latency_add(request_t *r);
+static void request_retire(request_t *r);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 static void ocf_request_wq(struct work_struct *work);
 #endif
@@ -174,17 +209,26 @@ ocf_cb(struct cryptop *crp)
 	crypto_freereq(crp);
 	crp = NULL;
 
+	latency_add(r);
+
 	/* do all requests  but take at least 1 second */
 	spin_lock_irqsave(&ocfbench_counter_lock, flags);
 	total++;
 	if (total > request_num && jstart + HZ < jiffies) {
 		outstanding--;
 		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+		request_retire(r);
 		return 0;
 	}
 	spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
 
-	schedule_work(&r->work);
+	if (r->thread) {
+		spin_lock_irqsave(&r->thread->lock, flags);
+		list_add_tail(&r->list, &r->thread->ready);
+		spin_unlock_irqrestore(&r->thread->lock, flags);
+		wake_up(&r->thread->wait);
+	} else
+		schedule_work(&r->work);
 	return 0;
 }
 
@@ -201,6 +245,7 @@ ocf_request(void *arg)
 		spin_lock_irqsave(&ocfbench_counter_lock, flags);
 		outstanding--;
 		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+		request_retire(r);
 		return;
 	}
 
@@ -234,6 +279,7 @@ ocf_request(void *arg)
 	crp->crp_callback = ocf_cb;
 	crp->crp_sid = ocf_cryptoid;
 	crp->crp_opaque = (caddr_t) r;
+	r->start = ktime_get();
 	crypto_dispatch(crp);
 }
 
@@ -246,6 +292,96 @@ ocf_request_wq(struct work_struct *work)
 }
 #endif
 
+/*
+ * latency and submitting thread support
+ */
+
+static void
+latency_add(request_t *r)
+{
+	int i = atomic_inc_return(&latency_cnt) - 1;
+
+	if (latency && i < request_num)
+		latency[i] = (u32) ktime_us_delta(ktime_get(), r->start);
+}
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *) a, y = *(const u32 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+latency_report(const char *name)
+{
+	int n = min(atomic_read(&latency_cnt), request_num);
+
+	if (!latency || n == 0)
+		return;
+	sort(latency, n, sizeof(latency[0]), latency_cmp, NULL);
+	printk("%s: latency usecs p50 %u p90 %u p99 %u p99.9 %u max %u\n", name,
+			latency[(n - 1) * 500 / 1000], latency[(n - 1) * 900 / 1000],
+			latency[(n - 1) * 990 / 1000], latency[(n - 1) * 999 / 1000],
+			latency[n - 1]);
+}
+
+/*
+ * a request will not be resubmitted, let its thread know
+ */
+static void
+request_retire(request_t *r)
+{
+	bench_thread_t *t = r->thread;
+	unsigned long flags;
+
+	if (!t)
+		return;
+	spin_lock_irqsave(&t->lock, flags);
+	t->outstanding--;
+	spin_unlock_irqrestore(&t->lock, flags);
+	wake_up(&t->wait);
+}
+
+static int
+bench_thread_ready(bench_thread_t *t)
+{
+	unsigned long flags;
+	int ready;
+
+	spin_lock_irqsave(&t->lock, flags);
+	ready = !list_empty(&t->ready) || t->outstanding == 0;
+	spin_unlock_irqrestore(&t->lock, flags);
+	return ready;
+}
+
+/*
+ * resubmit completed requests until all of ours have been retired
+ */
+static int
+bench_thread(void *arg)
+{
+	bench_thread_t *t = arg;
+	request_t *r;
+	unsigned long flags;
+
+	for (;;) {
+		wait_event(t->wait, bench_thread_ready(t));
+		spin_lock_irqsave(&t->lock, flags);
+		if (list_empty(&t->ready)) {
+			spin_unlock_irqrestore(&t->lock, flags);
+			break;
+		}
+		r = list_first_entry(&t->ready, request_t, list);
+		list_del(&r->list);
+		spin_unlock_irqrestore(&t->lock, flags);
+		ocf_request(r);
+	}
+	complete(&t->done);
+	return 0;
+}
+
 static void
 ocf_done(void)
 {
@@ -402,16 +538,77 @@ ixp_done(void)
 #endif /* BENCH_IXP_ACCESS_LIB */
 /*************************************************************************/
 
+/*
+ * hand the requests out round robin to request_threads threads, one per
+ * online CPU, and let them resubmit until the run is over
+ */
+static int
+ocf_run_threads(void)
+{
+	struct task_struct *task;
+	unsigned long flags;
+	int i, n, cpu;
+
+	n = min(request_threads, request_q_len);
+	threads = kzalloc(sizeof(bench_thread_t) * n, GFP_KERNEL);
+	if (!threads) {
+		printk("malloc failed\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n; i++) {
+		spin_lock_init(&threads[i].lock);
+		INIT_LIST_HEAD(&threads[i].ready);
+		init_waitqueue_head(&threads[i].wait);
+		init_completion(&threads[i].done);
+	}
+	for (i = 0; i < request_q_len; i++) {
+		requests[i].thread = &threads[i % n];
+		list_add_tail(&requests[i].list, &threads[i % n].ready);
+		threads[i % n].outstanding++;
+		spin_lock_irqsave(&ocfbench_counter_lock, flags);
+		outstanding++;
+		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+	}
+
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < n; i++) {
+		task = kthread_create(bench_thread, &threads[i], "ocf_bench_%d", i);
+		if (IS_ERR(task)) {
+			/* let the others finish without this one's requests */
+			printk("ocf_bench: cannot start thread %d\n", i);
+			spin_lock_irqsave(&ocfbench_counter_lock, flags);
+			outstanding -= threads[i].outstanding;
+			spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+			complete(&threads[i].done);
+			continue;
+		}
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	for (i = 0; i < n; i++)
+		wait_for_completion(&threads[i].done);
+	for (i = 0; i < request_q_len; i++)
+		requests[i].thread = NULL;
+	kfree(threads);
+	threads = NULL;
+	return n;
+}
+
 int
 ocfbench_init(void)
 {
-	int i;
-	unsigned long mbps;
+	int i, nthreads = 0;
+	unsigned long mbps, ops;
 	unsigned long flags;
 
 	printk("Crypto Speed tests\n");
 
-	requests = kmalloc(sizeof(request_t) * request_q_len, GFP_KERNEL);
+	requests = kzalloc(sizeof(request_t) * request_q_len, GFP_KERNEL);
 	if (!requests) {
 		printk("malloc failed\n");
 		return -EINVAL;
@@ -427,39 +624,57 @@ ocfbench_init(void)
 		requests[i].buffer = kmalloc(request_size + 128, GFP_DMA);
 		if (!requests[i].buffer) {
 			printk("malloc failed\n");
-			return -EINVAL;
+			goto out;
 		}
 		memset(requests[i].buffer, '0' + i, request_size + 128);
+		INIT_LIST_HEAD(&requests[i].list);
+		requests[i].thread = NULL;
 	}
 
+	latency = kmalloc(sizeof(*latency) * request_num, GFP_KERNEL);
+	if (!latency)
+		printk("no memory for latency samples, not reporting them\n");
+	atomic_set(&latency_cnt, 0);
+
 	/*
 	 * OCF benchmark
 	 */
 	printk("OCF: testing ...\n");
 	if (ocf_init() == -1)
-		return -EINVAL;
+		goto out;
 
 	spin_lock_init(&ocfbench_counter_lock);
 	total = outstanding = 0;
 	jstart = jiffies;
-	for (i = 0; i < request_q_len; i++) {
-		spin_lock_irqsave(&ocfbench_counter_lock, flags);
-		outstanding++;
-		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
-		ocf_request(&requests[i]);
+	if (request_threads > 0) {
+		nthreads = ocf_run_threads();
+		if (nthreads < 0) {
+			ocf_done();
+			goto out;
+		}
+	} else {
+		for (i = 0; i < request_q_len; i++) {
+			spin_lock_irqsave(&ocfbench_counter_lock, flags);
+			outstanding++;
+			spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+			ocf_request(&requests[i]);
+		}
 	}
 	while (outstanding > 0)
 		schedule();
 	jstop = jiffies;
 
-	mbps = 0;
+	mbps = ops = 0;
 	if (jstop > jstart) {
 		mbps = (unsigned long) total * (unsigned long) request_size * 8;
 		mbps /= ((jstop - jstart) * 1000) / HZ;
+		ops = (unsigned long) total * HZ / (jstop - jstart);
 	}
-	printk("OCF: %d requests of %d bytes in %d jiffies (%d.%03d Mbps)\n",
+	printk("OCF: %d requests of %d bytes in %d jiffies (%d.%03d Mbps, "
+			"%lu ops/sec, %d threads)\n",
 			total, request_size, (int)(jstop - jstart),
-			((int)mbps) / 1000, ((int)mbps) % 1000);
+			((int)mbps) / 1000, ((int)mbps) % 1000, ops, nthreads);
+	latency_report("OCF");
 	ocf_done();
 
 #ifdef BENCH_IXP_ACCESS_LIB
@@ -496,9 +711,12 @@ ocfbench_init(void)
 	ixp_done();
 #endif /* BENCH_IXP_ACCESS_LIB */
 
+out:
 	for (i = 0; i < request_q_len; i++)
 		kfree(requests[i].buffer);
 	kfree(requests);
+	kfree(latency);
+	latency = NULL;
 	return -EINVAL; /* always fail to load so it can be re-run quickly ;-) */
 }
 
@@ -30,6 +30,7 @@
 #include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/input.h>
+#include <linux/netdevice.h>
 #include <asm/cputime.h>
 
 #define CREATE_TRACE_POINTS
@@ -52,6 +53,7 @@ struct cpufreq_interactive_cpuinfo {
 	unsigned int floor_freq;
 	u64 floor_validate_time;
 	u64 hispeed_validate_time;
+	unsigned int net_time_squeeze;
 	int governor_enabled;
 };
 
@@ -112,6 +114,13 @@ static struct cpufreq_interactive_inputopen inputopen;
 
 static int boost_val;
 
+/*
+ * Boost to hispeed when the NET_RX softirq reports a packet burst, and
+ * treat a CPU as loaded while its receive backlog has not drained.
+ */
+#define DEFAULT_NET_BOOST 1
+static int net_boost_val;
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event);
 
@@ -125,6 +134,33 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+#ifdef CONFIG_NET
+/*
+ * A CPU still has a packet burst to work through while NAPI instances or
+ * backlog packets are queued for its NET_RX softirq, or while its softirq
+ * rounds keep running out of budget.
+ */
+static bool cpufreq_interactive_net_busy(unsigned int cpu,
+				struct cpufreq_interactive_cpuinfo *pcpu)
+{
+	struct softnet_data *sd = &per_cpu(softnet_data, cpu);
+	unsigned int time_squeeze = sd->time_squeeze;
+	bool busy;
+
+	busy = time_squeeze != pcpu->net_time_squeeze ||
+		skb_queue_len(&sd->input_pkt_queue) ||
+		!list_empty(&sd->poll_list);
+	pcpu->net_time_squeeze = time_squeeze;
+	return busy;
+}
+#else
+static inline bool cpufreq_interactive_net_busy(unsigned int cpu,
+				struct cpufreq_interactive_cpuinfo *pcpu)
+{
+	return false;
+}
+#endif
+
 static void cpufreq_interactive_timer(unsigned long data)
 {
 	unsigned int delta_idle;
@@ -195,6 +231,10 @@ static void cpufreq_interactive_timer(unsigned long data)
 	if (load_since_change > cpu_load)
 		cpu_load = load_since_change;
 
+	if (net_boost_val && cpu_load < go_hispeed_load &&
+	    cpufreq_interactive_net_busy(data, pcpu))
+		cpu_load = go_hispeed_load;
+
 	if (cpu_load >= go_hispeed_load || boost_val) {
 		if (pcpu->target_freq <= pcpu->policy->min) {
 			new_freq = hispeed_freq;
@@ -491,7 +531,7 @@ static void cpufreq_interactive_freq_down(struct work_struct *work)
 	}
 }
 
-static void cpufreq_interactive_boost(void)
+static void cpufreq_interactive_boost_cpus(const struct cpumask *mask)
 {
 	int i;
 	int anyboost = 0;
@@ -500,7 +540,7 @@ static void cpufreq_interactive_boost(void)
 
 	spin_lock_irqsave(&up_cpumask_lock, flags);
 
-	for_each_online_cpu(i) {
+	for_each_cpu(i, mask) {
 		pcpu = &per_cpu(cpuinfo, i);
 
 		if (pcpu->target_freq < hispeed_freq) {
@@ -527,6 +567,11 @@ static void cpufreq_interactive_boost(void)
 		wake_up_process(up_task);
 }
 
+static void cpufreq_interactive_boost(void)
+{
+	cpufreq_interactive_boost_cpus(cpu_online_mask);
+}
+
 /*
  * Pulsed boost on input event raises CPUs to hispeed_freq and lets
  * usual algorithm of min_sample_time  decide when to allow speed
@@ -617,6 +662,36 @@ static struct input_handler cpufreq_interactive_input_handler = {
 	.id_table       = cpufreq_interactive_ids,
 };
 
+#ifdef CONFIG_NET
+/*
+ * Raise the CPU running NET_RX to hispeed_freq as soon as a packet burst
+ * starts rather than on the next timer sample.  The timer then keeps it
+ * loaded until the receive backlog drains, and min_sample_time decides
+ * when to let the speed drop after that.
+ */
+static int cpufreq_interactive_net_rx_notifier(struct notifier_block *nb,
+					       unsigned long work,
+					       void *data)
+{
+	unsigned int cpu = smp_processor_id();
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+
+	if (!net_boost_val || !pcpu->governor_enabled)
+		return NOTIFY_DONE;
+
+	if (pcpu->target_freq < hispeed_freq) {
+		trace_cpufreq_interactive_boost("net");
+		cpufreq_interactive_boost_cpus(cpumask_of(cpu));
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block cpufreq_interactive_net_rx_nb = {
+	.notifier_call = cpufreq_interactive_net_rx_notifier,
+};
+#endif
+
 static ssize_t show_hispeed_freq(struct kobject *kobj,
 				 struct attribute *attr, char *buf)
 {
@@ -750,6 +825,27 @@ static ssize_t store_input_boost(struct kobject *kobj, struct attribute *attr,
 
 define_one_global_rw(input_boost);
 
+static ssize_t show_net_boost(struct kobject *kobj, struct attribute *attr,
+			      char *buf)
+{
+	return sprintf(buf, "%d\n", net_boost_val);
+}
+
+static ssize_t store_net_boost(struct kobject *kobj, struct attribute *attr,
+			       const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	net_boost_val = val;
+	return count;
+}
+
+define_one_global_rw(net_boost);
+
 static ssize_t show_boost(struct kobject *kobj, struct attribute *attr,
 			  char *buf)
 {
@@ -805,6 +901,7 @@ static struct attribute *interactive_attributes[] = {
 	&min_sample_time_attr.attr,
 	&timer_rate_attr.attr,
 	&input_boost.attr,
+	&net_boost.attr,
 	&boost.attr,
 	&boostpulse.attr,
 	NULL,
@@ -871,6 +968,10 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 			pr_warn("%s: failed to register input handler\n",
 				__func__);
 
+#ifdef CONFIG_NET
+		register_net_rx_burst_notifier(&cpufreq_interactive_net_rx_nb);
+#endif
+
 		break;
 
 	case CPUFREQ_GOV_STOP:
@@ -893,6 +994,9 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		if (atomic_dec_return(&active_count) > 0)
 			return 0;
 
+#ifdef CONFIG_NET
+		unregister_net_rx_burst_notifier(&cpufreq_interactive_net_rx_nb);
+#endif
 		input_unregister_handler(&cpufreq_interactive_input_handler);
 		sysfs_remove_group(cpufreq_global_kobject,
 				&interactive_attr_group);
@@ -941,6 +1045,7 @@ static int __init cpufreq_interactive_init(void)
 	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
 	above_hispeed_delay_val = DEFAULT_ABOVE_HISPEED_DELAY;
 	timer_rate = DEFAULT_TIMER_RATE;
+	net_boost_val = DEFAULT_NET_BOOST;
 
 	/* Initalize per-cpu timers */
 	for_each_possible_cpu(i) {
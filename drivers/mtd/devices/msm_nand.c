@@ -47,6 +47,9 @@ uint32_t boot_layout = 0;
 #define MSM_NAND_DMA_BUFFER_SLOTS \
 	(MSM_NAND_DMA_BUFFER_SIZE / (sizeof(((atomic_t *)0)->counter) * 8))
 
+/* pages chained into one data mover request by msm_nand_read_pages() */
+#define MSM_NAND_READ_BATCH 4
+
 #define MSM_NAND_CFG0_RAW_ONFI_IDENTIFIER 0x88000800
 #define MSM_NAND_CFG0_RAW_ONFI_PARAM_INFO 0x88040000
 #define MSM_NAND_CFG1_RAW_ONFI_IDENTIFIER 0x0005045d
@@ -1381,6 +1384,272 @@ static int msm_nand_read_oob(struct mtd_info *mtd, loff_t from,
 	return _msm_nand_read_oob(mtd, &mtd->ecc_stats, from, ops);
 }
 
+/*
+ * Pipelined multi-page ECC read of main area data.
+ *
+ * The command lists for up to MSM_NAND_READ_BATCH pages are chained
+ * through the data mover pointer list and issued as one request, so
+ * the controller goes from one page to the next without waiting for
+ * the CPU.  Every page is DMA mapped on its own: vmalloc'ed buffers
+ * are read in place as long as no flash page straddles a PAGE_SIZE
+ * boundary, otherwise -EAGAIN is returned and the caller falls back
+ * to single page reads.
+ */
+static int msm_nand_read_pages(struct mtd_info *mtd,
+			       struct mtd_ecc_stats *ecc_stats, loff_t from,
+			       size_t len, size_t *retlen, u_char *buf)
+{
+	struct msm_nand_chip *chip = mtd->priv;
+
+	struct {
+		struct {
+			dmov_s cmd[8 * 4 + 2];
+			struct {
+				uint32_t cmd;
+				uint32_t addr0;
+				uint32_t addr1;
+				uint32_t chipsel;
+				uint32_t cfg0;
+				uint32_t cfg1;
+				uint32_t eccbchcfg;
+				uint32_t exec;
+				uint32_t ecccfg;
+				struct {
+					uint32_t flash_status;
+					uint32_t buffer_status;
+				} result[8];
+			} data;
+		} __aligned(8) page[MSM_NAND_READ_BATCH];
+		unsigned cmdptr[MSM_NAND_READ_BATCH];
+	} *dma_buffer;
+	typeof(dma_buffer->page[0]) *pb;
+	dmov_s *cmd;
+	dma_addr_t data_dma_addr[MSM_NAND_READ_BATCH];
+	dma_addr_t data_dma_addr_curr;
+	unsigned cwperpage = mtd->writesize >> 9;
+	unsigned page = 0;
+	unsigned batch, i, n;
+	uint32_t sectordatasize;
+	uint32_t ecc_errors;
+	uint32_t total_ecc_errors = 0;
+	int err = 0, pageerr, rawerr;
+
+	*retlen = 0;
+
+	if (cwperpage > ARRAY_SIZE(dma_buffer->page[0].data.result))
+		return -EAGAIN;
+	if (!virt_addr_valid(buf) && (mtd->writesize > PAGE_SIZE ||
+	    (offset_in_page(buf) & (mtd->writesize - 1))))
+		return -EAGAIN;
+
+	if (mtd->writesize == 2048)
+		page = from >> 11;
+
+	if (mtd->writesize == 4096)
+		page = from >> 12;
+
+	wait_event(chip->wait_queue,
+		   (dma_buffer = msm_nand_get_dma_buffer(
+			    chip, sizeof(*dma_buffer))));
+
+	while (len >= mtd->writesize) {
+		batch = min_t(size_t, len / mtd->writesize,
+			      MSM_NAND_READ_BATCH);
+
+		for (i = 0; i < batch; i++) {
+			data_dma_addr[i] = msm_nand_dma_map(chip->dev,
+					buf + i * mtd->writesize,
+					mtd->writesize, DMA_FROM_DEVICE, NULL);
+			if (dma_mapping_error(chip->dev, data_dma_addr[i])) {
+				pr_err("%s: failed to get dma addr for %p\n",
+				       __func__, buf + i * mtd->writesize);
+				while (i-- > 0)
+					msm_nand_dma_unmap(chip->dev,
+						data_dma_addr[i],
+						mtd->writesize,
+						DMA_FROM_DEVICE, NULL, NULL);
+				err = -EIO;
+				goto out;
+			}
+		}
+
+		for (i = 0; i < batch; i++) {
+			pb = &dma_buffer->page[i];
+			cmd = pb->cmd;
+
+			pb->data.cmd = MSM_NAND_CMD_PAGE_READ_ECC;
+			pb->data.addr0 = (page + i) << 16;
+			pb->data.addr1 = ((page + i) >> 16) & 0xff;
+			/* chipsel_0 + enable DM interface */
+			pb->data.chipsel = 0 | 4;
+			pb->data.cfg0 = (chip->CFG0 & ~(7U << 6))
+				| ((cwperpage - 1) << 6);
+			pb->data.cfg1 = chip->CFG1;
+			pb->data.eccbchcfg = chip->ecc_bch_cfg;
+			/* GO bit for the EXEC register */
+			pb->data.exec = 1;
+			pb->data.ecccfg = chip->ecc_buf_cfg;
+
+			data_dma_addr_curr = data_dma_addr[i];
+
+			for (n = 0; n < cwperpage; n++) {
+				/* flash + buffer status return words */
+				pb->data.result[n].flash_status = 0xeeeeeeee;
+				pb->data.result[n].buffer_status = 0xeeeeeeee;
+
+				/* block on cmd ready, then
+				 * write CMD / ADDR0 / ADDR1 / CHIPSEL
+				 * regs in a burst
+				 */
+				cmd->cmd = DST_CRCI_NAND_CMD;
+				cmd->src = msm_virt_to_dma(chip, &pb->data.cmd);
+				cmd->dst = MSM_NAND_FLASH_CMD;
+				cmd->len = (n == 0) ? 16 : 4;
+				cmd++;
+
+				if (n == 0) {
+					cmd->cmd = 0;
+					cmd->src = msm_virt_to_dma(chip,
+							&pb->data.cfg0);
+					cmd->dst = MSM_NAND_DEV0_CFG0;
+					cmd->len = enable_bch_ecc ? 12 : 8;
+					cmd++;
+
+					cmd->cmd = 0;
+					cmd->src = msm_virt_to_dma(chip,
+							&pb->data.ecccfg);
+					cmd->dst = MSM_NAND_EBI2_ECC_BUF_CFG;
+					cmd->len = 4;
+					cmd++;
+				}
+
+				/* kick the execute register */
+				cmd->cmd = 0;
+				cmd->src = msm_virt_to_dma(chip, &pb->data.exec);
+				cmd->dst = MSM_NAND_EXEC_CMD;
+				cmd->len = 4;
+				cmd++;
+
+				/* block on data ready, then
+				 * read the status register
+				 */
+				cmd->cmd = SRC_CRCI_NAND_DATA;
+				cmd->src = MSM_NAND_FLASH_STATUS;
+				cmd->dst = msm_virt_to_dma(chip,
+							   &pb->data.result[n]);
+				/* MSM_NAND_FLASH_STATUS + MSM_NAND_BUFFER_STATUS */
+				cmd->len = 8;
+				cmd++;
+
+				/* read data block
+				 * (only valid if status says success)
+				 */
+				if (!boot_layout)
+					sectordatasize = (n < (cwperpage - 1))
+						? 516 : (512 - ((cwperpage - 1) << 2));
+				else
+					sectordatasize = 512;
+
+				cmd->cmd = 0;
+				cmd->src = MSM_NAND_FLASH_BUFFER;
+				cmd->dst = data_dma_addr_curr;
+				data_dma_addr_curr += sectordatasize;
+				cmd->len = sectordatasize;
+				cmd++;
+			}
+
+			BUILD_BUG_ON(8 * 4 + 2 != ARRAY_SIZE(pb->cmd));
+			BUG_ON(cmd - pb->cmd > ARRAY_SIZE(pb->cmd));
+			pb->cmd[0].cmd |= CMD_OCB;
+			cmd[-1].cmd |= CMD_OCU | CMD_LC;
+
+			dma_buffer->cmdptr[i] =
+				msm_virt_to_dma(chip, pb->cmd) >> 3;
+		}
+		dma_buffer->cmdptr[batch - 1] |= CMD_PTR_LP;
+
+		mb();
+		msm_dmov_exec_cmd(chip->dma_channel,
+			DMOV_CMD_PTR_LIST | DMOV_CMD_ADDR(msm_virt_to_dma(chip,
+			dma_buffer->cmdptr)));
+		mb();
+
+		for (i = 0; i < batch; i++)
+			msm_nand_dma_unmap(chip->dev, data_dma_addr[i],
+					   mtd->writesize, DMA_FROM_DEVICE,
+					   NULL, NULL);
+
+		for (i = 0; i < batch; i++) {
+			pb = &dma_buffer->page[i];
+
+			/* if any of the writes failed (0x10), or there
+			 * was a protection violation (0x100), we lose
+			 */
+			pageerr = rawerr = 0;
+			for (n = 0; n < cwperpage; n++) {
+				if (pb->data.result[n].flash_status & 0x110) {
+					rawerr = -EIO;
+					break;
+				}
+			}
+			if (rawerr) {
+				for (n = 0; n < mtd->writesize; n++) {
+					/* empty blocks read 0x54 at
+					 * these offsets
+					 */
+					if ((n % 516 == 3 || n % 516 == 175)
+							&& buf[n] == 0x54)
+						buf[n] = 0xff;
+					if (buf[n] != 0xff) {
+						pageerr = rawerr;
+						break;
+					}
+				}
+			}
+			if (pageerr) {
+				for (n = 0; n < cwperpage; n++) {
+					if (pb->data.result[n].buffer_status &
+						chip->uncorrectable_bit_mask) {
+						ecc_stats->failed++;
+						pageerr = -EBADMSG;
+						break;
+					}
+				}
+			}
+			if (!rawerr) { /* check for corretable errors */
+				for (n = 0; n < cwperpage; n++) {
+					ecc_errors =
+					(pb->data.result[n].buffer_status
+					 & chip->num_err_mask);
+					if (ecc_errors) {
+						total_ecc_errors += ecc_errors;
+						ecc_stats->corrected += ecc_errors;
+						if (ecc_errors > 1)
+							pageerr = -EUCLEAN;
+					}
+				}
+			}
+			if (pageerr && (pageerr != -EUCLEAN || err == 0))
+				err = pageerr;
+
+			if (err && err != -EUCLEAN && err != -EBADMSG)
+				goto out;
+
+			*retlen += mtd->writesize;
+			buf += mtd->writesize;
+			len -= mtd->writesize;
+		}
+		page += batch;
+	}
+out:
+	msm_nand_release_dma_buffer(chip, dma_buffer, sizeof(*dma_buffer));
+
+	if (err)
+		pr_err("%s %llx %zx failed %d, corrected %d\n", __func__,
+		       from, *retlen, err, total_ecc_errors);
+	return err;
+}
+
 static int _msm_nand_read_oob_dualnandc(struct mtd_info *mtd,
 			struct mtd_ecc_stats *ecc_stats, loff_t from,
 			struct mtd_oob_ops *ops)
@@ -2202,12 +2471,34 @@ msm_nand_read(struct mtd_info *mtd, loff_t from, size_t len,
 	ret = 0;
 	*retlen = 0;
 
+	if (!dual_nand_ctlr_present && (from & (mtd->writesize - 1)) == 0 &&
+	    len >= 2 * mtd->writesize) {
+		/* reading several whole pages, chain them in batches */
+		size_t pages_len = len & ~(mtd->writesize - 1);
+		size_t pages_retlen;
+
+		ret = msm_nand_read_pages(mtd, &stats, from, pages_len,
+					  &pages_retlen, buf);
+		if (ret != -EAGAIN) {
+			if (ret == -EBADMSG || ret == -EUCLEAN)
+				ret = 0;
+			*retlen = pages_retlen;
+			if (ret < 0)
+				goto out;
+
+			from += pages_len;
+			buf += pages_len;
+			len -= pages_len;
+		}
+		ret = 0;
+	}
+
 	if ((from & (mtd->writesize - 1)) == 0 && len == mtd->writesize) {
 		/* reading a page on page boundary */
 		ops.len = len;
 		ops.datbuf = buf;
 		ret = read_oob(mtd, &stats, from, &ops);
-		*retlen = ops.retlen;
+		*retlen += ops.retlen;
 	} else if (len > 0) {
 		/* reading any size on any offset. partial page is supported */
 		u8 *bounce_buf;
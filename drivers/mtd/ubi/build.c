@@ -575,10 +575,9 @@ static void free_internal_volumes(struct ubi_device *ubi)
  * This function returns zero in case of success and a negative error code in
  * case of failure.
  *
- * Note, currently this is the only method to attach UBI devices. Hopefully in
- * the future we'll have more scalable attaching methods and avoid full media
- * scanning. But even in this case scanning will be needed as a fall-back
- * attaching method if there are some on-flash table corruptions.
+ * If the device has a valid fastmap, scanning is limited to the PEBs it could
+ * not describe (see fastmap.c). Otherwise, or if the fastmap turns out to be
+ * stale or corrupted, all PEBs are scanned.
  */
 static int attach_by_scanning(struct ubi_device *ubi)
 {
@@ -939,6 +938,8 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 	mutex_init(&ubi->buf_mutex);
 	mutex_init(&ubi->ckvol_mutex);
 	mutex_init(&ubi->device_mutex);
+	mutex_init(&ubi->fm_mutex);
+	init_rwsem(&ubi->fm_sem);
 	spin_lock_init(&ubi->volumes_lock);
 
 	ubi_msg("attaching mtd%d to ubi%d", mtd->index, ubi_num);
@@ -970,6 +971,13 @@ int ubi_attach_mtd_dev(struct mtd_info *mtd, int ubi_num, int vid_hdr_offset)
 			goto out_detach;
 	}
 
+	/*
+	 * Checkpoint the freshly attached state, so that the next attach does
+	 * not have to scan even if we are not detached cleanly. Failing to do
+	 * so is not fatal, the next attach just has to scan.
+	 */
+	ubi_update_fastmap(ubi);
+
 	err = uif_init(ubi, &ref);
 	if (err)
 		goto out_detach;
@@ -1088,6 +1096,15 @@ int ubi_detach_mtd_dev(int ubi_num, int anyway)
 	if (ubi->bgt_thread)
 		kthread_stop(ubi->bgt_thread);
 
+	/*
+	 * Write the final fastmap, so that the next attach does not have to
+	 * scan. The thread is gone, so nobody must try to wake it up.
+	 */
+	spin_lock(&ubi->wl_lock);
+	ubi->thread_enabled = 0;
+	spin_unlock(&ubi->wl_lock);
+	ubi_update_fastmap(ubi);
+
 	/*
 	 * Get a reference to the device in order to prevent 'dev_release()'
 	 * from freeing the @ubi object.
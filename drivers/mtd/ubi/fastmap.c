@@ -0,0 +1,892 @@
+/*
+ * Copyright (c) International Business Machines Corp., 2006
+ * Copyright (c) Nokia Corporation, 2006, 2007
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * This file implements the fastmap - an on-flash snapshot of the attaching
+ * information, which allows to attach an MTD device without scanning all of
+ * its physical eraseblocks.
+ *
+ * The fastmap records the state and the erase counter of each PEB, and the
+ * LEB to PEB mapping of each volume. It is stored in the data area of a few
+ * PEBs belonging to two internal volumes (see &struct ubi_fm_sb). The super
+ * block PEB has to be one of the first %UBI_FM_MAX_START PEBs, so attaching
+ * has to scan only those to find it.
+ *
+ * The fastmap describes the flash correctly only as long as nothing it
+ * records changes. So while a fastmap is valid:
+ *   o new data is written only to the PEBs of the "pool" - free PEBs which the
+ *     fastmap records as %UBI_FM_PEB_SCAN, so attaching scans them and finds
+ *     whatever has been written there;
+ *   o PEBs the fastmap records as mapped are not erased - their erasure is
+ *     deferred until a newer fastmap is written.
+ *
+ * A new fastmap is written when the pool is used up or too many erasures have
+ * been deferred, which checkpoints the state periodically, and also when the
+ * MTD device is attached and detached. If attaching finds the fastmap stale
+ * or corrupted, it falls back to full scanning.
+ */
+
+#include <linux/crc32.h>
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include "ubi.h"
+
+/* Free PEBs the WL and EBA sub-systems reserve after the fastmap has */
+#define FM_SPARE_PEBS 2
+
+/* Limits of the pool size */
+#define FM_MIN_POOL_SIZE 8
+#define FM_MAX_POOL_SIZE 256
+
+/**
+ * fm_size - maximum size of the fastmap of an UBI device.
+ * @ubi: UBI device description object
+ */
+static int fm_size(const struct ubi_device *ubi)
+{
+	return sizeof(struct ubi_fm_sb) + sizeof(struct ubi_fm_hdr) +
+	       ubi->peb_count * (sizeof(struct ubi_fm_peb) +
+				 sizeof(struct ubi_fm_eba)) +
+	       (UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT) *
+	       sizeof(struct ubi_fm_volume);
+}
+
+/**
+ * is_fm_block - check if a PEB belongs to a fastmap.
+ * @fm: the fastmap
+ * @pnum: the physical eraseblock number
+ */
+static int is_fm_block(const struct ubi_fastmap *fm, int pnum)
+{
+	int i;
+
+	for (i = 0; i < fm->used_blocks; i++)
+		if (fm->e[i]->pnum == pnum)
+			return 1;
+	return 0;
+}
+
+/**
+ * ubi_free_fastmap - free an in-memory fastmap description.
+ * @fm: the fastmap to free (may be %NULL)
+ */
+void ubi_free_fastmap(struct ubi_fastmap *fm)
+{
+	int i;
+
+	if (!fm)
+		return;
+
+	for (i = 0; i < fm->used_blocks; i++)
+		kmem_cache_free(ubi_wl_entry_slab, fm->e[i]);
+	kfree(fm->used);
+	kfree(fm);
+}
+
+/**
+ * alloc_fastmap - allocate an in-memory fastmap description.
+ * @ubi: UBI device description object
+ * @gfp_flags: GFP flags to allocate with
+ */
+static struct ubi_fastmap *alloc_fastmap(const struct ubi_device *ubi,
+					 gfp_t gfp_flags)
+{
+	struct ubi_fastmap *fm;
+
+	fm = kzalloc(sizeof(struct ubi_fastmap), gfp_flags);
+	if (!fm)
+		return NULL;
+
+	fm->used = kzalloc(BITS_TO_LONGS(ubi->peb_count) *
+			   sizeof(unsigned long), gfp_flags);
+	if (!fm->used) {
+		kfree(fm);
+		return NULL;
+	}
+
+	return fm;
+}
+
+/**
+ * find_fastmap - find the super block of the newest fastmap.
+ * @ubi: UBI device description object
+ * @vh: VID header buffer to use
+ * @dirty: bitmap of PEBs which turned out to be not empty is returned here
+ * @sb_pnum: the super block PEB is returned here (%-1 if there is none)
+ * @sqnum: sequence number of the fastmap is returned here
+ *
+ * This function returns zero in case of success and a negative error code in
+ * case of failure.
+ */
+static int find_fastmap(struct ubi_device *ubi, struct ubi_vid_hdr *vh,
+			unsigned long *dirty, int *sb_pnum,
+			unsigned long long *sqnum)
+{
+	int err, pnum, end;
+
+	*sb_pnum = -1;
+
+	end = min_t(int, ubi->peb_count, UBI_FM_MAX_START);
+	for (pnum = 0; pnum < end; pnum++) {
+		err = ubi_io_is_bad(ubi, pnum);
+		if (err < 0)
+			return err;
+		else if (err)
+			continue;
+
+		err = ubi_io_read_vid_hdr(ubi, pnum, vh, 0);
+		if (err < 0)
+			return err;
+		if (err == UBI_IO_FF || err == UBI_IO_FF_BITFLIPS)
+			continue;
+
+		__set_bit(pnum, dirty);
+		if (err != 0 && err != UBI_IO_BITFLIPS)
+			continue;
+		if (be32_to_cpu(vh->vol_id) != UBI_FM_SB_VOLUME_ID)
+			continue;
+
+		if (*sb_pnum == -1 || be64_to_cpu(vh->sqnum) > *sqnum) {
+			*sb_pnum = pnum;
+			*sqnum = be64_to_cpu(vh->sqnum);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * read_fastmap - read and check the fastmap.
+ * @ubi: UBI device description object
+ * @vh: VID header buffer to use
+ * @sb_pnum: the super block PEB
+ * @sqnum: sequence number of the fastmap
+ *
+ * This function returns a vmalloc'ed buffer containing the whole fastmap in
+ * case of success and an error pointer in case of failure. %-EINVAL means
+ * that the fastmap is corrupted.
+ */
+static void *read_fastmap(struct ubi_device *ubi, struct ubi_vid_hdr *vh,
+			  int sb_pnum, unsigned long long sqnum)
+{
+	struct ubi_fm_sb *sb;
+	void *buf = NULL;
+	int i, err, pnum, len, size, used_blocks;
+	uint32_t crc, data_size;
+
+	sb = kmalloc(sizeof(struct ubi_fm_sb), GFP_KERNEL);
+	if (!sb)
+		return ERR_PTR(-ENOMEM);
+
+	err = ubi_io_read_data(ubi, sb, sb_pnum, 0, sizeof(struct ubi_fm_sb));
+	if (err && err != UBI_IO_BITFLIPS)
+		goto out_err;
+
+	err = -EINVAL;
+	crc = crc32(UBI_CRC32_INIT, sb, UBI_FM_SB_SIZE_CRC);
+	if (be32_to_cpu(sb->magic) != UBI_FM_SB_MAGIC ||
+	    sb->version != UBI_FM_FMT_VERSION ||
+	    be32_to_cpu(sb->sb_crc) != crc ||
+	    be64_to_cpu(sb->sqnum) != sqnum ||
+	    be32_to_cpu(sb->block_loc[0]) != sb_pnum) {
+		dbg_bld("bad fastmap super block at PEB %d", sb_pnum);
+		goto out_free;
+	}
+
+	used_blocks = be32_to_cpu(sb->used_blocks);
+	data_size = be32_to_cpu(sb->data_size);
+	size = sizeof(struct ubi_fm_sb) + data_size;
+	if (used_blocks < 1 || used_blocks > UBI_FM_MAX_BLOCKS ||
+	    data_size <= sizeof(struct ubi_fm_hdr) ||
+	    data_size > fm_size(ubi) ||
+	    DIV_ROUND_UP(size, ubi->leb_size) != used_blocks) {
+		dbg_bld("bad fastmap size %d, %d PEBs", size, used_blocks);
+		goto out_free;
+	}
+
+	err = -ENOMEM;
+	buf = vmalloc(size);
+	if (!buf)
+		goto out_free;
+
+	for (i = 0; i < used_blocks; i++) {
+		pnum = be32_to_cpu(sb->block_loc[i]);
+		len = min(size - i * ubi->leb_size, ubi->leb_size);
+
+		if (i) {
+			err = -EINVAL;
+			if (pnum < 0 || pnum >= ubi->peb_count)
+				goto out_free;
+
+			err = ubi_io_read_vid_hdr(ubi, pnum, vh, 0);
+			if (err && err != UBI_IO_BITFLIPS)
+				goto out_err;
+			if (be32_to_cpu(vh->vol_id) != UBI_FM_DATA_VOLUME_ID ||
+			    be32_to_cpu(vh->lnum) != i ||
+			    be64_to_cpu(vh->sqnum) != sqnum) {
+				dbg_bld("bad fastmap block %d at PEB %d",
+					i, pnum);
+				err = -EINVAL;
+				goto out_free;
+			}
+		}
+
+		err = ubi_io_read_data(ubi, buf + i * ubi->leb_size, pnum, 0,
+				       len);
+		if (err && err != UBI_IO_BITFLIPS)
+			goto out_err;
+	}
+
+	crc = crc32(UBI_CRC32_INIT, buf + sizeof(struct ubi_fm_sb),
+		    size - sizeof(struct ubi_fm_sb));
+	if (be32_to_cpu(sb->data_crc) != crc) {
+		dbg_bld("bad fastmap data CRC %#08x, expected %#08x",
+			crc, be32_to_cpu(sb->data_crc));
+		err = -EINVAL;
+		goto out_free;
+	}
+
+	kfree(sb);
+	return buf;
+
+out_err:
+	if (err > 0)
+		err = -EINVAL;
+out_free:
+	vfree(buf);
+	kfree(sb);
+	return ERR_PTR(err);
+}
+
+/**
+ * add_fm_volumes - add the LEBs recorded in the fastmap to the scanning info.
+ * @ubi: UBI device description object
+ * @si: scanning information
+ * @fm: the fastmap
+ * @buf: the fastmap contents
+ * @vh: VID header buffer to use
+ *
+ * The recorded LEBs are added with the sequence number of the fastmap, so that
+ * any LEB written to the pool later is newer. This function returns zero in
+ * case of success, %-EINVAL if the fastmap is inconsistent and other negative
+ * error codes in case of failure.
+ */
+static int add_fm_volumes(struct ubi_device *ubi, struct ubi_scan_info *si,
+			  struct ubi_fastmap *fm, void *buf,
+			  struct ubi_vid_hdr *vh)
+{
+	struct ubi_fm_sb *fmsb = buf;
+	struct ubi_fm_hdr *fmh = (void *)(fmsb + 1);
+	struct ubi_fm_peb *pebs = (void *)(fmh + 1);
+	void *p = pebs + ubi->peb_count;
+	void *end = buf + sizeof(struct ubi_fm_sb) +
+		    be32_to_cpu(fmsb->data_size);
+	int i, j, err, vol_id, vol_count, leb_count;
+
+	vol_count = be32_to_cpu(fmh->vol_count);
+	if (vol_count < 0 || vol_count > UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT)
+		return -EINVAL;
+
+	for (i = 0; i < vol_count; i++) {
+		struct ubi_fm_volume *fmv = p;
+		struct ubi_fm_eba *feba = (void *)(fmv + 1);
+
+		if ((void *)feba > end ||
+		    be32_to_cpu(fmv->magic) != UBI_FM_VHDR_MAGIC)
+			return -EINVAL;
+
+		vol_id = be32_to_cpu(fmv->vol_id);
+		leb_count = be32_to_cpu(fmv->leb_count);
+		if ((vol_id < 0 || vol_id >= UBI_MAX_VOLUMES) &&
+		    vol_id != UBI_LAYOUT_VOLUME_ID)
+			return -EINVAL;
+		if (fmv->vol_type != UBI_VID_DYNAMIC &&
+		    fmv->vol_type != UBI_VID_STATIC)
+			return -EINVAL;
+		if (leb_count < 0 || leb_count > ubi->peb_count ||
+		    (void *)(feba + leb_count) > end)
+			return -EINVAL;
+
+		memset(vh, 0, sizeof(struct ubi_vid_hdr));
+		vh->vol_type = fmv->vol_type;
+		vh->compat = fmv->compat;
+		vh->vol_id = fmv->vol_id;
+		vh->used_ebs = fmv->used_ebs;
+		vh->data_pad = fmv->data_pad;
+		vh->data_size = fmv->last_data_size;
+		vh->sqnum = cpu_to_be64(fm->sqnum);
+
+		for (j = 0; j < leb_count; j++) {
+			int pnum = be32_to_cpu(feba[j].pnum);
+			int state;
+
+			if (pnum < 0 || pnum >= ubi->peb_count ||
+			    (int)be32_to_cpu(feba[j].lnum) < 0)
+				return -EINVAL;
+
+			state = pebs[pnum].state;
+			if (state != UBI_FM_PEB_USED &&
+			    state != UBI_FM_PEB_SCRUB)
+				return -EINVAL;
+			if (test_and_set_bit(pnum, fm->used))
+				return -EINVAL;
+
+			vh->lnum = feba[j].lnum;
+			err = ubi_scan_add_used(ubi, si, pnum,
+						be32_to_cpu(pebs[pnum].ec), vh,
+						state == UBI_FM_PEB_SCRUB);
+			if (err)
+				return err;
+		}
+
+		p = feba + leb_count;
+	}
+
+	/* Every PEB recorded as mapped has to be referred to */
+	for (i = 0; i < ubi->peb_count; i++)
+		if ((pebs[i].state == UBI_FM_PEB_USED ||
+		     pebs[i].state == UBI_FM_PEB_SCRUB) &&
+		    !test_bit(i, fm->used))
+			return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * ubi_scan_fastmap - build scanning information from the fastmap.
+ * @ubi: UBI device description object
+ * @si: scanning information to fill
+ *
+ * This function looks for the fastmap in the first %UBI_FM_MAX_START PEBs and,
+ * if there is a valid one, fills @si from it. Only the PEBs the fastmap records
+ * as %UBI_FM_PEB_SCAN are actually scanned.
+ *
+ * This function returns zero if the device has been attached by means of the
+ * fastmap, %UBI_NO_FASTMAP if there is no fastmap, %UBI_BAD_FASTMAP if the
+ * fastmap cannot be used and @si has to be re-built by full scanning, and
+ * %-ENOMEM if there is not enough memory.
+ */
+int ubi_scan_fastmap(struct ubi_device *ubi, struct ubi_scan_info *si)
+{
+	DECLARE_BITMAP(dirty, UBI_FM_MAX_START);
+	struct ubi_vid_hdr *vh;
+	struct ubi_ec_hdr *ech = NULL;
+	struct ubi_fastmap *fm = NULL;
+	struct ubi_fm_sb *fmsb;
+	struct ubi_fm_hdr *fmh;
+	struct ubi_fm_peb *pebs;
+	unsigned long long sqnum = 0;
+	void *buf = NULL;
+	int i, err, pnum, sb_pnum, scanned = 0;
+
+	bitmap_zero(dirty, UBI_FM_MAX_START);
+
+	vh = ubi_zalloc_vid_hdr(ubi, GFP_KERNEL);
+	if (!vh)
+		return -ENOMEM;
+
+	err = -ENOMEM;
+	ech = kzalloc(ubi->ec_hdr_alsize, GFP_KERNEL);
+	if (!ech)
+		goto out;
+
+	err = find_fastmap(ubi, vh, dirty, &sb_pnum, &sqnum);
+	if (err)
+		goto out;
+	if (sb_pnum == -1) {
+		err = UBI_NO_FASTMAP;
+		goto out;
+	}
+
+	dbg_bld("fastmap super block at PEB %d, sqnum %llu", sb_pnum, sqnum);
+
+	err = ubi_io_read_ec_hdr(ubi, sb_pnum, ech, 0);
+	if (err && err != UBI_IO_BITFLIPS) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	buf = read_fastmap(ubi, vh, sb_pnum, sqnum);
+	if (IS_ERR(buf)) {
+		err = PTR_ERR(buf);
+		buf = NULL;
+		goto out;
+	}
+
+	fmsb = buf;
+	fmh = (void *)(fmsb + 1);
+	pebs = (void *)(fmh + 1);
+
+	err = -EINVAL;
+	if (be32_to_cpu(fmh->magic) != UBI_FM_HDR_MAGIC ||
+	    be32_to_cpu(fmh->peb_count) != ubi->peb_count)
+		goto out;
+	if (be32_to_cpu(fmsb->data_size) < sizeof(struct ubi_fm_hdr) +
+					   ubi->peb_count * sizeof(*pebs))
+		goto out;
+
+	err = -ENOMEM;
+	fm = alloc_fastmap(ubi, GFP_KERNEL);
+	if (!fm)
+		goto out;
+	fm->sqnum = sqnum;
+
+	for (i = 0; i < be32_to_cpu(fmsb->used_blocks); i++) {
+		struct ubi_wl_entry *e;
+
+		pnum = be32_to_cpu(fmsb->block_loc[i]);
+		err = -EINVAL;
+		if (pebs[pnum].state != UBI_FM_PEB_FM || is_fm_block(fm, pnum))
+			goto out_fm;
+
+		err = -ENOMEM;
+		e = kmem_cache_alloc(ubi_wl_entry_slab, GFP_KERNEL);
+		if (!e)
+			goto out_fm;
+		e->pnum = pnum;
+		e->ec = be32_to_cpu(fmsb->block_ec[i]);
+		fm->e[fm->used_blocks++] = e;
+	}
+
+	ubi->image_seq = be32_to_cpu(ech->image_seq);
+
+	/* Take the free, to-be-erased and fastmap PEBs as they are recorded */
+	for (pnum = 0; pnum < ubi->peb_count; pnum++) {
+		int state = pebs[pnum].state;
+		int ec = be32_to_cpu(pebs[pnum].ec);
+
+		if (!state || state == UBI_FM_PEB_SCAN)
+			continue;
+
+		/* Left over from an older fastmap */
+		if (state == UBI_FM_PEB_FM && !is_fm_block(fm, pnum))
+			state = UBI_FM_PEB_ERASE;
+
+		err = ubi_io_is_bad(ubi, pnum);
+		if (err < 0)
+			goto out_fm;
+		else if (err) {
+			/* Went bad after the fastmap was written */
+			pebs[pnum].state = UBI_FM_PEB_SCAN;
+			continue;
+		}
+
+		err = -EINVAL;
+		if (ec < 0 || ec > UBI_MAX_ERASECOUNTER)
+			goto out_fm;
+
+		switch (state) {
+		case UBI_FM_PEB_FREE:
+			/*
+			 * A free PEB which has been written to means that the
+			 * fastmap is stale.
+			 */
+			if (pnum < UBI_FM_MAX_START && test_bit(pnum, dirty)) {
+				dbg_bld("free PEB %d is not empty", pnum);
+				goto out_fm;
+			}
+			err = ubi_scan_add_to_list(si, pnum, ec, 0, &si->free);
+			break;
+		case UBI_FM_PEB_ERASE:
+			err = ubi_scan_add_to_list(si, pnum, ec, 0, &si->erase);
+			break;
+		case UBI_FM_PEB_USED:
+		case UBI_FM_PEB_SCRUB:
+		case UBI_FM_PEB_FM:
+			err = 0;
+			break;
+		}
+		if (err)
+			goto out_fm;
+
+		si->ec_sum += ec;
+		si->ec_count += 1;
+		if (ec > si->max_ec)
+			si->max_ec = ec;
+		if (ec < si->min_ec)
+			si->min_ec = ec;
+	}
+
+	err = add_fm_volumes(ubi, si, fm, buf, vh);
+	if (err)
+		goto out_fm;
+
+	/* And scan the rest, the pool is among them */
+	for (pnum = 0; pnum < ubi->peb_count; pnum++) {
+		if (pebs[pnum].state && pebs[pnum].state != UBI_FM_PEB_SCAN)
+			continue;
+
+		cond_resched();
+		err = ubi_scan_process_eb(ubi, si, pnum);
+		if (err)
+			goto out_fm;
+		scanned += 1;
+	}
+
+	if (si->max_sqnum < sqnum)
+		si->max_sqnum = sqnum;
+	si->fm = fm;
+	si->fm_sqnum = sqnum;
+	ubi_msg("attached by fastmap at PEB %d, %d PEBs scanned",
+		sb_pnum, scanned);
+	err = 0;
+	goto out;
+
+out_fm:
+	ubi_free_fastmap(fm);
+out:
+	vfree(buf);
+	kfree(ech);
+	ubi_free_vid_hdr(ubi, vh);
+	if (err < 0 && err != -ENOMEM) {
+		ubi_warn("cannot attach by fastmap (error %d), scanning", err);
+		err = UBI_BAD_FASTMAP;
+	}
+	return err;
+}
+
+/**
+ * ubi_scan_drop_fastmap - stop using the fastmap found when attaching.
+ * @ubi: UBI device description object
+ * @si: scanning information
+ *
+ * This function is called when something has to be written to the flash
+ * before the WL sub-system takes over the fastmap, or when it cannot take
+ * over. The super block is erased, so that the fastmap is not found anymore,
+ * and the fastmap PEBs are returned to the free and erase lists. Returns zero
+ * in case of success and a negative error code in case of failure.
+ */
+int ubi_scan_drop_fastmap(struct ubi_device *ubi, struct ubi_scan_info *si)
+{
+	struct ubi_fastmap *fm = si->fm;
+	int i, err, ec = fm->e[0]->ec + 1;
+
+	dbg_bld("drop fastmap at PEB %d", fm->e[0]->pnum);
+
+	err = ubi_scan_erase_peb(ubi, si, fm->e[0]->pnum, ec);
+	if (err)
+		return err;
+
+	err = ubi_scan_add_to_list(si, fm->e[0]->pnum, ec, 0, &si->free);
+	if (err)
+		return err;
+
+	for (i = 1; i < fm->used_blocks; i++) {
+		err = ubi_scan_add_to_list(si, fm->e[i]->pnum, fm->e[i]->ec, 0,
+					   &si->erase);
+		if (err)
+			return err;
+	}
+
+	si->fm = NULL;
+	ubi_free_fastmap(fm);
+	return 0;
+}
+
+/**
+ * ubi_fastmap_init - initialize fastmap support of an UBI device.
+ * @ubi: UBI device description object
+ *
+ * This function reserves the PEBs a fastmap needs: its blocks, as many spare
+ * ones to write the next fastmap, while the current one is still valid. If
+ * the device is too small or already too full, fastmap is disabled for it.
+ * Returns zero in case of success and %-ENOMEM in case of failure.
+ */
+int ubi_fastmap_init(struct ubi_device *ubi)
+{
+	int blocks, need;
+
+	ubi->fm_size = fm_size(ubi);
+	blocks = DIV_ROUND_UP(ubi->fm_size, ubi->leb_size);
+	need = 2 * blocks;
+
+	if (blocks > UBI_FM_MAX_BLOCKS) {
+		ubi_warn("fastmap needs %d PEBs, max. is %d, disabled",
+			 blocks, UBI_FM_MAX_BLOCKS);
+		return 0;
+	}
+
+	if (ubi->avail_pebs < need + FM_SPARE_PEBS) {
+		ubi_warn("not enough PEBs for fastmap (%d, need %d), disabled",
+			 ubi->avail_pebs, need + FM_SPARE_PEBS);
+		return 0;
+	}
+
+	ubi->fm_buf = vmalloc(blocks * ubi->leb_size);
+	if (!ubi->fm_buf)
+		return -ENOMEM;
+
+	ubi->avail_pebs -= need;
+	ubi->rsvd_pebs += need;
+	ubi->fm_blocks = blocks;
+	ubi->fm_pool_size = clamp_t(int, ubi->peb_count / 20,
+				    FM_MIN_POOL_SIZE, FM_MAX_POOL_SIZE);
+
+	dbg_gen("fastmap: %d PEBs reserved, pool size %d",
+		need, ubi->fm_pool_size);
+	return 0;
+}
+
+/**
+ * build_volumes - record the volumes and their LEB to PEB mapping.
+ * @ubi: UBI device description object
+ * @fm: the new fastmap
+ * @fmh: the fastmap header
+ * @pebs: the PEB records
+ *
+ * This function returns the size of the fastmap in bytes.
+ */
+static int build_volumes(struct ubi_device *ubi, struct ubi_fastmap *fm,
+			 struct ubi_fm_hdr *fmh, struct ubi_fm_peb *pebs)
+{
+	void *p = pebs + ubi->peb_count;
+	int i, j, pnum, vol_count = 0;
+
+	spin_lock(&ubi->volumes_lock);
+	for (i = 0; i < UBI_MAX_VOLUMES + UBI_INT_VOL_COUNT; i++) {
+		struct ubi_volume *vol = ubi->volumes[i];
+		struct ubi_fm_volume *fmv = p;
+		struct ubi_fm_eba *feba = (void *)(fmv + 1);
+		int leb_count = 0;
+
+		if (!vol)
+			continue;
+
+		fmv->magic = cpu_to_be32(UBI_FM_VHDR_MAGIC);
+		fmv->vol_id = cpu_to_be32(vol->vol_id);
+		fmv->data_pad = cpu_to_be32(vol->data_pad);
+		if (vol->vol_id == UBI_LAYOUT_VOLUME_ID)
+			fmv->compat = UBI_LAYOUT_VOLUME_COMPAT;
+		if (vol->vol_type == UBI_DYNAMIC_VOLUME)
+			fmv->vol_type = UBI_VID_DYNAMIC;
+		else {
+			fmv->vol_type = UBI_VID_STATIC;
+			fmv->used_ebs = cpu_to_be32(vol->used_ebs);
+			fmv->last_data_size = cpu_to_be32(vol->last_eb_bytes);
+		}
+
+		for (j = 0; j < vol->reserved_pebs; j++) {
+			pnum = vol->eba_tbl[j];
+			if (pnum < 0 || pnum >= ubi->peb_count)
+				continue;
+
+			feba[leb_count].lnum = cpu_to_be32(j);
+			feba[leb_count].pnum = cpu_to_be32(pnum);
+			leb_count += 1;
+			__set_bit(pnum, fm->used);
+		}
+
+		fmv->leb_count = cpu_to_be32(leb_count);
+		p = feba + leb_count;
+		vol_count += 1;
+	}
+	spin_unlock(&ubi->volumes_lock);
+
+	fmh->vol_count = cpu_to_be32(vol_count);
+
+	/*
+	 * PEBs which have just been taken for writing, but are not mapped yet,
+	 * have to be scanned.
+	 */
+	for (i = 0; i < ubi->peb_count; i++)
+		if ((pebs[i].state == UBI_FM_PEB_USED ||
+		     pebs[i].state == UBI_FM_PEB_SCRUB) &&
+		    !test_bit(i, fm->used))
+			pebs[i].state = UBI_FM_PEB_SCAN;
+
+	return p - ubi->fm_buf;
+}
+
+/**
+ * write_blocks - write a built fastmap to the flash.
+ * @ubi: UBI device description object
+ * @fm: the new fastmap
+ * @size: size of the fastmap in bytes
+ *
+ * The VID header of the super block is written first. Once it is on the
+ * flash, attaching does not trust the old fastmap anymore, whose free PEBs
+ * the other fastmap blocks may be. If writing is interrupted, attaching finds
+ * a broken fastmap and falls back to scanning.
+ */
+static int write_blocks(struct ubi_device *ubi, struct ubi_fastmap *fm,
+			int size)
+{
+	struct ubi_vid_hdr *vh;
+	int i, len, err;
+
+	vh = ubi_zalloc_vid_hdr(ubi, GFP_NOFS);
+	if (!vh)
+		return -ENOMEM;
+
+	memset(ubi->fm_buf + size, 0xFF,
+	       fm->used_blocks * ubi->leb_size - size);
+
+	vh->vol_type = UBI_VID_DYNAMIC;
+	vh->compat = UBI_FM_VOLUME_COMPAT;
+	vh->sqnum = cpu_to_be64(fm->sqnum);
+
+	vh->vol_id = cpu_to_be32(UBI_FM_SB_VOLUME_ID);
+	err = ubi_io_write_vid_hdr(ubi, fm->e[0]->pnum, vh);
+	if (err)
+		goto out;
+
+	vh->vol_id = cpu_to_be32(UBI_FM_DATA_VOLUME_ID);
+	for (i = 1; i < fm->used_blocks; i++) {
+		vh->lnum = cpu_to_be32(i);
+		err = ubi_io_write_vid_hdr(ubi, fm->e[i]->pnum, vh);
+		if (err)
+			goto out;
+
+		len = min(size - i * ubi->leb_size, ubi->leb_size);
+		err = ubi_io_write_data(ubi, ubi->fm_buf + i * ubi->leb_size,
+					fm->e[i]->pnum, 0,
+					ALIGN(len, ubi->min_io_size));
+		if (err)
+			goto out;
+	}
+
+	len = min(size, ubi->leb_size);
+	err = ubi_io_write_data(ubi, ubi->fm_buf, fm->e[0]->pnum, 0,
+				ALIGN(len, ubi->min_io_size));
+
+out:
+	ubi_free_vid_hdr(ubi, vh);
+	return err;
+}
+
+/**
+ * write_fastmap - build and write a new fastmap.
+ * @ubi: UBI device description object
+ *
+ * Note, the caller has to hold @ubi->work_sem and @ubi->fm_sem for writing.
+ * This function returns zero in case of success and a negative error code in
+ * case of failure.
+ */
+static int write_fastmap(struct ubi_device *ubi)
+{
+	struct ubi_fastmap *fm;
+	struct ubi_fm_sb *fmsb = ubi->fm_buf;
+	struct ubi_fm_hdr *fmh = (void *)(fmsb + 1);
+	struct ubi_fm_peb *pebs = (void *)(fmh + 1);
+	int i, err, size, count;
+	struct ubi_wl_entry *e;
+
+	fm = alloc_fastmap(ubi, GFP_NOFS);
+	if (!fm)
+		return -ENOMEM;
+
+	memset(ubi->fm_buf, 0, ubi->fm_size);
+	ubi_wl_fill_fm_pebs(ubi, pebs);
+	size = build_volumes(ubi, fm, fmh, pebs);
+	count = DIV_ROUND_UP(size, ubi->leb_size);
+
+	err = ubi_wl_get_fm_pebs(ubi, fm->e, count);
+	if (err)
+		goto out_free;
+	fm->used_blocks = count;
+	fm->sqnum = ubi_next_sqnum(ubi);
+
+	/* The old fastmap becomes garbage as soon as this one is written */
+	if (ubi->fm)
+		for (i = 0; i < ubi->fm->used_blocks; i++) {
+			e = ubi->fm->e[i];
+			pebs[e->pnum].ec = cpu_to_be32(e->ec);
+			pebs[e->pnum].state = UBI_FM_PEB_ERASE;
+		}
+
+	for (i = 0; i < count; i++) {
+		e = fm->e[i];
+		pebs[e->pnum].ec = cpu_to_be32(e->ec);
+		pebs[e->pnum].state = UBI_FM_PEB_FM;
+		fmsb->block_loc[i] = cpu_to_be32(e->pnum);
+		fmsb->block_ec[i] = cpu_to_be32(e->ec);
+	}
+
+	fmh->magic = cpu_to_be32(UBI_FM_HDR_MAGIC);
+	fmh->peb_count = cpu_to_be32(ubi->peb_count);
+
+	fmsb->magic = cpu_to_be32(UBI_FM_SB_MAGIC);
+	fmsb->version = UBI_FM_FMT_VERSION;
+	fmsb->data_size = cpu_to_be32(size - sizeof(struct ubi_fm_sb));
+	fmsb->data_crc = cpu_to_be32(crc32(UBI_CRC32_INIT, fmh,
+					   size - sizeof(struct ubi_fm_sb)));
+	fmsb->used_blocks = cpu_to_be32(count);
+	fmsb->sqnum = cpu_to_be64(fm->sqnum);
+	fmsb->sb_crc = cpu_to_be32(crc32(UBI_CRC32_INIT, fmsb,
+					 UBI_FM_SB_SIZE_CRC));
+
+	err = write_blocks(ubi, fm, size);
+	if (err) {
+		ubi_wl_put_fm_pebs(ubi, fm->e, count, err == -EIO);
+		goto out_free;
+	}
+
+	dbg_gen("fastmap written to PEB %d, %d PEBs, sqnum %llu",
+		fm->e[0]->pnum, count, fm->sqnum);
+
+	/* The fastmap and its PEBs belong to the WL sub-system from now on */
+	return ubi_wl_commit_fm(ubi, fm);
+
+out_free:
+	kfree(fm->used);
+	kfree(fm);
+	return err;
+}
+
+/**
+ * ubi_update_fastmap - write a new fastmap.
+ * @ubi: UBI device description object
+ *
+ * If the fastmap cannot be written, the current one is invalidated, so the
+ * device is attached by scanning next time. This function returns zero in
+ * case of success and a negative error code if the device had to be switched
+ * to R/O mode.
+ */
+int ubi_update_fastmap(struct ubi_device *ubi)
+{
+	int err;
+
+	if (!ubi->fm_blocks)
+		return 0;
+	if (ubi->ro_mode)
+		return -EROFS;
+
+	mutex_lock(&ubi->fm_mutex);
+	down_write(&ubi->work_sem);
+	down_write(&ubi->fm_sem);
+
+	spin_lock(&ubi->wl_lock);
+	ubi->fm_refill = 0;
+	spin_unlock(&ubi->wl_lock);
+
+	err = write_fastmap(ubi);
+	if (err) {
+		if (err == -ENOSPC)
+			dbg_gen("no space for fastmap");
+		else
+			ubi_warn("cannot write fastmap, error %d", err);
+		err = ubi_wl_commit_fm(ubi, NULL);
+	}
+
+	up_write(&ubi->fm_sem);
+	up_write(&ubi->work_sem);
+	mutex_unlock(&ubi->fm_mutex);
+	return err;
+}
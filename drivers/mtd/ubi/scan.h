@@ -110,6 +110,10 @@ struct ubi_scan_volume {
  * @ec_sum: a temporary variable used when calculating @mean_ec
  * @ec_count: a temporary variable used when calculating @mean_ec
  * @scan_leb_slab: slab cache for &struct ubi_scan_leb objects
+ * @fm: the fastmap the information was built from (%NULL if the device was
+ *      fully scanned)
+ * @fm_sqnum: sequence number of that fastmap (%0 if the device was fully
+ *            scanned)
  *
  * This data structure contains the result of scanning and may be used by other
  * UBI sub-systems to build final UBI data structures, further error-recovery
@@ -136,10 +140,13 @@ struct ubi_scan_info {
 	uint64_t ec_sum;
 	int ec_count;
 	struct kmem_cache *scan_leb_slab;
+	struct ubi_fastmap *fm;
+	unsigned long long fm_sqnum;
 };
 
 struct ubi_device;
 struct ubi_vid_hdr;
+struct ubi_fastmap;
 
 /*
  * ubi_scan_move_to_list - move a PEB from the volume tree to a list.
@@ -156,6 +163,10 @@ static inline void ubi_scan_move_to_list(struct ubi_scan_volume *sv,
 		list_add_tail(&seb->u.list, list);
 }
 
+int ubi_scan_add_to_list(struct ubi_scan_info *si, int pnum, int ec,
+			 int to_head, struct list_head *list);
+int ubi_scan_process_eb(struct ubi_device *ubi, struct ubi_scan_info *si,
+			int pnum);
 int ubi_scan_add_used(struct ubi_device *ubi, struct ubi_scan_info *si,
 		      int pnum, int ec, const struct ubi_vid_hdr *vid_hdr,
 		      int bitflips);
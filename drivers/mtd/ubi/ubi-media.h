@@ -312,6 +312,16 @@ struct ubi_vid_hdr {
 #define UBI_LAYOUT_VOLUME_NAME   "layout volume"
 #define UBI_LAYOUT_VOLUME_COMPAT UBI_COMPAT_REJECT
 
+/*
+ * The fastmap volumes contain a snapshot of the eraseblock mapping (see
+ * fastmap.c). They are not listed in the volume table and are not visible to
+ * users, and they are "delete"-compatible so that UBI implementations without
+ * fastmap support (and full scanning) simply erase them.
+ */
+#define UBI_FM_SB_VOLUME_ID      (UBI_INTERNAL_VOL_START + 1)
+#define UBI_FM_DATA_VOLUME_ID    (UBI_INTERNAL_VOL_START + 2)
+#define UBI_FM_VOLUME_COMPAT     UBI_COMPAT_DELETE
+
 /* The maximum number of volumes per one UBI device */
 #define UBI_MAX_VOLUMES 128
 
@@ -375,4 +385,141 @@ struct ubi_vtbl_record {
 	__be32  crc;
 } __packed;
 
+/* The fastmap super block must live in one of the first PEBs of the device */
+#define UBI_FM_MAX_START 64
+
+/* The maximum number of PEBs a fastmap may occupy */
+#define UBI_FM_MAX_BLOCKS 32
+
+/* Fastmap format version */
+#define UBI_FM_FMT_VERSION 1
+
+#define UBI_FM_SB_MAGIC   0x7B11D69F
+#define UBI_FM_HDR_MAGIC  0xD4B82EF7
+#define UBI_FM_VHDR_MAGIC 0xFA370ED1
+
+/* Size of the fastmap super block without the ending CRC */
+#define UBI_FM_SB_SIZE_CRC (sizeof(struct ubi_fm_sb) - sizeof(__be32))
+
+/**
+ * struct ubi_fm_sb - fastmap super block.
+ * @magic: fastmap super block magic number (%UBI_FM_SB_MAGIC)
+ * @version: format version of this fastmap
+ * @padding1: reserved for future, zeroes
+ * @data_crc: CRC32 checksum of the fastmap data which follows the super block
+ * @data_size: size of the fastmap data in bytes
+ * @used_blocks: number of PEBs used by this fastmap
+ * @block_loc: an array containing the location of all PEBs of the fastmap
+ * @block_ec: the erase counter of each used PEB
+ * @sqnum: sequence number of this fastmap
+ * @padding2: reserved for future, zeroes
+ * @sb_crc: CRC32 checksum of the super block
+ *
+ * The super block is stored at the beginning of the data area of the first
+ * fastmap PEB (volume %UBI_FM_SB_VOLUME_ID, LEB 0), which must be one of the
+ * first %UBI_FM_MAX_START PEBs. The fastmap data follows it and continues in
+ * LEBs 1, 2, ... of volume %UBI_FM_DATA_VOLUME_ID, whose locations are stored
+ * in @block_loc. All VID headers of one fastmap carry the same sequence number
+ * @sqnum.
+ */
+struct ubi_fm_sb {
+	__be32 magic;
+	__u8   version;
+	__u8   padding1[3];
+	__be32 data_crc;
+	__be32 data_size;
+	__be32 used_blocks;
+	__be32 block_loc[UBI_FM_MAX_BLOCKS];
+	__be32 block_ec[UBI_FM_MAX_BLOCKS];
+	__be64 sqnum;
+	__u8   padding2[32];
+	__be32 sb_crc;
+} __packed;
+
+/**
+ * struct ubi_fm_hdr - header of the fastmap data.
+ * @magic: fastmap header magic number (%UBI_FM_HDR_MAGIC)
+ * @peb_count: number of PEBs described by the fastmap
+ * @vol_count: number of &struct ubi_fm_volume records
+ * @padding: reserved for future, zeroes
+ *
+ * The header is followed by @peb_count &struct ubi_fm_peb records (indexed by
+ * PEB number) and then by @vol_count &struct ubi_fm_volume records.
+ */
+struct ubi_fm_hdr {
+	__be32 magic;
+	__be32 peb_count;
+	__be32 vol_count;
+	__u8   padding[20];
+} __packed;
+
+/*
+ * PEB states recorded in the fastmap.
+ *
+ * UBI_FM_PEB_SCAN: the PEB has to be scanned when attaching (bad, corrupted
+ *                  or alien PEBs, PEBs of the pool which may have been written
+ *                  after the fastmap was written)
+ * UBI_FM_PEB_FREE: the PEB is erased and contains only the EC header
+ * UBI_FM_PEB_USED: the PEB is mapped to the LEB listed in a volume record
+ * UBI_FM_PEB_SCRUB: same as %UBI_FM_PEB_USED, but the PEB has to be scrubbed
+ * UBI_FM_PEB_ERASE: the PEB has to be erased
+ * UBI_FM_PEB_FM: the PEB belongs to this fastmap
+ */
+enum {
+	UBI_FM_PEB_SCAN = 1,
+	UBI_FM_PEB_FREE,
+	UBI_FM_PEB_USED,
+	UBI_FM_PEB_SCRUB,
+	UBI_FM_PEB_ERASE,
+	UBI_FM_PEB_FM,
+};
+
+/**
+ * struct ubi_fm_peb - fastmap record of a physical eraseblock.
+ * @ec: erase counter of the PEB
+ * @state: state of the PEB (%UBI_FM_PEB_SCAN, %UBI_FM_PEB_FREE, etc)
+ * @padding: reserved for future, zeroes
+ */
+struct ubi_fm_peb {
+	__be32 ec;
+	__u8   state;
+	__u8   padding[3];
+} __packed;
+
+/**
+ * struct ubi_fm_volume - fastmap record of a volume.
+ * @magic: fastmap volume record magic number (%UBI_FM_VHDR_MAGIC)
+ * @vol_id: volume ID
+ * @vol_type: type of the volume (%UBI_VID_DYNAMIC or %UBI_VID_STATIC)
+ * @compat: compatibility flags of the volume
+ * @padding1: reserved for future, zeroes
+ * @used_ebs: number of used LEBs (static volumes only)
+ * @data_pad: how many bytes at the end of LEBs are not used
+ * @last_data_size: amount of data in the last LEB (static volumes only)
+ * @leb_count: number of &struct ubi_fm_eba records which follow
+ * @padding2: reserved for future, zeroes
+ */
+struct ubi_fm_volume {
+	__be32 magic;
+	__be32 vol_id;
+	__u8   vol_type;
+	__u8   compat;
+	__u8   padding1[2];
+	__be32 used_ebs;
+	__be32 data_pad;
+	__be32 last_data_size;
+	__be32 leb_count;
+	__u8   padding2[4];
+} __packed;
+
+/**
+ * struct ubi_fm_eba - fastmap record of a mapped logical eraseblock.
+ * @lnum: logical eraseblock number
+ * @pnum: physical eraseblock the LEB is mapped to
+ */
+struct ubi_fm_eba {
+	__be32 lnum;
+	__be32 pnum;
+} __packed;
+
 #endif /* !__UBI_MEDIA_H__ */
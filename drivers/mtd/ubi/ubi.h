@@ -107,6 +107,19 @@ enum {
 	UBI_IO_BITFLIPS,
 };
 
+/*
+ * Return codes of the 'ubi_scan_fastmap()' function.
+ *
+ * UBI_NO_FASTMAP: there is no fastmap on the device
+ * UBI_BAD_FASTMAP: the fastmap is stale or corrupted
+ *
+ * In both cases the device has to be attached by full scanning.
+ */
+enum {
+	UBI_NO_FASTMAP = 1,
+	UBI_BAD_FASTMAP,
+};
+
 /*
  * Return codes of the 'ubi_eba_copy_leb()' function.
  *
@@ -151,6 +164,24 @@ struct ubi_wl_entry {
 	int pnum;
 };
 
+/**
+ * struct ubi_fastmap - in-memory description of the on-flash fastmap.
+ * @sqnum: sequence number the fastmap was written with
+ * @used_blocks: number of PEBs used by the fastmap
+ * @e: WL entries of the fastmap PEBs (@e[0] holds the super block)
+ * @used: bitmap of PEBs the fastmap records as mapped to a LEB
+ *
+ * A PEB set in @used must not be erased while this fastmap is current,
+ * otherwise attaching by means of the fastmap would find the LEB missing.
+ * Erasure of such PEBs is deferred until a newer fastmap is written.
+ */
+struct ubi_fastmap {
+	unsigned long long sqnum;
+	int used_blocks;
+	struct ubi_wl_entry *e[UBI_FM_MAX_BLOCKS];
+	unsigned long *used;
+};
+
 /**
  * struct ubi_ltree_entry - an entry in the lock tree.
  * @rb: links RB-tree nodes
@@ -343,7 +374,7 @@ struct ubi_wl_entry;
  * @pq_head: protection queue head
  * @wl_lock: protects the @used, @free, @pq, @pq_head, @lookuptbl, @move_from,
  *	     @move_to, @move_to_put @erase_pending, @wl_scheduled, @works,
- *	     @erroneous, and @erroneous_peb_count fields
+ *	     @erroneous, @erroneous_peb_count and fastmap pool fields
  * @move_mutex: serializes eraseblock moves
  * @work_sem: synchronizes the WL worker with use tasks
  * @wl_scheduled: non-zero if the wear-leveling was scheduled
@@ -358,6 +389,23 @@ struct ubi_wl_entry;
  * @thread_enabled: if the background thread is enabled
  * @bgt_name: background thread name
  *
+ * @fm: current on-flash fastmap, %NULL if there is none
+ * @fm_pool: RB-tree of free PEBs recorded for scanning in @fm (the only PEBs
+ *           new data may be written to while @fm is valid)
+ * @fm_pool_count: count of PEBs in @fm_pool
+ * @fm_pool_size: how many PEBs are put to @fm_pool when a fastmap is written
+ * @fm_anchor: erased PEB reserved for the next fastmap super block
+ * @fm_works: erase works of PEBs protected by @fm
+ * @fm_works_count: count of works in @fm_works
+ * @fm_refill: non-zero if the background thread has to write a new fastmap
+ * @fm_blocks: number of PEBs a fastmap needs, %0 if fastmap is disabled
+ * @fm_size: size of the fastmap in bytes
+ * @fm_buf: buffer the fastmap is built in (@fm_blocks LEBs long)
+ * @fm_mutex: serializes fastmap writers
+ * @fm_sem: taken for reading while a LEB is being (re-)mapped, so that a
+ *          fastmap never records a PEB with a VID header which is newer than
+ *          the fastmap but not yet in the EBA table
+ *
  * @flash_size: underlying MTD device size (in bytes)
  * @peb_count: count of physical eraseblocks on the MTD device
  * @peb_size: physical eraseblock size
@@ -446,6 +494,21 @@ struct ubi_device {
 	int thread_enabled;
 	char bgt_name[sizeof(UBI_BGT_NAME_PATTERN)+2];
 
+	/* Fastmap stuff */
+	struct ubi_fastmap *fm;
+	struct rb_root fm_pool;
+	int fm_pool_count;
+	int fm_pool_size;
+	struct ubi_wl_entry *fm_anchor;
+	struct list_head fm_works;
+	int fm_works_count;
+	int fm_refill;
+	int fm_blocks;
+	int fm_size;
+	void *fm_buf;
+	struct mutex fm_mutex;
+	struct rw_semaphore fm_sem;
+
 	/* I/O sub-system's stuff */
 	long long flash_size;
 	int peb_count;
@@ -534,6 +597,7 @@ int ubi_eba_atomic_leb_change(struct ubi_device *ubi, struct ubi_volume *vol,
 int ubi_eba_copy_leb(struct ubi_device *ubi, int from, int to,
 		     struct ubi_vid_hdr *vid_hdr);
 int ubi_eba_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si);
+unsigned long long ubi_next_sqnum(struct ubi_device *ubi);
 
 /* wl.c */
 int ubi_wl_get_peb(struct ubi_device *ubi, int dtype);
@@ -543,6 +607,37 @@ int ubi_wl_scrub_peb(struct ubi_device *ubi, int pnum);
 int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si);
 void ubi_wl_close(struct ubi_device *ubi);
 int ubi_thread(void *u);
+#ifdef CONFIG_MTD_UBI_FASTMAP
+int ubi_wl_get_fm_pebs(struct ubi_device *ubi, struct ubi_wl_entry **e,
+		       int count);
+void ubi_wl_put_fm_pebs(struct ubi_device *ubi, struct ubi_wl_entry **e,
+			int count, int torture);
+void ubi_wl_fill_fm_pebs(struct ubi_device *ubi, struct ubi_fm_peb *pebs);
+int ubi_wl_commit_fm(struct ubi_device *ubi, struct ubi_fastmap *fm);
+#endif
+
+/* fastmap.c */
+#ifdef CONFIG_MTD_UBI_FASTMAP
+int ubi_scan_fastmap(struct ubi_device *ubi, struct ubi_scan_info *si);
+int ubi_scan_drop_fastmap(struct ubi_device *ubi, struct ubi_scan_info *si);
+int ubi_fastmap_init(struct ubi_device *ubi);
+int ubi_update_fastmap(struct ubi_device *ubi);
+void ubi_free_fastmap(struct ubi_fastmap *fm);
+#else
+static inline int ubi_scan_fastmap(struct ubi_device *ubi,
+				   struct ubi_scan_info *si)
+{
+	return UBI_NO_FASTMAP;
+}
+static inline int ubi_scan_drop_fastmap(struct ubi_device *ubi,
+					struct ubi_scan_info *si)
+{
+	return 0;
+}
+static inline int ubi_fastmap_init(struct ubi_device *ubi) { return 0; }
+static inline int ubi_update_fastmap(struct ubi_device *ubi) { return 0; }
+static inline void ubi_free_fastmap(struct ubi_fastmap *fm) {}
+#endif
 
 /* io.c */
 int ubi_io_read(const struct ubi_device *ubi, void *buf, int pnum, int offset,
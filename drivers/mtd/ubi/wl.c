@@ -380,6 +380,35 @@ static struct ubi_wl_entry *find_wl_entry(struct rb_root *root, int diff)
 	return e;
 }
 
+/**
+ * peb_source - get the RB-tree new data may be written to.
+ * @ubi: UBI device description object
+ *
+ * While there is a fastmap on the flash, it describes all free PEBs except
+ * the ones of its pool as erased, so only pool PEBs may be written to. Note,
+ * @ubi->wl_lock has to be locked.
+ */
+static struct rb_root *peb_source(struct ubi_device *ubi)
+{
+	return ubi->fm ? &ubi->fm_pool : &ubi->free;
+}
+
+/**
+ * request_fastmap - ask the background thread to write a new fastmap.
+ * @ubi: UBI device description object
+ *
+ * Note, @ubi->wl_lock has to be locked.
+ */
+static void request_fastmap(struct ubi_device *ubi)
+{
+	if (ubi->fm_refill)
+		return;
+
+	ubi->fm_refill = 1;
+	if (ubi->thread_enabled && !ubi_dbg_is_bgt_disabled(ubi))
+		wake_up_process(ubi->bgt_thread);
+}
+
 /**
  * ubi_wl_get_peb - get a physical eraseblock.
  * @ubi: UBI device description object
@@ -392,20 +421,57 @@ int ubi_wl_get_peb(struct ubi_device *ubi, int dtype)
 {
 	int err;
 	struct ubi_wl_entry *e, *first, *last;
+	struct rb_root *root;
 
 	ubi_assert(dtype == UBI_LONGTERM || dtype == UBI_SHORTTERM ||
 		   dtype == UBI_UNKNOWN);
 
 retry:
+	/*
+	 * A fastmap being written records the free PEBs as erased, so none of
+	 * them may be handed out meanwhile.
+	 */
+	down_read(&ubi->fm_sem);
 	spin_lock(&ubi->wl_lock);
-	if (!ubi->free.rb_node) {
+	if (ubi->fm && !ubi->fm_pool.rb_node) {
+		int have_free = !!ubi->free.rb_node;
+		int have_works = ubi->works_count || ubi->fm_works_count;
+
+		/*
+		 * The pool of the current fastmap is used up, and free PEBs
+		 * become usable only after a new fastmap puts them to the
+		 * pool.
+		 */
+		spin_unlock(&ubi->wl_lock);
+		up_read(&ubi->fm_sem);
+
+		if (!have_free) {
+			if (!have_works) {
+				ubi_err("no free eraseblocks");
+				return -ENOSPC;
+			}
+			err = produce_free_peb(ubi);
+			if (err < 0)
+				return err;
+		}
+
+		err = ubi_update_fastmap(ubi);
+		if (err)
+			return err;
+		goto retry;
+	}
+
+	root = peb_source(ubi);
+	if (!root->rb_node) {
 		if (ubi->works_count == 0) {
 			ubi_assert(list_empty(&ubi->works));
 			ubi_err("no free eraseblocks");
 			spin_unlock(&ubi->wl_lock);
+			up_read(&ubi->fm_sem);
 			return -ENOSPC;
 		}
 		spin_unlock(&ubi->wl_lock);
+		up_read(&ubi->fm_sem);
 
 		err = produce_free_peb(ubi);
 		if (err < 0)
@@ -421,7 +487,7 @@ retry:
 		 * bounded by the the lowest erase counter plus
 		 * %WL_FREE_MAX_DIFF.
 		 */
-		e = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF);
+		e = find_wl_entry(root, WL_FREE_MAX_DIFF);
 		break;
 	case UBI_UNKNOWN:
 		/*
@@ -430,37 +496,41 @@ retry:
 		 * eraseblock with erase counter greater or equivalent than the
 		 * lowest erase counter plus %WL_FREE_MAX_DIFF/2.
 		 */
-		first = rb_entry(rb_first(&ubi->free), struct ubi_wl_entry,
-					u.rb);
-		last = rb_entry(rb_last(&ubi->free), struct ubi_wl_entry, u.rb);
+		first = rb_entry(rb_first(root), struct ubi_wl_entry, u.rb);
+		last = rb_entry(rb_last(root), struct ubi_wl_entry, u.rb);
 
 		if (last->ec - first->ec < WL_FREE_MAX_DIFF)
-			e = rb_entry(ubi->free.rb_node,
-					struct ubi_wl_entry, u.rb);
+			e = rb_entry(root->rb_node, struct ubi_wl_entry, u.rb);
 		else
-			e = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF/2);
+			e = find_wl_entry(root, WL_FREE_MAX_DIFF/2);
 		break;
 	case UBI_SHORTTERM:
 		/*
 		 * For short term data we pick a physical eraseblock with the
 		 * lowest erase counter as we expect it will be erased soon.
 		 */
-		e = rb_entry(rb_first(&ubi->free), struct ubi_wl_entry, u.rb);
+		e = rb_entry(rb_first(root), struct ubi_wl_entry, u.rb);
 		break;
 	default:
 		BUG();
 	}
 
-	paranoid_check_in_wl_tree(ubi, e, &ubi->free);
+	paranoid_check_in_wl_tree(ubi, e, root);
 
 	/*
 	 * Move the physical eraseblock to the protection queue where it will
 	 * be protected from being moved for some time.
 	 */
-	rb_erase(&e->u.rb, &ubi->free);
+	rb_erase(&e->u.rb, root);
 	dbg_wl("PEB %d EC %d", e->pnum, e->ec);
 	prot_queue_add(ubi, e);
+	if (ubi->fm) {
+		ubi->fm_pool_count -= 1;
+		if (ubi->fm_pool_count < ubi->fm_pool_size / 4)
+			request_fastmap(ubi);
+	}
 	spin_unlock(&ubi->wl_lock);
+	up_read(&ubi->fm_sem);
 
 	err = ubi_dbg_check_all_ff(ubi, e->pnum, ubi->vid_hdr_aloffset,
 				   ubi->peb_size - ubi->vid_hdr_aloffset);
@@ -602,21 +672,31 @@ repeat:
 }
 
 /**
- * schedule_ubi_work - schedule a work.
+ * __schedule_ubi_work - schedule a work.
  * @ubi: UBI device description object
  * @wrk: the work to schedule
  *
  * This function adds a work defined by @wrk to the tail of the pending works
- * list.
+ * list. Note, @ubi->wl_lock has to be locked.
  */
-static void schedule_ubi_work(struct ubi_device *ubi, struct ubi_work *wrk)
+static void __schedule_ubi_work(struct ubi_device *ubi, struct ubi_work *wrk)
 {
-	spin_lock(&ubi->wl_lock);
 	list_add_tail(&wrk->list, &ubi->works);
 	ubi_assert(ubi->works_count >= 0);
 	ubi->works_count += 1;
 	if (ubi->thread_enabled && !ubi_dbg_is_bgt_disabled(ubi))
 		wake_up_process(ubi->bgt_thread);
+}
+
+/**
+ * schedule_ubi_work - schedule a work.
+ * @ubi: UBI device description object
+ * @wrk: the work to schedule
+ */
+static void schedule_ubi_work(struct ubi_device *ubi, struct ubi_work *wrk)
+{
+	spin_lock(&ubi->wl_lock);
+	__schedule_ubi_work(ubi, wrk);
 	spin_unlock(&ubi->wl_lock);
 }
 
@@ -629,6 +709,10 @@ static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
  * @e: the WL entry of the physical eraseblock to erase
  * @torture: if the physical eraseblock has to be tortured
  *
+ * If the current fastmap maps a LEB to the physical eraseblock, the erasure is
+ * deferred until a newer fastmap is written, because attaching by the current
+ * fastmap would find the LEB missing otherwise.
+ *
  * This function returns zero in case of success and a %-ENOMEM in case of
  * failure.
  */
@@ -648,7 +732,16 @@ static int schedule_erase(struct ubi_device *ubi, struct ubi_wl_entry *e,
 	wl_wrk->e = e;
 	wl_wrk->torture = torture;
 
-	schedule_ubi_work(ubi, wl_wrk);
+	spin_lock(&ubi->wl_lock);
+	if (ubi->fm && test_bit(e->pnum, ubi->fm->used)) {
+		dbg_wl("defer erasure of PEB %d", e->pnum);
+		list_add_tail(&wl_wrk->list, &ubi->fm_works);
+		ubi->fm_works_count += 1;
+		if (ubi->fm_works_count >= ubi->fm_pool_size / 2)
+			request_fastmap(ubi);
+	} else
+		__schedule_ubi_work(ubi, wl_wrk);
+	spin_unlock(&ubi->wl_lock);
 	return 0;
 }
 
@@ -669,6 +762,7 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 	int vol_id = -1, uninitialized_var(lnum);
 	struct ubi_wl_entry *e1, *e2;
 	struct ubi_vid_hdr *vid_hdr;
+	struct rb_root *root;
 
 	kfree(wrk);
 	if (cancel)
@@ -683,12 +777,14 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 	ubi_assert(!ubi->move_from && !ubi->move_to);
 	ubi_assert(!ubi->move_to_put);
 
-	if (!ubi->free.rb_node ||
+	root = peb_source(ubi);
+	if (!root->rb_node ||
 	    (!ubi->used.rb_node && !ubi->scrub.rb_node)) {
 		/*
 		 * No free physical eraseblocks? Well, they must be waiting in
-		 * the queue to be erased. Cancel movement - it will be
-		 * triggered again when a free physical eraseblock appears.
+		 * the queue to be erased, or in the free tree waiting for the
+		 * next fastmap. Cancel movement - it will be triggered again
+		 * when a free physical eraseblock appears.
 		 *
 		 * No used physical eraseblocks? They must be temporarily
 		 * protected from being moved. They will be moved to the
@@ -696,7 +792,9 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 		 * triggered again.
 		 */
 		dbg_wl("cancel WL, a list is empty: free %d, used %d",
-		       !ubi->free.rb_node, !ubi->used.rb_node);
+		       !root->rb_node, !ubi->used.rb_node);
+		if (ubi->fm && !root->rb_node)
+			request_fastmap(ubi);
 		goto out_cancel;
 	}
 
@@ -707,7 +805,7 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 		 * counters differ much enough, start wear-leveling.
 		 */
 		e1 = rb_entry(rb_first(&ubi->used), struct ubi_wl_entry, u.rb);
-		e2 = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF);
+		e2 = find_wl_entry(root, WL_FREE_MAX_DIFF);
 
 		if (!(e2->ec - e1->ec >= UBI_WL_THRESHOLD)) {
 			dbg_wl("no WL needed: min used EC %d, max free EC %d",
@@ -722,14 +820,16 @@ static int wear_leveling_worker(struct ubi_device *ubi, struct ubi_work *wrk,
 		/* Perform scrubbing */
 		scrubbing = 1;
 		e1 = rb_entry(rb_first(&ubi->scrub), struct ubi_wl_entry, u.rb);
-		e2 = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF);
+		e2 = find_wl_entry(root, WL_FREE_MAX_DIFF);
 		paranoid_check_in_wl_tree(ubi, e1, &ubi->scrub);
 		rb_erase(&e1->u.rb, &ubi->scrub);
 		dbg_wl("scrub PEB %d to PEB %d", e1->pnum, e2->pnum);
 	}
 
-	paranoid_check_in_wl_tree(ubi, e2, &ubi->free);
-	rb_erase(&e2->u.rb, &ubi->free);
+	paranoid_check_in_wl_tree(ubi, e2, root);
+	rb_erase(&e2->u.rb, root);
+	if (ubi->fm)
+		ubi->fm_pool_count -= 1;
 	ubi->move_from = e1;
 	ubi->move_to = e2;
 	spin_unlock(&ubi->wl_lock);
@@ -952,6 +1052,7 @@ static int ensure_wear_leveling(struct ubi_device *ubi)
 	struct ubi_wl_entry *e1;
 	struct ubi_wl_entry *e2;
 	struct ubi_work *wrk;
+	struct rb_root *root;
 
 	spin_lock(&ubi->wl_lock);
 	if (ubi->wl_scheduled)
@@ -963,7 +1064,8 @@ static int ensure_wear_leveling(struct ubi_device *ubi)
 	 * the WL worker has to be scheduled anyway.
 	 */
 	if (!ubi->scrub.rb_node) {
-		if (!ubi->used.rb_node || !ubi->free.rb_node)
+		root = peb_source(ubi);
+		if (!ubi->used.rb_node || !root->rb_node)
 			/* No physical eraseblocks - no deal */
 			goto out_unlock;
 
@@ -974,7 +1076,7 @@ static int ensure_wear_leveling(struct ubi_device *ubi)
 		 * %UBI_WL_THRESHOLD.
 		 */
 		e1 = rb_entry(rb_first(&ubi->used), struct ubi_wl_entry, u.rb);
-		e2 = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF);
+		e2 = find_wl_entry(root, WL_FREE_MAX_DIFF);
 
 		if (!(e2->ec - e1->ec >= UBI_WL_THRESHOLD))
 			goto out_unlock;
@@ -1036,6 +1138,9 @@ static int erase_worker(struct ubi_device *ubi, struct ubi_work *wl_wrk,
 
 		spin_lock(&ubi->wl_lock);
 		wl_tree_add(e, &ubi->free);
+		/* Retry writing a fastmap if the last attempt failed */
+		if (!ubi->fm && ubi->fm_blocks)
+			request_fastmap(ubi);
 		spin_unlock(&ubi->wl_lock);
 
 		/*
@@ -1272,6 +1377,270 @@ retry:
 	return ensure_wear_leveling(ubi);
 }
 
+#ifdef CONFIG_MTD_UBI_FASTMAP
+
+/**
+ * refill_pool - move free PEBs to the fastmap pool.
+ * @ubi: UBI device description object
+ *
+ * The pool gets both low and medium erase counter PEBs, so that all the data
+ * types 'ubi_wl_get_peb()' distinguishes have something to choose from. Note,
+ * @ubi->wl_lock has to be locked.
+ */
+static void refill_pool(struct ubi_device *ubi)
+{
+	struct ubi_wl_entry *e;
+	int i = 0;
+
+	while (ubi->fm_pool_count < ubi->fm_pool_size && ubi->free.rb_node) {
+		if (i++ & 1)
+			e = find_wl_entry(&ubi->free, WL_FREE_MAX_DIFF);
+		else
+			e = rb_entry(rb_first(&ubi->free),
+				     struct ubi_wl_entry, u.rb);
+		rb_erase(&e->u.rb, &ubi->free);
+		wl_tree_add(e, &ubi->fm_pool);
+		ubi->fm_pool_count += 1;
+	}
+}
+
+/**
+ * find_anchor - find the least worn PEB a fastmap super block may go to.
+ * @root: the RB-tree to look in
+ *
+ * Returns %NULL if there is no PEB below %UBI_FM_MAX_START in @root.
+ */
+static struct ubi_wl_entry *find_anchor(struct rb_root *root)
+{
+	struct ubi_wl_entry *e;
+	struct rb_node *p;
+
+	for (p = rb_first(root); p; p = rb_next(p)) {
+		e = rb_entry(p, struct ubi_wl_entry, u.rb);
+		if (e->pnum < UBI_FM_MAX_START)
+			return e;
+	}
+
+	return NULL;
+}
+
+/**
+ * ubi_wl_get_fm_pebs - get physical eraseblocks for a new fastmap.
+ * @ubi: UBI device description object
+ * @e: the PEBs are returned here
+ * @count: how many PEBs are needed, including the super block
+ *
+ * The super block (@e[0]) has to live in the first %UBI_FM_MAX_START PEBs,
+ * where attaching looks for it, so the least worn of the free and pool PEBs
+ * there and the anchor PEB kept back by the last fastmap update is taken. The
+ * other PEBs are taken from the free tree, or from the pool if it runs short.
+ *
+ * Note, the caller has to hold @ubi->fm_sem for writing. This function returns
+ * zero in case of success and %-ENOSPC if there are not enough free PEBs.
+ */
+int ubi_wl_get_fm_pebs(struct ubi_device *ubi, struct ubi_wl_entry **e,
+		       int count)
+{
+	struct ubi_wl_entry *anchor, *pool_anchor;
+	struct rb_root *root;
+	int i;
+
+	spin_lock(&ubi->wl_lock);
+	anchor = find_anchor(&ubi->free);
+	pool_anchor = find_anchor(&ubi->fm_pool);
+	if (pool_anchor && (!anchor || pool_anchor->ec < anchor->ec)) {
+		anchor = pool_anchor;
+		root = &ubi->fm_pool;
+	} else
+		root = &ubi->free;
+
+	if (ubi->fm_anchor && (!anchor || ubi->fm_anchor->ec <= anchor->ec))
+		anchor = ubi->fm_anchor;
+	else if (anchor) {
+		rb_erase(&anchor->u.rb, root);
+		if (root == &ubi->fm_pool)
+			ubi->fm_pool_count -= 1;
+		if (ubi->fm_anchor)
+			wl_tree_add(ubi->fm_anchor, &ubi->free);
+	}
+	ubi->fm_anchor = NULL;
+
+	if (!anchor) {
+		spin_unlock(&ubi->wl_lock);
+		return -ENOSPC;
+	}
+
+	/*
+	 * Pool PEBs may be written to while the current fastmap is valid, so
+	 * they are fine for data blocks when the free tree runs short.
+	 */
+	e[0] = anchor;
+	for (i = 1; i < count; i++) {
+		if (ubi->free.rb_node)
+			root = &ubi->free;
+		else if (ubi->fm_pool.rb_node) {
+			root = &ubi->fm_pool;
+			ubi->fm_pool_count -= 1;
+		} else
+			goto out_undo;
+		e[i] = rb_entry(rb_first(root), struct ubi_wl_entry, u.rb);
+		rb_erase(&e[i]->u.rb, root);
+	}
+	spin_unlock(&ubi->wl_lock);
+	return 0;
+
+out_undo:
+	while (--i > 0)
+		wl_tree_add(e[i], &ubi->free);
+	ubi->fm_anchor = anchor;
+	spin_unlock(&ubi->wl_lock);
+	return -ENOSPC;
+}
+
+/**
+ * ubi_wl_put_fm_pebs - return PEBs of a fastmap which could not be written.
+ * @ubi: UBI device description object
+ * @e: the PEBs to return
+ * @count: how many PEBs there are in @e
+ * @torture: if the physical eraseblocks have to be tortured
+ */
+void ubi_wl_put_fm_pebs(struct ubi_device *ubi, struct ubi_wl_entry **e,
+			int count, int torture)
+{
+	int i;
+
+	/* The super block goes last, it may point to the other PEBs */
+	for (i = count - 1; i >= 0; i--)
+		if (schedule_erase(ubi, e[i], torture))
+			ubi_ro_mode(ubi);
+}
+
+/**
+ * ubi_wl_fill_fm_pebs - record the state of all PEBs for a new fastmap.
+ * @ubi: UBI device description object
+ * @pebs: array of @ubi->peb_count records to fill
+ *
+ * This function refills the pool first, because the PEBs in there are the
+ * only free PEBs which may be written to while the new fastmap is valid. They
+ * are recorded as %UBI_FM_PEB_SCAN, so that attaching looks at them. PEBs this
+ * function knows nothing about stay zeroed, which attaching treats the same
+ * way. Note, the caller has to hold @ubi->work_sem and @ubi->fm_sem for
+ * writing.
+ */
+void ubi_wl_fill_fm_pebs(struct ubi_device *ubi, struct ubi_fm_peb *pebs)
+{
+	struct ubi_wl_entry *e;
+	struct ubi_work *wrk;
+	struct rb_node *rb;
+	int i;
+
+#define FM_SET(e, st) do {					\
+		pebs[(e)->pnum].ec = cpu_to_be32((e)->ec);	\
+		pebs[(e)->pnum].state = (st);			\
+	} while (0)
+
+	spin_lock(&ubi->wl_lock);
+	refill_pool(ubi);
+
+	ubi_rb_for_each_entry(rb, e, &ubi->free, u.rb)
+		FM_SET(e, UBI_FM_PEB_FREE);
+	if (ubi->fm_anchor)
+		FM_SET(ubi->fm_anchor, UBI_FM_PEB_FREE);
+	ubi_rb_for_each_entry(rb, e, &ubi->fm_pool, u.rb)
+		FM_SET(e, UBI_FM_PEB_SCAN);
+	ubi_rb_for_each_entry(rb, e, &ubi->used, u.rb)
+		FM_SET(e, UBI_FM_PEB_USED);
+	ubi_rb_for_each_entry(rb, e, &ubi->erroneous, u.rb)
+		FM_SET(e, UBI_FM_PEB_USED);
+	ubi_rb_for_each_entry(rb, e, &ubi->scrub, u.rb)
+		FM_SET(e, UBI_FM_PEB_SCRUB);
+	for (i = 0; i < UBI_PROT_QUEUE_LEN; i++)
+		list_for_each_entry(e, &ubi->pq[i], u.list)
+			FM_SET(e, UBI_FM_PEB_USED);
+	list_for_each_entry(wrk, &ubi->works, list)
+		if (wrk->func == &erase_worker)
+			FM_SET(wrk->e, UBI_FM_PEB_ERASE);
+	list_for_each_entry(wrk, &ubi->fm_works, list)
+		FM_SET(wrk->e, UBI_FM_PEB_ERASE);
+	spin_unlock(&ubi->wl_lock);
+
+#undef FM_SET
+}
+
+/**
+ * ubi_wl_commit_fm - make a new fastmap the current one.
+ * @ubi: UBI device description object
+ * @fm: the fastmap which has just been written, or %NULL to invalidate
+ *
+ * The super block of the old fastmap is erased synchronously, because it must
+ * not be found by attaching once the PEBs the old fastmap protected become
+ * writable. It is kept back as the anchor for the next fastmap. Then the old
+ * data blocks and all the erasures deferred because of the old fastmap are
+ * scheduled.
+ *
+ * Note, the caller has to hold @ubi->work_sem and @ubi->fm_sem for writing.
+ * This function returns zero in case of success and a negative error code in
+ * case of failure.
+ */
+int ubi_wl_commit_fm(struct ubi_device *ubi, struct ubi_fastmap *fm)
+{
+	struct ubi_fastmap *old = ubi->fm;
+	int i, err = 0;
+
+	if (old) {
+		err = sync_erase(ubi, old->e[0], 0);
+		if (err) {
+			ubi_err("cannot erase fastmap super block PEB %d",
+				old->e[0]->pnum);
+			ubi_ro_mode(ubi);
+			if (!fm)
+				return err;
+		}
+	}
+
+	spin_lock(&ubi->wl_lock);
+	ubi->fm = fm;
+	if (old && !err) {
+		if (!ubi->fm_anchor)
+			ubi->fm_anchor = old->e[0];
+		else
+			wl_tree_add(old->e[0], &ubi->free);
+	}
+
+	list_splice_tail_init(&ubi->fm_works, &ubi->works);
+	ubi->works_count += ubi->fm_works_count;
+	ubi->fm_works_count = 0;
+
+	if (!fm) {
+		struct rb_node *rb;
+
+		while ((rb = rb_first(&ubi->fm_pool))) {
+			struct ubi_wl_entry *e;
+
+			e = rb_entry(rb, struct ubi_wl_entry, u.rb);
+			rb_erase(rb, &ubi->fm_pool);
+			wl_tree_add(e, &ubi->free);
+		}
+		ubi->fm_pool_count = 0;
+	}
+	if (ubi->works_count && ubi->thread_enabled &&
+	    !ubi_dbg_is_bgt_disabled(ubi))
+		wake_up_process(ubi->bgt_thread);
+	spin_unlock(&ubi->wl_lock);
+
+	if (old) {
+		for (i = 1; i < old->used_blocks; i++)
+			if (schedule_erase(ubi, old->e[i], 0))
+				ubi_ro_mode(ubi);
+		kfree(old->used);
+		kfree(old);
+	}
+
+	return ensure_wear_leveling(ubi);
+}
+
+#endif /* CONFIG_MTD_UBI_FASTMAP */
+
 /**
  * ubi_wl_flush - flush all pending works.
  * @ubi: UBI device description object
@@ -1283,6 +1652,16 @@ int ubi_wl_flush(struct ubi_device *ubi)
 {
 	int err;
 
+	/*
+	 * Erasures deferred because of the current fastmap can only be done
+	 * after a newer fastmap has been written.
+	 */
+	if (ubi->fm_works_count) {
+		err = ubi_update_fastmap(ubi);
+		if (err)
+			return err;
+	}
+
 	/*
 	 * Erase while the pending works queue is not empty, but not more than
 	 * the number of currently pending works.
@@ -1369,8 +1748,9 @@ int ubi_thread(void *u)
 			continue;
 
 		spin_lock(&ubi->wl_lock);
-		if (list_empty(&ubi->works) || ubi->ro_mode ||
-		    !ubi->thread_enabled || ubi_dbg_is_bgt_disabled(ubi)) {
+		if ((list_empty(&ubi->works) && !ubi->fm_refill) ||
+		    ubi->ro_mode || !ubi->thread_enabled ||
+		    ubi_dbg_is_bgt_disabled(ubi)) {
 			set_current_state(TASK_INTERRUPTIBLE);
 			spin_unlock(&ubi->wl_lock);
 			schedule();
@@ -1378,7 +1758,10 @@ int ubi_thread(void *u)
 		}
 		spin_unlock(&ubi->wl_lock);
 
-		err = do_work(ubi);
+		if (ubi->fm_refill)
+			err = ubi_update_fastmap(ubi);
+		else
+			err = do_work(ubi);
 		if (err) {
 			ubi_err("%s: work failed with error code %d",
 				ubi->bgt_name, err);
@@ -1418,6 +1801,29 @@ static void cancel_pending(struct ubi_device *ubi)
 		ubi->works_count -= 1;
 		ubi_assert(ubi->works_count >= 0);
 	}
+
+	while (!list_empty(&ubi->fm_works)) {
+		struct ubi_work *wrk;
+
+		wrk = list_entry(ubi->fm_works.next, struct ubi_work, list);
+		list_del(&wrk->list);
+		wrk->func(ubi, wrk, 1);
+		ubi->fm_works_count -= 1;
+	}
+}
+
+/**
+ * fastmap_destroy - free the in-memory fastmap state.
+ * @ubi: UBI device description object
+ */
+static void fastmap_destroy(struct ubi_device *ubi)
+{
+	tree_destroy(&ubi->fm_pool);
+	if (ubi->fm_anchor)
+		kmem_cache_free(ubi_wl_entry_slab, ubi->fm_anchor);
+	ubi_free_fastmap(ubi->fm);
+	ubi->fm = NULL;
+	vfree(ubi->fm_buf);
 }
 
 /**
@@ -1442,18 +1848,46 @@ int ubi_wl_init_scan(struct ubi_device *ubi, struct ubi_scan_info *si)
 	init_rwsem(&ubi->work_sem);
 	ubi->max_ec = si->max_ec;
 	INIT_LIST_HEAD(&ubi->works);
+	ubi->fm_pool = RB_ROOT;
+	INIT_LIST_HEAD(&ubi->fm_works);
 
 	sprintf(ubi->bgt_name, UBI_BGT_NAME_PATTERN, ubi->ubi_num);
 
+	err = ubi_fastmap_init(ubi);
+	if (err)
+		return err;
+
+	/*
+	 * If fastmap cannot be used on this device, the fastmap we have been
+	 * attached by has to go before anything is changed on the flash.
+	 */
+	if (si->fm && !ubi->fm_blocks) {
+		err = ubi_scan_drop_fastmap(ubi, si);
+		if (err)
+			goto out_fm;
+	}
+
 	err = -ENOMEM;
 	ubi->lookuptbl = kzalloc(ubi->peb_count * sizeof(void *), GFP_KERNEL);
 	if (!ubi->lookuptbl)
-		return err;
+		goto out_fm;
 
 	for (i = 0; i < UBI_PROT_QUEUE_LEN; i++)
 		INIT_LIST_HEAD(&ubi->pq[i]);
 	ubi->pq_head = 0;
 
+	/*
+	 * The fastmap we have been attached by stays valid until a new one is
+	 * written, so erasure of the PEBs it maps has to be deferred, starting
+	 * with the PEBs in the erase list.
+	 */
+	if (si->fm) {
+		ubi->fm = si->fm;
+		si->fm = NULL;
+		for (i = 0; i < ubi->fm->used_blocks; i++)
+			ubi->lookuptbl[ubi->fm->e[i]->pnum] = ubi->fm->e[i];
+	}
+
 	list_for_each_entry_safe(seb, tmp, &si->erase, u.list) {
 		cond_resched();
 
@@ -1531,6 +1965,8 @@ out_free:
 	tree_destroy(&ubi->free);
 	tree_destroy(&ubi->scrub);
 	kfree(ubi->lookuptbl);
+out_fm:
+	fastmap_destroy(ubi);
 	return err;
 }
 
@@ -1560,6 +1996,7 @@ void ubi_wl_close(struct ubi_device *ubi)
 	dbg_wl("close the WL sub-system");
 	cancel_pending(ubi);
 	protection_queue_destroy(ubi);
+	fastmap_destroy(ubi);
 	tree_destroy(&ubi->used);
 	tree_destroy(&ubi->erroneous);
 	tree_destroy(&ubi->free);
@@ -34,6 +34,11 @@
 #include <linux/lockdep.h>
 #include <linux/ar8216_platform.h>
 #include <linux/workqueue.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_vlan.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/inet.h>
+#include <linux/inetdevice.h>
 #include "ar8216.h"
 
 /* size of the vlan table */
@@ -42,6 +47,9 @@
 #define AR8X16_MAX_PORTS	8
 
 #define AR8XXX_MIB_WORK_DELAY	2000 /* msecs */
+#define AR8XXX_MIB_MAX_WORDS	64
+
+#define AR8327_ACL_MAX_RULES	32
 
 struct ar8216_priv;
 
@@ -62,6 +70,52 @@ struct ar8xxx_mib_desc {
 	const char *name;
 };
 
+/*
+ * Indexes into the chip's MIB table of the counters that make up a
+ * rtnl_link_stats64, looked up by name since the tables differ per chip.
+ * A negative index means the chip doesn't have the counter.
+ */
+struct ar8xxx_mib_map {
+	u64 rx_pkts;	/* bitmap of the rx frame size buckets */
+	u64 tx_pkts;	/* bitmap of the tx frame size buckets */
+	int rx_bytes;
+	int tx_bytes;
+	int rx_multi;
+	int rx_fcs;
+	int rx_align;
+	int rx_runt;
+	int rx_fragment;
+	int rx_toolong;
+	int rx_overflow;
+	int filtered;
+	int tx_underrun;
+	int tx_collision;
+	int tx_abortcol;
+	int tx_latecol;
+};
+
+enum {
+	AR8XXX_ACL_MATCH_SRC_MAC,
+	AR8XXX_ACL_MATCH_DST_MAC,
+	AR8XXX_ACL_MATCH_SRC_IP,
+	AR8XXX_ACL_MATCH_DST_IP,
+};
+
+/*
+ * A flow rule handled by the switch's ACL engine: frames entering one of
+ * @ports that match the address get their DSCP rewritten and/or are
+ * policed, without ever being forwarded to the CPU port.
+ */
+struct ar8xxx_acl_rule {
+	u8 match;
+	u8 ports;
+	u8 mac[ETH_ALEN];
+	__be32 addr;
+	__be32 addr_mask;
+	u32 rate;	/* kbit/s, 0 for no limit */
+	s8 dscp;	/* -1 to leave untouched */
+};
+
 struct ar8xxx_chip {
 	unsigned long caps;
 
@@ -75,6 +129,7 @@ struct ar8xxx_chip {
 	void (*vtu_flush)(struct ar8216_priv *priv);
 	void (*vtu_load_vlan)(struct ar8216_priv *priv, u32 vid, u32 port_mask);
 	int (*atu_dump)(struct ar8216_priv *priv);
+	int (*acl_apply)(struct ar8216_priv *priv);
 
 	const struct ar8xxx_mib_desc *mib_decs;
 	unsigned num_mibs;
@@ -84,6 +139,8 @@ struct ar8216_priv {
 	struct switch_dev dev;
 	struct phy_device *phy;
 	u32 (*read)(struct ar8216_priv *priv, int reg);
+	void (*read_burst)(struct ar8216_priv *priv, int reg, u32 *val,
+			   int count);
 	void (*write)(struct ar8216_priv *priv, int reg, u32 val);
 	const struct net_device_ops *ndo_old;
 	struct net_device_ops ndo;
@@ -100,8 +157,22 @@ struct ar8216_priv {
 
 	struct mutex mib_lock;
 	struct delayed_work mib_work;
-	int mib_next_port;
+	struct work_struct netdev_nb_work;
+	bool netdev_nb_registered;
 	u64 *mib_stats;
+	struct u64_stats_sync mib_syncp;
+	int mib_words;
+	struct ar8xxx_mib_map mib_map;
+
+	/* VLAN netdevs whose ndo_get_stats64 reports the port MIBs */
+	bool vlan_hw_stats;
+	const struct net_device_ops *vlan_ndo_old;
+	struct net_device_ops vlan_ndo;
+	struct net_device *vlan_stats_dev[AR8X16_MAX_VLANS];
+	struct notifier_block netdev_nb;
+
+	/* number of ACL entries currently valid in hardware */
+	int acl_hw_count;
 
 	/* all fields below are cleared on reset */
 	bool vlan;
@@ -113,6 +184,10 @@ struct ar8216_priv {
 	u8 vlan_status[AR8X16_MAX_VLANS];
 	struct net_device *vlan_dev[AR8X16_MAX_VLANS];
 	u32 old_port_status;
+	/* per port mask of ports it must not forward to */
+	u8 port_isolate[AR8X16_MAX_PORTS];
+	struct ar8xxx_acl_rule acl[AR8327_ACL_MAX_RULES];
+	int acl_count;
 };
 
 #define MIB_DESC(_s , _o, _n)	\
@@ -275,6 +350,39 @@ ar8216_mii_read(struct ar8216_priv *priv, int reg)
 	return (hi << 16) | lo;
 }
 
+/*
+ * Read count consecutive registers starting at reg.  The page register
+ * is only rewritten (and waited for) when the burst crosses into a new
+ * 512 byte page, instead of once per register as ar8216_mii_read does.
+ */
+static void
+ar8216_mii_read_burst(struct ar8216_priv *priv, int reg, u32 *val, int count)
+{
+	struct phy_device *phy = priv->phy;
+	struct mii_bus *bus = phy->bus;
+	u16 r1, r2, page, cur_page = 0xffff;
+	u16 lo, hi;
+	int i;
+
+	mutex_lock(&bus->mdio_lock);
+
+	for (i = 0; i < count; i++, reg += 4) {
+		split_addr((u32) reg, &r1, &r2, &page);
+
+		if (page != cur_page) {
+			bus->write(bus, 0x18, 0, page);
+			usleep_range(1000, 2000); /* wait for the page switch */
+			cur_page = page;
+		}
+
+		lo = bus->read(bus, 0x10 | r2, r1);
+		hi = bus->read(bus, 0x10 | r2, r1 + 1);
+		val[i] = (hi << 16) | lo;
+	}
+
+	mutex_unlock(&bus->mdio_lock);
+}
+
 static void
 ar8216_mii_write(struct ar8216_priv *priv, int reg, u32 val)
 {
@@ -439,10 +547,27 @@ ar8216_mib_flush(struct ar8216_priv *priv)
 	return ar8216_mib_op(priv, AR8216_MIB_FUNC_FLUSH);
 }
 
+static unsigned int
+ar8216_mib_port_base(struct ar8216_priv *priv, int port)
+{
+	if (chip_is_ar8327(priv) || chip_is_ar8337(priv))
+		return AR8327_REG_PORT_STATS_BASE(port);
+	else if (chip_is_ar8236(priv) ||
+		 chip_is_ar8316(priv))
+		return AR8236_REG_PORT_STATS_BASE(port);
+	else
+		return AR8216_REG_PORT_STATS_BASE(port);
+}
+
+/*
+ * Read the captured counters of a port in a single burst and fold them
+ * into the 64 bit software counters (the hardware clears them on
+ * capture).
+ */
 static void
 ar8216_mib_fetch_port_stat(struct ar8216_priv *priv, int port, bool flush)
 {
-	unsigned int base;
+	u32 buf[AR8XXX_MIB_MAX_WORDS];
 	u64 *mib_stats;
 	int i;
 
@@ -450,25 +575,22 @@ ar8216_mib_fetch_port_stat(struct ar8216_priv *priv, int port, bool flush)
 
 	lockdep_assert_held(&priv->mib_lock);
 
-	if (chip_is_ar8327(priv) || chip_is_ar8337(priv))
-		base = AR8327_REG_PORT_STATS_BASE(port);
-	else if (chip_is_ar8236(priv) ||
-		 chip_is_ar8316(priv))
-		base = AR8236_REG_PORT_STATS_BASE(port);
-	else
-		base = AR8216_REG_PORT_STATS_BASE(port);
+	priv->read_burst(priv, ar8216_mib_port_base(priv, port), buf,
+			 priv->mib_words);
 
 	mib_stats = &priv->mib_stats[port * priv->chip->num_mibs];
+
+	u64_stats_update_begin(&priv->mib_syncp);
 	for (i = 0; i < priv->chip->num_mibs; i++) {
 		const struct ar8xxx_mib_desc *mib;
 		u64 t;
 
 		mib = &priv->chip->mib_decs[i];
-		t = priv->read(priv, base + mib->offset);
+		t = buf[mib->offset / 4];
 		if (mib->size == 2) {
 			u64 hi;
 
-			hi = priv->read(priv, base + mib->offset + 4);
+			hi = buf[mib->offset / 4 + 1];
 			t |= hi << 32;
 		}
 
@@ -477,6 +599,29 @@ ar8216_mib_fetch_port_stat(struct ar8216_priv *priv, int port, bool flush)
 		else
 			mib_stats[i] += t;
 	}
+	u64_stats_update_end(&priv->mib_syncp);
+}
+
+/*
+ * One capture snapshots every port, so always fetch all of them rather
+ * than letting the counters of the other ports pile up in hardware.
+ */
+static int
+ar8216_mib_fetch_all(struct ar8216_priv *priv)
+{
+	int port;
+	int ret;
+
+	lockdep_assert_held(&priv->mib_lock);
+
+	ret = ar8216_mib_capture(priv);
+	if (ret)
+		return ret;
+
+	for (port = 0; port < priv->dev.ports; port++)
+		ar8216_mib_fetch_port_stat(priv, port, false);
+
+	return 0;
 }
 
 static void
@@ -1434,6 +1579,140 @@ ar8327_setup_port(struct ar8216_priv *priv, int port, u32 egress, u32 ingress,
 	priv->write(priv, AR8327_REG_PORT_LOOKUP(port), t);
 }
 
+static void
+ar8327_acl_put_mac(u32 *w, const u8 *mac, bool src)
+{
+	if (src) {
+		w[1] |= ((u32) mac[4] << 24) | ((u32) mac[5] << 16);
+		w[2] |= ((u32) mac[0] << 24) | ((u32) mac[1] << 16) |
+			((u32) mac[2] << 8) | mac[3];
+	} else {
+		w[0] |= ((u32) mac[2] << 24) | ((u32) mac[3] << 16) |
+			((u32) mac[4] << 8) | mac[5];
+		w[1] |= ((u32) mac[0] << 8) | mac[1];
+	}
+}
+
+static void
+ar8327_acl_encode(const struct ar8xxx_acl_rule *r, u32 *rule, u32 *mask,
+		  u32 *result, int index)
+{
+	static const u8 mac_mask[ETH_ALEN] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+	};
+	u32 type;
+
+	switch (r->match) {
+	case AR8XXX_ACL_MATCH_SRC_MAC:
+	case AR8XXX_ACL_MATCH_DST_MAC:
+		ar8327_acl_put_mac(rule, r->mac,
+				   r->match == AR8XXX_ACL_MATCH_SRC_MAC);
+		ar8327_acl_put_mac(mask, mac_mask,
+				   r->match == AR8XXX_ACL_MATCH_SRC_MAC);
+		type = AR8327_ACL_MASK4_TYPE_MAC;
+		break;
+	default:
+		/* word 0 holds the destination, word 1 the source address */
+		rule[r->match == AR8XXX_ACL_MATCH_SRC_IP] = ntohl(r->addr);
+		mask[r->match == AR8XXX_ACL_MATCH_SRC_IP] = ntohl(r->addr_mask);
+		type = AR8327_ACL_MASK4_TYPE_IP4;
+		break;
+	}
+
+	rule[4] = r->ports & AR8327_ACL_RULE4_PORTS;
+	mask[4] = type | (AR8327_ACL_MASK4_VALID_START_END <<
+			  AR8327_ACL_MASK4_VALID_S);
+
+	if (r->dscp >= 0)
+		result[0] = AR8327_ACL_RESULT0_DSCP_REMAP |
+			    (r->dscp << AR8327_ACL_RESULT0_DSCP_S);
+	if (r->rate)
+		result[2] = AR8327_ACL_RESULT2_POLICER_EN |
+			    (index << AR8327_ACL_RESULT2_POLICER_S);
+}
+
+static int
+ar8327_acl_write(struct ar8216_priv *priv, int index, u32 sel,
+		 const u32 *data)
+{
+	int i;
+
+	if (ar8216_wait_bit(priv, AR8327_REG_ACL_FUNC0,
+			    AR8327_ACL_FUNC0_BUSY, 0))
+		return -ETIMEDOUT;
+
+	for (i = 0; i < AR8327_ACL_DATA_WORDS; i++)
+		priv->write(priv, AR8327_REG_ACL_DATA(i), data[i]);
+
+	priv->write(priv, AR8327_REG_ACL_FUNC0,
+		    AR8327_ACL_FUNC0_BUSY | (sel << AR8327_ACL_FUNC0_SEL_S) |
+		    (index & AR8327_ACL_FUNC0_INDEX));
+	return 0;
+}
+
+/*
+ * Each rule gets the policer with the same index, so there is no separate
+ * allocation. The mask entry carries the valid bits: it is cleared before
+ * a slot is rewritten and written last, so a half-loaded rule never matches.
+ */
+static int
+ar8327_acl_apply(struct ar8216_priv *priv)
+{
+	u32 rule[AR8327_ACL_DATA_WORDS];
+	u32 mask[AR8327_ACL_DATA_WORDS];
+	u32 result[AR8327_ACL_DATA_WORDS];
+	int count = max(priv->acl_count, priv->acl_hw_count);
+	int i, ret;
+
+	memset(mask, 0, sizeof(mask));
+	for (i = 0; i < priv->acl_hw_count; i++) {
+		ret = ar8327_acl_write(priv, i, AR8327_ACL_FUNC0_SEL_MASK,
+				       mask);
+		if (ret)
+			return ret;
+	}
+	priv->acl_hw_count = 0;
+
+	for (i = 0; i < count; i++) {
+		const struct ar8xxx_acl_rule *r = &priv->acl[i];
+		u32 policer = 0;
+
+		memset(rule, 0, sizeof(rule));
+		memset(mask, 0, sizeof(mask));
+		memset(result, 0, sizeof(result));
+
+		if (i < priv->acl_count) {
+			ar8327_acl_encode(r, rule, mask, result, i);
+			if (r->rate)
+				policer = AR8327_ACL_POLICER_EN |
+					  (AR8327_ACL_POLICER_CBS_32K <<
+					   AR8327_ACL_POLICER_CBS_S) |
+					  (DIV_ROUND_UP(r->rate,
+						AR8327_ACL_POLICER_RATE_UNIT) <<
+					   AR8327_ACL_POLICER_RATE_S);
+		}
+
+		priv->write(priv, AR8327_REG_ACL_POLICER(i), policer);
+
+		ret = ar8327_acl_write(priv, i, AR8327_ACL_FUNC0_SEL_RULE,
+				       rule);
+		if (!ret)
+			ret = ar8327_acl_write(priv, i,
+					       AR8327_ACL_FUNC0_SEL_RESULT,
+					       result);
+		if (!ret && i < priv->acl_count)
+			ret = ar8327_acl_write(priv, i,
+					       AR8327_ACL_FUNC0_SEL_MASK, mask);
+		if (ret)
+			return ret;
+	}
+	priv->acl_hw_count = priv->acl_count;
+
+	ar8216_rmw(priv, AR8327_REG_MODULE_EN, AR8327_MODULE_EN_ACL,
+		   priv->acl_count ? AR8327_MODULE_EN_ACL : 0);
+	return 0;
+}
+
 static const struct ar8xxx_chip ar8327_chip = {
 	.caps = AR8XXX_CAP_GIGE | AR8XXX_CAP_MIB_COUNTERS,
 	.hw_init = ar8327_hw_init,
@@ -1445,6 +1724,7 @@ static const struct ar8xxx_chip ar8327_chip = {
 	.vtu_flush = ar8327_vtu_flush,
 	.vtu_load_vlan = ar8327_vtu_load_vlan,
 	.atu_dump = ar8327_atu_dump,
+	.acl_apply = ar8327_acl_apply,
 
 	.num_mibs = ARRAY_SIZE(ar8236_mibs),
 	.mib_decs = ar8236_mibs,
@@ -1637,6 +1917,7 @@ ar8216_sw_hw_apply(struct switch_dev *dev)
 	struct ar8216_priv *priv = to_ar8216(dev);
 	u8 portmask[AR8X16_MAX_PORTS];
 	int i, j;
+	int ret = 0;
 
 	mutex_lock(&priv->reg_mutex);
 	/* flush all vlan translation unit entries */
@@ -1673,6 +1954,17 @@ ar8216_sw_hw_apply(struct switch_dev *dev)
 		}
 	}
 
+	/* isolation applies in both directions */
+	for (i = 0; i < dev->ports; i++) {
+		for (j = 0; j < dev->ports; j++) {
+			if (!(priv->port_isolate[i] & (1 << j)))
+				continue;
+
+			portmask[i] &= ~(1 << j);
+			portmask[j] &= ~(1 << i);
+		}
+	}
+
 	/* update the port destination mask registers and tag settings */
 	for (i = 0; i < dev->ports; i++) {
 		int egress, ingress;
@@ -1694,8 +1986,11 @@ ar8216_sw_hw_apply(struct switch_dev *dev)
 		priv->chip->setup_port(priv, i, egress, ingress, portmask[i],
 				       pvid);
 	}
+
+	if (priv->chip->acl_apply)
+		ret = priv->chip->acl_apply(priv);
 	mutex_unlock(&priv->reg_mutex);
-	return 0;
+	return ret;
 }
 
 static int
@@ -1737,7 +2032,9 @@ ar8216_sw_set_reset_mibs(struct switch_dev *dev,
 
 	len = priv->dev.ports * priv->chip->num_mibs *
 	      sizeof(*priv->mib_stats);
+	u64_stats_update_begin(&priv->mib_syncp);
 	memset(priv->mib_stats, '\0', len);
+	u64_stats_update_end(&priv->mib_syncp);
 	ret = ar8216_mib_flush(priv);
 	if (ret)
 		goto unlock;
@@ -1755,6 +2052,7 @@ ar8216_sw_set_port_reset_mib(struct switch_dev *dev,
 			     struct switch_val *val)
 {
 	struct ar8216_priv *priv = to_ar8216(dev);
+	unsigned int len;
 	int port;
 	int ret;
 
@@ -1766,11 +2064,14 @@ ar8216_sw_set_port_reset_mib(struct switch_dev *dev,
 		return -EINVAL;
 
 	mutex_lock(&priv->mib_lock);
-	ret = ar8216_mib_capture(priv);
+	ret = ar8216_mib_fetch_all(priv);
 	if (ret)
 		goto unlock;
 
-	ar8216_mib_fetch_port_stat(priv, port, true);
+	len = priv->chip->num_mibs * sizeof(*priv->mib_stats);
+	u64_stats_update_begin(&priv->mib_syncp);
+	memset(&priv->mib_stats[port * priv->chip->num_mibs], '\0', len);
+	u64_stats_update_end(&priv->mib_syncp);
 
 	ret = 0;
 
@@ -1808,6 +2109,208 @@ ar8xxx_atu_flush(struct switch_dev *dev,
 	return ret;
 }
 
+static int
+ar8xxx_sw_set_port_isolate(struct switch_dev *dev,
+			   const struct switch_attr *attr,
+			   struct switch_val *val)
+{
+	struct ar8216_priv *priv = to_ar8216(dev);
+	int port = val->port_vlan;
+
+	if (port >= dev->ports)
+		return -EINVAL;
+
+	priv->port_isolate[port] = val->value.i & ~(1 << port);
+	return 0;
+}
+
+static int
+ar8xxx_sw_get_port_isolate(struct switch_dev *dev,
+			   const struct switch_attr *attr,
+			   struct switch_val *val)
+{
+	struct ar8216_priv *priv = to_ar8216(dev);
+	int port = val->port_vlan;
+
+	if (port >= dev->ports)
+		return -EINVAL;
+
+	val->value.i = priv->port_isolate[port];
+	return 0;
+}
+
+/*
+ * Parses "<match>=<addr> [ports=<mask>] [rate=<kbit/s>] [dscp=<0-63>]",
+ * where <match> is one of src_mac, dst_mac, src_ip or dst_ip and the ip
+ * matches take an optional /prefix.
+ */
+static int
+ar8xxx_acl_parse(struct ar8216_priv *priv, char *str,
+		 struct ar8xxx_acl_rule *r)
+{
+	bool have_match = false;
+	char *tok, *arg;
+	unsigned int v;
+
+	memset(r, 0, sizeof(*r));
+	r->ports = (1 << priv->dev.ports) - 1;
+	r->dscp = -1;
+
+	while ((tok = strsep(&str, " ,\n")) != NULL) {
+		if (!*tok)
+			continue;
+
+		arg = strchr(tok, '=');
+		if (!arg)
+			return -EINVAL;
+		*arg++ = '\0';
+
+		if (!strcmp(tok, "src_mac") || !strcmp(tok, "dst_mac")) {
+			if (have_match || mac_pton(arg, r->mac))
+				return -EINVAL;
+			r->match = tok[0] == 's' ? AR8XXX_ACL_MATCH_SRC_MAC :
+						   AR8XXX_ACL_MATCH_DST_MAC;
+			have_match = true;
+		} else if (!strcmp(tok, "src_ip") || !strcmp(tok, "dst_ip")) {
+			const char *end;
+
+			if (have_match ||
+			    !in4_pton(arg, -1, (u8 *) &r->addr, '/', &end))
+				return -EINVAL;
+			v = 32;
+			if (*end == '/' && (kstrtouint(end + 1, 10, &v) ||
+					    v > 32))
+				return -EINVAL;
+			r->addr_mask = v ? inet_make_mask(v) : 0;
+			r->addr &= r->addr_mask;
+			r->match = tok[0] == 's' ? AR8XXX_ACL_MATCH_SRC_IP :
+						   AR8XXX_ACL_MATCH_DST_IP;
+			have_match = true;
+		} else if (!strcmp(tok, "ports")) {
+			if (kstrtouint(arg, 0, &v) || !v ||
+			    v >= (1 << priv->dev.ports))
+				return -EINVAL;
+			r->ports = v;
+		} else if (!strcmp(tok, "rate")) {
+			if (kstrtouint(arg, 10, &v) || !v ||
+			    DIV_ROUND_UP(v, AR8327_ACL_POLICER_RATE_UNIT) >
+			    AR8327_ACL_POLICER_RATE)
+				return -EINVAL;
+			r->rate = v;
+		} else if (!strcmp(tok, "dscp")) {
+			if (kstrtouint(arg, 0, &v) || v > 63)
+				return -EINVAL;
+			r->dscp = v;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	if (!have_match || (!r->rate && r->dscp < 0))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int
+ar8xxx_sw_set_acl_rule(struct switch_dev *dev,
+		       const struct switch_attr *attr,
+		       struct switch_val *val)
+{
+	struct ar8216_priv *priv = to_ar8216(dev);
+	struct ar8xxx_acl_rule r;
+	char *str;
+	int ret;
+
+	if (!priv->chip->acl_apply)
+		return -EOPNOTSUPP;
+
+	str = kstrdup(val->value.s, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	ret = ar8xxx_acl_parse(priv, str, &r);
+	kfree(str);
+	if (ret)
+		return ret;
+
+	mutex_lock(&priv->reg_mutex);
+	if (priv->acl_count < AR8327_ACL_MAX_RULES)
+		priv->acl[priv->acl_count++] = r;
+	else
+		ret = -ENOSPC;
+	mutex_unlock(&priv->reg_mutex);
+
+	return ret;
+}
+
+static int
+ar8xxx_sw_get_acl_rule(struct switch_dev *dev,
+		       const struct switch_attr *attr,
+		       struct switch_val *val)
+{
+	struct ar8216_priv *priv = to_ar8216(dev);
+	char *buf = priv->buf;
+	int len = 0;
+	int i;
+
+	if (!priv->chip->acl_apply)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&priv->reg_mutex);
+	for (i = 0; i < priv->acl_count; i++) {
+		const struct ar8xxx_acl_rule *r = &priv->acl[i];
+
+		len += snprintf(buf + len, sizeof(priv->buf) - len, "%d:", i);
+		switch (r->match) {
+		case AR8XXX_ACL_MATCH_SRC_MAC:
+		case AR8XXX_ACL_MATCH_DST_MAC:
+			len += snprintf(buf + len, sizeof(priv->buf) - len,
+					" %s_mac=%pM",
+					r->match == AR8XXX_ACL_MATCH_SRC_MAC ?
+					"src" : "dst", r->mac);
+			break;
+		default:
+			len += snprintf(buf + len, sizeof(priv->buf) - len,
+					" %s_ip=%pI4/%d",
+					r->match == AR8XXX_ACL_MATCH_SRC_IP ?
+					"src" : "dst", &r->addr,
+					inet_mask_len(r->addr_mask));
+			break;
+		}
+		len += snprintf(buf + len, sizeof(priv->buf) - len,
+				" ports=0x%02x", r->ports);
+		if (r->rate)
+			len += snprintf(buf + len, sizeof(priv->buf) - len,
+					" rate=%u", r->rate);
+		if (r->dscp >= 0)
+			len += snprintf(buf + len, sizeof(priv->buf) - len,
+					" dscp=%d", r->dscp);
+		len += snprintf(buf + len, sizeof(priv->buf) - len, "\n");
+	}
+	mutex_unlock(&priv->reg_mutex);
+
+	val->value.s = buf;
+	val->len = len;
+	return 0;
+}
+
+static int
+ar8xxx_sw_flush_acl(struct switch_dev *dev,
+		    const struct switch_attr *attr,
+		    struct switch_val *val)
+{
+	struct ar8216_priv *priv = to_ar8216(dev);
+
+	if (!priv->chip->acl_apply)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&priv->reg_mutex);
+	priv->acl_count = 0;
+	mutex_unlock(&priv->reg_mutex);
+	return 0;
+}
+
 static int
 ar8216_sw_get_port_mib(struct switch_dev *dev,
 		       const struct switch_attr *attr,
@@ -1829,12 +2332,10 @@ ar8216_sw_get_port_mib(struct switch_dev *dev,
 		return -EINVAL;
 
 	mutex_lock(&priv->mib_lock);
-	ret = ar8216_mib_capture(priv);
+	ret = ar8216_mib_fetch_all(priv);
 	if (ret)
 		goto unlock;
 
-	ar8216_mib_fetch_port_stat(priv, port, false);
-
 	len += snprintf(buf + len, sizeof(priv->buf) - len,
 			"Port %d MIB counters\n",
 			port);
@@ -1856,6 +2357,300 @@ unlock:
 	return ret;
 }
 
+static int
+ar8xxx_mib_index(struct ar8216_priv *priv, const char *name)
+{
+	int i;
+
+	for (i = 0; i < priv->chip->num_mibs; i++)
+		if (!strcmp(priv->chip->mib_decs[i].name, name))
+			return i;
+
+	return -1;
+}
+
+static u64
+ar8xxx_mib_mask(struct ar8216_priv *priv, const char * const *names)
+{
+	u64 mask = 0;
+	int i;
+
+	for (; *names; names++) {
+		i = ar8xxx_mib_index(priv, *names);
+		if (i >= 0)
+			mask |= 1ULL << i;
+	}
+
+	return mask;
+}
+
+static void
+ar8xxx_mib_map_init(struct ar8216_priv *priv)
+{
+	static const char * const rx_pkts[] = {
+		"Rx64Byte", "Rx128Byte", "Rx256Byte", "Rx512Byte",
+		"Rx1024Byte", "Rx1518Byte", "RxMaxByte", NULL
+	};
+	static const char * const tx_pkts[] = {
+		"Tx64Byte", "Tx128Byte", "Tx256Byte", "Tx512Byte",
+		"Tx1024Byte", "Tx1518Byte", "TxMaxByte", NULL
+	};
+	struct ar8xxx_mib_map *map = &priv->mib_map;
+
+	BUILD_BUG_ON(ARRAY_SIZE(ar8236_mibs) > 64);
+
+	map->rx_pkts = ar8xxx_mib_mask(priv, rx_pkts);
+	map->tx_pkts = ar8xxx_mib_mask(priv, tx_pkts);
+	map->rx_bytes = ar8xxx_mib_index(priv, "RxGoodByte");
+	map->tx_bytes = ar8xxx_mib_index(priv, "TxByte");
+	map->rx_multi = ar8xxx_mib_index(priv, "RxMulti");
+	map->rx_fcs = ar8xxx_mib_index(priv, "RxFcsErr");
+	map->rx_align = ar8xxx_mib_index(priv, "RxAlignErr");
+	map->rx_runt = ar8xxx_mib_index(priv, "RxRunt");
+	map->rx_fragment = ar8xxx_mib_index(priv, "RxFragment");
+	map->rx_toolong = ar8xxx_mib_index(priv, "RxTooLong");
+	map->rx_overflow = ar8xxx_mib_index(priv, "RxOverFlow");
+	map->filtered = ar8xxx_mib_index(priv, "Filtered");
+	map->tx_underrun = ar8xxx_mib_index(priv, "TxUnderRun");
+	map->tx_collision = ar8xxx_mib_index(priv, "TxCollision");
+	map->tx_abortcol = ar8xxx_mib_index(priv, "TxAbortCol");
+	map->tx_latecol = ar8xxx_mib_index(priv, "TxLateCol");
+}
+
+#define MIB_VAL(_m, _i)	((_i) < 0 ? 0 : (_m)[_i])
+
+/*
+ * Add the software MIB counters of a port to stats, seen from the host
+ * side: what the port received from the wire is rx, what it sent is tx.
+ */
+static void
+ar8xxx_port_stats64_add(struct ar8216_priv *priv, int port,
+			struct rtnl_link_stats64 *stats)
+{
+	const struct ar8xxx_mib_map *map = &priv->mib_map;
+	const u64 *mib = &priv->mib_stats[port * priv->chip->num_mibs];
+	u64 rx_length, rx_crc, rx_frame, tx_errors;
+	int i;
+
+	for (i = 0; i < priv->chip->num_mibs; i++) {
+		if (map->rx_pkts & (1ULL << i))
+			stats->rx_packets += mib[i];
+		if (map->tx_pkts & (1ULL << i))
+			stats->tx_packets += mib[i];
+	}
+
+	stats->rx_bytes += MIB_VAL(mib, map->rx_bytes);
+	stats->tx_bytes += MIB_VAL(mib, map->tx_bytes);
+	stats->multicast += MIB_VAL(mib, map->rx_multi);
+	stats->collisions += MIB_VAL(mib, map->tx_collision);
+	stats->rx_dropped += MIB_VAL(mib, map->filtered);
+
+	rx_crc = MIB_VAL(mib, map->rx_fcs);
+	rx_frame = MIB_VAL(mib, map->rx_align);
+	rx_length = MIB_VAL(mib, map->rx_runt) +
+		    MIB_VAL(mib, map->rx_fragment) +
+		    MIB_VAL(mib, map->rx_toolong);
+	stats->rx_crc_errors += rx_crc;
+	stats->rx_frame_errors += rx_frame;
+	stats->rx_length_errors += rx_length;
+	stats->rx_fifo_errors += MIB_VAL(mib, map->rx_overflow);
+	stats->rx_errors += rx_crc + rx_frame + rx_length;
+
+	stats->tx_fifo_errors += MIB_VAL(mib, map->tx_underrun);
+	stats->tx_aborted_errors += MIB_VAL(mib, map->tx_abortcol);
+	stats->tx_window_errors += MIB_VAL(mib, map->tx_latecol);
+	tx_errors = MIB_VAL(mib, map->tx_underrun) +
+		    MIB_VAL(mib, map->tx_abortcol) +
+		    MIB_VAL(mib, map->tx_latecol);
+	stats->tx_errors += tx_errors;
+}
+
+/*
+ * ndo_get_stats64 of the hooked VLAN netdevs: the sum of the MIB
+ * counters of the VLAN's member ports, without the CPU port.  This may
+ * be called in atomic context, so it only reads the software counters
+ * maintained by the MIB work and never touches MDIO.
+ */
+static struct rtnl_link_stats64 *
+ar8xxx_vlan_get_stats64(struct net_device *dev,
+			struct rtnl_link_stats64 *stats)
+{
+	struct ar8216_priv *priv = container_of(dev->netdev_ops,
+						struct ar8216_priv, vlan_ndo);
+	unsigned int start;
+	u8 ports = 0;
+	int i, port;
+
+	for (i = 0; i < AR8X16_MAX_VLANS; i++) {
+		if (priv->vlan_stats_dev[i] == dev) {
+			ports = priv->vlan_table[i] & ~BIT(AR8216_PORT_CPU);
+			break;
+		}
+	}
+
+	if (!ports) {
+		if (priv->vlan_ndo_old->ndo_get_stats64)
+			return priv->vlan_ndo_old->ndo_get_stats64(dev, stats);
+		netdev_stats_to_stats64(stats, &dev->stats);
+		return stats;
+	}
+
+	do {
+		start = u64_stats_fetch_begin(&priv->mib_syncp);
+		memset(stats, 0, sizeof(*stats));
+		for (port = 0; port < priv->dev.ports; port++)
+			if (ports & BIT(port))
+				ar8xxx_port_stats64_add(priv, port, stats);
+	} while (u64_stats_fetch_retry(&priv->mib_syncp, start));
+
+	return stats;
+}
+
+/*
+ * Switch a VLAN netdev named <attached>.<vlan> over to the MIB backed
+ * ndo_get_stats64.  Called with rtnl held.
+ */
+static void
+ar8xxx_vlan_stats_hook_dev(struct ar8216_priv *priv, struct net_device *dev)
+{
+	struct net_device *attached = priv->phy->attached_dev;
+	int len, vid, vlan;
+
+	ASSERT_RTNL();
+
+	if (!attached)
+		return;
+
+	if (!is_vlan_dev(dev) || dev->iflink != attached->ifindex)
+		return;
+
+	len = strlen(attached->name);
+	if (strncmp(dev->name, attached->name, len) || dev->name[len] != '.')
+		return;
+
+	if (kstrtoint(dev->name + len + 1, 10, &vid))
+		return;
+
+	/* the netdev is named after the VID, find the table slot using it */
+	for (vlan = 0; vlan < priv->dev.vlans; vlan++)
+		if (priv->vlan_id[vlan] == vid)
+			break;
+
+	if (vlan == priv->dev.vlans || priv->vlan_stats_dev[vlan])
+		return;
+
+	if (!priv->vlan_ndo_old) {
+		priv->vlan_ndo_old = dev->netdev_ops;
+		priv->vlan_ndo = *dev->netdev_ops;
+		priv->vlan_ndo.ndo_get_stats64 = ar8xxx_vlan_get_stats64;
+	}
+
+	if (dev->netdev_ops != priv->vlan_ndo_old)
+		return;
+
+	priv->vlan_stats_dev[vlan] = dev;
+	dev->netdev_ops = &priv->vlan_ndo;
+}
+
+static void
+ar8xxx_vlan_stats_unhook_dev(struct ar8216_priv *priv, int vlan)
+{
+	struct net_device *dev = priv->vlan_stats_dev[vlan];
+
+	ASSERT_RTNL();
+
+	dev->netdev_ops = priv->vlan_ndo_old;
+	priv->vlan_stats_dev[vlan] = NULL;
+}
+
+static void
+ar8xxx_vlan_stats_hook(struct ar8216_priv *priv)
+{
+	struct net_device *dev;
+
+	rtnl_lock();
+	for_each_netdev(&init_net, dev)
+		ar8xxx_vlan_stats_hook_dev(priv, dev);
+	rtnl_unlock();
+}
+
+static void
+ar8xxx_vlan_stats_unhook(struct ar8216_priv *priv)
+{
+	int i;
+
+	rtnl_lock();
+	for (i = 0; i < AR8X16_MAX_VLANS; i++)
+		if (priv->vlan_stats_dev[i])
+			ar8xxx_vlan_stats_unhook_dev(priv, i);
+	rtnl_unlock();
+
+	/* let readers still running the hooked ops finish */
+	synchronize_net();
+}
+
+static int
+ar8xxx_netdev_event(struct notifier_block *nb, unsigned long event,
+		    void *ptr)
+{
+	struct ar8216_priv *priv = container_of(nb, struct ar8216_priv,
+						netdev_nb);
+	struct net_device *dev = ptr;
+	int i;
+
+	switch (event) {
+	case NETDEV_REGISTER:
+		if (priv->vlan_hw_stats)
+			ar8xxx_vlan_stats_hook_dev(priv, dev);
+		break;
+	case NETDEV_UNREGISTER:
+		for (i = 0; i < AR8X16_MAX_VLANS; i++)
+			if (priv->vlan_stats_dev[i] == dev)
+				ar8xxx_vlan_stats_unhook_dev(priv, i);
+		break;
+	}
+
+	return NOTIFY_DONE;
+}
+
+static int
+ar8xxx_sw_set_vlan_hw_stats(struct switch_dev *dev,
+			    const struct switch_attr *attr,
+			    struct switch_val *val)
+{
+	struct ar8216_priv *priv = to_ar8216(dev);
+	bool enable = !!val->value.i;
+
+	if (!ar8xxx_has_mib_counters(priv))
+		return -EOPNOTSUPP;
+
+	/* hooked netdevs are only released once the notifier is up */
+	if (!priv->netdev_nb_registered)
+		return -EBUSY;
+
+	if (enable == priv->vlan_hw_stats)
+		return 0;
+
+	priv->vlan_hw_stats = enable;
+	if (enable)
+		ar8xxx_vlan_stats_hook(priv);
+	else
+		ar8xxx_vlan_stats_unhook(priv);
+
+	return 0;
+}
+
+static int
+ar8xxx_sw_get_vlan_hw_stats(struct switch_dev *dev,
+			    const struct switch_attr *attr,
+			    struct switch_val *val)
+{
+	struct ar8216_priv *priv = to_ar8216(dev);
+
+	val->value.i = priv->vlan_hw_stats;
+	return 0;
+}
+
 static struct switch_attr ar8216_globals[] = {
 	{
 		.type = SWITCH_TYPE_INT,
@@ -1878,6 +2673,14 @@ static struct switch_attr ar8216_globals[] = {
 		.description = "Reset all MIB counters",
 		.set = ar8216_sw_set_reset_mibs,
 	},
+	{
+		.type = SWITCH_TYPE_INT,
+		.name = "vlan_hw_stats",
+		.description = "Report port MIB counters as VLAN netdev stats",
+		.set = ar8xxx_sw_set_vlan_hw_stats,
+		.get = ar8xxx_sw_get_vlan_hw_stats,
+		.max = 1
+	},
 	{
 		.type = SWITCH_TYPE_NOVAL,
 		.name = "flush_arl",
@@ -1890,6 +2693,19 @@ static struct switch_attr ar8216_globals[] = {
 		.description = "Dump ARL table with mac and port map",
 		.get = ar8xxx_atu_dump,
 	},
+	{
+		.type = SWITCH_TYPE_STRING,
+		.name = "acl_rule",
+		.description = "Add an ACL flow rule (DSCP remark/rate limit)",
+		.set = ar8xxx_sw_set_acl_rule,
+		.get = ar8xxx_sw_get_acl_rule,
+	},
+	{
+		.type = SWITCH_TYPE_NOVAL,
+		.name = "flush_acl",
+		.description = "Remove all ACL flow rules",
+		.set = ar8xxx_sw_flush_acl,
+	},
 };
 
 static struct switch_attr ar8216_port[] = {
@@ -1906,6 +2722,14 @@ static struct switch_attr ar8216_port[] = {
 		.set = NULL,
 		.get = ar8216_sw_get_port_mib,
 	},
+	{
+		.type = SWITCH_TYPE_INT,
+		.name = "isolate",
+		.description = "Mask of ports this port must not forward to",
+		.set = ar8xxx_sw_set_port_isolate,
+		.get = ar8xxx_sw_get_port_isolate,
+		.max = (1 << AR8X16_MAX_PORTS) - 1,
+	},
 };
 
 static struct switch_attr ar8216_vlan[] = {
@@ -2005,32 +2829,37 @@ static void
 ar8xxx_mib_work_func(struct work_struct *work)
 {
 	struct ar8216_priv *priv;
-	int err;
 
 	priv = container_of(work, struct ar8216_priv, mib_work.work);
 
 	mutex_lock(&priv->mib_lock);
+	ar8216_mib_fetch_all(priv);
+	mutex_unlock(&priv->mib_lock);
 
-	err = ar8216_mib_capture(priv);
-	if (err)
-		goto next_port;
+	schedule_delayed_work(&priv->mib_work,
+			      msecs_to_jiffies(AR8XXX_MIB_WORK_DELAY));
+}
 
-	ar8216_mib_fetch_port_stat(priv, priv->mib_next_port, false);
+/*
+ * config_init runs with rtnl held, so the netdev notifier is registered
+ * from process context once the switch is up.
+ */
+static void
+ar8xxx_netdev_nb_work_func(struct work_struct *work)
+{
+	struct ar8216_priv *priv;
 
-next_port:
-	priv->mib_next_port++;
-	if (priv->mib_next_port >= priv->dev.ports)
-		priv->mib_next_port = 0;
+	priv = container_of(work, struct ar8216_priv, netdev_nb_work);
 
-	mutex_unlock(&priv->mib_lock);
-	schedule_delayed_work(&priv->mib_work,
-			      msecs_to_jiffies(AR8XXX_MIB_WORK_DELAY));
+	if (!register_netdevice_notifier(&priv->netdev_nb))
+		priv->netdev_nb_registered = true;
 }
 
 static int
 ar8xxx_mib_init(struct ar8216_priv *priv)
 {
 	unsigned int len;
+	int i, words = 0;
 
 	if (!ar8xxx_has_mib_counters(priv))
 		return 0;
@@ -2044,9 +2873,23 @@ ar8xxx_mib_init(struct ar8216_priv *priv)
 	if (!priv->mib_stats)
 		return -ENOMEM;
 
+	/* number of 32 bit words spanned by a port's counters */
+	for (i = 0; i < priv->chip->num_mibs; i++) {
+		const struct ar8xxx_mib_desc *mib = &priv->chip->mib_decs[i];
+
+		words = max_t(int, words, mib->offset / 4 + mib->size);
+	}
+	BUG_ON(words > AR8XXX_MIB_MAX_WORDS);
+	priv->mib_words = words;
+
+	ar8xxx_mib_map_init(priv);
+
 	mutex_init(&priv->mib_lock);
 	INIT_DELAYED_WORK(&priv->mib_work, ar8xxx_mib_work_func);
 
+	priv->netdev_nb.notifier_call = ar8xxx_netdev_event;
+	INIT_WORK(&priv->netdev_nb_work, ar8xxx_netdev_nb_work_func);
+
 	return 0;
 }
 
@@ -2058,6 +2901,7 @@ ar8xxx_mib_start(struct ar8216_priv *priv)
 
 	schedule_delayed_work(&priv->mib_work,
 			      msecs_to_jiffies(AR8XXX_MIB_WORK_DELAY));
+	schedule_work(&priv->netdev_nb_work);
 }
 
 static void
@@ -2066,7 +2910,16 @@ ar8xxx_mib_cleanup(struct ar8216_priv *priv)
 	if (!ar8xxx_has_mib_counters(priv))
 		return;
 
-	cancel_delayed_work(&priv->mib_work);
+	/*
+	 * The notifier is only registered after ar8xxx_mib_start(), so the
+	 * config_init error path never takes rtnl here.
+	 */
+	cancel_work_sync(&priv->netdev_nb_work);
+	if (priv->netdev_nb_registered) {
+		unregister_netdevice_notifier(&priv->netdev_nb);
+		ar8xxx_vlan_stats_unhook(priv);
+	}
+	cancel_delayed_work_sync(&priv->mib_work);
 	kfree(priv->mib_stats);
 }
 
@@ -2134,6 +2987,7 @@ ar8216_config_init(struct phy_device *pdev)
 
 	mutex_init(&priv->reg_mutex);
 	priv->read = ar8216_mii_read;
+	priv->read_burst = ar8216_mii_read_burst;
 	priv->write = ar8216_mii_write;
 
 	pdev->priv = priv;
@@ -307,6 +307,7 @@
 
 #define AR8327_REG_MODULE_EN			0x030
 #define   AR8327_MODULE_EN_MIB			BIT(0)
+#define   AR8327_MODULE_EN_ACL			BIT(1)
 
 #define AR8327_REG_MIB_FUNC			0x034
 #define AR8327_MIB_CPU_KEEP			BIT(20)
@@ -340,6 +341,35 @@
 #define   AR8327_MAC_PWR_RGMII1_1_8V		BIT(18)
 #define   AR8327_MAC_PWR_RGMII0_1_8V		BIT(19)
 
+#define AR8327_REG_ACL_FUNC0			0x400
+#define   AR8327_ACL_FUNC0_INDEX		BITS(0, 7)
+#define   AR8327_ACL_FUNC0_SEL			BITS(8, 2)
+#define   AR8327_ACL_FUNC0_SEL_S		8
+#define   AR8327_ACL_FUNC0_SEL_RULE		0
+#define   AR8327_ACL_FUNC0_SEL_MASK		1
+#define   AR8327_ACL_FUNC0_SEL_RESULT		2
+#define   AR8327_ACL_FUNC0_OP_READ		BIT(10)
+#define   AR8327_ACL_FUNC0_BUSY			BIT(31)
+
+#define AR8327_REG_ACL_DATA(_i)			(0x404 + (_i) * 4)
+#define   AR8327_ACL_DATA_WORDS			5
+
+/* rule word 4 (MAC rule) / mask word 4 */
+#define   AR8327_ACL_RULE4_PORTS		BITS(0, 7)
+#define   AR8327_ACL_MASK4_TYPE			BITS(0, 3)
+#define   AR8327_ACL_MASK4_TYPE_MAC		1
+#define   AR8327_ACL_MASK4_TYPE_IP4		2
+#define   AR8327_ACL_MASK4_VALID		BITS(6, 2)
+#define   AR8327_ACL_MASK4_VALID_S		6
+#define   AR8327_ACL_MASK4_VALID_START_END	3
+
+/* result word 0..2 */
+#define   AR8327_ACL_RESULT0_DSCP		BITS(0, 6)
+#define   AR8327_ACL_RESULT0_DSCP_S		0
+#define   AR8327_ACL_RESULT0_DSCP_REMAP		BIT(6)
+#define   AR8327_ACL_RESULT2_POLICER		BITS(0, 5)
+#define   AR8327_ACL_RESULT2_POLICER_S		0
+#define   AR8327_ACL_RESULT2_POLICER_EN		BIT(5)
 
 #define AR8327_REG_PORT_VLAN0(_i)		(0x420 + (_i) * 0x8)
 #define   AR8327_PORT_VLAN0_DEF_SVID		BITS(0, 12)
@@ -424,6 +454,15 @@
 
 #define AR8327_REG_PORT_PRIO(_i)		(0x664 + (_i) * 0xc)
 
+#define AR8327_REG_ACL_POLICER(_i)		(0xa00 + (_i) * 0x10)
+#define   AR8327_ACL_POLICER_RATE		BITS(0, 15)
+#define   AR8327_ACL_POLICER_RATE_S		0
+#define   AR8327_ACL_POLICER_RATE_UNIT		32	/* kbit/s */
+#define   AR8327_ACL_POLICER_CBS		BITS(16, 3)
+#define   AR8327_ACL_POLICER_CBS_S		16
+#define   AR8327_ACL_POLICER_CBS_32K		4
+#define   AR8327_ACL_POLICER_EN			BIT(31)
+
 #define AR8327_REG_PORT_STATS_BASE(_i)		(0x1000 + (_i) * 0x100)
 
 #define AR8xxx_ARL_NO_MORE_ENTRY		1
@@ -52,6 +52,8 @@
 #include <linux/sysctl.h>
 #endif
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/u64_stats_sync.h>
 #include <asm/unaligned.h>
 #include <net/slhc_vj.h>
 #include <linux/atomic.h>
@@ -136,6 +138,15 @@ struct ppp_file {
 #define PF_TO_PPP(pf)		PF_TO_X(pf, struct ppp)
 #define PF_TO_CHANNEL(pf)	PF_TO_X(pf, struct channel)
 
+/* Per-cpu counters for frames that take the lock-free fast path */
+struct ppp_pcpu_stats {
+	u64			rx_packets;
+	u64			rx_bytes;
+	u64			tx_packets;
+	u64			tx_bytes;
+	struct u64_stats_sync	syncp;
+};
+
 /*
  * Data structure describing one ppp unit.
  * A ppp unit corresponds to a ppp network interface device
@@ -179,6 +190,8 @@ struct ppp {
 	unsigned pass_len, active_len;
 #endif /* CONFIG_PPP_FILTER */
 	struct net	*ppp_net;	/* the net we belong to */
+	struct channel __rcu *fast;	/* channel for lock-free xmit, if any */
+	struct ppp_pcpu_stats __percpu *fast_stats;
 };
 
 /*
@@ -206,6 +219,7 @@ struct channel {
 	struct net	*chan_net;	/* the net channel belongs to */
 	struct list_head clist;		/* link in list of channels per unit */
 	rwlock_t	upl;		/* protects `ppp' */
+	struct ppp __rcu *fast;		/* unit for lock-free receive, if any */
 #ifdef CONFIG_PPP_MULTILINK
 	u8		avail;		/* flag used in multilink stuff */
 	u8		had_frag;	/* >= 1 fragments have been sent */
@@ -221,6 +235,12 @@ struct channel {
  * before you modify them.
  * The lock ordering is: channel.upl -> ppp.wlock -> ppp.rlock ->
  * channel.downl.
+ *
+ * A unit with a single channel and nothing that needs per-unit state
+ * per frame (multilink, compression, VJ, filters, demand dialling)
+ * publishes that channel in ppp.fast, and the channel publishes the
+ * unit in channel.fast.  Data frames then bypass all of the above
+ * under RCU; see ppp_fast_update().
  */
 
 static DEFINE_MUTEX(ppp_mutex);
@@ -315,6 +335,7 @@ static struct channel *ppp_find_channel(struct ppp_net *pn, int unit);
 static int ppp_connect_channel(struct channel *pch, int unit);
 static int ppp_disconnect_channel(struct channel *pch);
 static void ppp_destroy_channel(struct channel *pch);
+static void ppp_fast_update(struct ppp *ppp);
 static int unit_get(struct idr *p, void *ptr);
 static int unit_set(struct idr *p, void *ptr, int n);
 static void unit_put(struct idr *p, int n);
@@ -699,6 +720,7 @@ static long ppp_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		ppp_lock(ppp);
 		cflags = ppp->flags & ~val;
 		ppp->flags = val & SC_FLAG_BITS;
+		ppp_fast_update(ppp);
 		ppp_unlock(ppp);
 		if (cflags & SC_CCP_OPEN)
 			ppp_ccp_closed(ppp);
@@ -762,6 +784,7 @@ static long ppp_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		if (ppp->vj)
 			slhc_free(ppp->vj);
 		ppp->vj = vj;
+		ppp_fast_update(ppp);
 		ppp_unlock(ppp);
 		err = 0;
 		break;
@@ -797,6 +820,7 @@ static long ppp_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			kfree(ppp->pass_filter);
 			ppp->pass_filter = code;
 			ppp->pass_len = err;
+			ppp_fast_update(ppp);
 			ppp_unlock(ppp);
 			err = 0;
 		}
@@ -811,6 +835,7 @@ static long ppp_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			kfree(ppp->active_filter);
 			ppp->active_filter = code;
 			ppp->active_len = err;
+			ppp_fast_update(ppp);
 			ppp_unlock(ppp);
 			err = 0;
 		}
@@ -1071,6 +1096,108 @@ out:
 /*
  * Network interface unit routines.
  */
+
+/*
+ * NETGEAR SPEC v1.9   5.6 PPP dial on demand:
+ * Frames marked as control traffic don't count as activity.
+ */
+static inline int
+ppp_frame_actived(struct sk_buff *skb, int proto)
+{
+	if (proto == PPP_IP && (dod_skip_control_packet != 0))
+	{
+		//return session_actived_frame(skb->data);
+		if(dial_on_demand_dns == 1)
+			return 1;
+		else if(skb->mark == 0x2015)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Lock-free transmit of a data frame that already carries its PPP
+ * protocol.  The device queue lock keeps us from racing ourselves and
+ * the fast channel never refuses a frame, so the xmit lock, the xmit
+ * queue and downl are all skipped.  Returns false if the frame has to
+ * take the locked path.  Called under rcu_read_lock.
+ */
+static bool
+ppp_fast_xmit(struct ppp *ppp, struct sk_buff *skb, int proto)
+{
+	struct ppp_pcpu_stats *stats;
+	struct ppp_channel *chan;
+	struct channel *pch;
+
+	pch = rcu_dereference(ppp->fast);
+	if (!pch)
+		return false;
+
+#ifdef PPP_TM_ACCURATE_CONTROL
+	/* the traffic meter is only kept by the locked path */
+	if (need_drop || ppp_tm_limit != TM_PPP_MAX_LIMIT)
+		return false;
+#endif
+
+	chan = ACCESS_ONCE(pch->chan);
+	if (!chan) {
+		/* channel got unregistered */
+		kfree_skb(skb);
+		++ppp->dev->stats.tx_dropped;
+		return true;
+	}
+
+#ifdef CONFIG_PPP_FILTER
+	/* no filters are attached on the fast path */
+	ppp->last_xmit = jiffies;
+#else
+	if (ppp_frame_actived(skb, proto))
+		ppp->last_xmit = jiffies;
+#endif
+
+	stats = this_cpu_ptr(ppp->fast_stats);
+	u64_stats_update_begin(&stats->syncp);
+	stats->tx_packets += skb_shinfo(skb)->gso_segs ?: 1;
+	stats->tx_bytes += skb->len - 2;
+	u64_stats_update_end(&stats->syncp);
+
+	chan->ops->fast_xmit(chan, skb);
+	return true;
+}
+
+/*
+ * The device advertises checksum and segmentation offload for the
+ * benefit of the fast path, where the channel finishes them after
+ * encapsulation.  Frames taking the locked path are finished here in
+ * software instead.  Returns a list of frames, or NULL on failure.
+ */
+static struct sk_buff *
+ppp_xmit_offload(struct sk_buff *skb)
+{
+	struct sk_buff *segs;
+
+	if (skb_is_gso(skb)) {
+		/* the protocol bytes are copied into every segment */
+		segs = skb_gso_segment(skb, 0);
+		if (IS_ERR(segs)) {
+			kfree_skb(skb);
+			return NULL;
+		}
+		if (segs) {
+			consume_skb(skb);
+			return segs;
+		}
+	}
+
+	if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb)) {
+		kfree_skb(skb);
+		return NULL;
+	}
+
+	return skb;
+}
+
 static netdev_tx_t
 ppp_start_xmit(struct sk_buff *skb, struct net_device *dev)
 {
@@ -1104,7 +1231,24 @@ ppp_start_xmit(struct sk_buff *skb, struct net_device *dev)
 	proto = npindex_to_proto[npi];
 	put_unaligned_be16(proto, pp);
 
-	skb_queue_tail(&ppp->file.xq, skb);
+	rcu_read_lock();
+	if (ppp_fast_xmit(ppp, skb, proto)) {
+		rcu_read_unlock();
+		return NETDEV_TX_OK;
+	}
+	rcu_read_unlock();
+
+	skb = ppp_xmit_offload(skb);
+	if (!skb)
+		goto outf;
+
+	while (skb) {
+		struct sk_buff *next = skb->next;
+
+		skb->next = NULL;
+		skb_queue_tail(&ppp->file.xq, skb);
+		skb = next;
+	}
 	ppp_xmit_process(ppp);
 	return NETDEV_TX_OK;
 
@@ -1157,9 +1301,40 @@ ppp_net_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 	return err;
 }
 
+static struct rtnl_link_stats64 *
+ppp_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats64)
+{
+	struct ppp *ppp = netdev_priv(dev);
+	int cpu;
+
+	netdev_stats_to_stats64(stats64, &dev->stats);
+
+	for_each_possible_cpu(cpu) {
+		struct ppp_pcpu_stats *stats = per_cpu_ptr(ppp->fast_stats, cpu);
+		u64 rx_packets, rx_bytes, tx_packets, tx_bytes;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_bh(&stats->syncp);
+			rx_packets = stats->rx_packets;
+			rx_bytes = stats->rx_bytes;
+			tx_packets = stats->tx_packets;
+			tx_bytes = stats->tx_bytes;
+		} while (u64_stats_fetch_retry_bh(&stats->syncp, start));
+
+		stats64->rx_packets += rx_packets;
+		stats64->rx_bytes += rx_bytes;
+		stats64->tx_packets += tx_packets;
+		stats64->tx_bytes += tx_bytes;
+	}
+
+	return stats64;
+}
+
 static const struct net_device_ops ppp_netdev_ops = {
 	.ndo_start_xmit = ppp_start_xmit,
 	.ndo_do_ioctl   = ppp_net_ioctl,
+	.ndo_get_stats64 = ppp_get_stats64,
 };
 
 static void ppp_setup(struct net_device *dev)
@@ -1172,6 +1347,9 @@ static void ppp_setup(struct net_device *dev)
 	dev->type = ARPHRD_PPP;
 	dev->flags = IFF_POINTOPOINT | IFF_NOARP | IFF_MULTICAST;
 	dev->features |= NETIF_F_NETNS_LOCAL;
+	/* see ppp_xmit_offload() */
+	dev->features |= NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_TSO |
+			 NETIF_F_TSO6;
 	dev->priv_flags &= ~IFF_XMIT_DST_RELEASE;
 }
 
@@ -1321,16 +1499,7 @@ ppp_send_frame(struct ppp *ppp, struct sk_buff *skb)
 	int len;
 	unsigned char *cp;
 
-	int actived = 1;
-
-	if (proto == PPP_IP && (dod_skip_control_packet != 0))
-	{
-		//actived = session_actived_frame(skb->data);
-		if(dial_on_demand_dns == 1)
-			actived = 1;
-		else if(skb->mark == 0x2015)
-			actived = 0;
-	}
+	int actived = ppp_frame_actived(skb, proto);
 
 	if (proto < 0x8000) {
 #ifdef CONFIG_PPP_FILTER
@@ -1830,6 +1999,58 @@ done:
 	read_unlock_bh(&pch->upl);
 }
 
+/*
+ * Lock-free receive for a channel whose unit runs the fast path:
+ * network data frames are counted and handed straight to the stack
+ * without the upl/recv locks.  Everything else returns false and goes
+ * through ppp_input().  Called under rcu_read_lock.
+ */
+bool
+ppp_fast_input(struct ppp_channel *chan, struct sk_buff *skb)
+{
+	struct channel *pch = ACCESS_ONCE(chan->ppp);
+	struct ppp_pcpu_stats *stats;
+	struct ppp *ppp;
+	int npi;
+
+	if (!pch)
+		return false;
+
+	ppp = rcu_dereference(pch->fast);
+	if (!ppp)
+		return false;
+
+#ifdef PPP_TM_ACCURATE_CONTROL
+	if (need_drop || ppp_tm_limit != TM_PPP_MAX_LIMIT)
+		return false;
+#endif
+
+	if (!pskb_may_pull(skb, 2))
+		return false;
+
+	npi = proto_to_npindex(PPP_PROTO(skb));
+	if (npi < 0 || ppp->npmode[npi] != NPMODE_PASS ||
+	    (ppp->dev->flags & IFF_UP) == 0)
+		return false;
+
+	stats = this_cpu_ptr(ppp->fast_stats);
+	u64_stats_update_begin(&stats->syncp);
+	stats->rx_packets++;
+	stats->rx_bytes += skb->len - 2;
+	u64_stats_update_end(&stats->syncp);
+
+	ppp->last_recv = jiffies;
+
+	/* chop off protocol */
+	skb_pull_rcsum(skb, 2);
+	skb->dev = ppp->dev;
+	skb->protocol = htons(npindex_to_ethertype[npi]);
+	skb_reset_mac_header(skb);
+	netif_rx(skb);
+
+	return true;
+}
+
 /* Put a 0-length skb in the receive queue as an error indication */
 void
 ppp_input_error(struct ppp_channel *chan, int code)
@@ -2548,6 +2769,8 @@ ppp_unregister_channel(struct ppp_channel *chan)
 		return;		/* should never happen */
 
 	chan->ppp = NULL;
+	/* wait for ppp_fast_input() callers still using pch to finish */
+	synchronize_net();
 
 	/*
 	 * This ensures that we have returned from any calls into the
@@ -2653,6 +2876,12 @@ ppp_set_compress(struct ppp *ppp, unsigned long arg)
 			module_put(cp->owner);
 	}
 
+	if (!err) {
+		ppp_lock(ppp);
+		ppp_fast_update(ppp);
+		ppp_unlock(ppp);
+	}
+
  out:
 	return err;
 }
@@ -2762,6 +2991,7 @@ ppp_ccp_closed(struct ppp *ppp)
 	rcomp = ppp->rcomp;
 	rstate = ppp->rc_state;
 	ppp->rc_state = NULL;
+	ppp_fast_update(ppp);
 	ppp_unlock(ppp);
 
 	if (xstate) {
@@ -2858,14 +3088,17 @@ static void
 ppp_get_stats(struct ppp *ppp, struct ppp_stats *st)
 {
 	struct slcompress *vj = ppp->vj;
+	struct rtnl_link_stats64 stats64;
+
+	ppp_get_stats64(ppp->dev, &stats64);
 
 	memset(st, 0, sizeof(*st));
-	st->p.ppp_ipackets = ppp->dev->stats.rx_packets;
-	st->p.ppp_ierrors = ppp->dev->stats.rx_errors;
-	st->p.ppp_ibytes = ppp->dev->stats.rx_bytes;
-	st->p.ppp_opackets = ppp->dev->stats.tx_packets;
-	st->p.ppp_oerrors = ppp->dev->stats.tx_errors;
-	st->p.ppp_obytes = ppp->dev->stats.tx_bytes;
+	st->p.ppp_ipackets = stats64.rx_packets;
+	st->p.ppp_ierrors = stats64.rx_errors;
+	st->p.ppp_ibytes = stats64.rx_bytes;
+	st->p.ppp_opackets = stats64.tx_packets;
+	st->p.ppp_oerrors = stats64.tx_errors;
+	st->p.ppp_obytes = stats64.tx_bytes;
 	if (!vj)
 		return;
 	st->vj.vjs_packets = vj->sls_o_compressed + vj->sls_o_uncompressed;
@@ -2905,6 +3138,9 @@ ppp_create_interface(struct net *net, int unit, int *retp)
 
 	ppp = netdev_priv(dev);
 	ppp->dev = dev;
+	ppp->fast_stats = alloc_percpu(struct ppp_pcpu_stats);
+	if (!ppp->fast_stats)
+		goto out_free;
 	ppp->mru = PPP_MRU;
 	init_ppp_file(&ppp->file, INTERFACE);
 	ppp->file.hdrlen = PPP_HDRLEN - 2;	/* don't count proto bytes */
@@ -2972,6 +3208,8 @@ ppp_create_interface(struct net *net, int unit, int *retp)
 
 out2:
 	mutex_unlock(&pn->all_ppp_mutex);
+	free_percpu(ppp->fast_stats);
+out_free:
 	free_netdev(dev);
 out1:
 	*retp = ret;
@@ -3006,6 +3244,7 @@ static void ppp_shutdown_interface(struct ppp *ppp)
 	ppp_lock(ppp);
 	if (!ppp->closing) {
 		ppp->closing = 1;
+		ppp_fast_update(ppp);
 		ppp_unlock(ppp);
 		unregister_netdev(ppp->dev);
 		unit_put(&pn->units_idr, ppp->file.index);
@@ -3055,6 +3294,7 @@ static void ppp_destroy_interface(struct ppp *ppp)
 
 	kfree_skb(ppp->xmit_pending);
 
+	free_percpu(ppp->fast_stats);
 	free_netdev(ppp->dev);
 }
 
@@ -3128,6 +3368,7 @@ ppp_connect_channel(struct channel *pch, int unit)
 	++ppp->n_channels;
 	pch->ppp = ppp;
 	atomic_inc(&ppp->file.refcnt);
+	ppp_fast_update(ppp);
 	ppp_unlock(ppp);
 	ret = 0;
 
@@ -3146,6 +3387,7 @@ ppp_disconnect_channel(struct channel *pch)
 {
 	struct ppp *ppp;
 	int err = -EINVAL;
+	bool fast;
 
 	write_lock_bh(&pch->upl);
 	ppp = pch->ppp;
@@ -3157,7 +3399,12 @@ ppp_disconnect_channel(struct channel *pch)
 		list_del(&pch->clist);
 		if (--ppp->n_channels == 0)
 			wake_up_interruptible(&ppp->file.rwait);
+		fast = rcu_access_pointer(ppp->fast) == pch;
+		ppp_fast_update(ppp);
 		ppp_unlock(ppp);
+		/* let lock-free users of the channel and unit drain */
+		if (fast)
+			synchronize_net();
 		if (atomic_dec_and_test(&ppp->file.refcnt))
 			ppp_destroy_interface(ppp);
 		err = 0;
@@ -3165,6 +3412,41 @@ ppp_disconnect_channel(struct channel *pch)
 	return err;
 }
 
+/*
+ * Publish or withdraw the lock-free fast path of a unit; see the notes
+ * on locking above.  Called with ppp_lock held whenever something it
+ * depends on changes.  New frames stop using a withdrawn channel at
+ * once; anyone about to free it must wait for a grace period first.
+ */
+static void
+ppp_fast_update(struct ppp *ppp)
+{
+	struct channel *pch = NULL, *old;
+
+	if (!ppp->closing && ppp->n_channels == 1 &&
+	    !(ppp->flags & (SC_MULTILINK | SC_LOOP_TRAFFIC | SC_COMP_TCP |
+			    SC_MUST_COMP)) &&
+	    !ppp->xc_state && !ppp->rc_state && !ppp->vj
+#ifdef CONFIG_PPP_FILTER
+	    && !ppp->pass_filter && !ppp->active_filter
+#endif
+	    ) {
+		pch = list_first_entry(&ppp->channels, struct channel, clist);
+		if (!pch->chan || !pch->chan->ops->fast_xmit)
+			pch = NULL;
+	}
+
+	old = rcu_dereference_protected(ppp->fast, 1);
+	if (old == pch)
+		return;
+
+	if (old)
+		RCU_INIT_POINTER(old->fast, NULL);
+	if (pch)
+		rcu_assign_pointer(pch->fast, ppp);
+	rcu_assign_pointer(ppp->fast, pch);
+}
+
 /*
  * Free up the resources used by a ppp channel.
  */
@@ -3594,6 +3876,7 @@ EXPORT_SYMBOL(ppp_unit_number);
 EXPORT_SYMBOL(ppp_dev_name);
 EXPORT_SYMBOL(ppp_dev_index);
 EXPORT_SYMBOL(ppp_input);
+EXPORT_SYMBOL(ppp_fast_input);
 EXPORT_SYMBOL(ppp_input_error);
 EXPORT_SYMBOL(ppp_output_wakeup);
 EXPORT_SYMBOL(ppp_register_compressor);
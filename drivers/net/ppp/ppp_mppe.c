@@ -50,11 +50,14 @@
 #include <linux/types.h>
 #include <linux/slab.h>
 #include <linux/string.h>
-#include <linux/crypto.h>
+#include <linux/cryptohash.h>
+#include <linux/jiffies.h>
 #include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/ppp_defs.h>
 #include <linux/ppp-comp.h>
-#include <linux/scatterlist.h>
 #include <asm/unaligned.h>
 
 #include "ppp_mppe.h"
@@ -65,39 +68,44 @@ MODULE_LICENSE("Dual BSD/GPL");
 MODULE_ALIAS("ppp-compress-" __stringify(CI_MPPE));
 MODULE_VERSION("1.0.2");
 
-static unsigned int
-setup_sg(struct scatterlist *sg, const void *address, unsigned int length)
-{
-	sg_set_buf(sg, address, length);
-	return length;
-}
+/*
+ * When non-zero, time the encrypt path for this many seconds per test
+ * at module load, in the manner of tcrypt's speed tests.
+ */
+static unsigned int speed_sec;
+module_param(speed_sec, uint, 0);
+MODULE_PARM_DESC(speed_sec, "Run MPPE speed tests for this many seconds at load (0 = off)");
 
 #define SHA1_PAD_SIZE 40
 
 /*
- * kernel crypto API needs its arguments to be in kmalloc'd memory, not in the module
- * static data area.  That means sha_pad needs to be kmalloc'd.
+ * Get_Key() hashes MasterKey | SHAPad1 | SessionKey | SHAPad2, which is
+ * at most 112 bytes and so always pads out to exactly two SHA1 blocks.
  */
+#define MPPE_SHA_BLOCKS	2
+#define MPPE_SHA_BUFLEN	(MPPE_SHA_BLOCKS * 64)
 
-struct sha_pad {
-	unsigned char sha_pad1[SHA1_PAD_SIZE];
-	unsigned char sha_pad2[SHA1_PAD_SIZE];
-};
-static struct sha_pad *sha_pad;
+/*
+ * Number of session keys derived ahead of the coherency count.  In
+ * stateless mode every packet consumes one; the key generator refills
+ * the ring from process context once it has drained to half.
+ */
+#define MPPE_KEYS_AHEAD	8
 
-static inline void sha_pad_init(struct sha_pad *shapad)
-{
-	memset(shapad->sha_pad1, 0x00, sizeof(shapad->sha_pad1));
-	memset(shapad->sha_pad2, 0xF2, sizeof(shapad->sha_pad2));
-}
+/*
+ * ARC4 stream state.  Kept inline in the session so that the data path
+ * needs neither a crypto tfm nor scatterlists.
+ */
+struct mppe_arc4 {
+	u8 S[256];
+	u8 x, y;
+};
 
 /*
  * State for an MPPE (de)compressor.
  */
 struct ppp_mppe_state {
-	struct crypto_blkcipher *arc4;
-	struct crypto_hash *sha1;
-	unsigned char *sha1_digest;
+	struct mppe_arc4 arc4;	/* cipher for the current ccount */
 	unsigned char master_key[MPPE_MAX_KEY_LEN];
 	unsigned char session_key[MPPE_MAX_KEY_LEN];
 	unsigned keylen;	/* key length in bytes             */
@@ -112,6 +120,18 @@ struct ppp_mppe_state {
 	int unit;
 	int debug;
 	struct compstat stats;
+
+	/*
+	 * Key generator.  session_key is the newest key derived, which is
+	 * ahead of the one arc4 was scheduled from whenever keys are queued.
+	 * key_lock covers the generator and the ring below.
+	 */
+	spinlock_t key_lock;
+	unsigned char sha_buf[MPPE_SHA_BUFLEN];
+	struct work_struct key_work;
+	unsigned key_head;
+	unsigned key_count;
+	struct mppe_arc4 keys[MPPE_KEYS_AHEAD];
 };
 
 /* struct ppp_mppe_state.bits definitions */
@@ -130,54 +150,106 @@ struct ppp_mppe_state {
 #define MPPE_OVHD	2	/* MPPE overhead/packet */
 #define SANITY_MAX	1600	/* Max bogon factor we will tolerate */
 
+static void mppe_arc4_setkey(struct mppe_arc4 *ctx, const u8 *key,
+			     unsigned int keylen)
+{
+	unsigned int i, k = 0;
+	u8 j = 0, a;
+
+	ctx->x = 0;
+	ctx->y = 0;
+	for (i = 0; i < 256; i++)
+		ctx->S[i] = i;
+	for (i = 0; i < 256; i++) {
+		a = ctx->S[i];
+		j += key[k] + a;
+		ctx->S[i] = ctx->S[j];
+		ctx->S[j] = a;
+		if (++k >= keylen)
+			k = 0;
+	}
+}
+
+/*
+ * Run len bytes through the key stream.  in and out may be the same.
+ */
+static void mppe_arc4_crypt(struct mppe_arc4 *ctx, u8 *out, const u8 *in,
+			    unsigned int len)
+{
+	u8 *S = ctx->S;
+	u8 x = ctx->x, y = ctx->y, a, b;
+
+	while (len--) {
+		a = S[++x];
+		y += a;
+		b = S[y];
+		S[x] = b;
+		S[y] = a;
+		*out++ = *in++ ^ S[(u8)(a + b)];
+	}
+	ctx->x = x;
+	ctx->y = y;
+}
+
+/*
+ * Lay out the Get_Key() message for this key length.  Only the session
+ * key part changes from one rekey to the next.
+ */
+static void mppe_sha_init(struct ppp_mppe_state *state)
+{
+	unsigned char *p = state->sha_buf;
+	unsigned len = 2 * (state->keylen + SHA1_PAD_SIZE);
+
+	memset(p, 0, MPPE_SHA_BUFLEN);
+	memcpy(p, state->master_key, state->keylen);
+	p += state->keylen + SHA1_PAD_SIZE + state->keylen;
+	memset(p, 0xF2, SHA1_PAD_SIZE);
+	p += SHA1_PAD_SIZE;
+	*p = 0x80;
+	put_unaligned_be64((u64)len << 3,
+			   state->sha_buf + MPPE_SHA_BUFLEN - sizeof(u64));
+}
+
 /*
  * Key Derivation, from RFC 3078, RFC 3079.
  * Equivalent to Get_Key() for MS-CHAP as described in RFC 3079.
  */
-static void get_new_key_from_sha(struct ppp_mppe_state * state)
+static void get_new_key_from_sha(struct ppp_mppe_state *state, u8 *digest)
 {
-	struct hash_desc desc;
-	struct scatterlist sg[4];
-	unsigned int nbytes;
+	__u32 hash[5], W[SHA_WORKSPACE_WORDS];
+	int i;
 
-	sg_init_table(sg, 4);
+	memcpy(state->sha_buf + state->keylen + SHA1_PAD_SIZE,
+	       state->session_key, state->keylen);
 
-	nbytes = setup_sg(&sg[0], state->master_key, state->keylen);
-	nbytes += setup_sg(&sg[1], sha_pad->sha_pad1,
-			   sizeof(sha_pad->sha_pad1));
-	nbytes += setup_sg(&sg[2], state->session_key, state->keylen);
-	nbytes += setup_sg(&sg[3], sha_pad->sha_pad2,
-			   sizeof(sha_pad->sha_pad2));
+	sha_init(hash);
+	for (i = 0; i < MPPE_SHA_BLOCKS; i++)
+		sha_transform(hash, state->sha_buf + i * 64, W);
 
-	desc.tfm = state->sha1;
-	desc.flags = 0;
-
-	crypto_hash_digest(&desc, sg, nbytes, state->sha1_digest);
+	for (i = 0; i < MPPE_MAX_KEY_LEN / 4; i++)
+		put_unaligned_be32(hash[i], digest + i * 4);
+	memset(W, 0, sizeof(W));
 }
 
 /*
  * Perform the MPPE rekey algorithm, from RFC 3078, sec. 7.3.
  * Well, not what's written there, but rather what they meant.
+ *
+ * Advances session_key and schedules ctx from it.  Called with key_lock
+ * held.
  */
-static void mppe_rekey(struct ppp_mppe_state * state, int initial_key)
+static void mppe_derive_key(struct ppp_mppe_state *state,
+			    struct mppe_arc4 *ctx, int initial_key)
 {
-	struct scatterlist sg_in[1], sg_out[1];
-	struct blkcipher_desc desc = { .tfm = state->arc4 };
+	u8 digest[MPPE_MAX_KEY_LEN];
 
-	get_new_key_from_sha(state);
+	get_new_key_from_sha(state, digest);
 	if (!initial_key) {
-		crypto_blkcipher_setkey(state->arc4, state->sha1_digest,
-					state->keylen);
-		sg_init_table(sg_in, 1);
-		sg_init_table(sg_out, 1);
-		setup_sg(sg_in, state->sha1_digest, state->keylen);
-		setup_sg(sg_out, state->session_key, state->keylen);
-		if (crypto_blkcipher_encrypt(&desc, sg_out, sg_in,
-					     state->keylen) != 0) {
-    		    printk(KERN_WARNING "mppe_rekey: cipher_encrypt failed\n");
-		}
+		mppe_arc4_setkey(ctx, digest, state->keylen);
+		mppe_arc4_crypt(ctx, state->session_key, digest,
+				state->keylen);
 	} else {
-		memcpy(state->session_key, state->sha1_digest, state->keylen);
+		memcpy(state->session_key, digest, state->keylen);
 	}
 	if (state->keylen == 8) {
 		/* See RFC 3078 */
@@ -185,7 +257,52 @@ static void mppe_rekey(struct ppp_mppe_state * state, int initial_key)
 		state->session_key[1] = 0x26;
 		state->session_key[2] = 0x9e;
 	}
-	crypto_blkcipher_setkey(state->arc4, state->session_key, state->keylen);
+	mppe_arc4_setkey(ctx, state->session_key, state->keylen);
+}
+
+/*
+ * Fill the key ring.  Keys are derived one at a time so that the data
+ * path is never held off for more than a single derivation.
+ */
+static void mppe_key_work(struct work_struct *work)
+{
+	struct ppp_mppe_state *state =
+		container_of(work, struct ppp_mppe_state, key_work);
+	unsigned tail;
+
+	spin_lock_bh(&state->key_lock);
+	while (!state->stateful && state->key_count < MPPE_KEYS_AHEAD) {
+		tail = (state->key_head + state->key_count) % MPPE_KEYS_AHEAD;
+		mppe_derive_key(state, &state->keys[tail], 0);
+		state->key_count++;
+		spin_unlock_bh(&state->key_lock);
+		cond_resched();
+		spin_lock_bh(&state->key_lock);
+	}
+	spin_unlock_bh(&state->key_lock);
+}
+
+/*
+ * Move the cipher on to the next session key.  Stateless sessions take
+ * it from the ring; it is only derived here if the ring has run dry.
+ */
+static void mppe_rekey(struct ppp_mppe_state *state)
+{
+	unsigned count;
+
+	spin_lock(&state->key_lock);
+	count = state->key_count;
+	if (count) {
+		state->arc4 = state->keys[state->key_head];
+		state->key_head = (state->key_head + 1) % MPPE_KEYS_AHEAD;
+		state->key_count = --count;
+	} else {
+		mppe_derive_key(state, &state->arc4, 0);
+	}
+	spin_unlock(&state->key_lock);
+
+	if (!state->stateful && count <= MPPE_KEYS_AHEAD / 2)
+		queue_work(system_unbound_wq, &state->key_work);
 }
 
 /*
@@ -194,7 +311,6 @@ static void mppe_rekey(struct ppp_mppe_state * state, int initial_key)
 static void *mppe_alloc(unsigned char *options, int optlen)
 {
 	struct ppp_mppe_state *state;
-	unsigned int digestsize;
 
 	if (optlen != CILEN_MPPE + sizeof(state->master_key) ||
 	    options[0] != CI_MPPE || options[1] != CILEN_MPPE)
@@ -204,26 +320,8 @@ static void *mppe_alloc(unsigned char *options, int optlen)
 	if (state == NULL)
 		goto out;
 
-
-	state->arc4 = crypto_alloc_blkcipher("ecb(arc4)", 0, CRYPTO_ALG_ASYNC);
-	if (IS_ERR(state->arc4)) {
-		state->arc4 = NULL;
-		goto out_free;
-	}
-
-	state->sha1 = crypto_alloc_hash("sha1", 0, CRYPTO_ALG_ASYNC);
-	if (IS_ERR(state->sha1)) {
-		state->sha1 = NULL;
-		goto out_free;
-	}
-
-	digestsize = crypto_hash_digestsize(state->sha1);
-	if (digestsize < MPPE_MAX_KEY_LEN)
-		goto out_free;
-
-	state->sha1_digest = kmalloc(digestsize, GFP_KERNEL);
-	if (!state->sha1_digest)
-		goto out_free;
+	spin_lock_init(&state->key_lock);
+	INIT_WORK(&state->key_work, mppe_key_work);
 
 	/* Save keys. */
 	memcpy(state->master_key, &options[CILEN_MPPE],
@@ -238,14 +336,6 @@ static void *mppe_alloc(unsigned char *options, int optlen)
 
 	return (void *)state;
 
-	out_free:
-	    if (state->sha1_digest)
-		kfree(state->sha1_digest);
-	    if (state->sha1)
-		crypto_free_hash(state->sha1);
-	    if (state->arc4)
-		crypto_free_blkcipher(state->arc4);
-	    kfree(state);
 	out:
 	return NULL;
 }
@@ -257,13 +347,8 @@ static void mppe_free(void *arg)
 {
 	struct ppp_mppe_state *state = (struct ppp_mppe_state *) arg;
 	if (state) {
-	    if (state->sha1_digest)
-		kfree(state->sha1_digest);
-	    if (state->sha1)
-		crypto_free_hash(state->sha1);
-	    if (state->arc4)
-		crypto_free_blkcipher(state->arc4);
-	    kfree(state);
+	    cancel_work_sync(&state->key_work);
+	    kzfree(state);
 	}
 }
 
@@ -282,20 +367,33 @@ mppe_init(void *arg, unsigned char *options, int optlen, int unit, int debug,
 		return 0;
 
 	MPPE_CI_TO_OPTS(&options[2], mppe_opts);
+
+	/*
+	 * CCP may renegotiate on a live state from the xmit path, so the
+	 * generator is reset under its lock rather than by flushing the
+	 * work item.
+	 */
+	spin_lock_bh(&state->key_lock);
 	if (mppe_opts & MPPE_OPT_128)
 		state->keylen = 16;
 	else if (mppe_opts & MPPE_OPT_40)
 		state->keylen = 8;
 	else {
+		spin_unlock_bh(&state->key_lock);
 		printk(KERN_WARNING "%s[%d]: unknown key length\n", debugstr,
 		       unit);
 		return 0;
 	}
-	if (mppe_opts & MPPE_OPT_STATEFUL)
-		state->stateful = 1;
+	state->stateful = !!(mppe_opts & MPPE_OPT_STATEFUL);
 
 	/* Generate the initial session key. */
-	mppe_rekey(state, 1);
+	memcpy(state->session_key, state->master_key,
+	       sizeof(state->master_key));
+	mppe_sha_init(state);
+	mppe_derive_key(state, &state->arc4, 1);
+	state->key_head = 0;
+	state->key_count = 0;
+	spin_unlock_bh(&state->key_lock);
 
 	if (debug) {
 		int i;
@@ -332,6 +430,9 @@ mppe_init(void *arg, unsigned char *options, int optlen, int unit, int debug,
 	state->unit = unit;
 	state->debug = debug;
 
+	if (!state->stateful)
+		queue_work(system_unbound_wq, &state->key_work);
+
 	return 1;
 }
 
@@ -369,9 +470,7 @@ mppe_compress(void *arg, unsigned char *ibuf, unsigned char *obuf,
 	      int isize, int osize)
 {
 	struct ppp_mppe_state *state = (struct ppp_mppe_state *) arg;
-	struct blkcipher_desc desc = { .tfm = state->arc4 };
 	int proto;
-	struct scatterlist sg_in[1], sg_out[1];
 
 	/*
 	 * Check that the protocol is in the range we handle.
@@ -412,7 +511,7 @@ mppe_compress(void *arg, unsigned char *ibuf, unsigned char *obuf,
 		if (state->debug && state->stateful)
 			printk(KERN_DEBUG "mppe_compress[%d]: rekeying\n",
 			       state->unit);
-		mppe_rekey(state, 0);
+		mppe_rekey(state);
 		state->bits |= MPPE_BIT_FLUSHED;
 	}
 	obuf[0] |= state->bits;
@@ -423,14 +522,7 @@ mppe_compress(void *arg, unsigned char *ibuf, unsigned char *obuf,
 	isize -= 2;
 
 	/* Encrypt packet */
-	sg_init_table(sg_in, 1);
-	sg_init_table(sg_out, 1);
-	setup_sg(sg_in, ibuf, isize);
-	setup_sg(sg_out, obuf, osize);
-	if (crypto_blkcipher_encrypt(&desc, sg_out, sg_in, isize) != 0) {
-		printk(KERN_DEBUG "crypto_cypher_encrypt failed\n");
-		return -1;
-	}
+	mppe_arc4_crypt(&state->arc4, obuf, ibuf, isize);
 
 	state->stats.unc_bytes += isize;
 	state->stats.unc_packets++;
@@ -476,11 +568,9 @@ mppe_decompress(void *arg, unsigned char *ibuf, int isize, unsigned char *obuf,
 		int osize)
 {
 	struct ppp_mppe_state *state = (struct ppp_mppe_state *) arg;
-	struct blkcipher_desc desc = { .tfm = state->arc4 };
 	unsigned ccount;
 	int flushed = MPPE_BITS(ibuf) & MPPE_BIT_FLUSHED;
 	int sanity = 0;
-	struct scatterlist sg_in[1], sg_out[1];
 
 	if (isize <= PPP_HDRLEN + MPPE_OVHD) {
 		if (state->debug)
@@ -549,7 +639,7 @@ mppe_decompress(void *arg, unsigned char *ibuf, int isize, unsigned char *obuf,
 	if (!state->stateful) {
 		/* RFC 3078, sec 8.1.  Rekey for every packet. */
 		while (state->ccount != ccount) {
-			mppe_rekey(state, 0);
+			mppe_rekey(state);
 			state->ccount = (state->ccount + 1) % MPPE_CCOUNT_SPACE;
 		}
 	} else {
@@ -575,7 +665,7 @@ mppe_decompress(void *arg, unsigned char *ibuf, int isize, unsigned char *obuf,
 				/* Rekey for every missed "flag" packet. */
 				while ((ccount & ~0xff) !=
 				       (state->ccount & ~0xff)) {
-					mppe_rekey(state, 0);
+					mppe_rekey(state);
 					state->ccount =
 					    (state->ccount +
 					     256) % MPPE_CCOUNT_SPACE;
@@ -594,7 +684,7 @@ mppe_decompress(void *arg, unsigned char *ibuf, int isize, unsigned char *obuf,
 			}
 		}
 		if (flushed)
-			mppe_rekey(state, 0);
+			mppe_rekey(state);
 	}
 
 	/*
@@ -612,14 +702,7 @@ mppe_decompress(void *arg, unsigned char *ibuf, int isize, unsigned char *obuf,
 	 * Decrypt the first byte in order to check if it is
 	 * a compressed or uncompressed protocol field.
 	 */
-	sg_init_table(sg_in, 1);
-	sg_init_table(sg_out, 1);
-	setup_sg(sg_in, ibuf, 1);
-	setup_sg(sg_out, obuf, 1);
-	if (crypto_blkcipher_decrypt(&desc, sg_out, sg_in, 1) != 0) {
-		printk(KERN_DEBUG "crypto_cypher_decrypt failed\n");
-		return DECOMP_ERROR;
-	}
+	mppe_arc4_crypt(&state->arc4, obuf, ibuf, 1);
 
 	/*
 	 * Do PFC decompression.
@@ -634,12 +717,7 @@ mppe_decompress(void *arg, unsigned char *ibuf, int isize, unsigned char *obuf,
 	}
 
 	/* And finally, decrypt the rest of the packet. */
-	setup_sg(sg_in, ibuf + 1, isize - 1);
-	setup_sg(sg_out, obuf + 1, osize - 1);
-	if (crypto_blkcipher_decrypt(&desc, sg_out, sg_in, isize - 1)) {
-		printk(KERN_DEBUG "crypto_cypher_decrypt failed\n");
-		return DECOMP_ERROR;
-	}
+	mppe_arc4_crypt(&state->arc4, obuf + 1, ibuf + 1, isize - 1);
 
 	state->stats.unc_bytes += osize;
 	state->stats.unc_packets++;
@@ -700,32 +778,112 @@ static struct compressor ppp_mppe = {
 	.comp_extra     = MPPE_PAD,
 };
 
+/*
+ * Speed tests, see speed_sec.  Each test times mppe_compress() over a
+ * single session for the given packet size and reports packets/sec.
+ */
+static const struct {
+	unsigned char opts;
+	int len;
+} mppe_speed_template[] = {
+	{ MPPE_OPT_128, 64 },
+	{ MPPE_OPT_128, 512 },
+	{ MPPE_OPT_128, 1400 },
+	{ MPPE_OPT_128 | MPPE_OPT_STATEFUL, 64 },
+	{ MPPE_OPT_128 | MPPE_OPT_STATEFUL, 512 },
+	{ MPPE_OPT_128 | MPPE_OPT_STATEFUL, 1400 },
+	{ MPPE_OPT_40, 1400 },
+	{ MPPE_OPT_40 | MPPE_OPT_STATEFUL, 1400 },
+};
+
+static int mppe_speed_jiffies(struct ppp_mppe_state *state,
+			      unsigned char *ibuf, unsigned char *obuf,
+			      int len, unsigned int sec)
+{
+	unsigned long start, end;
+	int pcount;
+
+	for (start = jiffies, end = start + sec * HZ, pcount = 0;
+	     time_before(jiffies, end); pcount++) {
+		local_bh_disable();
+		if (mppe_compress(state, ibuf, obuf, len,
+				  len + MPPE_PAD) < 0) {
+			local_bh_enable();
+			return -EINVAL;
+		}
+		local_bh_enable();
+	}
+
+	pr_info("%d operations in %u seconds (%ld bytes), %u packets/sec\n",
+		pcount, sec, (long)pcount * len, pcount / sec);
+	return 0;
+}
+
+static void mppe_speed_test(unsigned int sec)
+{
+	unsigned char opts[CILEN_MPPE + MPPE_MAX_KEY_LEN];
+	struct ppp_mppe_state *state;
+	unsigned char *ibuf, *obuf;
+	int i, len, ret;
+
+	ibuf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	if (!ibuf)
+		return;
+	obuf = ibuf + PAGE_SIZE;
+
+	opts[0] = CI_MPPE;
+	opts[1] = CILEN_MPPE;
+	for (i = 0; i < MPPE_MAX_KEY_LEN; i++)
+		opts[CILEN_MPPE + i] = i;
+
+	for (i = 0; i < ARRAY_SIZE(mppe_speed_template); i++) {
+		len = mppe_speed_template[i].len;
+		MPPE_OPTS_TO_CI(mppe_speed_template[i].opts, &opts[2]);
+
+		state = mppe_alloc(opts, sizeof(opts));
+		if (!state)
+			break;
+		if (!mppe_init(state, opts, CILEN_MPPE, 0, 0,
+			       "mppe_speed_test")) {
+			mppe_free(state);
+			break;
+		}
+
+		memset(ibuf, 0xff, len);
+		put_unaligned_be16(PPP_IP, ibuf + 2);
+
+		printk(KERN_INFO "testing speed of mppe-%d %s, "
+		       "test %d (%d byte packets)\n",
+		       state->keylen == 16 ? 128 : 40,
+		       state->stateful ? "stateful" : "stateless", i, len);
+		ret = mppe_speed_jiffies(state, ibuf, obuf, len, sec);
+		mppe_free(state);
+		if (ret) {
+			printk(KERN_ERR "mppe_speed_test: compress failed\n");
+			break;
+		}
+	}
+
+	kfree(ibuf);
+}
+
 /*
  * ppp_mppe_init()
  *
- * Prior to allowing load, try to load the arc4 and sha1 crypto
- * libraries.  The actual use will be allocated later, but
- * this way the module will fail to insmod if they aren't available.
+ * The cipher and hash are built in, so there is nothing to probe for.
  */
 
 static int __init ppp_mppe_init(void)
 {
 	int answer;
-	if (!(crypto_has_blkcipher("ecb(arc4)", 0, CRYPTO_ALG_ASYNC) &&
-	      crypto_has_hash("sha1", 0, CRYPTO_ALG_ASYNC)))
-		return -ENODEV;
 
-	sha_pad = kmalloc(sizeof(struct sha_pad), GFP_KERNEL);
-	if (!sha_pad)
-		return -ENOMEM;
-	sha_pad_init(sha_pad);
+	if (speed_sec)
+		mppe_speed_test(speed_sec);
 
 	answer = ppp_register_compressor(&ppp_mppe);
 
 	if (answer == 0)
 		printk(KERN_INFO "PPP MPPE Compression module registered\n");
-	else
-		kfree(sha_pad);
 
 	return answer;
 }
@@ -733,7 +891,6 @@ static int __init ppp_mppe_init(void)
 static void __exit ppp_mppe_cleanup(void)
 {
 	ppp_unregister_compressor(&ppp_mppe);
-	kfree(sha_pad);
 }
 
 module_init(ppp_mppe_init);
@@ -80,6 +80,9 @@
 #include <linux/file.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
 
 #include <linux/nsproxy.h>
 #include <net/net_namespace.h>
@@ -88,15 +91,26 @@
 
 #include <asm/uaccess.h>
 
+/*
+ * The session table starts at PPPOE_HASH_SIZE buckets and doubles
+ * whenever it holds more sessions than buckets, up to PPPOE_HASH_MAX.
+ */
 #define PPPOE_HASH_BITS 4
 #define PPPOE_HASH_SIZE (1 << PPPOE_HASH_BITS)
-#define PPPOE_HASH_MASK	(PPPOE_HASH_SIZE - 1)
+#define PPPOE_HASH_MAX	(1 << 12)
 
 static int __pppoe_xmit(struct sock *sk, struct sk_buff *skb);
 
 static const struct proto_ops pppoe_ops;
 static const struct pppoe_channel_ops pppoe_chan_ops;
 
+/* RCU-managed session table, sized at runtime */
+struct pppoe_hash {
+	unsigned int size;		/* buckets, a power of two */
+	struct rcu_head rcu;
+	struct pppox_sock __rcu *bucket[0];
+};
+
 /* per-net private data for this module */
 static int pppoe_net_id __read_mostly;
 struct pppoe_net {
@@ -108,8 +122,16 @@ struct pppoe_net {
 	 * as well, moreover in case of SMP less locking
 	 * controversy here
 	 */
-	struct pppox_sock *hash_table[PPPOE_HASH_SIZE];
-	rwlock_t hash_lock;
+	struct pppoe_hash __rcu *hash;
+	unsigned int hash_count;	/* sessions in the table */
+
+	/*
+	 * Lookups are lockless under RCU.  hash_lock serialises
+	 * writers; hash_seq lets a reader that missed retry if a
+	 * resize was moving sessions between tables meanwhile.
+	 */
+	spinlock_t hash_lock;
+	seqcount_t hash_seq;
 
 	/*
 	 * This function is registered by the generic PPP
@@ -150,23 +172,32 @@ static inline int cmp_addr(struct pppoe_addr *a, __be16 sid, char *addr)
 	return a->sid == sid && !memcmp(a->remote, addr, ETH_ALEN);
 }
 
-#if 8 % PPPOE_HASH_BITS
-#error 8 must be a multiple of PPPOE_HASH_BITS
-#endif
+static inline unsigned int hash_item(__be16 sid, unsigned char *addr)
+{
+	return jhash(addr, ETH_ALEN, (__force u32)sid);
+}
 
-static int hash_item(__be16 sid, unsigned char *addr)
+static struct pppoe_hash *pppoe_hash_alloc(unsigned int size)
 {
-	unsigned char hash = 0;
-	unsigned int i;
+	struct pppoe_hash *ht;
+
+	ht = kzalloc(sizeof(*ht) + size * sizeof(ht->bucket[0]), GFP_KERNEL);
+	if (ht)
+		ht->size = size;
+
+	return ht;
+}
 
-	for (i = 0; i < ETH_ALEN; i++)
-		hash ^= addr[i];
-	for (i = 0; i < sizeof(sid_t) * 8; i += 8)
-		hash ^= (__force __u32)sid >> i;
-	for (i = 8; (i >>= 1) >= PPPOE_HASH_BITS;)
-		hash ^= hash >> i;
+static inline struct pppoe_hash *pppoe_hash_locked(struct pppoe_net *pn)
+{
+	return rcu_dereference_protected(pn->hash,
+					 lockdep_is_held(&pn->hash_lock));
+}
 
-	return hash & PPPOE_HASH_MASK;
+static inline struct pppox_sock __rcu **
+pppoe_bucket(struct pppoe_hash *ht, __be16 sid, unsigned char *addr)
+{
+	return &ht->bucket[hash_item(sid, addr) & (ht->size - 1)];
 }
 
 /**********************************************************************
@@ -174,40 +205,54 @@ static int hash_item(__be16 sid, unsigned char *addr)
  *  Set/get/delete/rehash items  (internal versions)
  *
  **********************************************************************/
+
+/*
+ * Lockless lookup, called under rcu_read_lock.  A match is always
+ * valid; a miss is retried if a resize ran concurrently, since the
+ * session may have been moved behind our back.
+ */
 static struct pppox_sock *__get_item(struct pppoe_net *pn, __be16 sid,
 				unsigned char *addr, int ifindex)
 {
-	int hash = hash_item(sid, addr);
+	struct pppoe_hash *ht;
 	struct pppox_sock *ret;
-
-	ret = pn->hash_table[hash];
-	while (ret) {
-		if (cmp_addr(&ret->pppoe_pa, sid, addr) &&
-		    ret->pppoe_ifindex == ifindex)
-			return ret;
-
-		ret = ret->next;
-	}
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&pn->hash_seq);
+		ht = rcu_dereference(pn->hash);
+		ret = rcu_dereference(*pppoe_bucket(ht, sid, addr));
+		while (ret) {
+			if (cmp_addr(&ret->pppoe_pa, sid, addr) &&
+			    ret->pppoe_ifindex == ifindex)
+				return ret;
+
+			ret = rcu_dereference(ret->next);
+		}
+	} while (read_seqcount_retry(&pn->hash_seq, seq));
 
 	return NULL;
 }
 
 static int __set_item(struct pppoe_net *pn, struct pppox_sock *po)
 {
-	int hash = hash_item(po->pppoe_pa.sid, po->pppoe_pa.remote);
+	struct pppox_sock __rcu **head;
 	struct pppox_sock *ret;
 
-	ret = pn->hash_table[hash];
+	head = pppoe_bucket(pppoe_hash_locked(pn), po->pppoe_pa.sid,
+			    po->pppoe_pa.remote);
+	ret = rcu_dereference_protected(*head, 1);
 	while (ret) {
 		if (cmp_2_addr(&ret->pppoe_pa, &po->pppoe_pa) &&
 		    ret->pppoe_ifindex == po->pppoe_ifindex)
 			return -EALREADY;
 
-		ret = ret->next;
+		ret = rcu_dereference_protected(ret->next, 1);
 	}
 
-	po->next = pn->hash_table[hash];
-	pn->hash_table[hash] = po;
+	RCU_INIT_POINTER(po->next, rcu_dereference_protected(*head, 1));
+	rcu_assign_pointer(*head, po);
+	pn->hash_count++;
 
 	return 0;
 }
@@ -215,41 +260,99 @@ static int __set_item(struct pppoe_net *pn, struct pppox_sock *po)
 static struct pppox_sock *__delete_item(struct pppoe_net *pn, __be16 sid,
 					char *addr, int ifindex)
 {
-	int hash = hash_item(sid, addr);
-	struct pppox_sock *ret, **src;
+	struct pppox_sock __rcu **src;
+	struct pppox_sock *ret;
 
-	ret = pn->hash_table[hash];
-	src = &pn->hash_table[hash];
+	src = pppoe_bucket(pppoe_hash_locked(pn), sid, addr);
+	ret = rcu_dereference_protected(*src, 1);
 
 	while (ret) {
 		if (cmp_addr(&ret->pppoe_pa, sid, addr) &&
 		    ret->pppoe_ifindex == ifindex) {
-			*src = ret->next;
+			/* Readers on ret keep walking its old successors */
+			rcu_assign_pointer(*src,
+				rcu_dereference_protected(ret->next, 1));
+			pn->hash_count--;
 			break;
 		}
 
 		src = &ret->next;
-		ret = ret->next;
+		ret = rcu_dereference_protected(ret->next, 1);
 	}
 
 	return ret;
 }
 
+/*
+ * Double the table once it holds more sessions than buckets.  Sessions
+ * are moved one by one into the new table inside a hash_seq write
+ * section, so a lookup racing with us either finds its session or
+ * retries; chains stay NULL-terminated throughout.
+ */
+static void pppoe_hash_grow(struct pppoe_net *pn)
+{
+	struct pppoe_hash *old, *ht;
+	struct pppox_sock *po;
+	unsigned int i, size;
+
+	size = rcu_dereference_raw(pn->hash)->size * 2;
+	if (size > PPPOE_HASH_MAX)
+		return;
+
+	ht = pppoe_hash_alloc(size);
+	if (!ht)
+		return;
+
+	spin_lock_bh(&pn->hash_lock);
+	old = pppoe_hash_locked(pn);
+	if (old->size * 2 != size || pn->hash_count <= old->size) {
+		spin_unlock_bh(&pn->hash_lock);
+		kfree(ht);
+		return;
+	}
+
+	write_seqcount_begin(&pn->hash_seq);
+	for (i = 0; i < old->size; i++) {
+		while ((po = rcu_dereference_protected(old->bucket[i], 1))) {
+			struct pppox_sock __rcu **head;
+
+			rcu_assign_pointer(old->bucket[i],
+				rcu_dereference_protected(po->next, 1));
+			head = pppoe_bucket(ht, po->pppoe_pa.sid,
+					    po->pppoe_pa.remote);
+			RCU_INIT_POINTER(po->next,
+					 rcu_dereference_protected(*head, 1));
+			rcu_assign_pointer(*head, po);
+		}
+	}
+	rcu_assign_pointer(pn->hash, ht);
+	write_seqcount_end(&pn->hash_seq);
+	spin_unlock_bh(&pn->hash_lock);
+
+	kfree_rcu(old, rcu);
+}
+
 /**********************************************************************
  *
  *  Set/get/delete/rehash items
  *
  **********************************************************************/
+
+/*
+ * A socket only leaves the table through delete_item(), which waits
+ * for lockless readers before its owner can drop the last reference;
+ * so the refcount of a socket found here is never zero.
+ */
 static inline struct pppox_sock *get_item(struct pppoe_net *pn, __be16 sid,
 					unsigned char *addr, int ifindex)
 {
 	struct pppox_sock *po;
 
-	read_lock_bh(&pn->hash_lock);
+	rcu_read_lock();
 	po = __get_item(pn, sid, addr, ifindex);
 	if (po)
 		sock_hold(sk_pppox(po));
-	read_unlock_bh(&pn->hash_lock);
+	rcu_read_unlock();
 
 	return po;
 }
@@ -275,14 +378,34 @@ static inline struct pppox_sock *get_item_by_addr(struct net *net,
 	return pppox_sock;
 }
 
+static inline int set_item(struct pppoe_net *pn, struct pppox_sock *po)
+{
+	int error;
+	bool grow;
+
+	spin_lock_bh(&pn->hash_lock);
+	error = __set_item(pn, po);
+	grow = pn->hash_count > pppoe_hash_locked(pn)->size;
+	spin_unlock_bh(&pn->hash_lock);
+
+	if (grow)
+		pppoe_hash_grow(pn);
+
+	return error;
+}
+
+/* Must be called from process context: it waits out lockless readers. */
 static inline struct pppox_sock *delete_item(struct pppoe_net *pn, __be16 sid,
 					char *addr, int ifindex)
 {
 	struct pppox_sock *ret;
 
-	write_lock_bh(&pn->hash_lock);
+	spin_lock_bh(&pn->hash_lock);
 	ret = __delete_item(pn, sid, addr, ifindex);
-	write_unlock_bh(&pn->hash_lock);
+	spin_unlock_bh(&pn->hash_lock);
+
+	if (ret)
+		synchronize_rcu();
 
 	return ret;
 }
@@ -300,14 +423,15 @@ static void pppoe_flush_dev(struct net_device *dev)
 	int i;
 
 	pn = pppoe_pernet(dev_net(dev));
-	write_lock_bh(&pn->hash_lock);
-	for (i = 0; i < PPPOE_HASH_SIZE; i++) {
-		struct pppox_sock *po = pn->hash_table[i];
+	spin_lock_bh(&pn->hash_lock);
+	for (i = 0; i < pppoe_hash_locked(pn)->size; i++) {
+		struct pppox_sock *po;
 		struct sock *sk;
 
+		po = rcu_dereference_protected(pppoe_hash_locked(pn)->bucket[i], 1);
 		while (po) {
 			while (po && po->pppoe_dev != dev) {
-				po = po->next;
+				po = rcu_dereference_protected(po->next, 1);
 			}
 
 			if (!po)
@@ -324,7 +448,7 @@ static void pppoe_flush_dev(struct net_device *dev)
 			 */
 
 			sock_hold(sk);
-			write_unlock_bh(&pn->hash_lock);
+			spin_unlock_bh(&pn->hash_lock);
 			lock_sock(sk);
 
 			if (po->pppoe_dev == dev &&
@@ -341,15 +465,16 @@ static void pppoe_flush_dev(struct net_device *dev)
 
 			/* Restart the process from the start of the current
 			 * hash chain. We dropped locks so the world may have
-			 * change from underneath us.
+			 * change from underneath us, the table may even have
+			 * grown.
 			 */
 
 			BUG_ON(pppoe_pernet(dev_net(dev)) == NULL);
-			write_lock_bh(&pn->hash_lock);
-			po = pn->hash_table[i];
+			spin_lock_bh(&pn->hash_lock);
+			po = rcu_dereference_protected(pppoe_hash_locked(pn)->bucket[i], 1);
 		}
 	}
-	write_unlock_bh(&pn->hash_lock);
+	spin_unlock_bh(&pn->hash_lock);
 }
 
 static int pppoe_device_event(struct notifier_block *this,
@@ -457,12 +582,25 @@ static int pppoe_rcv(struct sk_buff *skb, struct net_device *dev,
 
 	pn = pppoe_pernet(dev_net(dev));
 
-	/* Note that get_item does a sock_hold(), so sk_pppox(po)
-	 * is known to be safe.
+	/* Data frames of a session whose ppp unit runs the fast path
+	 * go straight to the stack without touching the socket.
 	 */
-	po = get_item(pn, ph->sid, eth_hdr(skb)->h_source, dev->ifindex);
-	if (!po)
+	rcu_read_lock();
+	po = __get_item(pn, ph->sid, eth_hdr(skb)->h_source, dev->ifindex);
+	if (!po) {
+		rcu_read_unlock();
 		goto drop;
+	}
+
+	if ((sk_pppox(po)->sk_state & PPPOX_BOUND) &&
+	    ppp_fast_input(&po->chan, skb)) {
+		rcu_read_unlock();
+		return NET_RX_SUCCESS;
+	}
+
+	/* See get_item() for why the reference can't be zero here. */
+	sock_hold(sk_pppox(po));
+	rcu_read_unlock();
 
 	return sk_receive_skb(sk_pppox(po), skb, 0);
 
@@ -607,10 +745,10 @@ static int pppoe_release(struct socket *sock)
 	 * PPPoE session before the socket is released.
 	 */
 	if (po->pppoe_pa.sid) {
-		read_lock_bh(&pn->hash_lock);
+		spin_lock_bh(&pn->hash_lock);
 		pppoe_destroy_method = pn->pppoe_destroy_method;
 		destroy_method_arg = pn->destroy_method_arg;
-		read_unlock_bh(&pn->hash_lock);
+		spin_unlock_bh(&pn->hash_lock);
 
 		if (pppoe_destroy_method) {
 			pppoe_destroy_method(destroy_method_arg, be16_to_cpu(po->pppoe_pa.sid), po->pppoe_pa.remote);
@@ -680,10 +818,10 @@ static int pppoe_connect(struct socket *sock, struct sockaddr *uservaddr,
 		 * the user has unregitered because the destory existed while the lock was held.
 		 * This race needs to be fixed in a future patch.
 		 */
-		read_lock_bh(&pn->hash_lock);
+		spin_lock_bh(&pn->hash_lock);
 		pppoe_destroy_method = pn->pppoe_destroy_method;
 		destroy_method_arg = pn->destroy_method_arg;
-		read_unlock_bh(&pn->hash_lock);
+		spin_unlock_bh(&pn->hash_lock);
 
 		if (pppoe_destroy_method) {
 			pppoe_destroy_method(destroy_method_arg, be16_to_cpu(po->pppoe_pa.sid), po->pppoe_pa.remote);
@@ -704,10 +842,10 @@ static int pppoe_connect(struct socket *sock, struct sockaddr *uservaddr,
 		 * Unregister the destroy method and its argument. They
 		 * will be re-registered once the new connection is established.
 		 */
-		write_lock_bh(&pn->hash_lock);
+		spin_lock_bh(&pn->hash_lock);
 		pn->pppoe_destroy_method = NULL;
 		pn->destroy_method_arg = NULL;
-		write_unlock_bh(&pn->hash_lock);
+		spin_unlock_bh(&pn->hash_lock);
 	}
 
 	/* Re-bind in session stage only */
@@ -729,9 +867,7 @@ static int pppoe_connect(struct socket *sock, struct sockaddr *uservaddr,
 		       &sp->sa_addr.pppoe,
 		       sizeof(struct pppoe_addr));
 
-		write_lock_bh(&pn->hash_lock);
-		error = __set_item(pn, po);
-		write_unlock_bh(&pn->hash_lock);
+		error = set_item(pn, po);
 		if (error < 0)
 			goto err_put;
 
@@ -1021,6 +1157,77 @@ static int pppoe_xmit(struct ppp_channel *chan, struct sk_buff *skb)
 	return __pppoe_xmit(sk, skb);
 }
 
+/************************************************************************
+ *
+ * Lock-free xmit called by generic PPP driver for data frames when the
+ * ppp unit runs the fast path.  The PPPoE and link headers are pushed
+ * straight onto the frame; a GSO frame is segmented only now, once,
+ * with the finished headers copied into every segment.
+ *
+ ***********************************************************************/
+static void pppoe_fast_xmit(struct ppp_channel *chan, struct sk_buff *skb)
+{
+	struct sock *sk = (struct sock *)chan->private;
+	struct pppox_sock *po = pppox_sk(sk);
+	struct net_device *dev = ACCESS_ONCE(po->pppoe_dev);
+	struct sk_buff *segs, *next;
+	struct pppoe_hdr *ph;
+	int data_len = skb->len;
+	int hdr_off;
+
+	if (!dev || !(sk->sk_state & PPPOX_CONNECTED))
+		goto abort;
+
+	if (skb_cow_head(skb, sizeof(*ph) + dev->hard_header_len))
+		goto abort;
+
+	ph = (struct pppoe_hdr *)__skb_push(skb, sizeof(*ph));
+	ph->ver	= 1;
+	ph->type = 1;
+	ph->code = 0;
+	ph->sid	= po->num;
+	ph->length = htons(data_len);
+
+	skb->dev = dev;
+	if (!skb_is_gso(skb))
+		skb_reset_network_header(skb);
+
+	if (dev_hard_header(skb, dev, ETH_P_PPP_SES,
+			    po->pppoe_pa.remote, NULL, data_len) < 0)
+		goto abort;
+
+	if (!skb_is_gso(skb)) {
+		skb->protocol = cpu_to_be16(ETH_P_PPP_SES);
+		dev_queue_xmit(skb);
+		return;
+	}
+
+	/* skb->protocol and the network header still describe the inner
+	 * packet, so everything in front of it is copied per segment.
+	 */
+	hdr_off = (unsigned char *)ph - skb->data;
+	segs = skb_gso_segment(skb, dev->features & NETIF_F_SG);
+	if (IS_ERR_OR_NULL(segs))
+		goto abort;
+
+	consume_skb(skb);
+	do {
+		next = segs->next;
+		segs->next = NULL;
+
+		ph = (struct pppoe_hdr *)(segs->data + hdr_off);
+		ph->length = htons(segs->len - hdr_off - sizeof(*ph));
+		segs->protocol = cpu_to_be16(ETH_P_PPP_SES);
+		dev_queue_xmit(segs);
+
+		segs = next;
+	} while (segs);
+	return;
+
+abort:
+	kfree_skb(skb);
+}
+
 /************************************************************************
  *
  * function called by generic PPP driver to register destroy methods
@@ -1031,14 +1238,14 @@ static bool pppoe_register_destroy_method(struct ppp_channel *chan, ppp_channel_
 	struct sock *sk = (struct sock *)chan->private;
 	struct pppoe_net *pn = pppoe_pernet(sock_net(sk));
 
-	write_lock_bh(&pn->hash_lock);
+	spin_lock_bh(&pn->hash_lock);
 	if (pn->pppoe_destroy_method || pn->destroy_method_arg) {
-		write_unlock_bh(&pn->hash_lock);
+		spin_unlock_bh(&pn->hash_lock);
 		return false;
 	}
 	pn->pppoe_destroy_method = method;
 	pn->destroy_method_arg = destroy_method_arg;
-	write_unlock_bh(&pn->hash_lock);
+	spin_unlock_bh(&pn->hash_lock);
 
 	return true;
 }
@@ -1053,10 +1260,10 @@ static void pppoe_unregister_destroy_method(struct ppp_channel *chan)
 	struct sock *sk = (struct sock *)chan->private;
 	struct pppoe_net *pn = pppoe_pernet(sock_net(sk));
 
-	write_lock_bh(&pn->hash_lock);
+	spin_lock_bh(&pn->hash_lock);
 	pn->pppoe_destroy_method = NULL;
 	pn->destroy_method_arg = NULL;
-	write_unlock_bh(&pn->hash_lock);
+	spin_unlock_bh(&pn->hash_lock);
 }
 
 /************************************************************************
@@ -1180,6 +1387,7 @@ static const struct pppoe_channel_ops pppoe_chan_ops = {
 	.ops.get_channel_protocol = pppoe_get_channel_protocol,
 	.ops.hold = pppoe_hold_chan,
 	.ops.release = pppoe_release_chan,
+	.ops.fast_xmit = pppoe_fast_xmit,
 };
 
 static int pppoe_recvmsg(struct kiocb *iocb, struct socket *sock,
@@ -1233,15 +1441,16 @@ out:
 
 static inline struct pppox_sock *pppoe_get_idx(struct pppoe_net *pn, loff_t pos)
 {
-	struct pppox_sock *po;
+	struct pppoe_hash *ht = pppoe_hash_locked(pn);
+	struct pppox_sock *po = NULL;
 	int i;
 
-	for (i = 0; i < PPPOE_HASH_SIZE; i++) {
-		po = pn->hash_table[i];
+	for (i = 0; i < ht->size; i++) {
+		po = rcu_dereference_protected(ht->bucket[i], 1);
 		while (po) {
 			if (!pos--)
 				goto out;
-			po = po->next;
+			po = rcu_dereference_protected(po->next, 1);
 		}
 	}
 
@@ -1255,7 +1464,7 @@ static void *pppoe_seq_start(struct seq_file *seq, loff_t *pos)
 	struct pppoe_net *pn = pppoe_pernet(seq_file_net(seq));
 	loff_t l = *pos;
 
-	read_lock_bh(&pn->hash_lock);
+	spin_lock_bh(&pn->hash_lock);
 	return l ? pppoe_get_idx(pn, --l) : SEQ_START_TOKEN;
 }
 
@@ -1270,14 +1479,17 @@ static void *pppoe_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 		goto out;
 	}
 	po = v;
-	if (po->next)
-		po = po->next;
+	if (rcu_access_pointer(po->next))
+		po = rcu_dereference_protected(po->next, 1);
 	else {
-		int hash = hash_item(po->pppoe_pa.sid, po->pppoe_pa.remote);
+		struct pppoe_hash *ht = pppoe_hash_locked(pn);
+		unsigned int hash;
 
+		hash = hash_item(po->pppoe_pa.sid, po->pppoe_pa.remote) &
+		       (ht->size - 1);
 		po = NULL;
-		while (++hash < PPPOE_HASH_SIZE) {
-			po = pn->hash_table[hash];
+		while (++hash < ht->size) {
+			po = rcu_dereference_protected(ht->bucket[hash], 1);
 			if (po)
 				break;
 		}
@@ -1291,7 +1503,7 @@ static void pppoe_seq_stop(struct seq_file *seq, void *v)
 	__releases(pn->hash_lock)
 {
 	struct pppoe_net *pn = pppoe_pernet(seq_file_net(seq));
-	read_unlock_bh(&pn->hash_lock);
+	spin_unlock_bh(&pn->hash_lock);
 }
 
 static const struct seq_operations pppoe_seq_ops = {
@@ -1348,15 +1560,22 @@ static __net_init int pppoe_init_net(struct net *net)
 	struct pppoe_net *pn = pppoe_pernet(net);
 	struct proc_dir_entry *pde;
 
-	rwlock_init(&pn->hash_lock);
+	spin_lock_init(&pn->hash_lock);
+	seqcount_init(&pn->hash_seq);
+
+	RCU_INIT_POINTER(pn->hash, pppoe_hash_alloc(PPPOE_HASH_SIZE));
+	if (!rcu_access_pointer(pn->hash))
+		return -ENOMEM;
 
 	pn->pppoe_destroy_method = NULL;
 	pn->destroy_method_arg = NULL;
 
 	pde = proc_net_fops_create(net, "pppoe", S_IRUGO, &pppoe_seq_fops);
 #ifdef CONFIG_PROC_FS
-	if (!pde)
+	if (!pde) {
+		kfree(rcu_access_pointer(pn->hash));
 		return -ENOMEM;
+	}
 #endif
 
 	return 0;
@@ -1364,7 +1583,10 @@ static __net_init int pppoe_init_net(struct net *net)
 
 static __net_exit void pppoe_exit_net(struct net *net)
 {
+	struct pppoe_net *pn = pppoe_pernet(net);
+
 	proc_net_remove(net, "pppoe");
+	kfree(rcu_dereference_raw(pn->hash));
 }
 
 static struct pernet_operations pppoe_net_ops = {
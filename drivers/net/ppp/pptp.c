@@ -32,6 +32,7 @@
 #include <linux/netfilter_ipv4.h>
 #include <linux/rcupdate.h>
 #include <linux/spinlock.h>
+#include <linux/jhash.h>
 
 #include <net/sock.h>
 #include <net/protocol.h>
@@ -45,10 +46,18 @@
 #define PPTP_DRIVER_VERSION "0.8.5"
 
 #define MAX_CALLID 65535
+#define CALLID_WORDS BITS_TO_LONGS(MAX_CALLID + 1)
 
 static DECLARE_BITMAP(callid_bitmap, MAX_CALLID + 1);
+/* One bit per callid_bitmap word, set while that word is full */
+static DECLARE_BITMAP(callid_full, CALLID_WORDS);
 static struct pppox_sock **callid_sock;
 
+/* Connected calls, indexed by peer address and peer call ID */
+#define CALLID_DST_HASH_BITS 10
+#define CALLID_DST_HASH_SIZE (1 << CALLID_DST_HASH_BITS)
+static struct hlist_head callid_dst_hash[CALLID_DST_HASH_SIZE];
+
 static DEFINE_SPINLOCK(chan_lock);
 
 static struct proto pptp_sk_proto __read_mostly;
@@ -109,45 +118,71 @@ static struct pppox_sock *lookup_chan(u16 call_id, __be32 s_addr)
 	return sock;
 }
 
-static int lookup_chan_dst(u16 call_id, __be32 d_addr)
+static inline struct hlist_head *callid_dst_bucket(u16 call_id, __be32 d_addr)
 {
-	struct pppox_sock *sock;
-	struct pptp_opt *opt;
-	int i;
+	u32 hash = jhash_2words((__force u32)d_addr, call_id, 0);
 
-	rcu_read_lock();
-	for (i = find_next_bit(callid_bitmap, MAX_CALLID, 1); i < MAX_CALLID;
-	     i = find_next_bit(callid_bitmap, MAX_CALLID, i + 1)) {
-		sock = rcu_dereference(callid_sock[i]);
-		if (!sock)
-			continue;
-		opt = &sock->proto.pptp;
-		if (opt->dst_addr.call_id == call_id &&
-			  opt->dst_addr.sin_addr.s_addr == d_addr)
-			break;
+	return &callid_dst_hash[hash & (CALLID_DST_HASH_SIZE - 1)];
+}
+
+/*
+ * Find a free call ID at or after @start, wrapping around once.  Full
+ * words of callid_bitmap are skipped through callid_full, so this is a
+ * couple of short word scans however many calls are up.  IDs 0 and
+ * MAX_CALLID are never handed out.  Called with chan_lock held.
+ */
+static int find_free_callid(unsigned int start)
+{
+	unsigned int word, end, id;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++, start = 1) {
+		word = start / BITS_PER_LONG;
+		while ((word = find_next_zero_bit(callid_full, CALLID_WORDS,
+						  word)) < CALLID_WORDS) {
+			end = (word + 1) * BITS_PER_LONG;
+			id = find_next_zero_bit(callid_bitmap, end,
+						max(start, word * BITS_PER_LONG));
+			if (id < end && id < MAX_CALLID)
+				return id;
+			word++;
+		}
 	}
-	rcu_read_unlock();
 
-	return i < MAX_CALLID;
+	return -1;
+}
+
+static void set_callid(unsigned int call_id)
+{
+	unsigned int word = call_id / BITS_PER_LONG;
+
+	set_bit(call_id, callid_bitmap);
+	if (callid_bitmap[word] == ~0UL)
+		set_bit(word, callid_full);
+}
+
+static void clear_callid(unsigned int call_id)
+{
+	clear_bit(call_id, callid_bitmap);
+	clear_bit(call_id / BITS_PER_LONG, callid_full);
 }
 
 static int add_chan(struct pppox_sock *sock)
 {
 	static int call_id;
+	int id;
 
 	spin_lock(&chan_lock);
 	if (!sock->proto.pptp.src_addr.call_id)	{
-		call_id = find_next_zero_bit(callid_bitmap, MAX_CALLID, call_id + 1);
-		if (call_id == MAX_CALLID) {
-			call_id = find_next_zero_bit(callid_bitmap, MAX_CALLID, 1);
-			if (call_id == MAX_CALLID)
-				goto out_err;
-		}
+		id = find_free_callid(call_id + 1);
+		if (id < 0)
+			goto out_err;
+		call_id = id;
 		sock->proto.pptp.src_addr.call_id = call_id;
 	} else if (test_bit(sock->proto.pptp.src_addr.call_id, callid_bitmap))
 		goto out_err;
 
-	set_bit(sock->proto.pptp.src_addr.call_id, callid_bitmap);
+	set_callid(sock->proto.pptp.src_addr.call_id);
 	rcu_assign_pointer(callid_sock[sock->proto.pptp.src_addr.call_id], sock);
 	spin_unlock(&chan_lock);
 
@@ -158,11 +193,53 @@ out_err:
 	return -1;
 }
 
+/*
+ * Claim the peer's (address, call ID) for this socket; fails if another
+ * call is already connected to it.
+ */
+static int add_chan_dst(struct pppox_sock *sock, struct pptp_addr *dst)
+{
+	struct pptp_opt *opt;
+	struct hlist_node *node;
+	struct hlist_head *head;
+
+	head = callid_dst_bucket(dst->call_id, dst->sin_addr.s_addr);
+
+	spin_lock(&chan_lock);
+	hlist_for_each_entry(opt, node, head, dst_node) {
+		if (opt->dst_addr.call_id == dst->call_id &&
+		    opt->dst_addr.sin_addr.s_addr == dst->sin_addr.s_addr) {
+			spin_unlock(&chan_lock);
+			return -1;
+		}
+	}
+
+	sock->proto.pptp.dst_addr = *dst;
+	hlist_add_head(&sock->proto.pptp.dst_node, head);
+	spin_unlock(&chan_lock);
+
+	return 0;
+}
+
+static void __del_chan_dst(struct pppox_sock *sock)
+{
+	if (!hlist_unhashed(&sock->proto.pptp.dst_node))
+		hlist_del_init(&sock->proto.pptp.dst_node);
+}
+
+static void del_chan_dst(struct pppox_sock *sock)
+{
+	spin_lock(&chan_lock);
+	__del_chan_dst(sock);
+	spin_unlock(&chan_lock);
+}
+
 static void del_chan(struct pppox_sock *sock)
 {
 	spin_lock(&chan_lock);
-	clear_bit(sock->proto.pptp.src_addr.call_id, callid_bitmap);
+	clear_callid(sock->proto.pptp.src_addr.call_id);
 	RCU_INIT_POINTER(callid_sock[sock->proto.pptp.src_addr.call_id], NULL);
+	__del_chan_dst(sock);
 	spin_unlock(&chan_lock);
 	synchronize_rcu();
 }
@@ -463,6 +540,7 @@ static int pptp_connect(struct socket *sock, struct sockaddr *uservaddr,
 	struct sockaddr_pppox *sp = (struct sockaddr_pppox *) uservaddr;
 	struct pppox_sock *po = pppox_sk(sk);
 	struct pptp_opt *opt = &po->proto.pptp;
+	struct pptp_addr dst;
 	struct rtable *rt;
 	struct flowi4 fl4;
 	int error = 0;
@@ -470,9 +548,6 @@ static int pptp_connect(struct socket *sock, struct sockaddr *uservaddr,
 	if (sp->sa_protocol != PX_PROTO_PPTP)
 		return -EINVAL;
 
-	if (lookup_chan_dst(sp->sa_addr.pptp.call_id, sp->sa_addr.pptp.sin_addr.s_addr))
-		return -EALREADY;
-
 	lock_sock(sk);
 	/* Check for already bound sockets */
 	if (sk->sk_state & PPPOX_CONNECTED) {
@@ -491,6 +566,13 @@ static int pptp_connect(struct socket *sock, struct sockaddr *uservaddr,
 		goto end;
 	}
 
+	/* Claims the peer call atomically, also setting opt->dst_addr */
+	dst = sp->sa_addr.pptp;
+	if (add_chan_dst(po, &dst)) {
+		error = -EALREADY;
+		goto end;
+	}
+
 	po->chan.private = sk;
 	po->chan.ops = &pptp_chan_ops;
 
@@ -501,7 +583,7 @@ static int pptp_connect(struct socket *sock, struct sockaddr *uservaddr,
 				   IPPROTO_GRE, RT_CONN_FLAGS(sk), 0);
 	if (IS_ERR(rt)) {
 		error = -EHOSTUNREACH;
-		goto end;
+		goto err_dst;
 	}
 	sk_setup_caps(sk, &rt->dst);
 
@@ -515,15 +597,18 @@ static int pptp_connect(struct socket *sock, struct sockaddr *uservaddr,
 	error = ppp_register_channel(&po->chan);
 	if (error) {
 		pr_err("PPTP: failed to register PPP channel (%d)\n", error);
-		goto end;
+		goto err_dst;
 	}
 
-	opt->dst_addr = sp->sa_addr.pptp;
 	sk->sk_state = PPPOX_CONNECTED;
 
  end:
 	release_sock(sk);
 	return error;
+
+ err_dst:
+	del_chan_dst(po);
+	goto end;
 }
 
 static int pptp_getname(struct socket *sock, struct sockaddr *uaddr,
@@ -613,6 +698,7 @@ static int pptp_create(struct net *net, struct socket *sock)
 
 	opt->seq_sent = 0; opt->seq_recv = 0xffffffff;
 	opt->ack_recv = 0; opt->ack_sent = 0xffffffff;
+	INIT_HLIST_NODE(&opt->dst_node);
 
 	error = 0;
 out:
@@ -25,6 +25,7 @@
 #include <linux/mm_inline.h>
 #include <linux/swap.h>
 #include <linux/writeback.h>
+#include <linux/backing-dev.h>
 #include <linux/export.h>
 #include <linux/syscalls.h>
 #include <linux/uio.h>
@@ -91,13 +92,11 @@ static void page_cache_pipe_buf_release(struct pipe_inode_info *pipe,
 }
 
 /*
- * Check whether the contents of buf is OK to access. Since the content
- * is a page cache page, IO may be in flight.
+ * Wait for read I/O started on a page cache page by the splice read side and
+ * make sure the page is still usable.
  */
-static int page_cache_pipe_buf_confirm(struct pipe_inode_info *pipe,
-				       struct pipe_buffer *buf)
+static int splice_confirm_page(struct page *page)
 {
-	struct page *page = buf->page;
 	int err;
 
 	if (!PageUptodate(page)) {
@@ -132,6 +131,16 @@ error:
 	return err;
 }
 
+/*
+ * Check whether the contents of buf is OK to access. Since the content
+ * is a page cache page, IO may be in flight.
+ */
+static int page_cache_pipe_buf_confirm(struct pipe_inode_info *pipe,
+				       struct pipe_buffer *buf)
+{
+	return splice_confirm_page(buf->page);
+}
+
 const struct pipe_buf_operations page_cache_pipe_buf_ops = {
 	.can_merge = 0,
 	.map = generic_pipe_buf_map,
@@ -301,52 +310,44 @@ void splice_shrink_spd(struct splice_pipe_desc *spd)
 	kfree(spd->partial);
 }
 
-static int
-__generic_file_splice_read(struct file *in, loff_t *ppos,
-			   struct pipe_inode_info *pipe, size_t len,
-			   unsigned int flags)
+/*
+ * Look up, and start reading in if needed, up to spd->nr_pages_max page
+ * cache pages of @in covering @len bytes at @pos. On return spd->pages holds
+ * references to spd->nr_pages pages, which may still be under read I/O, and
+ * spd->partial describes the data to use from each of them.
+ */
+static int splice_lookup_pages(struct file *in, loff_t pos,
+			       struct splice_pipe_desc *spd, size_t len)
 {
 	struct address_space *mapping = in->f_mapping;
 	unsigned int loff, nr_pages, req_pages;
-	struct page *pages[PIPE_DEF_BUFFERS];
-	struct partial_page partial[PIPE_DEF_BUFFERS];
 	struct page *page;
 	pgoff_t index, end_index;
 	loff_t isize;
 	int error, page_nr;
-	struct splice_pipe_desc spd = {
-		.pages = pages,
-		.partial = partial,
-		.nr_pages_max = PIPE_DEF_BUFFERS,
-		.flags = flags,
-		.ops = &page_cache_pipe_buf_ops,
-		.spd_release = spd_release_page,
-	};
-
-	if (splice_grow_spd(pipe, &spd))
-		return -ENOMEM;
 
-	index = *ppos >> PAGE_CACHE_SHIFT;
-	loff = *ppos & ~PAGE_CACHE_MASK;
+	index = pos >> PAGE_CACHE_SHIFT;
+	loff = pos & ~PAGE_CACHE_MASK;
 	req_pages = (len + loff + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
-	nr_pages = min(req_pages, spd.nr_pages_max);
+	nr_pages = min(req_pages, spd->nr_pages_max);
 
 	/*
 	 * Lookup the (hopefully) full range of pages we need.
 	 */
-	spd.nr_pages = find_get_pages_contig(mapping, index, nr_pages, spd.pages);
-	index += spd.nr_pages;
+	spd->nr_pages = find_get_pages_contig(mapping, index, nr_pages,
+					      spd->pages);
+	index += spd->nr_pages;
 
 	/*
 	 * If find_get_pages_contig() returned fewer pages than we needed,
 	 * readahead/allocate the rest and fill in the holes.
 	 */
-	if (spd.nr_pages < nr_pages)
+	if (spd->nr_pages < nr_pages)
 		page_cache_sync_readahead(mapping, &in->f_ra, in,
-				index, req_pages - spd.nr_pages);
+				index, req_pages - spd->nr_pages);
 
 	error = 0;
-	while (spd.nr_pages < nr_pages) {
+	while (spd->nr_pages < nr_pages) {
 		/*
 		 * Page could be there, find_get_pages_contig() breaks on
 		 * the first hole.
@@ -375,7 +376,7 @@ __generic_file_splice_read(struct file *in, loff_t *ppos,
 			unlock_page(page);
 		}
 
-		spd.pages[spd.nr_pages++] = page;
+		spd->pages[spd->nr_pages++] = page;
 		index++;
 	}
 
@@ -383,9 +384,9 @@ __generic_file_splice_read(struct file *in, loff_t *ppos,
 	 * Now loop over the map and see if we need to start IO on any
 	 * pages, fill in the partial map, etc.
 	 */
-	index = *ppos >> PAGE_CACHE_SHIFT;
-	nr_pages = spd.nr_pages;
-	spd.nr_pages = 0;
+	index = pos >> PAGE_CACHE_SHIFT;
+	nr_pages = spd->nr_pages;
+	spd->nr_pages = 0;
 	for (page_nr = 0; page_nr < nr_pages; page_nr++) {
 		unsigned int this_len;
 
@@ -396,7 +397,7 @@ __generic_file_splice_read(struct file *in, loff_t *ppos,
 		 * this_len is the max we'll use from this page
 		 */
 		this_len = min_t(unsigned long, len, PAGE_CACHE_SIZE - loff);
-		page = spd.pages[page_nr];
+		page = spd->pages[page_nr];
 
 		if (PageReadahead(page))
 			page_cache_async_readahead(mapping, &in->f_ra, in,
@@ -423,8 +424,8 @@ __generic_file_splice_read(struct file *in, loff_t *ppos,
 					error = -ENOMEM;
 					break;
 				}
-				page_cache_release(spd.pages[page_nr]);
-				spd.pages[page_nr] = page;
+				page_cache_release(spd->pages[page_nr]);
+				spd->pages[page_nr] = page;
 			}
 			/*
 			 * page was already under io and is now done, great
@@ -481,11 +482,11 @@ fill_it:
 			len = this_len;
 		}
 
-		spd.partial[page_nr].offset = loff;
-		spd.partial[page_nr].len = this_len;
+		spd->partial[page_nr].offset = loff;
+		spd->partial[page_nr].len = this_len;
 		len -= this_len;
 		loff = 0;
-		spd.nr_pages++;
+		spd->nr_pages++;
 		index++;
 	}
 
@@ -494,9 +495,33 @@ fill_it:
 	 * we got, 'nr_pages' is how many pages are in the map.
 	 */
 	while (page_nr < nr_pages)
-		page_cache_release(spd.pages[page_nr++]);
+		page_cache_release(spd->pages[page_nr++]);
 	in->f_ra.prev_pos = (loff_t)index << PAGE_CACHE_SHIFT;
 
+	return error;
+}
+
+static int
+__generic_file_splice_read(struct file *in, loff_t *ppos,
+			   struct pipe_inode_info *pipe, size_t len,
+			   unsigned int flags)
+{
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	int error;
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &page_cache_pipe_buf_ops,
+		.spd_release = spd_release_page,
+	};
+
+	if (splice_grow_spd(pipe, &spd))
+		return -ENOMEM;
+
+	error = splice_lookup_pages(in, *ppos, &spd, len);
 	if (spd.nr_pages)
 		error = splice_to_pipe(pipe, &spd);
 
@@ -1276,6 +1301,142 @@ static int direct_splice_actor(struct pipe_inode_info *pipe,
 			      sd->flags);
 }
 
+/*
+ * Pages looked up and handed to the socket at once by splice_file_to_socket().
+ */
+#define SPLICE_SENDPAGE_BATCH	32
+
+/*
+ * Factor by which splice_file_to_socket() grows the readahead window of a
+ * file it reads sequentially, relative to the device default.
+ */
+#define SPLICE_SENDPAGE_RA_SCALE	4
+
+/*
+ * Files sent out sequentially are media streams or bulk copies, so give them
+ * a large readahead window, like POSIX_FADV_SEQUENTIAL does but bigger.
+ */
+static void splice_sendpage_readahead(struct file *in, loff_t pos)
+{
+	struct backing_dev_info *bdi = in->f_mapping->backing_dev_info;
+	unsigned long ra_pages = bdi->ra_pages * SPLICE_SENDPAGE_RA_SCALE;
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	pgoff_t prev = in->f_ra.prev_pos >> PAGE_CACHE_SHIFT;
+
+	if (!pos || (in->f_mode & FMODE_RANDOM))
+		return;
+
+	/* the previous call stopped in or right before this page */
+	if (index + 1 < prev || index > prev)
+		return;
+
+	if (in->f_ra.ra_pages < ra_pages)
+		in->f_ra.ra_pages = ra_pages;
+}
+
+/*
+ * Fast path of do_splice_direct() for sending a page cache backed file to a
+ * socket, as sendfile() does. The pages are looked up and read in the same
+ * way generic_file_splice_read() does it, but instead of being queued to the
+ * internal pipe and fed to the socket one pipe buffer at a time, each batch
+ * of pages is handed straight to ->sendpage(). Only the last page of a batch
+ * is sent without MSG_SENDPAGE_NOTLAST, so TCP pushes out full segments once
+ * per batch. The socket takes its own page references, so the page cache
+ * pages are only pinned while being sent.
+ */
+static long splice_file_to_socket(struct file *in, loff_t *ppos,
+				  struct file *out, size_t len,
+				  unsigned int flags)
+{
+	struct page *pages[SPLICE_SENDPAGE_BATCH];
+	struct partial_page partial[SPLICE_SENDPAGE_BATCH];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = SPLICE_SENDPAGE_BATCH,
+		.flags = flags,
+	};
+	loff_t isize, pos = *ppos, out_pos = out->f_pos;
+	long bytes = 0;
+	int i, ret, more, done = 0;
+
+	if (unlikely(!(in->f_mode & FMODE_READ)))
+		return -EBADF;
+	if (unlikely(!(out->f_mode & FMODE_WRITE)))
+		return -EBADF;
+	if (unlikely(out->f_flags & O_APPEND))
+		return -EINVAL;
+
+	ret = rw_verify_area(READ, in, ppos, len);
+	if (unlikely(ret < 0))
+		return ret;
+	ret = rw_verify_area(WRITE, out, &out_pos, len);
+	if (unlikely(ret < 0))
+		return ret;
+
+	isize = i_size_read(in->f_mapping->host);
+	if (unlikely(pos >= isize))
+		return 0;
+	if (unlikely(isize - pos < len))
+		len = isize - pos;
+
+	splice_sendpage_readahead(in, pos);
+
+	ret = 0;
+	while (len && !done) {
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		ret = splice_lookup_pages(in, pos, &spd, len);
+		if (!spd.nr_pages)
+			break;
+
+		for (i = 0; i < spd.nr_pages; i++) {
+			size_t this_len = spd.partial[i].len;
+
+			ret = splice_confirm_page(spd.pages[i]);
+			if (unlikely(ret)) {
+				if (ret == -ENODATA)
+					ret = 0;
+				done = 1;
+				break;
+			}
+
+			more = (flags & SPLICE_F_MORE) ? MSG_MORE : 0;
+			if (i + 1 < spd.nr_pages && this_len < len)
+				more |= MSG_SENDPAGE_NOTLAST;
+
+			ret = out->f_op->sendpage(out, spd.pages[i],
+						  spd.partial[i].offset,
+						  this_len, &out_pos, more);
+			if (ret <= 0) {
+				done = 1;
+				break;
+			}
+
+			bytes += ret;
+			pos += ret;
+			len -= ret;
+			if (ret < this_len) {
+				done = 1;
+				break;
+			}
+		}
+
+		while (spd.nr_pages)
+			page_cache_release(spd.pages[--spd.nr_pages]);
+	}
+
+	if (bytes) {
+		*ppos = pos;
+		file_accessed(in);
+		return bytes;
+	}
+	return ret;
+}
+
 /**
  * do_splice_direct - splices data directly between two files
  * @in:		file to splice from
@@ -1303,6 +1464,11 @@ long do_splice_direct(struct file *in, loff_t *ppos, struct file *out,
 	};
 	long ret;
 
+	if (in->f_op && in->f_op->splice_read == generic_file_splice_read &&
+	    out->f_op && out->f_op->splice_write == generic_splice_sendpage &&
+	    out->f_op->sendpage)
+		return splice_file_to_socket(in, ppos, out, len, flags);
+
 	ret = splice_direct_to_actor(in, &sd, direct_splice_actor);
 	if (ret > 0)
 		*ppos = sd.pos;
@@ -0,0 +1,175 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2013
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * file_direct.c
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "squashfs.h"
+#include "page_actor.h"
+
+/*
+ * This file implements reading of separately compressed datablocks
+ * directly into the page cache.  All the pages covered by the datablock
+ * are grabbed up front and handed to the decompressor through a page
+ * actor, which avoids decompressing into the shared "data" cache entry
+ * and memcopying out of it.  The actor maps only the page currently being
+ * filled.  Pages which can't be grabbed (locked by another reader) or are
+ * already up to date are replaced by a scratch page whose contents are
+ * thrown away.
+ */
+
+static int squashfs_read_cache(struct page *target_page, u64 block, int bsize)
+{
+	struct inode *i = target_page->mapping->host;
+	struct squashfs_cache_entry *buffer = squashfs_get_datablock(i->i_sb,
+		block, bsize);
+	int res = buffer->error;
+
+	if (res)
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+	else
+		squashfs_copy_cache(target_page, buffer, buffer->length, 0);
+
+	squashfs_cache_put(buffer);
+	return res;
+}
+
+/*
+ * Unlock and drop the extra pages grabbed for the block, leaving them
+ * !Uptodate to be read again later.  The target page stays locked for
+ * the caller.
+ */
+static void squashfs_release_pages(struct page *target_page,
+	struct page **page, int pages)
+{
+	int i;
+
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL || page[i] == target_page)
+			continue;
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+	}
+}
+
+/* Read separately compressed datablock directly into page cache */
+int squashfs_readpage_block(struct page *target_page, u64 block, int bsize)
+{
+	struct inode *inode = target_page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int file_end = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = target_page->index & ~mask;
+	int end_index = start_index | mask;
+	int i, n, pages, missing, res;
+	struct page **page;
+	struct squashfs_page_actor actor;
+	void *scratch = NULL;
+
+	if (end_index > file_end)
+		end_index = file_end;
+
+	pages = end_index - start_index + 1;
+
+	page = kmalloc(sizeof(void *) * pages, GFP_KERNEL);
+	if (page == NULL)
+		goto fallback;
+
+	/* Try to grab all the pages covered by the Squashfs block */
+	for (missing = 0, i = 0, n = start_index; i < pages; i++, n++) {
+		page[i] = (n == target_page->index) ? target_page :
+			grab_cache_page_nowait(target_page->mapping, n);
+
+		if (page[i] == NULL) {
+			missing++;
+			continue;
+		}
+
+		if (PageUptodate(page[i])) {
+			unlock_page(page[i]);
+			page_cache_release(page[i]);
+			page[i] = NULL;
+			missing++;
+		}
+	}
+
+	if (missing) {
+		scratch = kmalloc(PAGE_CACHE_SIZE, GFP_KERNEL);
+		if (scratch == NULL) {
+			squashfs_release_pages(target_page, page, pages);
+			goto fallback;
+		}
+	}
+
+	/* Decompress directly into the page cache buffers */
+	squashfs_page_actor_init_special(&actor, page, pages, 0, scratch);
+	res = squashfs_read_data(inode->i_sb, block, bsize, NULL, &actor);
+
+	if (res < 0) {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+		squashfs_release_pages(target_page, page, pages);
+		goto out;
+	}
+
+	/*
+	 * Zero any part of the block not filled by the decompressor and
+	 * mark the pages up to date.
+	 */
+	for (i = 0; i < pages; i++) {
+		int avail = clamp_t(int, res - (i << PAGE_CACHE_SHIFT), 0,
+							PAGE_CACHE_SIZE);
+
+		if (page[i] == NULL)
+			continue;
+
+		if (avail < PAGE_CACHE_SIZE)
+			zero_user_segment(page[i], avail, PAGE_CACHE_SIZE);
+		flush_dcache_page(page[i]);
+		SetPageUptodate(page[i]);
+		unlock_page(page[i]);
+		if (page[i] != target_page)
+			page_cache_release(page[i]);
+	}
+
+	res = 0;
+
+out:
+	kfree(scratch);
+	kfree(page);
+	return res;
+
+fallback:
+	kfree(page);
+	return squashfs_read_cache(target_page, block, bsize);
+}
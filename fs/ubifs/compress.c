@@ -24,10 +24,12 @@
 
 /*
  * This file provides a single place to access to compression and
- * decompression.
+ * decompression. Every compressor has a workspace per CPU, so data nodes may
+ * be compressed and decompressed on all CPUs at the same time.
  */
 
 #include <linux/crypto.h>
+#include <linux/percpu.h>
 #include "ubifs.h"
 
 /* Fake description object for the "none" compressor */
@@ -38,11 +40,8 @@ static struct ubifs_compressor none_compr = {
 };
 
 #ifdef CONFIG_UBIFS_FS_LZO
-static DEFINE_MUTEX(lzo_mutex);
-
 static struct ubifs_compressor lzo_compr = {
 	.compr_type = UBIFS_COMPR_LZO,
-	.comp_mutex = &lzo_mutex,
 	.name = "lzo",
 	.capi_name = "lzo",
 };
@@ -54,13 +53,8 @@ static struct ubifs_compressor lzo_compr = {
 #endif
 
 #ifdef CONFIG_UBIFS_FS_ZLIB
-static DEFINE_MUTEX(deflate_mutex);
-static DEFINE_MUTEX(inflate_mutex);
-
 static struct ubifs_compressor zlib_compr = {
 	.compr_type = UBIFS_COMPR_ZLIB,
-	.comp_mutex = &deflate_mutex,
-	.decomp_mutex = &inflate_mutex,
 	.name = "zlib",
 	.capi_name = "deflate",
 };
@@ -72,13 +66,8 @@ static struct ubifs_compressor zlib_compr = {
 #endif
 
 #ifdef CONFIG_UBIFS_FS_XZ
-static DEFINE_MUTEX(xz_enc_mutex);
-static DEFINE_MUTEX(xz_dec_mutex);
-
 static struct ubifs_compressor xz_compr = {
 	.compr_type = UBIFS_COMPR_XZ,
-	.comp_mutex = &xz_enc_mutex,
-	.decomp_mutex = &xz_dec_mutex,
 	.name = "xz",
 	.capi_name = "xz",
 };
@@ -92,6 +81,33 @@ static struct ubifs_compressor xz_compr = {
 /* All UBIFS compressors */
 struct ubifs_compressor *ubifs_compressors[UBIFS_COMPR_TYPES_CNT];
 
+/**
+ * get_compr_ws - get and lock a compressor workspace.
+ * @compr: compressor description object
+ *
+ * This function returns the workspace of @compr which belongs to the current
+ * CPU, so that compression and decompression on different CPUs do not
+ * serialize on each other. The workspace is locked because the caller may be
+ * preempted or migrated while using it.
+ */
+static struct ubifs_compr_ws *get_compr_ws(struct ubifs_compressor *compr)
+{
+	struct ubifs_compr_ws *ws;
+
+	ws = per_cpu_ptr(compr->ws, raw_smp_processor_id());
+	mutex_lock(&ws->mutex);
+	return ws;
+}
+
+/**
+ * put_compr_ws - unlock a compressor workspace.
+ * @ws: workspace returned by 'get_compr_ws()'
+ */
+static void put_compr_ws(struct ubifs_compr_ws *ws)
+{
+	mutex_unlock(&ws->mutex);
+}
+
 /**
  * ubifs_compress - compress data.
  * @in_buf: data to compress
@@ -115,6 +131,7 @@ void ubifs_compress(const void *in_buf, int in_len, void *out_buf, int *out_len,
 {
 	int err;
 	struct ubifs_compressor *compr = ubifs_compressors[*compr_type];
+	struct ubifs_compr_ws *ws;
 
 	if (*compr_type == UBIFS_COMPR_NONE)
 		goto no_compr;
@@ -123,12 +140,10 @@ void ubifs_compress(const void *in_buf, int in_len, void *out_buf, int *out_len,
 	if (in_len < UBIFS_MIN_COMPR_LEN)
 		goto no_compr;
 
-	if (compr->comp_mutex)
-		mutex_lock(compr->comp_mutex);
-	err = crypto_comp_compress(compr->cc, in_buf, in_len, out_buf,
+	ws = get_compr_ws(compr);
+	err = crypto_comp_compress(ws->cc, in_buf, in_len, out_buf,
 				   (unsigned int *)out_len);
-	if (compr->comp_mutex)
-		mutex_unlock(compr->comp_mutex);
+	put_compr_ws(ws);
 	if (unlikely(err)) {
 		ubifs_warn("cannot compress %d bytes, compressor %s, "
 			   "error %d, leave data uncompressed",
@@ -168,6 +183,7 @@ int ubifs_decompress(const void *in_buf, int in_len, void *out_buf,
 {
 	int err;
 	struct ubifs_compressor *compr;
+	struct ubifs_compr_ws *ws;
 
 	if (unlikely(compr_type < 0 || compr_type >= UBIFS_COMPR_TYPES_CNT)) {
 		ubifs_err("invalid compression type %d", compr_type);
@@ -187,12 +203,10 @@ int ubifs_decompress(const void *in_buf, int in_len, void *out_buf,
 		return 0;
 	}
 
-	if (compr->decomp_mutex)
-		mutex_lock(compr->decomp_mutex);
-	err = crypto_comp_decompress(compr->cc, in_buf, in_len, out_buf,
+	ws = get_compr_ws(compr);
+	err = crypto_comp_decompress(ws->cc, in_buf, in_len, out_buf,
 				     (unsigned int *)out_len);
-	if (compr->decomp_mutex)
-		mutex_unlock(compr->decomp_mutex);
+	put_compr_ws(ws);
 	if (err)
 		ubifs_err("cannot decompress %d bytes, compressor %s, "
 			  "error %d", in_len, compr->name, err);
@@ -200,21 +214,57 @@ int ubifs_decompress(const void *in_buf, int in_len, void *out_buf,
 	return err;
 }
 
+/**
+ * compr_exit - de-initialize a compressor.
+ * @compr: compressor description object
+ */
+static void compr_exit(struct ubifs_compressor *compr)
+{
+	int cpu;
+	struct ubifs_compr_ws *ws;
+
+	if (!compr->ws)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		ws = per_cpu_ptr(compr->ws, cpu);
+		if (ws->cc)
+			crypto_free_comp(ws->cc);
+	}
+	free_percpu(compr->ws);
+	compr->ws = NULL;
+}
+
 /**
  * compr_init - initialize a compressor.
  * @compr: compressor description object
  *
- * This function initializes the requested compressor and returns zero in case
- * of success or a negative error code in case of failure.
+ * This function initializes the requested compressor and allocates a
+ * workspace for it on each possible CPU. Returns zero in case of success or
+ * a negative error code in case of failure.
  */
 static int __init compr_init(struct ubifs_compressor *compr)
 {
+	int cpu, err;
+	struct ubifs_compr_ws *ws;
+
 	if (compr->capi_name) {
-		compr->cc = crypto_alloc_comp(compr->capi_name, 0, 0);
-		if (IS_ERR(compr->cc)) {
-			ubifs_err("cannot initialize compressor %s, error %ld",
-				  compr->name, PTR_ERR(compr->cc));
-			return PTR_ERR(compr->cc);
+		compr->ws = alloc_percpu(struct ubifs_compr_ws);
+		if (!compr->ws)
+			return -ENOMEM;
+
+		for_each_possible_cpu(cpu) {
+			ws = per_cpu_ptr(compr->ws, cpu);
+			mutex_init(&ws->mutex);
+			ws->cc = crypto_alloc_comp(compr->capi_name, 0, 0);
+			if (IS_ERR(ws->cc)) {
+				err = PTR_ERR(ws->cc);
+				ubifs_err("cannot initialize compressor %s, "
+					  "error %d", compr->name, err);
+				ws->cc = NULL;
+				compr_exit(compr);
+				return err;
+			}
 		}
 	}
 
@@ -222,17 +272,6 @@ static int __init compr_init(struct ubifs_compressor *compr)
 	return 0;
 }
 
-/**
- * compr_exit - de-initialize a compressor.
- * @compr: compressor description object
- */
-static void compr_exit(struct ubifs_compressor *compr)
-{
-	if (compr->capi_name)
-		crypto_free_comp(compr->cc);
-	return;
-}
-
 /**
  * ubifs_compressors_init - initialize UBIFS compressors.
  *
@@ -893,6 +893,41 @@ static int ubifs_readpage(struct file *file, struct page *page)
 	return 0;
 }
 
+/**
+ * finish_writepage - finish write-back of a page.
+ * @page: page which was written back
+ * @err: write-back result
+ *
+ * This function releases the budget of @page, unmaps and unlocks it and ends
+ * its write-back.
+ */
+static void finish_writepage(struct page *page, int err)
+{
+	struct inode *inode = page->mapping->host;
+	struct ubifs_info *c = inode->i_sb->s_fs_info;
+
+	if (err) {
+		SetPageError(page);
+		ubifs_err("cannot write page %lu of inode %lu, error %d",
+			  page->index, inode->i_ino, err);
+		ubifs_ro_mode(c, err);
+	}
+
+	ubifs_assert(PagePrivate(page));
+	if (PageChecked(page))
+		release_new_page_budget(c);
+	else
+		release_existing_page_budget(c);
+
+	atomic_long_dec(&c->dirty_pg_cnt);
+	ClearPagePrivate(page);
+	ClearPageChecked(page);
+
+	kunmap(page);
+	unlock_page(page);
+	end_page_writeback(page);
+}
+
 static int do_writepage(struct page *page, int len)
 {
 	int err = 0, i, blen;
@@ -926,29 +961,210 @@ static int do_writepage(struct page *page, int len)
 		addr += blen;
 		len -= blen;
 	}
-	if (err) {
-		SetPageError(page);
-		ubifs_err("cannot write page %lu of inode %lu, error %d",
-			  page->index, inode->i_ino, err);
-		ubifs_ro_mode(c, err);
+
+	finish_writepage(page, err);
+	return err;
+}
+
+/*
+ * Parallel write-back compression.
+ *
+ * When write-back goes through 'ubifs_writepages()', pages are not written to
+ * the journal one by one. They are collected in a batch of up to
+ * %UBIFS_WB_BATCH data nodes instead, then all the nodes of the batch are
+ * compressed at once by the write-back task and by helper work items queued
+ * on the other online CPUs, and only then are they added to the journal in
+ * page order. Compression is the expensive part of writing a data node, so
+ * this lets write-back of a single file use more than one CPU.
+ */
+
+/* Maximum number of data nodes in a write-back batch */
+#define UBIFS_WB_BATCH 16
+/* Maximum number of CPUs helping the write-back task to compress a batch */
+#define UBIFS_WB_HELPERS 3
+
+/**
+ * struct wb_node - a data node of a write-back batch.
+ * @key: node key
+ * @buf: data to put to the node
+ * @len: data length
+ * @data: prepared data node (%NULL if it could not be allocated)
+ * @dlen: length of the prepared data node
+ */
+struct wb_node {
+	union ubifs_key key;
+	const void *buf;
+	int len;
+	struct ubifs_data_node *data;
+	int dlen;
+};
+
+struct wb_batch;
+
+/**
+ * struct wb_helper - a work item compressing data nodes of a batch.
+ * @work: the work item
+ * @b: the batch to help with
+ */
+struct wb_helper {
+	struct work_struct work;
+	struct wb_batch *b;
+};
+
+/**
+ * struct wb_batch - a batch of pages under write-back.
+ * @c: UBIFS file-system description object
+ * @inode: inode the pages belong to
+ * @page_cnt: count of pages in the batch
+ * @cnt: count of data nodes in the batch
+ * @next: index of the next data node to compress
+ * @done_index: page index following the last page added to the batch
+ * @pages: locked pages under write-back
+ * @page_nodes: count of data nodes of each page
+ * @nodes: data nodes of all pages
+ * @helpers: compression helpers
+ */
+struct wb_batch {
+	struct ubifs_info *c;
+	struct inode *inode;
+	int page_cnt;
+	int cnt;
+	atomic_t next;
+	pgoff_t done_index;
+	struct page *pages[UBIFS_WB_BATCH];
+	int page_nodes[UBIFS_WB_BATCH];
+	struct wb_node nodes[UBIFS_WB_BATCH];
+	struct wb_helper helpers[UBIFS_WB_HELPERS];
+};
+
+/**
+ * wb_compress_nodes - compress data nodes of a batch.
+ * @b: the batch
+ *
+ * This function takes not yet compressed data nodes of batch @b one by one
+ * and prepares them. It runs concurrently on several CPUs. Nodes which cannot
+ * be allocated are left to 'ubifs_jnl_write_data()', which falls back to the
+ * write reserve buffer.
+ */
+static void wb_compress_nodes(struct wb_batch *b)
+{
+	int i;
+	struct wb_node *n;
+
+	while ((i = atomic_inc_return(&b->next) - 1) < b->cnt) {
+		n = &b->nodes[i];
+		n->data = kmalloc(COMPRESSED_DATA_NODE_BUF_SZ,
+				  GFP_NOFS | __GFP_NOWARN);
+		if (!n->data)
+			continue;
+		n->dlen = ubifs_prepare_data_node(b->c, b->inode, &n->key,
+						  n->buf, n->len, n->data);
 	}
+}
 
-	ubifs_assert(PagePrivate(page));
-	if (PageChecked(page))
-		release_new_page_budget(c);
-	else
-		release_existing_page_budget(c);
+static void wb_compress_work(struct work_struct *work)
+{
+	struct wb_helper *h = container_of(work, struct wb_helper, work);
 
-	atomic_long_dec(&c->dirty_pg_cnt);
-	ClearPagePrivate(page);
-	ClearPageChecked(page);
+	wb_compress_nodes(h->b);
+}
 
-	kunmap(page);
-	unlock_page(page);
-	end_page_writeback(page);
+/**
+ * wb_batch_flush - write back all pages of a batch.
+ * @b: the batch
+ *
+ * This function compresses the data nodes of batch @b in parallel, writes them
+ * to the journal and finishes write-back of the pages. Returns zero in case of
+ * success and a negative error code in case of failure.
+ */
+static int wb_batch_flush(struct wb_batch *b)
+{
+	int i, j, cpu, this_cpu, helpers = 0, err = 0, page_err;
+	struct wb_node *n = b->nodes;
+
+	if (!b->cnt)
+		return 0;
+
+	atomic_set(&b->next, 0);
+	this_cpu = get_cpu();
+	for_each_online_cpu(cpu) {
+		if (helpers == UBIFS_WB_HELPERS || helpers + 1 >= b->cnt)
+			break;
+		if (cpu == this_cpu)
+			continue;
+		queue_work_on(cpu, ubifs_wb_wq, &b->helpers[helpers++].work);
+	}
+	put_cpu();
+
+	wb_compress_nodes(b);
+	for (i = 0; i < helpers; i++)
+		flush_work(&b->helpers[i].work);
+
+	for (i = 0; i < b->page_cnt; i++) {
+		page_err = err;
+		for (j = 0; j < b->page_nodes[i]; j++, n++) {
+			if (!page_err && n->data)
+				page_err = ubifs_jnl_write_data_node(b->c,
+						&n->key, n->data, n->dlen);
+			else if (!page_err)
+				page_err = ubifs_jnl_write_data(b->c, b->inode,
+						&n->key, n->buf, n->len);
+			kfree(n->data);
+		}
+		finish_writepage(b->pages[i], page_err);
+		err = page_err;
+	}
+
+	b->page_cnt = b->cnt = 0;
 	return err;
 }
 
+/**
+ * wb_batch_add - add a page to a write-back batch.
+ * @b: the batch
+ * @page: locked page to write back
+ * @len: amount of page data to write back
+ *
+ * This function starts write-back of @page and adds its data nodes to batch
+ * @b. The batch is flushed once it cannot take another page. Returns zero in
+ * case of success and a negative error code in case of failure.
+ */
+static int wb_batch_add(struct wb_batch *b, struct page *page, int len)
+{
+	int i = 0, blen;
+	unsigned int block;
+	void *addr;
+	struct wb_node *n = &b->nodes[b->cnt];
+
+	/* Update radix tree tags */
+	set_page_writeback(page);
+
+	addr = kmap(page);
+	block = page->index << UBIFS_BLOCKS_PER_PAGE_SHIFT;
+	while (len) {
+		blen = min_t(int, len, UBIFS_BLOCK_SIZE);
+		data_key_init(b->c, &n->key, b->inode->i_ino, block);
+		n->buf = addr;
+		n->len = blen;
+		n->data = NULL;
+		n += 1;
+		if (++i >= UBIFS_BLOCKS_PER_PAGE)
+			break;
+		block += 1;
+		addr += blen;
+		len -= blen;
+	}
+
+	b->done_index = page->index + 1;
+	b->pages[b->page_cnt] = page;
+	b->page_nodes[b->page_cnt++] = i;
+	b->cnt += i;
+
+	if (b->cnt + UBIFS_BLOCKS_PER_PAGE > UBIFS_WB_BATCH)
+		return wb_batch_flush(b);
+	return 0;
+}
+
 /*
  * When writing-back dirty inodes, VFS first writes-back pages belonging to the
  * inode, then the inode itself. For UBIFS this may cause a problem. Consider a
@@ -994,8 +1210,12 @@ static int do_writepage(struct page *page, int len)
  * A: If we are in the middle of 'do_writepage()', truncation would be locked
  * on the page lock and it would not write the truncated inode node to the
  * journal before we have finished.
+ *
+ * When called from 'ubifs_writepages()', @data is the write-back batch the
+ * page has to be added to instead of being written out right away.
  */
-static int ubifs_writepage(struct page *page, struct writeback_control *wbc)
+static int __ubifs_writepage(struct page *page, struct writeback_control *wbc,
+			     void *data)
 {
 	struct inode *inode = page->mapping->host;
 	struct ubifs_inode *ui = ubifs_inode(inode);
@@ -1033,7 +1253,8 @@ static int ubifs_writepage(struct page *page, struct writeback_control *wbc)
 			 * with this.
 			 */
 		}
-		return do_writepage(page, PAGE_CACHE_SIZE);
+		len = PAGE_CACHE_SIZE;
+		goto out_write;
 	}
 
 	/*
@@ -1054,6 +1275,9 @@ static int ubifs_writepage(struct page *page, struct writeback_control *wbc)
 			goto out_unlock;
 	}
 
+out_write:
+	if (data)
+		return wb_batch_add(data, page, len);
 	return do_writepage(page, len);
 
 out_unlock:
@@ -1061,6 +1285,77 @@ out_unlock:
 	return err;
 }
 
+static int ubifs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	return __ubifs_writepage(page, wbc, NULL);
+}
+
+static int ubifs_writepages(struct address_space *mapping,
+			    struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct ubifs_inode *ui = ubifs_inode(inode);
+	struct wb_batch *b;
+	pgoff_t index = 0;
+	int i, err, err1, cycled = 1, range_cyclic = wbc->range_cyclic;
+
+	/* Batching only pays off if there is compression to parallelize */
+	if (num_online_cpus() < 2 || !(ui->flags & UBIFS_COMPR_FL) ||
+	    ui->compr_type == UBIFS_COMPR_NONE)
+		return generic_writepages(mapping, wbc);
+
+	b = kmalloc(sizeof(struct wb_batch), GFP_NOFS | __GFP_NOWARN);
+	if (!b)
+		return generic_writepages(mapping, wbc);
+
+	b->c = inode->i_sb->s_fs_info;
+	b->inode = inode;
+	b->page_cnt = b->cnt = 0;
+	for (i = 0; i < UBIFS_WB_HELPERS; i++) {
+		INIT_WORK(&b->helpers[i].work, wb_compress_work);
+		b->helpers[i].b = b;
+	}
+
+	/*
+	 * Batched pages stay locked until the batch is flushed, so pages have
+	 * to be locked in ascending index order, otherwise two batches of the
+	 * same file could deadlock on each other's pages. Do the range_cyclic
+	 * wrap to the start of the file here, with the batch flushed, instead
+	 * of letting 'write_cache_pages()' do it.
+	 */
+	if (range_cyclic) {
+		index = mapping->writeback_index;
+		if (index)
+			cycled = 0;
+		wbc->range_start = (loff_t)index << PAGE_CACHE_SHIFT;
+		wbc->range_end = LLONG_MAX;
+		wbc->range_cyclic = 0;
+	}
+	b->done_index = index;
+
+retry:
+	err = write_cache_pages(mapping, wbc, __ubifs_writepage, b);
+	err1 = wb_batch_flush(b);
+	if (!err)
+		err = err1;
+
+	if (!err && !cycled &&
+	    (wbc->nr_to_write > 0 || wbc->sync_mode != WB_SYNC_NONE)) {
+		cycled = 1;
+		wbc->range_start = 0;
+		wbc->range_end = ((loff_t)index << PAGE_CACHE_SHIFT) - 1;
+		goto retry;
+	}
+
+	if (range_cyclic) {
+		wbc->range_cyclic = 1;
+		mapping->writeback_index = b->done_index;
+	}
+
+	kfree(b);
+	return err;
+}
+
 /**
  * do_attr_changes - change inode attributes.
  * @inode: inode to change attributes for
@@ -1553,6 +1848,7 @@ static int ubifs_file_mmap(struct file *file, struct vm_area_struct *vma)
 const struct address_space_operations ubifs_file_address_operations = {
 	.readpage       = ubifs_readpage,
 	.writepage      = ubifs_writepage,
+	.writepages     = ubifs_writepages,
 	.write_begin    = ubifs_write_begin,
 	.write_end      = ubifs_write_end,
 	.invalidatepage = ubifs_invalidatepage,
@@ -47,6 +47,9 @@
 /* Slab cache for UBIFS inodes */
 struct kmem_cache *ubifs_inode_slab;
 
+/* Workqueue for the write-back compression helpers */
+struct workqueue_struct *ubifs_wb_wq;
+
 /* UBIFS TNC shrinker description */
 static struct shrinker ubifs_shrinker_info = {
 	.shrink = ubifs_shrinker,
@@ -2270,9 +2273,17 @@ static int __init ubifs_init(void)
 
 	register_shrinker(&ubifs_shrinker_info);
 
+	/* the helpers run on behalf of write-back, which may be reclaim */
+	ubifs_wb_wq = alloc_workqueue("ubifs_wb",
+				      WQ_MEM_RECLAIM | WQ_CPU_INTENSIVE, 0);
+	if (!ubifs_wb_wq) {
+		err = -ENOMEM;
+		goto out_shrinker;
+	}
+
 	err = ubifs_compressors_init();
 	if (err)
-		goto out_shrinker;
+		goto out_wq;
 
 	err = dbg_debugfs_init();
 	if (err)
@@ -2289,6 +2300,8 @@ out_dbg:
 	dbg_debugfs_exit();
 out_compr:
 	ubifs_compressors_exit();
+out_wq:
+	destroy_workqueue(ubifs_wb_wq);
 out_shrinker:
 	unregister_shrinker(&ubifs_shrinker_info);
 	kmem_cache_destroy(ubifs_inode_slab);
@@ -2304,6 +2317,7 @@ static void __exit ubifs_exit(void)
 
 	dbg_debugfs_exit();
 	ubifs_compressors_exit();
+	destroy_workqueue(ubifs_wb_wq);
 	unregister_shrinker(&ubifs_shrinker_info);
 	kmem_cache_destroy(ubifs_inode_slab);
 	unregister_filesystem(&ubifs_fs_type);
@@ -1548,6 +1548,8 @@ struct packet_type {
 
 extern int register_netdevice_notifier(struct notifier_block *nb);
 extern int unregister_netdevice_notifier(struct notifier_block *nb);
+extern int register_net_rx_burst_notifier(struct notifier_block *nb);
+extern int unregister_net_rx_burst_notifier(struct notifier_block *nb);
 extern int call_netdevice_notifiers(unsigned long val, struct net_device *dev);
 
 
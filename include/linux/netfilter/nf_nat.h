@@ -22,6 +22,15 @@ extern unsigned int range_udp_tcp_port_status;
 extern unsigned int sysctl_snatp2p_range_port_full_control;
 #endif
 
+#ifdef __KERNEL__
+/* sysctl_nat_filtering_behavior: who may come in through a NAT mapping */
+#define NF_NAT_FILTERING_SECURED		0	/* hosts the mapping went to */
+#define NF_NAT_FILTERING_OPEN			1	/* anyone */
+#define NF_NAT_FILTERING_PORT_RESTRICTED	2	/* host and port it went to */
+
+extern unsigned int sysctl_nat_filtering_behavior;
+#endif
+
 struct nf_nat_ipv4_range {
 	unsigned int			flags;
 	__be32				min_ip;
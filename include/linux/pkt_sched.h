@@ -435,6 +435,9 @@ enum
 	TCA_SFQ_HASH_CTREPLDST,
 	TCA_SFQ_HASH_CTREPLSRC,
 	TCA_SFQ_HASH_CTNATCHG,
+	/* already computed per packet */
+	TCA_SFQ_HASH_CTID,	/* conntrack entry */
+	TCA_SFQ_HASH_RXHASH,	/* skb->rxhash */
 };
 
 struct tc_esfq_qopt
@@ -447,6 +450,24 @@ struct tc_esfq_qopt
 	unsigned	hash_kind;	/* Hash function to use for flow identification */
 };
 
+struct tc_esfq_qopt_v1 {
+	struct tc_esfq_qopt v0;
+	__u32		flags;
+	__u32		target;		/* CoDel target delay (us) */
+	__u32		interval;	/* CoDel interval (us) */
+};
+
+#define TC_ESFQ_CODEL	1	/* CoDel on each flow */
+#define TC_ESFQ_ECN	2	/* CoDel marks ECT packets instead of dropping */
+
+struct tc_esfq_xstats {
+	__u32		flows;		/* flows allocated */
+	__u32		new_flow_count;	/* flows that became active */
+	__u32		drop_overlimit;	/* drops because the queue was full */
+	__u32		codel_drops;	/* drops by CoDel */
+	__u32		ecn_mark;	/* packets marked by CoDel */
+};
+
 /* RED section */
 
 enum {
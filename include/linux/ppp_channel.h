@@ -47,6 +47,10 @@ struct ppp_channel_ops {
 	void (*hold)(struct ppp_channel *);
 	/* Release hold on the channel */
 	void (*release)(struct ppp_channel *);
+	/* Send a data frame without the generic PPP locks.  Only offered
+	   by channels that never refuse a frame; the skb is always consumed
+	   and may be a GSO frame that the channel must segment itself. */
+	void (*fast_xmit)(struct ppp_channel *, struct sk_buff *);
 };
 
 struct ppp_channel {
@@ -100,6 +104,11 @@ extern void ppp_output_wakeup(struct ppp_channel *);
    The packet should have just the 2-byte PPP protocol header. */
 extern void ppp_input(struct ppp_channel *, struct sk_buff *);
 
+/* Called by the channel, under rcu_read_lock, to hand a received PPP
+   data frame straight to the network stack when the unit allows it.
+   Returns false if the frame must go through ppp_input() instead. */
+extern bool ppp_fast_input(struct ppp_channel *, struct sk_buff *);
+
 /* Called by the channel when an input error occurs, indicating
    that we may have missed a packet. */
 extern void ppp_input_error(struct ppp_channel *, int code);
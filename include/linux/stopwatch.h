@@ -19,10 +19,21 @@
 #include <linux/seq_file.h>
 #include <linux/smp.h>
 #include <linux/time.h>
+#include <linux/sched.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/bottom_half.h>
 
 #define STOPWATCH_MICRO        	0x1
 #define STOPWATCH_NANO 		0x2
 
+/*
+ * Samples are binned by log2 of their duration in ns: bucket n holds
+ * samples in [2^(n-1), 2^n) and the last bucket everything from ~1s up.
+ */
+#define STOPWATCH_HIST_BUCKETS	32
+
 /*
  * Create a false set of defines and functions enabling users
  * of the stopwatch to leave the code in place.
@@ -36,9 +47,15 @@ struct stopwatch_instance;
 #define INIT_STOPWATCH_ARRAY(x,y)
 #define STOPWATCH_START(x)
 #define STOPWATCH_STOP(x)
+#define STOPWATCH_TIMER(t)
+#define STOPWATCH_TIMER_START(t)
+#define STOPWATCH_TIMER_STOP(x,t)
 #define STOPWATCH_INSTANCE_THIS_CPU(x)
 #define STOPWATCH_INSTANCE_CPU(x,y)
+#define REGISTER_STOPWATCH(x) do { } while (0)
+#define UNREGISTER_STOPWATCH(x) do { } while (0)
 #define stopwatch_register(name, count, show) (0)
+#define stopwatch_register_percpu(name, pcpu) (0)
 #define stopwatch_unregister(name) (0)
 #define stopwatch_show(instance, p, prec) (0)
 
@@ -54,10 +71,9 @@ struct stopwatch_instance;
 	do { \
 		int cpu; \
 		struct stopwatch_instance *si; \
-		for_each_cpu(cpu, cpu_online_mask) { \
+		for_each_possible_cpu(cpu) { \
 			si = &per_cpu(__stop_watch_##x, cpu); \
 			memset(si, 0, sizeof(struct stopwatch_instance)); \
-			spin_lock_init(&si->lock); \
 		} \
 	} while(0);
 
@@ -65,67 +81,140 @@ struct stopwatch_instance;
 	do { \
 		int cpu, i; \
 		struct stopwatch_instance *si; \
-		for_each_cpu(cpu, cpu_online_mask) { \
+		for_each_possible_cpu(cpu) { \
 			for (i = 0; i < y; i++) { \
 				si = &per_cpu(__stop_watch_##x[i], cpu); \
 				memset(si, 0, sizeof(struct stopwatch_instance)); \
-				spin_lock_init(&si->lock); \
 			} \
 		} \
 	} while(0);
 
+/*
+ * START/STOP keep the start time in the per-cpu instance, so they must
+ * not nest on the same watch.  Paths that can recurse (receive through
+ * a bridge, tunnels) use the TIMER variants, which keep the start time
+ * in a local declared with STOPWATCH_TIMER() after the other locals.
+ */
 #define STOPWATCH_START(x) \
 	do { \
-		struct stopwatch_instance *si; \
-		si = &__get_cpu_var(__stop_watch_##x); \
-		getnstimeofday((struct timespec *)&si->last); \
+		__get_cpu_var(__stop_watch_##x).last = stopwatch_now(); \
 	} while(0);
 
 #define STOPWATCH_STOP(x) \
 	do { \
-		unsigned long flags; \
-		struct timespec now; \
-		unsigned long long delta; \
 		struct stopwatch_instance *si; \
 		\
 		si = &__get_cpu_var(__stop_watch_##x); \
-		getnstimeofday(&now); \
-		delta = timespec_to_ns(&now) - \
-				timespec_to_ns((struct timespec *)&si->last); \
-		\
-		spin_lock_irqsave(&si->lock, flags); \
-		if (unlikely(si->count == 0)) { \
-			si->min = delta; \
-			si->max = delta; \
-		} \
-		else { \
-			if (unlikely(si->min > delta))  \
-				si->min = delta; \
-			else if (unlikely(si->max < delta)) \
-				si->max = delta; \
-		} \
-		\
-		si->avg += delta; \
-		si->count++; \
-		spin_unlock_irqrestore(&si->lock, flags); \
+		stopwatch_account(si, stopwatch_now() - si->last); \
 	} while(0);
 
+#define STOPWATCH_TIMER(t)	u64 t
+
+#define STOPWATCH_TIMER_START(t) \
+	do { \
+		t = stopwatch_now(); \
+	} while (0)
+
+/* may be used from process context, keep softirq updates off this cpu */
+#define STOPWATCH_TIMER_STOP(x, t) \
+	do { \
+		u64 __sw_delta = stopwatch_now() - (t); \
+		\
+		local_bh_disable(); \
+		stopwatch_account(&__get_cpu_var(__stop_watch_##x), \
+				  __sw_delta); \
+		local_bh_enable(); \
+	} while (0)
+
 #define STOPWATCH_INSTANCE_THIS_CPU(x) (__get_cpu_var(__stop_watch_##x))
 #define STOPWATCH_INSTANCE_CPU(x,y) (per_cpu(__stop_watch_##x, y))
 
+/*
+ * Register a DEFINE_STOPWATCH() watch as /proc/stopwatch/<x>, shown
+ * with per-cpu and total percentiles.
+ */
+#define REGISTER_STOPWATCH(x) \
+		stopwatch_register_percpu(#x, &__stop_watch_##x)
+#define UNREGISTER_STOPWATCH(x) \
+		stopwatch_unregister(#x)
+
+/*
+ * Each instance is only ever updated by its own cpu, so no lock is
+ * taken on the fast path; syncp only lets readers on other cpus take a
+ * consistent snapshot of the 64 bit fields.  A watch must not be
+ * updated from two contexts that can preempt each other on one cpu.
+ */
 struct stopwatch_instance {
 	unsigned long long min;
-	unsigned long long avg;
+	unsigned long long sum;
 	unsigned long long max;
 	unsigned long count;
-	struct timespec last;
-	spinlock_t lock;
+	unsigned int gen;
+	u64 last;
+	u32 hist[STOPWATCH_HIST_BUCKETS];
+	struct u64_stats_sync syncp;
 };
 
+/*
+ * Bumped by a write to /proc/stopwatch/reset.  Instances carrying an
+ * older generation are treated as empty and restart on their next
+ * sample, so a reset never has to touch another cpu's counters.
+ */
+extern unsigned int stopwatch_gen;
+
+/*
+ * stopwatch_now()
+ *	Read the time in ns.
+ *
+ * sched_clock() reads the free running timer counter directly (the
+ * ARM get_cycles() is a stub), avoiding the xtime seqlock and timespec
+ * arithmetic of getnstimeofday().
+ */
+static inline u64 stopwatch_now(void)
+{
+	return sched_clock();
+}
+
+/*
+ * stopwatch_account()
+ *	Add one sample of delta ns to this cpu's instance.
+ */
+static inline void stopwatch_account(struct stopwatch_instance *si,
+					u64 delta)
+{
+	unsigned int gen = ACCESS_ONCE(stopwatch_gen);
+	int bucket = fls64(delta);
+
+	if (unlikely(bucket >= STOPWATCH_HIST_BUCKETS))
+		bucket = STOPWATCH_HIST_BUCKETS - 1;
+
+	u64_stats_update_begin(&si->syncp);
+	if (unlikely(si->count == 0 || si->gen != gen)) {
+		memset(si->hist, 0, sizeof(si->hist));
+		si->gen = gen;
+		si->count = 0;
+		si->sum = 0;
+		si->min = delta;
+		si->max = delta;
+	} else {
+		if (unlikely(si->min > delta))
+			si->min = delta;
+		if (unlikely(si->max < delta))
+			si->max = delta;
+	}
+
+	si->sum += delta;
+	si->count++;
+	si->hist[bucket]++;
+	u64_stats_update_end(&si->syncp);
+}
+
 typedef int (*stopwatch_show_t)(struct seq_file *f, void *v);
 
 unsigned int stopwatch_register(const char *name, int count,
 					stopwatch_show_t show);
+unsigned int stopwatch_register_percpu(const char *name,
+			struct stopwatch_instance __percpu *pcpu);
 void stopwatch_unregister(const char *name);
 void stopwatch_show(struct stopwatch_instance *si, struct seq_file *p,
 			int precision);
@@ -116,6 +116,7 @@ struct nf_conn {
 	struct nf_conntrack ct_general;
 
 	spinlock_t lock;
+	u16 cpu;	/* owner of the unconfirmed/dying list we are on */
 
 	/* XXX should I move this to the tail ? - Y.K */
 	/* These are my tuples; original and reply */
@@ -124,6 +125,11 @@ struct nf_conn {
 	/* Have we seen traffic both ways yet? (bitset) */
 	unsigned long status;
 
+	/* On the eviction list of lru_class while not assured */
+	struct list_head lru;
+	unsigned long lru_stamp;	/* jiffies at confirmation */
+	u8 lru_class;
+
 #if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
 #if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
 	/* Used for single UDP conntrack for lan-wan sessions */
@@ -144,8 +150,9 @@ struct nf_conn {
 	/* If we were expected by an expectation, this will be it */
 	struct nf_conn *master;
 
-	/* Timer function; drops refcnt when it goes off. */
-	struct timer_list timeout;
+	/* Expiry in nfct_time_stamp units; relative until confirmed.  The
+	 * conntrack GC and lookups reap it once passed. */
+	u32 timeout;
 
 #if defined(CONFIG_NF_CONNTRACK_MARK)
 	u_int32_t mark;
@@ -161,22 +168,6 @@ struct nf_conn {
 	struct net *ct_net;
 #endif
 
-#if defined(CONFIG_NETFILTER_XT_MATCH_LAYER7) || \
-    defined(CONFIG_NETFILTER_XT_MATCH_LAYER7_MODULE)
-	struct {
-		/*
-		 * e.g. "http". NULL before decision. "unknown" after decision
-		 * if no match.
-		 */
-		char *app_proto;
-		/*
-		 * application layer data so far. NULL after match decision.
-		 */
-		char *app_data;
-		unsigned int app_data_len;
-	} layer7;
-#endif
-
 	/* Storage reserved for other modules, must be the last member */
 	union nf_conntrack_proto proto;
 };
@@ -315,6 +306,8 @@ static inline bool nf_ct_kill(struct nf_conn *ct)
 	return __nf_ct_kill_acct(ct, 0, NULL, 0);
 }
 
+extern bool nf_ct_delete(struct nf_conn *ct, u32 pid, int report);
+
 /* These are for NAT.  Icky. */
 extern s16 (*nf_ct_nat_offset)(const struct nf_conn *ct,
 			       enum ip_conntrack_dir dir,
@@ -359,6 +352,28 @@ static inline int nf_ct_is_untracked(const struct nf_conn *ct)
 	return test_bit(IPS_UNTRACKED_BIT, &ct->status);
 }
 
+#define nfct_time_stamp ((u32)(jiffies))
+
+/* jiffies until timeout */
+static inline unsigned long nf_ct_expires(const struct nf_conn *ct)
+{
+	s32 timeout = ACCESS_ONCE(ct->timeout) - nfct_time_stamp;
+
+	return timeout > 0 ? timeout : 0;
+}
+
+static inline bool nf_ct_is_expired(const struct nf_conn *ct)
+{
+	return (s32)(ACCESS_ONCE(ct->timeout) - nfct_time_stamp) <= 0;
+}
+
+/* use after obtaining a reference count */
+static inline bool nf_ct_should_gc(struct nf_conn *ct)
+{
+	return nf_ct_is_expired(ct) && nf_ct_is_confirmed(ct) &&
+	       !nf_ct_is_dying(ct);
+}
+
 /* Packet is received from loopback */
 static inline bool nf_is_loopback_packet(const struct sk_buff *skb)
 {
@@ -373,6 +388,26 @@ extern unsigned int nf_conntrack_max;
 extern unsigned int nf_conntrack_hash_rnd;
 void init_nf_conntrack_hash_rnd(void);
 
+/*
+ * nf_conntrack_get_ht()
+ *	Reads a hash table and its size that belong together.  The table
+ *	stays valid until the end of the current RCU read side section.
+ */
+static inline void nf_conntrack_get_ht(struct net *net,
+				       struct hlist_nulls_head **hash,
+				       unsigned int *hsize)
+{
+	unsigned int sequence;
+
+	do {
+		sequence = read_seqcount_begin(&net->ct.generation);
+		*hash = net->ct.hash;
+		*hsize = net->ct.htable_size;
+	} while (read_seqcount_retry(&net->ct.generation, sequence));
+}
+
+extern int nf_conntrack_hash_resize(unsigned int hashsize);
+
 #if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
 #if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
 extern struct hlist_nulls_head *single_udp_ct_hash;
@@ -385,6 +420,10 @@ extern struct hlist_nulls_head *conenat_ct_hash;
 extern u_int32_t conenat_hash_conntrack(const struct nf_conntrack_tuple *tuple);
 extern void nf_conenat_conntrack_hash_mangement(void);
 #endif
+
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE) || defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+extern int nf_conntrack_aux_rehash(unsigned int nat_filtering_behavior);
+#endif
 #endif
 
 #define NF_CT_STAT_INC(net, count)	\
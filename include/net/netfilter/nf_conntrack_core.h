@@ -54,6 +54,9 @@ nf_conntrack_find_get(struct net *net, u16 zone,
 
 extern int __nf_conntrack_confirm(struct sk_buff *skb);
 
+/* Conntrack limit of an eviction class, 0 if none */
+extern unsigned int nf_ct_lru_quota(unsigned int class);
+
 /* Confirm a connection: returns NF_DROP if packet must be dropped. */
 static inline int nf_conntrack_confirm(struct sk_buff *skb)
 {
@@ -74,7 +77,13 @@ print_tuple(struct seq_file *s, const struct nf_conntrack_tuple *tuple,
             const struct nf_conntrack_l3proto *l3proto,
             const struct nf_conntrack_l4proto *proto);
 
+/* Guards expectations and helper assignment, not the conntrack hash */
 extern spinlock_t nf_conntrack_lock ;
 extern spinlock_t *nf_conntrack_lock_for_conenat;
 
+/* Hash bucket locks, bucket n is guarded by nf_conntrack_locks[n % CONNTRACK_LOCKS] */
+#define CONNTRACK_LOCKS 1024
+extern spinlock_t nf_conntrack_locks[CONNTRACK_LOCKS];
+extern void nf_conntrack_lock_stripe(spinlock_t *lock);
+
 #endif /* _NF_CONNTRACK_CORE_H */
@@ -28,6 +28,9 @@ enum nf_ct_ext_id {
 #endif
 #ifdef CONFIG_NF_CONNTRACK_VLANTAG_EXT
 	NF_CT_EXT_VLANTAG,
+#endif
+#ifdef CONFIG_NF_CONNTRACK_LAYER7_EXT
+	NF_CT_EXT_LAYER7,
 #endif
 	NF_CT_EXT_NUM,
 };
@@ -41,6 +44,7 @@ enum nf_ct_ext_id {
 #define NF_CT_EXT_TIMEOUT_TYPE struct nf_conn_timeout
 #define NF_CT_EXT_DSCPREMARK_TYPE struct nf_ct_dscpremark_ext
 #define NF_CT_EXT_VLANTAG_TYPE struct nf_ct_vlantag_ext
+#define NF_CT_EXT_LAYER7_TYPE struct nf_conn_layer7
 
 /* Extensions: optional stuff which isn't permanently in struct. */
 struct nf_ct_ext {
@@ -0,0 +1,90 @@
+/* layer7 (l7-filter) classification state conntrack extension. */
+
+#ifndef _NF_CONNTRACK_LAYER7_H
+#define _NF_CONNTRACK_LAYER7_H
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_extend.h>
+
+/* Pattern ids the layer7 DFAs can report, and number of DFAs */
+#define NF_CT_LAYER7_MAX_PATTERNS	128
+#define NF_CT_LAYER7_MAX_GROUPS		8
+
+/* Longer protocol names are truncated */
+#define NF_CT_LAYER7_PROTO_LEN		32
+
+/*
+ * layer7 conntrack extension structure.  Only used on the master of a
+ * connection family, except for app_proto.  Protected by the lock of the
+ * master conntrack.
+ */
+struct nf_conn_layer7 {
+	/* e.g. "http".  Empty before decision, "unknown" if nothing matched */
+	char app_proto[NF_CT_LAYER7_PROTO_LEN];
+	/* application data so far, only kept for patterns left to regexec() */
+	char *app_data;
+	unsigned int app_data_len;	/* bytes of data looked at so far */
+	/* DFA scan state, valid for the pattern set of generation scan_gen */
+	unsigned int scan_gen;
+	u16 state[NF_CT_LAYER7_MAX_GROUPS];
+	unsigned long matched[BITS_TO_LONGS(NF_CT_LAYER7_MAX_PATTERNS)];
+	unsigned long eol_matched[BITS_TO_LONGS(NF_CT_LAYER7_MAX_PATTERNS)];
+};
+
+#ifdef CONFIG_NF_CONNTRACK_LAYER7_EXT
+/* Set while xt_layer7 is loaded: only then do new conntracks get the
+ * extension. */
+extern int nf_ct_layer7_enabled;
+/* Called by the extension destructor to give app_data back */
+extern void (*nf_ct_layer7_destroy_hook)(struct nf_conn_layer7 *l7);
+#endif
+
+/*
+ * nf_ct_layer7_find()
+ *	Finds the extension data of the conntrack entry if it exists.
+ */
+static inline struct nf_conn_layer7 *nf_ct_layer7_find(const struct nf_conn *ct)
+{
+#ifdef CONFIG_NF_CONNTRACK_LAYER7_EXT
+	return nf_ct_ext_find(ct, NF_CT_EXT_LAYER7);
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * nf_ct_layer7_ext_add()
+ *	Adds the extension data to the conntrack entry.
+ */
+static inline struct nf_conn_layer7 *nf_ct_layer7_ext_add(struct nf_conn *ct, gfp_t gfp)
+{
+#ifdef CONFIG_NF_CONNTRACK_LAYER7_EXT
+	if (!nf_ct_layer7_enabled)
+		return NULL;
+
+	return nf_ct_ext_add(ct, NF_CT_EXT_LAYER7, gfp);
+#else
+	return NULL;
+#endif
+};
+
+#ifdef CONFIG_NF_CONNTRACK_LAYER7_EXT
+extern int nf_conntrack_layer7_ext_init(void);
+extern void nf_conntrack_layer7_ext_fini(void);
+#else
+/*
+ * nf_conntrack_layer7_ext_init()
+ */
+static inline int nf_conntrack_layer7_ext_init(void)
+{
+	return 0;
+}
+
+/*
+ * nf_conntrack_layer7_ext_fini()
+ */
+static inline void nf_conntrack_layer7_ext_fini(void)
+{
+	return;
+}
+#endif /* CONFIG_NF_CONNTRACK_LAYER7_EXT */
+#endif /* _NF_CONNTRACK_LAYER7_H */
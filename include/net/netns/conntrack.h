@@ -4,20 +4,62 @@
 #include <linux/list.h>
 #include <linux/list_nulls.h>
 #include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 
 struct ctl_table_header;
 struct nf_conntrack_ecache;
 
+enum udp_conntrack {
+	UDP_CT_UNREPLIED,
+	UDP_CT_REPLIED,
+	UDP_CT_MAX
+};
+
+/* Per-cpu lists of conntracks not (or no longer) in the hash table */
+struct ct_pcpu {
+	spinlock_t		lock;
+	struct hlist_nulls_head	unconfirmed;
+	struct hlist_nulls_head	dying;
+};
+
+/*
+ * Classes of conntracks, each with the list of its unassured members that
+ * early drop takes the oldest of.  The reserve classes go last.
+ */
+enum nf_ct_lru_class {
+	NF_CT_LRU_OTHER,
+	NF_CT_LRU_NAT,			/* LAN to WAN NAT sessions */
+	NF_CT_LRU_LOCAL,		/* sessions of the router itself */
+	NF_CT_LRU_TCP_RESERVE,		/* local TCP beyond the local quota */
+	NF_CT_LRU_ICMP_RESERVE,		/* local ICMP beyond the local quota */
+	NF_CT_LRU_MAX,
+	NF_CT_LRU_NONE = NF_CT_LRU_MAX	/* not confirmed */
+};
+
+struct nf_ct_lru {
+	spinlock_t		lock;
+	struct list_head	head;		/* oldest first */
+	atomic_t		count;		/* confirmed conntracks */
+	atomic_t		evicted;	/* dropped to make room */
+	atomic_t		refused;	/* not admitted for lack of room */
+} ____cacheline_aligned_in_smp;
+
 struct netns_ct {
 	atomic_t		count;
 	unsigned int		expect_count;
 	unsigned int		htable_size;
+	seqcount_t		generation;	/* bumped when hash is replaced */
 	struct kmem_cache	*nf_conntrack_cachep;
 	struct hlist_nulls_head	*hash;
 	struct hlist_head	*expect_hash;
-	struct hlist_nulls_head	unconfirmed;
-	struct hlist_nulls_head	dying;
+	struct ct_pcpu __percpu	*pcpu_lists;
 	struct ip_conntrack_stat __percpu *stat;
+	struct nf_ct_lru	lru[NF_CT_LRU_MAX];
+	struct delayed_work	gc_work;	/* reaps expired conntracks */
+	unsigned int		gc_bucket;	/* where gc_work goes on */
 #ifdef CONFIG_NF_CONNTRACK_CHAIN_EVENTS
 	struct atomic_notifier_head nf_conntrack_chain;
 #else
@@ -206,7 +206,8 @@ int stopwatch_softirq_show(struct seq_file *f, void *v)
 	int sirq = *((loff_t *) v);
 
 	if (sirq == 0)
-		seq_printf(f, "%20s\tCPU\tmin(us)\tavg(us)\tmax(us)\n\n", "");
+		seq_printf(f, "%20s\tCPU\tmin(us)\tavg(us)\tp50(us)\tp99(us)"
+			"\tmax(us)\n\n", "");
 
 	seq_printf(f, "%2d:%-18s", sirq, softirq_to_name[sirq]);
 	for_each_cpu(cpu, cpu_online_mask) {
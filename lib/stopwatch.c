@@ -18,95 +18,185 @@
 #include <linux/seq_file.h>
 #include <linux/proc_fs.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
 #define __STOPWATCH_USE__
 #include <linux/stopwatch.h>
 
-#define STOPWATCH_MAX_WATCHES 10
-
-static DEFINE_SPINLOCK(stopwatch_init_lock);
-static DEFINE_SPINLOCK(stopwatch_lock);
+static DEFINE_MUTEX(stopwatch_mutex);
+static LIST_HEAD(stopwatch_list);
 static struct proc_dir_entry *stopwatch_root;
 
-#define STOPWATCH_FLAG_INUSE	0x01
-#define STOPWTACH_FLAG_CREATED	0x02
+unsigned int stopwatch_gen __read_mostly;
+EXPORT_SYMBOL(stopwatch_gen);
 
-static struct stopwatch {
-	int flags;
+struct stopwatch {
+	struct list_head list;
 	const char *name;
 	int count;
 	stopwatch_show_t show;
-} stopwatches[STOPWATCH_MAX_WATCHES];
+	struct stopwatch_instance __percpu *pcpu;
+};
 
 /*
  * stopwatch_find()
- *	Find the stop watch.
+ *	Find the stop watch, called with stopwatch_mutex held.
  */
 static struct stopwatch *stopwatch_find(const char *name)
 {
-	int idx;
-	unsigned long flags;
-
-	spin_lock_irqsave(&stopwatch_lock, flags);
-	for (idx = 0; idx < STOPWATCH_MAX_WATCHES; idx++) {
-		/*
-		 * Trying to find a match.
-		 */
-		struct stopwatch *sw = &stopwatches[idx];
-		if (!sw->name) {
-			continue;
-		}
-		if (strcmp(sw->name, name)) {
-			continue;
-		}
-		spin_unlock_irqrestore(&stopwatch_lock, flags);
-		return sw;
+	struct stopwatch *sw;
+
+	list_for_each_entry(sw, &stopwatch_list, list) {
+		if (strcmp(sw->name, name) == 0)
+			return sw;
 	}
-	spin_unlock_irqrestore(&stopwatch_lock, flags);
 	return NULL;
 }
 
 /*
- * stopwatch_alloc()
- *	Allocate an entry, check for duplicates
+ * stopwatch_snapshot()
+ *	Take a consistent copy of another cpu's instance.
  */
-static struct stopwatch *stopwatch_alloc(const char *name)
+static void stopwatch_snapshot(struct stopwatch_instance *si,
+				struct stopwatch_instance *snap)
 {
-	int idx;
-	unsigned long flags;
-	struct stopwatch *free = NULL;
-
-	spin_lock_irqsave(&stopwatch_lock, flags);
-	for (idx = 0; idx < STOPWATCH_MAX_WATCHES; idx++) {
-		struct stopwatch *sw = &stopwatches[idx];
-
-		/*
-		 * Looking for an empty slot?
-		 */
-		if (!(sw->flags & STOPWATCH_FLAG_INUSE)) {
-			free = sw;
-			continue;
-		}
-
-		/*
-		 * Trying to find a match.
-		 */
-		if (strcmp(sw->name, name) == 0) {
-			printk(KERN_WARNING "[%s]: duplicate found: %d\n",
-				__func__, idx);
-			spin_unlock_irqrestore(&stopwatch_lock, flags);
-			return NULL;
-		}
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin(&si->syncp);
+		snap->min = si->min;
+		snap->sum = si->sum;
+		snap->max = si->max;
+		snap->count = si->count;
+		snap->gen = si->gen;
+		memcpy(snap->hist, si->hist, sizeof(snap->hist));
+	} while (u64_stats_fetch_retry(&si->syncp, start));
+
+	/*
+	 * Samples from before the last reset don't count.
+	 */
+	if (snap->gen != ACCESS_ONCE(stopwatch_gen))
+		snap->count = 0;
+}
+
+/*
+ * stopwatch_merge()
+ *	Fold a snapshot into a running total.
+ */
+static void stopwatch_merge(struct stopwatch_instance *total,
+				struct stopwatch_instance *snap)
+{
+	int i;
+
+	if (snap->count == 0)
+		return;
+
+	if (total->count == 0 || total->min > snap->min)
+		total->min = snap->min;
+	if (total->count == 0 || total->max < snap->max)
+		total->max = snap->max;
+	total->sum += snap->sum;
+	total->count += snap->count;
+	for (i = 0; i < STOPWATCH_HIST_BUCKETS; i++)
+		total->hist[i] += snap->hist[i];
+}
+
+/*
+ * stopwatch_percentile()
+ *	Upper bound in ns of the bucket holding the permille'th sample.
+ */
+static unsigned long long stopwatch_percentile(struct stopwatch_instance *snap,
+						unsigned int permille)
+{
+	unsigned long long want, seen = 0, bound;
+	int i;
+
+	want = (unsigned long long)snap->count * permille + 999;
+	do_div(want, 1000);
+
+	for (i = 0; i < STOPWATCH_HIST_BUCKETS - 1; i++) {
+		seen += snap->hist[i];
+		if (seen >= want)
+			break;
 	}
 
 	/*
-	 * If we have a free slot, use it.
+	 * The bucket bounds are powers of two; never report more than was
+	 * actually seen.
 	 */
-	if (free) {
-		free->name = name;
-		free->flags |= STOPWATCH_FLAG_INUSE;
+	bound = i ? (1ULL << i) - 1 : 0;
+	return min(bound, snap->max);
+}
+
+/*
+ * stopwatch_percpu_row()
+ *	Print one line of the default per-cpu show.
+ */
+static void stopwatch_percpu_row(struct seq_file *f,
+				struct stopwatch_instance *snap)
+{
+	unsigned long long avg;
+
+	if (snap->count == 0) {
+		seq_printf(f, "\t0\t0\t0\t0\t0\t0\t0\t0\n");
+		return;
+	}
+
+	avg = snap->sum;
+	do_div(avg, snap->count);
+	seq_printf(f, "\t%lu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+		   snap->count, snap->min, avg,
+		   stopwatch_percentile(snap, 500),
+		   stopwatch_percentile(snap, 900),
+		   stopwatch_percentile(snap, 990),
+		   stopwatch_percentile(snap, 999), snap->max);
+}
+
+/*
+ * stopwatch_percpu_show()
+ *	Show for watches registered with stopwatch_register_percpu().
+ */
+static int stopwatch_percpu_show(struct seq_file *f, struct stopwatch *sw)
+{
+	struct stopwatch_instance snap, total;
+	unsigned long seen = 0;
+	int cpu, i;
+
+	memset(&total, 0, sizeof(total));
+
+	seq_printf(f, "CPU\tcount\tmin(ns)\tavg(ns)\tp50\tp90\tp99\tp99.9"
+		   "\tmax(ns)\n");
+	for_each_online_cpu(cpu) {
+		stopwatch_snapshot(per_cpu_ptr(sw->pcpu, cpu), &snap);
+		stopwatch_merge(&total, &snap);
+		seq_printf(f, "%d", cpu);
+		stopwatch_percpu_row(f, &snap);
+	}
+	seq_printf(f, "all");
+	stopwatch_percpu_row(f, &total);
+
+	/*
+	 * Cumulative histogram of all cpus.
+	 */
+	seq_printf(f, "\n<= ns\t\tcount\tcum%%\n");
+	for (i = 0; i < STOPWATCH_HIST_BUCKETS && seen < total.count; i++) {
+		unsigned long long pct;
+		unsigned int tenths;
+
+		if (!total.hist[i])
+			continue;
+
+		seen += total.hist[i];
+		pct = (unsigned long long)seen * 1000;
+		do_div(pct, total.count);
+		tenths = do_div(pct, 10);
+		seq_printf(f, "%-10llu\t%u\t%llu.%u\n",
+			   i ? (1ULL << i) - 1 : 0ULL, total.hist[i],
+			   pct, tenths);
 	}
-	spin_unlock_irqrestore(&stopwatch_lock, flags);
-	return free;
+	return 0;
 }
 
 /*
@@ -119,6 +209,9 @@ static int stopwatch_seq_show(struct seq_file *f, void *v)
 	if (!sw) {
 		return 0;
 	}
+	if (sw->pcpu) {
+		return stopwatch_percpu_show(f, sw);
+	}
 	return sw->show(f, v);
 }
 
@@ -213,17 +306,33 @@ static const struct file_operations stopwatch_fops = {
 };
 
 /*
- * stopwatch_init()
- *	Initialize the stop watch service.
+ * stopwatch_reset_write()
+ *	Any write to /proc/stopwatch/reset restarts all watches.
  */
-static int stopwatch_init(void)
+static ssize_t stopwatch_reset_write(struct file *f, const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	mutex_lock(&stopwatch_mutex);
+	stopwatch_gen++;
+	mutex_unlock(&stopwatch_mutex);
+	return count;
+}
+
+static const struct file_operations stopwatch_reset_fops = {
+	.write		= stopwatch_reset_write,
+	.llseek		= noop_llseek,
+};
+
+/*
+ * stopwatch_root_init()
+ *	Create /proc/stopwatch, called with stopwatch_mutex held.
+ */
+static int stopwatch_root_init(void)
 {
 	/*
 	 * Already inited, do nothing?
 	 */
-	spin_lock(&stopwatch_init_lock);
 	if (stopwatch_root) {
-		spin_unlock(&stopwatch_init_lock);
 		return 0;
 	}
 
@@ -232,15 +341,28 @@ static int stopwatch_init(void)
 	 */
 	stopwatch_root = proc_mkdir("stopwatch", NULL);
 	if (!stopwatch_root) {
-		spin_unlock(&stopwatch_init_lock);
 		printk(KERN_WARNING "[%s]: unable to create /proc/stopwatch\n",
 			__func__);
 		return -ENOMEM;
 	}
 
-	spin_unlock(&stopwatch_init_lock);
+	proc_create("reset", S_IWUSR, stopwatch_root, &stopwatch_reset_fops);
 	return 0;
 }
+
+/*
+ * stopwatch_init()
+ *	Initialize the stop watch service.
+ */
+static int stopwatch_init(void)
+{
+	int ret;
+
+	mutex_lock(&stopwatch_mutex);
+	ret = stopwatch_root_init();
+	mutex_unlock(&stopwatch_mutex);
+	return ret;
+}
 module_init(stopwatch_init);
 
 /*
@@ -250,39 +372,33 @@ module_init(stopwatch_init);
 void stopwatch_show(struct stopwatch_instance *si, struct seq_file *p,
 			int precision)
 {
-	unsigned long flags;
-	unsigned long long min, avg, max;
-	unsigned long count;
+	struct stopwatch_instance snap;
+	unsigned long long min, avg, max, p50, p99;
 
-	if (si->count == 0) {
-		seq_printf(p, "   \t%u\t%u\t%u", 0, 0, 0);
+	stopwatch_snapshot(si, &snap);
+	if (snap.count == 0) {
+		seq_printf(p, "   \t%u\t%u\t%u\t%u\t%u", 0, 0, 0, 0, 0);
 		return;
 	}
 
-	spin_lock_irqsave(&si->lock, flags);
-
-	min = si->min;
-	avg = si->avg;
-	max = si->max;
-	count = si->count;
-
-	si->min = 0;
-	si->avg = 0;
-	si->max = 0;
-	si->count = 0;
-
-	spin_unlock_irqrestore(&si->lock, flags);
-
 	/* Calculate the actual average */
-	do_div(avg, count);
+	min = snap.min;
+	avg = snap.sum;
+	max = snap.max;
+	do_div(avg, snap.count);
+	p50 = stopwatch_percentile(&snap, 500);
+	p99 = stopwatch_percentile(&snap, 990);
 
 	if (precision == STOPWATCH_MICRO) {
 		do_div(min, 1000);
 		do_div(avg, 1000);
 		do_div(max, 1000);
+		do_div(p50, 1000);
+		do_div(p99, 1000);
 	}
 
-	seq_printf(p, "   \t%llu\t%llu\t%llu", min, avg, max);
+	seq_printf(p, "   \t%llu\t%llu\t%llu\t%llu\t%llu", min, avg, p50, p99,
+		   max);
 }
 EXPORT_SYMBOL(stopwatch_show);
 
@@ -293,63 +409,109 @@ EXPORT_SYMBOL(stopwatch_show);
  */
 void stopwatch_unregister(const char *name)
 {
-	unsigned long flags;
-	struct stopwatch *sw = stopwatch_find(name);
+	struct stopwatch *sw;
+
+	mutex_lock(&stopwatch_mutex);
+	sw = stopwatch_find(name);
 	if (!sw) {
+		mutex_unlock(&stopwatch_mutex);
 		printk(KERN_WARNING "[%s]: unable to find: %s\n",
 		       __func__, name);
 		return;
 	}
-	remove_proc_entry(name, stopwatch_root);
 
 	/*
 	 * Remove an entry.
 	 */
-	spin_lock_irqsave(&stopwatch_lock, flags);
-	sw->name = NULL;
-	sw->flags = 0;
-	spin_unlock_irqrestore(&stopwatch_lock, flags);
+	remove_proc_entry(name, stopwatch_root);
+	list_del(&sw->list);
+	mutex_unlock(&stopwatch_mutex);
+	kfree(sw);
 }
 EXPORT_SYMBOL(stopwatch_unregister);
 
 /*
- * stopwatch_register()
- *	Register a new stop watch counter group.
+ * stopwatch_add()
+ *	Create the entry and its node in the stop watch directory.
  */
-unsigned int stopwatch_register(const char *name, int count,
-					stopwatch_show_t show)
+static unsigned int stopwatch_add(const char *name, int count,
+				stopwatch_show_t show,
+				struct stopwatch_instance __percpu *pcpu)
 {
-	unsigned long flags;
 	struct stopwatch *sw;
+	int ret;
+
+	sw = kzalloc(sizeof(*sw), GFP_KERNEL);
+	if (!sw) {
+		printk(KERN_WARNING "[%s]: unable to allocate %s\n",
+		       __func__, name);
+		return -ENOMEM;
+	}
+	sw->name = name;
+	sw->count = count;
+	sw->show = show;
+	sw->pcpu = pcpu;
+
+	mutex_lock(&stopwatch_mutex);
 
 	/*
 	 * If we try to register before the stopwatch init, just do
 	 * the init first.
 	 */
-	if (!stopwatch_root) {
-		stopwatch_init();
-	}
+	ret = stopwatch_root_init();
+	if (ret)
+		goto fail;
 
 	/*
 	 * Check for duplicate name use.
 	 */
-	sw = stopwatch_alloc(name);
-	if (!sw) {
-		printk(KERN_WARNING "[%s]: unable to allocate empty slot\n",
-		       __func__);
-		return -ENOMEM;
+	if (stopwatch_find(name)) {
+		printk(KERN_WARNING "[%s]: duplicate found: %s\n",
+		       __func__, name);
+		ret = -EEXIST;
+		goto fail;
 	}
 
-	/*
-	 * Create a node in the stop watch directory.
-	 */
-	proc_create_data(name, 0, stopwatch_root, &stopwatch_fops, (void *)sw);
+	if (!proc_create_data(name, 0, stopwatch_root, &stopwatch_fops,
+			      (void *)sw)) {
+		ret = -ENOMEM;
+		goto fail;
+	}
 
-	spin_lock_irqsave(&stopwatch_lock, flags);
-	sw->count = count;
-	sw->show = show;
-	sw->flags |= STOPWTACH_FLAG_CREATED;
-	spin_unlock_irqrestore(&stopwatch_lock, flags);
+	list_add_tail(&sw->list, &stopwatch_list);
+	mutex_unlock(&stopwatch_mutex);
 	return 0;
+
+fail:
+	mutex_unlock(&stopwatch_mutex);
+	kfree(sw);
+	return ret;
+}
+
+/*
+ * stopwatch_register()
+ *	Register a new stop watch counter group with its own show.
+ */
+unsigned int stopwatch_register(const char *name, int count,
+					stopwatch_show_t show)
+{
+	return stopwatch_add(name, count, show, NULL);
 }
 EXPORT_SYMBOL(stopwatch_register);
+
+/*
+ * stopwatch_register_percpu()
+ *	Register a single per-cpu watch using the default percentile show.
+ */
+unsigned int stopwatch_register_percpu(const char *name,
+			struct stopwatch_instance __percpu *pcpu)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(pcpu, cpu), 0,
+		       sizeof(struct stopwatch_instance));
+
+	return stopwatch_add(name, 1, NULL, pcpu);
+}
+EXPORT_SYMBOL(stopwatch_register_percpu);
@@ -23,6 +23,8 @@
 #include <linux/ip.h>
 #include <linux/in.h>
 #include <linux/rtnetlink.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "br_private.h"
 
 #define QUANTENNA_IP 0x01010102
@@ -41,6 +43,107 @@ struct dns_nl_packet_msg
 
 static struct sock *dnsnl = NULL;
 
+/*
+ * DNS queries of blocked devices are handed to the hijack daemon through
+ * NETLINK_USERSOCK group 1.  The packet path only copies them into a free
+ * slot; a work item sends them out, one netlink message per skb as the
+ * daemon expects.  Producers fill one ring while the work item drains
+ * the other.
+ */
+#define DNS_NL_RING_SIZE	64
+#define DNS_NL_DATA_MAX		576	/* IP packet, DNS over UDP is <= 512 */
+
+struct dns_nl_record
+{
+	unsigned int len;
+	unsigned char saddr[ETH_ALEN];
+	unsigned char data[DNS_NL_DATA_MAX];
+};
+
+struct dns_nl_ring
+{
+	unsigned int count;
+	struct dns_nl_record rec[DNS_NL_RING_SIZE];
+};
+
+static struct dns_nl_ring *dns_nl_rings;
+static int dns_nl_active;
+static DEFINE_SPINLOCK(dns_nl_lock);
+static atomic_t dns_nl_dropped = ATOMIC_INIT(0);
+
+static void dns_nl_send(struct sk_buff *skb)
+{
+	NETLINK_CB(skb).dst_group = 1;
+	netlink_broadcast(dnsnl, skb, 0, 1, GFP_KERNEL);
+}
+
+static void dns_nl_flush(struct work_struct *work)
+{
+	struct dns_nl_ring *ring;
+	unsigned int i;
+
+	spin_lock_bh(&dns_nl_lock);
+	ring = &dns_nl_rings[dns_nl_active];
+	dns_nl_active ^= 1;
+	spin_unlock_bh(&dns_nl_lock);
+
+	for (i = 0; i < ring->count; i++) {
+		struct dns_nl_record *rec = &ring->rec[i];
+		size_t payload = sizeof(struct dns_nl_packet_msg) + rec->len;
+		struct dns_nl_packet_msg *pm;
+		struct nlmsghdr *nlh;
+		struct sk_buff *skb;
+
+		skb = alloc_skb(NLMSG_SPACE(payload), GFP_KERNEL);
+		if (!skb) {
+			atomic_add(ring->count - i, &dns_nl_dropped);
+			break;
+		}
+
+		nlh = nlmsg_put(skb, 0, 0, 0, payload, 0);
+		/* the daemon reads nlmsg_len as the payload length */
+		nlh->nlmsg_len = payload;
+		pm = nlmsg_data(nlh);
+		pm->data_len = rec->len;
+		memcpy(pm->saddr, rec->saddr, ETH_ALEN);
+		memcpy(pm->data, rec->data, rec->len);
+
+		dns_nl_send(skb);
+	}
+
+	ring->count = 0;
+}
+
+/* system_nrt_wq: a flush never runs concurrently with itself */
+static DECLARE_WORK(dns_nl_work, dns_nl_flush);
+
+static void dns_nl_queue(const unsigned char *saddr, const struct sk_buff *skb)
+{
+	struct dns_nl_ring *ring;
+	struct dns_nl_record *rec;
+
+	if (skb->len > DNS_NL_DATA_MAX)
+		goto drop;
+
+	spin_lock_bh(&dns_nl_lock);
+	ring = &dns_nl_rings[dns_nl_active];
+	if (ring->count == DNS_NL_RING_SIZE) {
+		spin_unlock_bh(&dns_nl_lock);
+		goto drop;
+	}
+	rec = &ring->rec[ring->count++];
+	rec->len = skb->len;
+	memcpy(rec->saddr, saddr, ETH_ALEN);
+	skb_copy_bits(skb, 0, rec->data, skb->len);
+	spin_unlock_bh(&dns_nl_lock);
+
+	queue_work(system_nrt_wq, &dns_nl_work);
+	return;
+
+drop:
+	atomic_inc(&dns_nl_dropped);
+}
+
 static struct kmem_cache *br_acl_cache __read_mostly;
 struct net_bridge_acl_entry
 {
@@ -57,13 +160,23 @@ void __init br_acl_init(void)
 					 0,
 					 SLAB_HWCACHE_ALIGN, NULL);
 	dnsnl = netlink_kernel_create(&init_net, NETLINK_USERSOCK, 0, NULL, NULL, THIS_MODULE);
+	if (dnsnl) {
+		dns_nl_rings = vzalloc(2 * sizeof(struct dns_nl_ring));
+		if (!dns_nl_rings) {
+			netlink_kernel_release(dnsnl);
+			dnsnl = NULL;
+		}
+	}
 }
 
 void __exit br_acl_fini(void)
 {
 	kmem_cache_destroy(br_acl_cache);
-	if (dnsnl)
+	if (dnsnl) {
+		cancel_work_sync(&dns_nl_work);
 		netlink_kernel_release(dnsnl);
+		vfree(dns_nl_rings);
+	}
 }
 
 static __inline__ int br_mac_hash(const unsigned char *mac)
@@ -81,7 +194,55 @@ static void acl_free(struct rcu_head *head)
 static __inline__ void acl_delete(struct net_bridge_acl_entry *f)
 {
 	hlist_del_rcu(&f->hlist);
-	acl_free(&f->rcu);
+	call_rcu(&f->rcu, acl_free);
+}
+
+/*
+ * The ACL membership of an address is cached in its FDB entry as
+ * (acl_gen | listed).  acl_gen moves on in steps of 2, skipping 0 which
+ * new FDB entries start with, whenever acl_hash changes.  That invalidates
+ * every cached membership at once.  Called with acl_hash_lock held, after
+ * the change.
+ */
+static void br_acl_gen_bump(struct net_bridge *br)
+{
+	u32 gen = br->acl_gen + 2;
+
+	if (!gen)
+		gen = 2;
+	/* readers that see the new generation must see the new list */
+	smp_wmb();
+	ACCESS_ONCE(br->acl_gen) = gen;
+}
+
+/* Is addr in acl_hash?  fdb is the FDB entry of addr, or NULL if unknown. */
+static int br_acl_listed(struct net_bridge *br,
+			 struct net_bridge_fdb_entry *fdb,
+			 const unsigned char *addr)
+{
+	struct net_bridge_acl_entry *acl;
+	struct hlist_node *h;
+	u32 gen = ACCESS_ONCE(br->acl_gen);
+	int listed = 0;
+
+	if (likely(fdb)) {
+		u32 cookie = ACCESS_ONCE(fdb->acl_cookie);
+
+		if (likely((cookie & ~1U) == gen))
+			return cookie & 1;
+	}
+
+	smp_rmb();
+	hlist_for_each_entry_rcu(acl, h, &br->acl_hash[br_mac_hash(addr)], hlist) {
+		if (!compare_ether_addr(acl->addr.addr, addr)) {
+			listed = 1;
+			break;
+		}
+	}
+
+	if (fdb)
+		ACCESS_ONCE(fdb->acl_cookie) = gen | listed;
+	return listed;
 }
 
 void br_acl_cleanup(struct net_bridge *br)
@@ -96,6 +257,7 @@ void br_acl_cleanup(struct net_bridge *br)
 		hlist_for_each_entry_safe(acl, h, n, &br->acl_hash[i], hlist)
 			acl_delete(acl);
 	}
+	br_acl_gen_bump(br);
 	spin_unlock_bh(&br->acl_hash_lock);
 }
 
@@ -103,29 +265,46 @@ void br_acl_cleanup(struct net_bridge *br)
 #define	ETHERTYPE_PAE	0x888e		/* EAPOL PAE/802.1x */
 #endif
 
-int br_acl_should_pass(struct net_bridge *br, struct sk_buff *skb, int type)
+/*
+ * src_fdb/dst_fdb are the FDB entries of the source/destination address
+ * when the caller already has them, which lets the verdict come from the
+ * cached membership.  Headers past Ethernet are only looked at for frames
+ * the list would drop.
+ */
+int br_acl_should_pass(struct net_bridge *br, struct sk_buff *skb, int type,
+		       struct net_bridge_fdb_entry *src_fdb,
+		       struct net_bridge_fdb_entry *dst_fdb)
 {
 	struct ethhdr *eth_h;
 	struct iphdr *ip_h;
 	struct tcpudphdr *tcpudp_h;
-	struct hlist_node *h;
-	struct net_bridge_acl_entry *acl;
 	unsigned char *src, *dst;
-	int src_allow = 1;
-	int dst_allow = 1;
-	int src_block = 0;
-	int dst_block = 0;
-	int drop = 0;
+	int src_listed = -1;
+	int dst_listed = -1;
+	int drop;
 	struct in_device * in_dev;
 
-	eth_h = (struct ethhdr *)skb->mac_header;
-	ip_h = (struct iphdr *)(skb->mac_header + sizeof(struct ethhdr));
-	tcpudp_h = (struct tcpudphdr *)(skb->mac_header + sizeof(struct ethhdr) + sizeof(struct iphdr));
+	if (!br->acl_enabled)
+		return 1;
 
+	eth_h = (struct ethhdr *)skb->mac_header;
 	src = eth_h->h_source;
 	dst = eth_h->h_dest;
 
-	if (!br->acl_enabled)
+	if (type & ACL_CHECK_SRC)
+		src_listed = br_acl_listed(br, src_fdb, src);
+
+	if ((type & ACL_CHECK_DST) && !(dst[0] & 1))
+		dst_listed = br_acl_listed(br, dst_fdb, dst);
+
+	if (br->acl_type == 1)
+		/* just block the device in acl_hash */
+		drop = (src_listed == 1 || dst_listed == 1);
+	else
+		/* just allow the device in acl_hash */
+		drop = (src_listed == 0 || dst_listed == 0);
+
+	if (likely(!drop))
 		return 1;
 
 	if (eth_h->h_proto == __constant_htons(ETH_P_ARP))
@@ -135,102 +314,47 @@ int br_acl_should_pass(struct net_bridge *br, struct sk_buff *skb, int type)
 	if (eth_h->h_proto == __constant_htons(ETHERTYPE_PAE))
 		return 1;
 
+	ip_h = (struct iphdr *)(skb->mac_header + sizeof(struct ethhdr));
+	tcpudp_h = (struct tcpudphdr *)(skb->mac_header + sizeof(struct ethhdr) + sizeof(struct iphdr));
+
 	if (eth_h->h_proto == __constant_htons(ETH_P_IP) &&  (ip_h->saddr == __constant_htonl(QUANTENNA_IP) || ip_h->daddr == __constant_htonl(QUANTENNA_IP))) 
 			return 1;
 
 	if (eth_h->h_proto == __constant_htons(ETH_P_IP) && ip_h->protocol == IPPROTO_UDP && (tcpudp_h->dst == __constant_htons(67) || tcpudp_h->dst == __constant_htons(68))) {
 		return 1;
 	}
-   
-	if (type & ACL_CHECK_SRC) {
-		src_allow = 0;
-		hlist_for_each_entry_rcu(acl, h, &br->acl_hash[br_mac_hash(src)], hlist) {
-			if (!compare_ether_addr(acl->addr.addr, src)) {
-				src_allow = 1;
-				src_block = 1;
-				break;
-			}
-		}
-	}
 
-	if ((type & ACL_CHECK_DST) && !(dst[0] & 1)) {
-		dst_allow = 0;
-		hlist_for_each_entry_rcu(acl, h, &br->acl_hash[br_mac_hash(dst)], hlist) {
-			if (!compare_ether_addr(acl->addr.addr, dst)) {
-				dst_allow = 1;
-				dst_block = 1;
-				break;
-			}
-		}
+	/* pass through the http packet to/from DUT */
+	if (eth_h->h_proto == __constant_htons(ETH_P_IP) && ip_h->protocol == IPPROTO_TCP && (tcpudp_h->dst ==__constant_htons(80) || tcpudp_h->src == __constant_htons(80))) {
+		in_dev = (struct in_device *)br->dev->ip_ptr;
+		if (in_dev && in_dev->ifa_list && (in_dev->ifa_list->ifa_local == ip_h->saddr || in_dev->ifa_list->ifa_local == ip_h->daddr))
+			return 1;
 	}
 
-	if (br->acl_type == 1) {
-		/* just block the device in acl_hash */
-		if (src_block == 1 || dst_block == 1)
-			drop = 1;
+	/* hijack the DNS */
+	if (eth_h->h_proto == __constant_htons(ETH_P_IP) && ip_h->protocol == IPPROTO_UDP && tcpudp_h->src == __constant_htons(53)) {
+		return 1;
 	}
-	else {
-		/* just allow the device in acl_hash */
-		if (src_allow == 0 || dst_allow == 0)
-			drop = 1;
+	if (eth_h->h_proto == __constant_htons(ETH_P_IP) && ip_h->protocol == IPPROTO_UDP && tcpudp_h->dst == __constant_htons(53) && dnsnl) {
+		dns_nl_queue(src, skb);
+		return 0;
 	}
 
-	if (drop) {
-		/* pass through the http packet to/from DUT */
-		if (eth_h->h_proto == __constant_htons(ETH_P_IP) && ip_h->protocol == IPPROTO_TCP && (tcpudp_h->dst ==__constant_htons(80) || tcpudp_h->src == __constant_htons(80))) {
-			in_dev = (struct in_device *)br->dev->ip_ptr;
-			if (in_dev && in_dev->ifa_list && (in_dev->ifa_list->ifa_local == ip_h->saddr || in_dev->ifa_list->ifa_local == ip_h->daddr))
-				return 1;
-		}
-
-		/* hijack the DNS */
-		if (eth_h->h_proto == __constant_htons(ETH_P_IP) && ip_h->protocol == IPPROTO_UDP && tcpudp_h->src == __constant_htons(53)) {
-			return 1;
-		}
-		if (eth_h->h_proto == __constant_htons(ETH_P_IP) && ip_h->protocol == IPPROTO_UDP && tcpudp_h->dst == __constant_htons(53) && dnsnl) {
-			struct dns_nl_packet_msg *pm;
-			struct nlmsghdr *nlh;
-			size_t size, copy_len;
-			struct sk_buff *skbnew;
-			copy_len = skb->len;
-			size = NLMSG_SPACE(sizeof(*pm) + copy_len);
-			skbnew = alloc_skb(4096, GFP_ATOMIC);
-			if (!skbnew) {
-				skbnew = alloc_skb(size, GFP_ATOMIC);
-				if (!skbnew) {
-					return 0;
-				}
-			}
-			nlh = NLMSG_PUT(skbnew, 0, 0, 0, (size - NLMSG_ALIGN(sizeof(*nlh))));
-			nlh->nlmsg_len = sizeof(*pm) + skb->len;
-			pm = NLMSG_DATA(nlh);
-			pm->data_len = skb->len;
-			memcpy(pm->saddr, src, 6);
-			skb_copy_bits(skb, 0, pm->data, skb->len);
-			NETLINK_CB(skbnew).dst_group = 1;
-			netlink_broadcast(dnsnl, skbnew, 0, 1, GFP_ATOMIC);
-nlmsg_failure:
-			return 0;
-		}
-
-		if (br->acl_debug) {
-			char msg[1024];
-			sprintf(msg, "ACL: drop packet to %s, src: %02x:%02x:%02x:%02x:%02x:%02x, dst: %02x:%02x:%02x:%02x:%02x:%02x, protocol 0x%04x",
-				(type == ACL_CHECK_SRC) ? br->dev->name : skb->dev->name,
-				src[0], src[1], src[2], src[3], src[4], src[5],
-				dst[0], dst[1], dst[2], dst[3], dst[4], dst[5],
-				eth_h->h_proto);
-			if (eth_h->h_proto == __constant_htons(ETH_P_IP)) {
-				sprintf(msg + strlen(msg), ", IP protocol %d", ip_h->protocol);
-				if (ip_h->protocol == IPPROTO_UDP)
-					sprintf(msg + strlen(msg), ", dest port %d", __constant_ntohs(tcpudp_h->dst));
-			}
-			printk("%s\n", msg);
+	if (br->acl_debug) {
+		char msg[1024];
+		sprintf(msg, "ACL: drop packet to %s, src: %02x:%02x:%02x:%02x:%02x:%02x, dst: %02x:%02x:%02x:%02x:%02x:%02x, protocol 0x%04x",
+			(type == ACL_CHECK_SRC) ? br->dev->name : skb->dev->name,
+			src[0], src[1], src[2], src[3], src[4], src[5],
+			dst[0], dst[1], dst[2], dst[3], dst[4], dst[5],
+			eth_h->h_proto);
+		if (eth_h->h_proto == __constant_htons(ETH_P_IP)) {
+			sprintf(msg + strlen(msg), ", IP protocol %d", ip_h->protocol);
+			if (ip_h->protocol == IPPROTO_UDP)
+				sprintf(msg + strlen(msg), ", dest port %d", __constant_ntohs(tcpudp_h->dst));
 		}
-		return 0;
+		printk("%s\n", msg);
 	}
-
-	return 1;
+	return 0;
 }
 
 int wl_acl_should_pass(struct net_device *dev, struct sk_buff *skb)
@@ -254,7 +378,7 @@ int wl_acl_should_pass(struct net_device *dev, struct sk_buff *skb)
 	skb_reset_mac_header(skb);
 	skb_set_network_header(skb, sizeof(struct ethhdr));
 
-	return br_acl_should_pass(p->br, skb, (ACL_CHECK_SRC | ACL_CHECK_DST));
+	return br_acl_should_pass(p->br, skb, (ACL_CHECK_SRC | ACL_CHECK_DST), NULL, NULL);
 }
 EXPORT_SYMBOL(wl_acl_should_pass);
 
@@ -297,6 +421,7 @@ static int acl_insert(struct net_bridge *br, const unsigned char *addr)
 	if (!acl_create(head, addr))
 		return -ENOMEM;
 
+	br_acl_gen_bump(br);
 	return 0;
 }
 
@@ -325,6 +450,7 @@ void br_acl_debug_onoff(struct net_bridge *br, int onoff)
 		return;
 	}
 	printk("ACL type: only %s in ACL list\n", br->acl_type == 1 ? "block" : "allow");
+	printk("ACL DNS notifications dropped: %d\n", atomic_read(&dns_nl_dropped));
 	printk("ACL list:\n");
 	for (i = 0; i < BR_ACL_HASH_SIZE; i++) {
 		struct net_bridge_acl_entry *acl;
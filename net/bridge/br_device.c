@@ -62,6 +62,10 @@ netdev_tx_t br_dev_xmit(struct sk_buff *skb, struct net_device *dev)
 #endif
 
 	BR_INPUT_SKB_CB(skb)->brdev = dev;
+#ifdef CONFIG_BRIDGE_NETGEAR_ACL
+	BR_INPUT_SKB_CB(skb)->acl_src = NULL;
+	BR_INPUT_SKB_CB(skb)->acl_dst = NULL;
+#endif
 
 	skb_reset_mac_header(skb);
 	skb_pull(skb, ETH_HLEN);
@@ -111,9 +115,12 @@ netdev_tx_t br_dev_xmit(struct sk_buff *skb, struct net_device *dev)
 		if (!skb)
 			goto out;
 		br_deliver(pdst, skb);
-	} else if ((dst = __br_fdb_get(br, dest)) != NULL)
+	} else if ((dst = __br_fdb_get(br, dest)) != NULL) {
+#ifdef CONFIG_BRIDGE_NETGEAR_ACL
+		BR_INPUT_SKB_CB(skb)->acl_dst = dst;
+#endif
 		br_deliver(dst->dst, skb);
-	else
+	} else
 		br_flood_deliver(br, skb);
 
 out:
@@ -424,5 +431,6 @@ void br_dev_setup(struct net_device *dev)
         br->acl_type = 1;
         br->acl_debug = 0;
         spin_lock_init(&br->acl_hash_lock);
+        br->acl_gen = 2;
 #endif
 }
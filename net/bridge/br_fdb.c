@@ -397,6 +397,9 @@ static struct net_bridge_fdb_entry *fdb_create(struct hlist_head *head,
 		fdb->is_local = 0;
 		fdb->is_static = 0;
 		fdb->updated = fdb->used = jiffies;
+#ifdef CONFIG_BRIDGE_NETGEAR_ACL
+		fdb->acl_cookie = 0;
+#endif
 		BR_INCR_ENTRIES();
 
 		hlist_add_head_rcu(&fdb->hlist, head);
@@ -484,20 +487,22 @@ static void br_fdb_refresh_stats(struct net_bridge *br,
 	}
 }
 
-void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
-		   const unsigned char *addr)
+/* Returns the entry of addr if there is one, for the caller to reuse */
+struct net_bridge_fdb_entry *br_fdb_update(struct net_bridge *br,
+					   struct net_bridge_port *source,
+					   const unsigned char *addr)
 {
 	struct hlist_head *head = &br->hash[br_mac_hash(addr)];
 	struct net_bridge_fdb_entry *fdb;
 
 	/* some users want to always flood. */
 	if (hold_time(br) == 0)
-		return;
+		return NULL;
 
 	/* ignore packets unless we are using this port */
 	if (!(source->state == BR_STATE_LEARNING ||
 	      source->state == BR_STATE_FORWARDING))
-		return;
+		return NULL;
 
 	fdb = fdb_find_rcu(head, addr);
 	if (likely(fdb)) {
@@ -529,6 +534,8 @@ void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 		 */
 		spin_unlock(&br->hash_lock);
 	}
+
+	return fdb;
 }
 
 /* Refresh FDB entries for bridge packets being forwarded by offload engines */
@@ -651,7 +651,8 @@ static void __br_deliver(const struct net_bridge_port *to, struct sk_buff *skb)
 
 #ifdef CONFIG_BRIDGE_NETGEAR_ACL
        struct net_bridge *br = to->br;
-       if (!br_acl_should_pass(br, skb, ACL_CHECK_DST)) {
+       if (!br_acl_should_pass(br, skb, ACL_CHECK_DST,
+                               NULL, BR_INPUT_SKB_CB(skb)->acl_dst)) {
                br->dev->stats.tx_dropped++;
                kfree_skb(skb);
                return;
@@ -696,7 +697,9 @@ static void __br_forward(const struct net_bridge_port *to, struct sk_buff *skb)
 	skb_forward_csum(skb);
 #ifdef CONFIG_BRIDGE_NETGEAR_ACL
        struct net_bridge *br = to->br;
-       if (!br_acl_should_pass(br, skb, (ACL_CHECK_SRC | ACL_CHECK_DST))) {
+       if (!br_acl_should_pass(br, skb, (ACL_CHECK_SRC | ACL_CHECK_DST),
+                               BR_INPUT_SKB_CB(skb)->acl_src,
+                               BR_INPUT_SKB_CB(skb)->acl_dst)) {
                br->dev->stats.tx_dropped++;
                kfree_skb(skb);
                return;
@@ -877,8 +880,22 @@ static void br_multicast_flood(struct net_bridge_mdb_entry *mdst,
 	struct net_device *dev = BR_INPUT_SKB_CB(skb)->brdev;
 	struct net_bridge *br = netdev_priv(dev);
 	struct net_bridge_port *prev = NULL;
+	struct net_bridge_mdb_egress *eg;
 	struct net_bridge_port_group *p;
 	struct hlist_node *rp;
+	unsigned int i;
+
+	eg = mdst ? rcu_dereference(mdst->egress) :
+		    rcu_dereference(br->router_egress);
+	if (likely(eg)) {
+		for (i = 0; i < eg->count; i++) {
+			prev = maybe_deliver(prev, eg->ports[i], skb,
+					     __packet_hook);
+			if (IS_ERR(prev))
+				goto out;
+		}
+		goto deliver;
+	}
 
 	rp = rcu_dereference(hlist_first_rcu(&br->router_list));
 	p = mdst ? rcu_dereference(mdst->ports) : NULL;
@@ -902,6 +919,7 @@ static void br_multicast_flood(struct net_bridge_mdb_entry *mdst,
 			rp = rcu_dereference(hlist_next_rcu(rp));
 	}
 
+deliver:
 	if (!prev)
 		goto out;
 
@@ -87,10 +87,11 @@ static int br_pass_frame_up(struct sk_buff *skb)
 //      }
 //#endif
 #ifdef CONFIG_BRIDGE_NETGEAR_ACL
-      if (!br_acl_should_pass(br, skb, ACL_CHECK_SRC)) {
+      if (!br_acl_should_pass(br, skb, ACL_CHECK_SRC,
+                              BR_INPUT_SKB_CB(skb)->acl_src, NULL)) {
               br->dev->stats.rx_dropped++;
               kfree_skb(skb);
-              return;
+              return NET_RX_DROP;
       }
 #endif
 	u64_stats_update_begin(&brstats->syncp);
@@ -130,13 +131,14 @@ int br_handle_frame_finish(struct sk_buff *skb)
 	struct sk_buff *skb2;
 	struct net_bridge_port *pdst = NULL;
 	br_get_dst_hook_t *get_dst_hook = rcu_dereference(br_get_dst_hook);
+	struct net_bridge_fdb_entry *src;
 
 	if (!p || p->state == BR_STATE_DISABLED)
 		goto drop;
 
 	/* insert into forwarding database after filtering to avoid spoofing */
 	br = p->br;
-	br_fdb_update(br, p, eth_hdr(skb)->h_source);
+	src = br_fdb_update(br, p, eth_hdr(skb)->h_source);
 
 
 	if (!is_broadcast_ether_addr(dest) && is_multicast_ether_addr(dest) &&
@@ -147,6 +149,10 @@ int br_handle_frame_finish(struct sk_buff *skb)
 		goto drop;
 
 	BR_INPUT_SKB_CB(skb)->brdev = br->dev;
+#ifdef CONFIG_BRIDGE_NETGEAR_ACL
+	BR_INPUT_SKB_CB(skb)->acl_src = src;
+	BR_INPUT_SKB_CB(skb)->acl_dst = NULL;
+#endif
 
 	/* The packet skb2 goes to the local host (NULL to skip). */
 	skb2 = NULL;
@@ -197,6 +203,9 @@ int br_handle_frame_finish(struct sk_buff *skb)
 		if (dst) {
 			dst->used = jiffies;
 			pdst = dst->dst;
+#ifdef CONFIG_BRIDGE_NETGEAR_ACL
+			BR_INPUT_SKB_CB(skb)->acl_dst = dst;
+#endif
 		}
 
 		if (pdst)
@@ -36,6 +36,9 @@
 #define mlock_dereference(X, br) \
 	rcu_dereference_protected(X, lockdep_is_held(&br->multicast_lock))
 
+/* group records of a v3 report handled per multicast_lock acquisition */
+#define BR_MULTICAST_REPORT_BATCH	16
+
 #if IS_ENABLED(CONFIG_IPV6)
 static inline int ipv6_is_transient_multicast(const struct in6_addr *addr)
 {
@@ -264,9 +267,97 @@ static void br_multicast_free_group(struct rcu_head *head)
 	struct net_bridge_mdb_entry *mp =
 		container_of(head, struct net_bridge_mdb_entry, rcu);
 
+	kfree(rcu_dereference_protected(mp->egress, 1));
 	kfree(mp);
 }
 
+static void br_multicast_free_egress(struct rcu_head *head)
+{
+	struct net_bridge_mdb_egress *eg =
+		container_of(head, struct net_bridge_mdb_egress, rcu);
+
+	kfree(eg);
+}
+
+static void br_multicast_set_egress(struct net_bridge *br,
+				    struct net_bridge_mdb_egress __rcu **slot,
+				    struct net_bridge_mdb_egress *eg)
+{
+	struct net_bridge_mdb_egress *old = mlock_dereference(*slot, br);
+
+	rcu_assign_pointer(*slot, eg);
+	if (old)
+		call_rcu_bh(&old->rcu, br_multicast_free_egress);
+}
+
+/*
+ * Rebuild the egress array of @mp, or of the bridge's router ports if @mp
+ * is NULL, visiting ports in the same order and with the same merging of
+ * members and routers as the list walk in br_multicast_flood(). If the
+ * allocation fails the array is dropped and the data path falls back to
+ * that walk.
+ */
+static void br_multicast_update_egress(struct net_bridge *br,
+				       struct net_bridge_mdb_entry *mp)
+{
+	struct net_bridge_mdb_egress *eg;
+	struct net_bridge_port_group *p;
+	struct net_bridge_port *port;
+	struct hlist_node *rp;
+	unsigned int n = 0;
+
+	for (p = mp ? mlock_dereference(mp->ports, br) : NULL; p;
+	     p = mlock_dereference(p->next, br))
+		n++;
+	hlist_for_each(rp, &br->router_list)
+		n++;
+
+	eg = kmalloc(sizeof(*eg) + n * sizeof(eg->ports[0]), GFP_ATOMIC);
+	if (eg) {
+		eg->count = 0;
+		p = mp ? mlock_dereference(mp->ports, br) : NULL;
+		rp = br->router_list.first;
+		while (p || rp) {
+			struct net_bridge_port *lport, *rport;
+
+			lport = p ? p->port : NULL;
+			rport = rp ? hlist_entry(rp, struct net_bridge_port,
+						 rlist) : NULL;
+
+			port = (unsigned long)lport > (unsigned long)rport ?
+			       lport : rport;
+			eg->ports[eg->count++] = port;
+
+			if ((unsigned long)lport >= (unsigned long)port)
+				p = mlock_dereference(p->next, br);
+			if ((unsigned long)rport >= (unsigned long)port)
+				rp = rp->next;
+		}
+	}
+
+	br_multicast_set_egress(br, mp ? &mp->egress : &br->router_egress,
+				eg);
+}
+
+/* the router ports are part of every array, so rebuild them all */
+static void br_multicast_update_all_egress(struct net_bridge *br)
+{
+	struct net_bridge_mdb_htable *mdb;
+	struct net_bridge_mdb_entry *mp;
+	struct hlist_node *p;
+	int i;
+
+	br_multicast_update_egress(br, NULL);
+
+	mdb = mlock_dereference(br->mdb, br);
+	if (!mdb)
+		return;
+
+	for (i = 0; i < mdb->max; i++)
+		hlist_for_each_entry(mp, p, &mdb->mhash[i], hlist[mdb->ver])
+			br_multicast_update_egress(br, mp);
+}
+
 static void br_multicast_group_expired(unsigned long data)
 {
 	struct net_bridge_mdb_entry *mp = (void *)data;
@@ -317,6 +408,7 @@ static void br_multicast_del_pg(struct net_bridge *br,
 		hlist_del_init(&p->mglist);
 		del_timer(&p->timer);
 		call_rcu_bh(&p->rcu, br_multicast_free_pg);
+		br_multicast_update_egress(br, mp);
 
 		if (!mp->ports && !mp->mglist &&
 		    netif_running(br->dev))
@@ -667,6 +759,7 @@ rehash:
 	mp->addr = *group;
 	setup_timer(&mp->timer, br_multicast_group_expired,
 		    (unsigned long)mp);
+	br_multicast_update_egress(br, mp);
 
 	hlist_add_head_rcu(&mp->hlist[mdb->ver], &mdb->mhash[hash]);
 	mdb->size++;
@@ -675,9 +768,10 @@ out:
 	return mp;
 }
 
-static int br_multicast_add_group(struct net_bridge *br,
-				  struct net_bridge_port *port,
-				  struct br_ip *group)
+/* called with multicast_lock held */
+static int __br_multicast_add_group(struct net_bridge *br,
+				    struct net_bridge_port *port,
+				    struct br_ip *group)
 {
 	struct net_bridge_mdb_entry *mp;
 	struct net_bridge_port_group *p;
@@ -685,7 +779,6 @@ static int br_multicast_add_group(struct net_bridge *br,
 	unsigned long now = jiffies;
 	int err;
 
-	spin_lock(&br->multicast_lock);
 	if (!netif_running(br->dev) ||
 	    (port && port->state == BR_STATE_DISABLED))
 		goto out;
@@ -723,6 +816,7 @@ static int br_multicast_add_group(struct net_bridge *br,
 		    (unsigned long)p);
 
 	rcu_assign_pointer(*pp, p);
+	br_multicast_update_egress(br, mp);
 
 found:
 	mod_timer(&p->timer, now + br->multicast_membership_interval);
@@ -730,39 +824,117 @@ out:
 	err = 0;
 
 err:
-	spin_unlock(&br->multicast_lock);
 	return err;
 }
 
+/*
+ * Lockless check, under rcu_read_lock, for a port's membership that was
+ * refreshed within the last second. Re-arming its timer would only push
+ * expiry out by that much, so repeated reports from IPTV set-top boxes can
+ * be dropped here instead of serializing on multicast_lock.
+ */
+static bool br_multicast_report_fresh(struct net_bridge *br,
+				      struct net_bridge_port *port,
+				      struct br_ip *group)
+{
+	struct net_bridge_mdb_entry *mp;
+	struct net_bridge_port_group *p;
+	unsigned long expires;
+
+	if (!port)
+		return false;
+
+	mp = br_mdb_ip_get(rcu_dereference(br->mdb), group);
+	if (!mp)
+		return false;
+
+	for (p = rcu_dereference(mp->ports); p; p = rcu_dereference(p->next)) {
+		if (p->port != port)
+			continue;
+
+		expires = ACCESS_ONCE(p->timer.expires);
+		return timer_pending(&p->timer) &&
+		       time_after_eq(expires,
+				     jiffies + br->multicast_membership_interval -
+				     HZ);
+	}
+
+	return false;
+}
+
+/*
+ * Add a batch of groups reported on @port, taking multicast_lock once for
+ * all of them rather than once per group record.
+ */
+static int br_multicast_add_groups(struct net_bridge *br,
+				   struct net_bridge_port *port,
+				   struct br_ip *groups, int num)
+{
+	bool locked = false;
+	int err = 0;
+	int i;
+
+	for (i = 0; i < num && !err; i++) {
+		if (br_multicast_report_fresh(br, port, &groups[i]))
+			continue;
+
+		if (!locked) {
+			spin_lock(&br->multicast_lock);
+			locked = true;
+		}
+		err = __br_multicast_add_group(br, port, &groups[i]);
+	}
+
+	if (locked)
+		spin_unlock(&br->multicast_lock);
+
+	return err;
+}
+
+static bool br_ip4_multicast_group(struct br_ip *br_group, __be32 group)
+{
+	if (ipv4_is_local_multicast(group))
+		return false;
+
+	br_group->u.ip4 = group;
+	br_group->proto = htons(ETH_P_IP);
+	return true;
+}
+
 static int br_ip4_multicast_add_group(struct net_bridge *br,
 				      struct net_bridge_port *port,
 				      __be32 group)
 {
 	struct br_ip br_group;
 
-	if (ipv4_is_local_multicast(group))
+	if (!br_ip4_multicast_group(&br_group, group))
 		return 0;
 
-	br_group.u.ip4 = group;
-	br_group.proto = htons(ETH_P_IP);
-
-	return br_multicast_add_group(br, port, &br_group);
+	return br_multicast_add_groups(br, port, &br_group, 1);
 }
 
 #if IS_ENABLED(CONFIG_IPV6)
+static bool br_ip6_multicast_group(struct br_ip *br_group,
+				   const struct in6_addr *group)
+{
+	if (!ipv6_is_transient_multicast(group))
+		return false;
+
+	br_group->u.ip6 = *group;
+	br_group->proto = htons(ETH_P_IPV6);
+	return true;
+}
+
 static int br_ip6_multicast_add_group(struct net_bridge *br,
 				      struct net_bridge_port *port,
 				      const struct in6_addr *group)
 {
 	struct br_ip br_group;
 
-	if (!ipv6_is_transient_multicast(group))
+	if (!br_ip6_multicast_group(&br_group, group))
 		return 0;
 
-	br_group.u.ip6 = *group;
-	br_group.proto = htons(ETH_P_IPV6);
-
-	return br_multicast_add_group(br, port, &br_group);
+	return br_multicast_add_groups(br, port, &br_group, 1);
 }
 #endif
 
@@ -778,6 +950,7 @@ static void br_multicast_router_expired(unsigned long data)
 		goto out;
 
 	hlist_del_init_rcu(&port->rlist);
+	br_multicast_update_all_egress(br);
 
 out:
 	spin_unlock(&br->multicast_lock);
@@ -903,8 +1076,10 @@ void br_multicast_disable_port(struct net_bridge_port *port)
 	hlist_for_each_entry_safe(pg, p, n, &port->mglist, mglist)
 		br_multicast_del_pg(br, pg);
 
-	if (!hlist_unhashed(&port->rlist))
+	if (!hlist_unhashed(&port->rlist)) {
 		hlist_del_init_rcu(&port->rlist);
+		br_multicast_update_all_egress(br);
+	}
 	del_timer(&port->multicast_router_timer);
 	del_timer(&port->multicast_query_timer);
 	spin_unlock(&br->multicast_lock);
@@ -914,12 +1089,14 @@ static int br_ip4_multicast_igmp3_report(struct net_bridge *br,
 					 struct net_bridge_port *port,
 					 struct sk_buff *skb)
 {
+	struct br_ip groups[BR_MULTICAST_REPORT_BATCH];
 	struct igmpv3_report *ih;
 	struct igmpv3_grec *grec;
 	int i;
 	int len;
 	int num;
 	int type;
+	int n = 0;
 	int err = 0;
 	__be32 group;
 
@@ -957,12 +1134,18 @@ static int br_ip4_multicast_igmp3_report(struct net_bridge *br,
 			continue;
 		}
 
-		err = br_ip4_multicast_add_group(br, port, group);
-		if (err)
-			break;
+		if (!br_ip4_multicast_group(&groups[n], group))
+			continue;
+
+		if (++n == ARRAY_SIZE(groups)) {
+			err = br_multicast_add_groups(br, port, groups, n);
+			if (err)
+				return err;
+			n = 0;
+		}
 	}
 
-	return err;
+	return br_multicast_add_groups(br, port, groups, n);
 }
 
 #if IS_ENABLED(CONFIG_IPV6)
@@ -970,12 +1153,14 @@ static int br_ip6_multicast_mld2_report(struct net_bridge *br,
 					struct net_bridge_port *port,
 					struct sk_buff *skb)
 {
+	struct br_ip groups[BR_MULTICAST_REPORT_BATCH];
 	struct icmp6hdr *icmp6h;
 	struct mld2_grec *grec;
 	int i;
 	int len;
 	int num;
-	int err = 0;
+	int n = 0;
+	int err;
 
 	if (!pskb_may_pull(skb, sizeof(*icmp6h)))
 		return -EINVAL;
@@ -1017,12 +1202,18 @@ static int br_ip6_multicast_mld2_report(struct net_bridge *br,
 			continue;
 		}
 
-		err = br_ip6_multicast_add_group(br, port, &grec->grec_mca);
-		if (!err)
-			break;
+		if (!br_ip6_multicast_group(&groups[n], &grec->grec_mca))
+			continue;
+
+		if (++n == ARRAY_SIZE(groups)) {
+			err = br_multicast_add_groups(br, port, groups, n);
+			if (err)
+				return err;
+			n = 0;
+		}
 	}
 
-	return err;
+	return br_multicast_add_groups(br, port, groups, n);
 }
 #endif
 
@@ -1047,6 +1238,8 @@ static void br_multicast_add_router(struct net_bridge *br,
 		hlist_add_after_rcu(slot, &port->rlist);
 	else
 		hlist_add_head_rcu(&port->rlist, &br->router_list);
+
+	br_multicast_update_all_egress(br);
 }
 
 static void br_multicast_mark_router(struct net_bridge *br,
@@ -1651,6 +1844,8 @@ void br_multicast_stop(struct net_bridge *br)
 	del_timer_sync(&br->multicast_query_timer);
 
 	spin_lock_bh(&br->multicast_lock);
+	br_multicast_set_egress(br, &br->router_egress, NULL);
+
 	mdb = mlock_dereference(br->mdb, br);
 	if (!mdb)
 		goto out;
@@ -1725,8 +1920,10 @@ int br_multicast_set_port_router(struct net_bridge_port *p, unsigned long val)
 		p->multicast_router = val;
 		err = 0;
 
-		if (val < 2 && !hlist_unhashed(&p->rlist))
+		if (val < 2 && !hlist_unhashed(&p->rlist)) {
 			hlist_del_init_rcu(&p->rlist);
+			br_multicast_update_all_egress(br);
+		}
 
 		if (val == 1)
 			break;
@@ -76,6 +76,10 @@ struct net_bridge_fdb_entry
 	mac_addr			addr;
 	unsigned char			is_local;
 	unsigned char			is_static;
+#ifdef CONFIG_BRIDGE_NETGEAR_ACL
+	/* ACL membership of addr, see br_acl_listed() */
+	u32				acl_cookie;
+#endif
 };
 
 struct net_bridge_port_group {
@@ -87,11 +91,24 @@ struct net_bridge_port_group {
 	struct br_ip			addr;
 };
 
+/*
+ * Flattened copy of a group's member ports merged with the multicast
+ * router ports, rebuilt under multicast_lock whenever either changes so
+ * that br_multicast_flood() needn't walk and merge both lists per packet.
+ */
+struct net_bridge_mdb_egress
+{
+	struct rcu_head			rcu;
+	unsigned int			count;
+	struct net_bridge_port		*ports[0];
+};
+
 struct net_bridge_mdb_entry
 {
 	struct hlist_node		hlist[2];
 	struct net_bridge		*br;
 	struct net_bridge_port_group __rcu *ports;
+	struct net_bridge_mdb_egress __rcu *egress;
 	struct rcu_head			rcu;
 	struct timer_list		timer;
 	struct br_ip			addr;
@@ -244,6 +261,8 @@ struct net_bridge
 	spinlock_t			multicast_lock;
 	struct net_bridge_mdb_htable __rcu *mdb;
 	struct hlist_head		router_list;
+	/* egress ports for groups without an mdb entry */
+	struct net_bridge_mdb_egress __rcu *router_egress;
 
 	struct timer_list		multicast_router_timer;
 	struct timer_list		multicast_querier_timer;
@@ -266,6 +285,7 @@ struct net_bridge
         unsigned char                   acl_debug;
         struct hlist_head               acl_hash[BR_ACL_HASH_SIZE]; /* mac address of the devices that are blocked/allowed*/
         spinlock_t                      acl_hash_lock;
+        u32                             acl_gen; /* bumped on every acl_hash change */
 #endif
 };
 
@@ -275,6 +295,11 @@ struct br_input_skb_cb {
 	int igmp;
 	int mrouters_only;
 #endif
+#ifdef CONFIG_BRIDGE_NETGEAR_ACL
+	/* FDB entries of the frame's addresses if already looked up, or NULL */
+	struct net_bridge_fdb_entry *acl_src;
+	struct net_bridge_fdb_entry *acl_dst;
+#endif
 };
 
 #define BR_INPUT_SKB_CB(__skb)	((struct br_input_skb_cb *)(__skb)->cb)
@@ -360,7 +385,9 @@ extern void br_acl_init(void);
 extern void br_acl_fini(void);
 extern void br_acl_cleanup(struct net_bridge *br);
 extern int br_acl_insert(struct net_bridge *br, const unsigned char *addr);
-extern int br_acl_should_pass(struct net_bridge *br, struct sk_buff *skb, int type);
+extern int br_acl_should_pass(struct net_bridge *br, struct sk_buff *skb, int type,
+			      struct net_bridge_fdb_entry *src_fdb,
+			      struct net_bridge_fdb_entry *dst_fdb);
 extern void br_acl_debug_onoff(struct net_bridge *br, int onoff);
 #endif
 
@@ -382,9 +409,9 @@ extern int br_fdb_fillbuf(struct net_bridge *br, void *buf,
 extern int br_fdb_insert(struct net_bridge *br,
 			 struct net_bridge_port *source,
 			 const unsigned char *addr);
-extern void br_fdb_update(struct net_bridge *br,
-			  struct net_bridge_port *source,
-			  const unsigned char *addr);
+extern struct net_bridge_fdb_entry *br_fdb_update(struct net_bridge *br,
+						  struct net_bridge_port *source,
+						  const unsigned char *addr);
 extern int br_fdb_dump(struct sk_buff *skb, struct netlink_callback *cb);
 extern int br_fdb_add(struct sk_buff *skb, struct nlmsghdr *nlh, void *arg);
 extern int br_fdb_delete(struct sk_buff *skb, struct nlmsghdr *nlh, void *arg);
@@ -135,6 +135,10 @@
 #include <linux/net_tstamp.h>
 #include <linux/static_key.h>
 #include <net/flow_keys.h>
+#ifdef CONFIG_STOPWATCH_NET
+#define __STOPWATCH_USE__
+#endif
+#include <linux/stopwatch.h>
 
 #include "net-sysfs.h"
 
@@ -3190,6 +3194,9 @@ EXPORT_SYMBOL_GPL(netdev_rx_handler_unregister);
 int (*athrs_fast_nat_recv)(struct sk_buff *skb) __rcu __read_mostly;
 EXPORT_SYMBOL_GPL(athrs_fast_nat_recv);
 
+DEFINE_STOPWATCH(napi_poll);
+DEFINE_STOPWATCH(netif_receive_skb);
+
 static int __netif_receive_skb(struct sk_buff *skb)
 {
 	struct packet_type *ptype, *pt_prev;
@@ -3344,6 +3351,9 @@ out:
  */
 int netif_receive_skb(struct sk_buff *skb)
 {
+	int ret;
+	STOPWATCH_TIMER(t);
+
 	net_timestamp_check(netdev_tstamp_prequeue, skb);
 
 	if (skb_defer_rx_timestamp(skb))
@@ -3352,7 +3362,7 @@ int netif_receive_skb(struct sk_buff *skb)
 #ifdef CONFIG_RPS
 	if (static_key_false(&rps_needed)) {
 		struct rps_dev_flow voidflow, *rflow = &voidflow;
-		int cpu, ret;
+		int cpu;
 
 		rcu_read_lock();
 
@@ -3366,7 +3376,10 @@ int netif_receive_skb(struct sk_buff *skb)
 		rcu_read_unlock();
 	}
 #endif
-	return __netif_receive_skb(skb);
+	STOPWATCH_TIMER_START(t);
+	ret = __netif_receive_skb(skb);
+	STOPWATCH_TIMER_STOP(netif_receive_skb, t);
+	return ret;
 }
 EXPORT_SYMBOL(netif_receive_skb);
 
@@ -3756,10 +3769,13 @@ static int process_backlog(struct napi_struct *napi, int quota)
 	local_irq_disable();
 	while (1) {
 		struct sk_buff *skb;
+		STOPWATCH_TIMER(t);
 
 		while ((skb = __skb_dequeue(&sd->process_queue))) {
 			local_irq_enable();
+			STOPWATCH_TIMER_START(t);
 			__netif_receive_skb(skb);
+			STOPWATCH_TIMER_STOP(netif_receive_skb, t);
 			local_irq_disable();
 			input_queue_head_incr(sd);
 			if (++work >= quota) {
@@ -3876,11 +3892,45 @@ void netif_napi_del(struct napi_struct *napi)
 }
 EXPORT_SYMBOL(netif_napi_del);
 
+/*
+ * Work done by a NET_RX softirq round from which on it counts as a packet
+ * burst, one default NAPI weight.
+ */
+#define NET_RX_BURST_WORK 64
+
+static ATOMIC_NOTIFIER_HEAD(net_rx_burst_chain);
+
+/**
+ *	register_net_rx_burst_notifier - register a packet burst notifier
+ *	@nb: notifier
+ *
+ *	@nb is called on the CPU running the NET_RX softirq whenever a
+ *	softirq round processed at least %NET_RX_BURST_WORK packets or ran
+ *	out of budget. The notifier gets the number of processed packets and
+ *	the CPU's softnet_data, and runs in softirq context.
+ */
+int register_net_rx_burst_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&net_rx_burst_chain, nb);
+}
+EXPORT_SYMBOL(register_net_rx_burst_notifier);
+
+/**
+ *	unregister_net_rx_burst_notifier - unregister a packet burst notifier
+ *	@nb: notifier
+ */
+int unregister_net_rx_burst_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&net_rx_burst_chain, nb);
+}
+EXPORT_SYMBOL(unregister_net_rx_burst_notifier);
+
 static void net_rx_action(struct softirq_action *h)
 {
 	struct softnet_data *sd = &__get_cpu_var(softnet_data);
 	unsigned long time_limit = jiffies + 2;
 	int budget = netdev_budget;
+	int squeezed = 0;
 	void *have;
 
 	local_irq_disable();
@@ -3917,7 +3967,11 @@ static void net_rx_action(struct softirq_action *h)
 		 */
 		work = 0;
 		if (test_bit(NAPI_STATE_SCHED, &n->state)) {
+			STOPWATCH_TIMER(t);
+
+			STOPWATCH_TIMER_START(t);
 			work = n->poll(n, weight);
+			STOPWATCH_TIMER_STOP(napi_poll, t);
 			trace_napi_poll(n);
 		}
 
@@ -3946,6 +4000,10 @@ static void net_rx_action(struct softirq_action *h)
 out:
 	net_rps_action_and_irq_enable(sd);
 
+	if (squeezed || netdev_budget - budget >= NET_RX_BURST_WORK)
+		atomic_notifier_call_chain(&net_rx_burst_chain,
+					   netdev_budget - budget, sd);
+
 #ifdef CONFIG_NET_DMA
 	/*
 	 * There may not be any more sk_buffs coming right now, so push
@@ -3958,6 +4016,7 @@ out:
 
 softnet_break:
 	sd->time_squeeze++;
+	squeezed = 1;
 	__raise_softirq_irqoff(NET_RX_SOFTIRQ);
 	goto out;
 }
@@ -6620,6 +6679,8 @@ static int __init net_dev_init(void)
 	hotcpu_notifier(dev_cpu_callback, 0);
 	dst_init();
 	dev_mcast_init();
+	REGISTER_STOPWATCH(napi_poll);
+	REGISTER_STOPWATCH(netif_receive_skb);
 	rc = 0;
 out:
 	return rc;
@@ -344,9 +344,7 @@ struct sk_buff *__netdev_alloc_skb(struct net_device *dev,
 		return skb;
 	}
 
-	len = SKB_RECYCLE_SIZE;
-	if (unlikely(length > SKB_RECYCLE_SIZE))
-		len = length;
+	len = skb_recycle_alloc_size(length);
 
 	skb = __alloc_skb(len + NET_SKB_PAD, gfp_mask, 0, NUMA_NO_NODE);
 	if (unlikely(skb == NULL))
@@ -406,9 +404,7 @@ struct sk_buff *dev_alloc_skb(unsigned int length)
 		return skb;
 	}
 
-	len = SKB_RECYCLE_SIZE;
-	if (unlikely(length > SKB_RECYCLE_SIZE))
-		len = length;
+	len = skb_recycle_alloc_size(length);
 
 	/*
 	 * There is more code here than it seems:
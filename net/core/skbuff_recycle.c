@@ -17,55 +17,280 @@
  * Generic skb recycler
  *
  */
-#include <skbuff_recycle.h>
+#include "skbuff_recycle.h"
 #include <trace/events/skb.h>
 #include <linux/proc_fs.h>
 #include <linux/string.h>
 
 static struct proc_dir_entry *proc_net_skbrecycler;
 
-static DEFINE_PER_CPU(struct sk_buff_head, recycle_list);
+static DEFINE_PER_CPU(struct skb_recycle_pool [SKB_RECYCLE_NR_CLASSES],
+		      recycle_pools);
 static int skb_recycle_max_skbs = SKB_RECYCLE_MAX_SKBS;
 
 #ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-static DEFINE_PER_CPU(struct sk_buff_head, recycle_spare_list);
-static struct global_recycler glob_recycler;
 static int skb_recycle_spare_max_skbs = SKB_RECYCLE_SPARE_MAX_SKBS;
 #endif
 
-inline struct sk_buff *skb_recycler_alloc(struct net_device *dev, unsigned int length) {
-	unsigned long flags;
-	struct sk_buff_head *h;
-	struct sk_buff *skb = NULL;
+static const char * const skb_recycle_class_names[SKB_RECYCLE_NR_CLASSES] = {
+	[SKB_RECYCLE_CLASS_SMALL] = "small",
+	[SKB_RECYCLE_CLASS_MTU] = "mtu",
+	[SKB_RECYCLE_CLASS_JUMBO] = "jumbo",
+};
 
-	if (unlikely(length > SKB_RECYCLE_SIZE)) {
-		return NULL;
+static void skb_recycler_free_skb(struct sk_buff_head *list);
+
+/* Class an allocation of @length bytes is served from, or -1 */
+static inline int skb_recycle_alloc_class(unsigned int length)
+{
+	if (length <= SKB_RECYCLE_SMALL_SIZE)
+		return SKB_RECYCLE_CLASS_SMALL;
+	if (length <= SKB_RECYCLE_SIZE)
+		return SKB_RECYCLE_CLASS_MTU;
+	if (length <= SKB_RECYCLE_JUMBO_SIZE)
+		return SKB_RECYCLE_CLASS_JUMBO;
+	return -1;
+}
+
+/* Class a freed skb can be recycled into, judged by its buffer size */
+static inline int skb_recycle_consume_class(const struct sk_buff *skb)
+{
+	unsigned int size = skb_end_pointer(skb) - skb->head;
+
+	if (size >= SKB_DATA_ALIGN(SKB_RECYCLE_JUMBO_SIZE + NET_SKB_PAD)) {
+		if (size <= SKB_DATA_ALIGN(SKB_RECYCLE_JUMBO_MAX_SIZE +
+					   NET_SKB_PAD))
+			return SKB_RECYCLE_CLASS_JUMBO;
+		return -1;
 	}
 
-	h = &get_cpu_var(recycle_list);
-	local_irq_save(flags);
-	skb = __skb_dequeue(h);
+	if (size >= SKB_DATA_ALIGN(SKB_RECYCLE_SIZE + NET_SKB_PAD)) {
+		if (size <= SKB_DATA_ALIGN(SKB_RECYCLE_MAX_SIZE + NET_SKB_PAD))
+			return SKB_RECYCLE_CLASS_MTU;
+		return -1;
+	}
+
+	if (size <= SKB_DATA_ALIGN(SKB_RECYCLE_SMALL_MAX_SIZE + NET_SKB_PAD))
+		return SKB_RECYCLE_CLASS_SMALL;
+
+	return -1;
+}
+
+static int skb_recycle_class_max_skbs(int c)
+{
+	switch (c) {
+	case SKB_RECYCLE_CLASS_SMALL:
+		return SKB_RECYCLE_SMALL_MAX_SKBS;
+	case SKB_RECYCLE_CLASS_JUMBO:
+		return SKB_RECYCLE_JUMBO_MAX_SKBS;
+	default:
+		return skb_recycle_max_skbs;
+	}
+}
+
+/* End of an adaptation window: grow the pool if too many allocations
+ * missed, shrink it if a good part of it sat unused for the whole
+ * window.  Buffers above the new depth are moved to @trim so that the
+ * caller can free them once interrupts are enabled again.
+ * Called with interrupts disabled on the pool's own CPU.
+ */
+static void skb_recycler_adapt(struct skb_recycle_pool *p,
+			       struct sk_buff_head *trim)
+{
+	int floor = min(SKB_RECYCLE_MIN_DEPTH, p->max_depth);
+
+	if ((p->window_misses << SKB_RECYCLE_ADAPT_MISS_SHIFT) >
+	    p->window_allocs) {
+		if (p->depth < p->max_depth) {
+			p->depth = min(max(p->depth * 2, floor), p->max_depth);
+			p->stats.grows++;
+		}
+	} else if (p->low_water > (unsigned int)p->depth / 4 &&
+		   p->depth > floor) {
+		p->depth = max(p->depth - (int)(p->low_water / 2), floor);
+		p->stats.shrinks++;
+	}
+
+	if (p->depth > p->max_depth)
+		p->depth = p->max_depth;
+
+	while (skb_queue_len(&p->list) > p->depth)
+		__skb_queue_tail(trim, __skb_dequeue_tail(&p->list));
+
+	p->window = 0;
+	p->window_allocs = 0;
+	p->window_misses = 0;
+	p->low_water = skb_queue_len(&p->list);
+}
+
 #ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-	if (unlikely(!skb)) {
-		uint8_t head;
-		spin_lock(&glob_recycler.lock);
-		/* If global recycle list is not empty, use global buffers */
-		head = glob_recycler.head;
-		if (likely(head != glob_recycler.tail)) {
-			/* Move SKBs from global list to CPU pool */
-			skb_queue_splice_init(&glob_recycler.pool[head], h);
-			head = (head + 1) & SKB_RECYCLE_MAX_SHARED_POOLS_MASK;
-			glob_recycler.head = head;
-			spin_unlock(&glob_recycler.lock);
-			/* We have refilled the CPU pool - dequeue */
-			skb = __skb_dequeue(h);
-		} else {
-			spin_unlock(&glob_recycler.lock);
+/* Publish @list as one batch on our own return ring.  Only the owning
+ * CPU calls this, with interrupts disabled.
+ */
+static bool skb_recycle_ring_put(struct skb_recycle_ring *r,
+				 struct sk_buff_head *list)
+{
+	struct skb_recycle_batch *b;
+	unsigned long tail = r->tail;
+
+	if (tail - ACCESS_ONCE(r->head) >= SKB_RECYCLE_MAX_SHARED_POOLS)
+		return false;
+
+	/* Consumers that read the slot's old contents have claimed it by
+	 * moving head; make sure we see that before overwriting the slot.
+	 */
+	smp_mb();
+
+	b = &r->slot[tail & SKB_RECYCLE_MAX_SHARED_POOLS_MASK];
+	b->first = list->next;
+	b->last = list->prev;
+	b->qlen = list->qlen;
+
+	/* Slot contents must be visible before the new tail */
+	smp_wmb();
+	ACCESS_ONCE(r->tail) = tail + 1;
+
+	__skb_queue_head_init(list);
+	return true;
+}
+
+/* Claim the oldest batch on a return ring; safe from any CPU */
+static bool skb_recycle_ring_get(struct skb_recycle_ring *r,
+				 struct skb_recycle_batch *b)
+{
+	unsigned long head;
+
+	do {
+		head = ACCESS_ONCE(r->head);
+		if (head == ACCESS_ONCE(r->tail))
+			return false;
+
+		/* Pairs with smp_wmb() in skb_recycle_ring_put() */
+		smp_rmb();
+		*b = r->slot[head & SKB_RECYCLE_MAX_SHARED_POOLS_MASK];
+	} while (cmpxchg(&r->head, head, head + 1) != head);
+
+	return true;
+}
+
+static void skb_recycle_batch_splice(struct skb_recycle_batch *b,
+				     struct sk_buff_head *list)
+{
+	struct sk_buff_head tmp;
+
+	tmp.next = b->first;
+	tmp.prev = b->last;
+	tmp.qlen = b->qlen;
+	skb_queue_splice(&tmp, list);
+}
+
+static void skb_recycle_ring_drain(struct skb_recycle_ring *r,
+				   struct sk_buff_head *list)
+{
+	struct skb_recycle_batch b;
+
+	while (skb_recycle_ring_get(r, &b))
+		skb_recycle_batch_splice(&b, list);
+}
+
+/* The hot list of @p is empty: refill it from our own spare list or,
+ * failing that, from a batch another CPU returned.
+ */
+static struct sk_buff *skb_recycler_refill(struct skb_recycle_pool *p, int c)
+{
+	struct skb_recycle_batch b;
+	int this_cpu = smp_processor_id();
+	int cpu = this_cpu;
+
+	if (!skb_queue_empty(&p->spare)) {
+		skb_queue_splice_init(&p->spare, &p->list);
+		return __skb_dequeue(&p->list);
+	}
+
+	/* Start with the next CPU so that the rings are drained evenly;
+	 * our own ring is tried last.
+	 */
+	do {
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+
+		if (skb_recycle_ring_get(&per_cpu(recycle_pools, cpu)[c].ring,
+					 &b)) {
+			p->stats.ring_gets++;
+			skb_recycle_batch_splice(&b, &p->list);
+			return __skb_dequeue(&p->list);
 		}
+	} while (cpu != this_cpu);
+
+	return NULL;
+}
+
+static bool skb_recycler_spare_push(struct skb_recycle_pool *p,
+				    struct sk_buff *skb)
+{
+	struct sk_buff_head *h = &p->spare;
+
+	if (unlikely(!skb_recycle_spare_max_skbs))
+		return false;
+
+	/* A full spare list is handed over to the return ring as a whole
+	 * for other CPUs to pick up.
+	 */
+	if (unlikely(skb_queue_len(h) >= skb_recycle_spare_max_skbs)) {
+		if (!skb_recycle_ring_put(&p->ring, h))
+			return false;
+		p->stats.ring_puts++;
 	}
+
+	__skb_queue_head(h, skb);
+	return true;
+}
+#else
+static inline bool skb_recycler_spare_push(struct skb_recycle_pool *p,
+					   struct sk_buff *skb)
+{
+	return false;
+}
+#endif /* CONFIG_SKB_RECYCLER_MULTI_CPU */
+
+struct sk_buff *skb_recycler_alloc(struct net_device *dev, unsigned int length)
+{
+	unsigned long flags;
+	struct skb_recycle_pool *p;
+	struct sk_buff_head trim;
+	struct sk_buff *skb;
+	int c;
+
+	c = skb_recycle_alloc_class(length);
+	if (unlikely(c < 0))
+		return NULL;
+
+	__skb_queue_head_init(&trim);
+
+	local_irq_save(flags);
+	p = &__get_cpu_var(recycle_pools)[c];
+	skb = __skb_dequeue(&p->list);
+#ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
+	if (unlikely(!skb))
+		skb = skb_recycler_refill(p, c);
 #endif
+	p->window_allocs++;
+	if (likely(skb)) {
+		p->stats.hits++;
+		if (skb_queue_len(&p->list) < p->low_water)
+			p->low_water = skb_queue_len(&p->list);
+	} else {
+		p->stats.misses++;
+		p->window_misses++;
+	}
+
+	if (unlikely(++p->window >= SKB_RECYCLE_ADAPT_WINDOW))
+		skb_recycler_adapt(p, &trim);
 	local_irq_restore(flags);
-	put_cpu_var(recycle_list);
+
+	if (unlikely(!skb_queue_empty(&trim)))
+		skb_recycler_free_skb(&trim);
 
 	if (likely(skb)) {
 		struct skb_shared_info *shinfo;
@@ -96,99 +321,91 @@ inline struct sk_buff *skb_recycler_alloc(struct net_device *dev, unsigned int l
 	return skb;
 }
 
-inline bool skb_recycler_consume(struct sk_buff *skb) {
+bool skb_recycler_consume(struct sk_buff *skb)
+{
 	unsigned long flags;
-	struct sk_buff_head *h;
+	struct skb_recycle_pool *p;
+	struct sk_buff_head trim;
+	bool recycled = true;
+	int c;
 
 	/* Can we recycle this skb?  If not, simply return that we cannot */
-	if (unlikely(!consume_skb_can_recycle(skb, SKB_RECYCLE_MIN_SIZE,
-					      SKB_RECYCLE_MAX_SIZE)))
+	if (unlikely(!consume_skb_can_recycle(skb, SKB_RECYCLE_SMALL_SIZE,
+					      SKB_RECYCLE_JUMBO_MAX_SIZE)))
 		return false;
 
+	c = skb_recycle_consume_class(skb);
+	if (unlikely(c < 0))
+		return false;
+
+	__skb_queue_head_init(&trim);
+
 	/* If we can, then it will be much faster for us to recycle this one
 	 * later than to allocate a new one from scratch.
 	 */
-	preempt_disable();
-	h = &__get_cpu_var(recycle_list);
 	local_irq_save(flags);
-	/* Attempt to enqueue the CPU hot recycle list first */
-	if (likely(skb_queue_len(h) < skb_recycle_max_skbs)) {
-		__skb_queue_head(h, skb);
-		local_irq_restore(flags);
-		preempt_enable();
-		return true;
-	}
-#ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-	h = &__get_cpu_var(recycle_spare_list);
-
-	/* The CPU hot recycle list was full; if the spare list is also full,
-	 * attempt to move the spare list to the global list for other CPUs to
-	 * use.
-	 */
-	if (unlikely(skb_queue_len(h) >= skb_recycle_spare_max_skbs)) {
-		uint8_t cur_tail, next_tail;
-		spin_lock(&glob_recycler.lock);
-		cur_tail = glob_recycler.tail;
-		next_tail = (cur_tail + 1) & SKB_RECYCLE_MAX_SHARED_POOLS_MASK;
-		if (next_tail != glob_recycler.head) {
-			struct sk_buff_head *p = &glob_recycler.pool[cur_tail];
-
-			/* Move SKBs from CPU pool to Global pool*/
-			skb_queue_splice_init(h, p);
-
-			/* Done with global list init */
-			glob_recycler.tail = next_tail;
-			spin_unlock(&glob_recycler.lock);
-
-			/* We have now cleared room in the spare;
-			 * Intialize and enqueue skb into spare
-			 */
-			__skb_queue_head(h, skb);
-
-			local_irq_restore(flags);
-			preempt_enable();
-			return true;
-		}
-		/* We still have a full spare because the global is also full */
-		spin_unlock(&glob_recycler.lock);
-	} else {
-		/* We have room in the spare list; enqueue to spare list */
-		__skb_queue_head(h, skb);
-		local_irq_restore(flags);
-		preempt_enable();
-		return true;
-	}
-#endif
+	p = &__get_cpu_var(recycle_pools)[c];
 
+	/* Attempt to enqueue the CPU hot recycle list first */
+	if (likely(skb_queue_len(&p->list) < p->depth))
+		__skb_queue_head(&p->list, skb);
+	else
+		recycled = skb_recycler_spare_push(p, skb);
+
+	if (likely(recycled))
+		p->stats.recycled++;
+	else
+		p->stats.overflows++;
+
+	if (unlikely(++p->window >= SKB_RECYCLE_ADAPT_WINDOW))
+		skb_recycler_adapt(p, &trim);
 	local_irq_restore(flags);
-	preempt_enable();
 
-	return false;
+	if (unlikely(!skb_queue_empty(&trim)))
+		skb_recycler_free_skb(&trim);
+
+	return recycled;
 }
 
 static void skb_recycler_free_skb(struct sk_buff_head *list)
 {
 	struct sk_buff *skb = NULL;
 
-	while ((skb = skb_dequeue(list)) != NULL) {
+	while ((skb = __skb_dequeue(list)) != NULL) {
 		trace_consume_skb(skb);
 		skb_release_data(skb);
 		kfree_skbmem(skb);
 	}
 }
 
+/* Move everything a CPU's pools hold onto @list.  Must run either on
+ * @cpu with interrupts disabled or after @cpu has gone away.
+ */
+static void skb_recycler_collect(int cpu, struct sk_buff_head *list)
+{
+	struct skb_recycle_pool *p;
+	int c;
+
+	for (c = 0; c < SKB_RECYCLE_NR_CLASSES; c++) {
+		p = &per_cpu(recycle_pools, cpu)[c];
+		skb_queue_splice_init(&p->list, list);
+#ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
+		skb_queue_splice_init(&p->spare, list);
+		skb_recycle_ring_drain(&p->ring, list);
+#endif
+	}
+}
+
 static int skb_cpu_callback(struct notifier_block *nfb,
 		unsigned long action, void *ocpu)
 {
 	unsigned long oldcpu = (unsigned long)ocpu;
+	struct sk_buff_head tmp;
 
 	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN) {
-		skb_recycler_free_skb(&per_cpu(recycle_list, oldcpu));
-#ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-		spin_lock(&glob_recycler.lock);
-		skb_recycler_free_skb(&per_cpu(recycle_spare_list, oldcpu));
-		spin_unlock(&glob_recycler.lock);
-#endif
+		__skb_queue_head_init(&tmp);
+		skb_recycler_collect(oldcpu, &tmp);
+		skb_recycler_free_skb(&tmp);
 	}
 
 	return NOTIFY_OK;
@@ -208,7 +425,8 @@ static int __init skb_prealloc_init_list(void)
 
 		skb_reserve(skb, NET_SKB_PAD);
 
-		skb_recycler_consume(skb);
+		if (!skb_recycler_consume(skb))
+			__kfree_skb(skb);
 	}
 	return 0;
 }
@@ -218,36 +436,49 @@ static int __init skb_prealloc_init_list(void)
  */
 static int proc_skb_count_show(struct seq_file *seq, void *v)
 {
+	struct skb_recycle_pool *p;
 	int cpu;
 	int len;
 	int total;
+	int c;
 #ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-	unsigned int i;
+	unsigned long i, tail;
 #endif
 
 	total = 0;
 
-	for_each_online_cpu(cpu) {
-		len = skb_queue_len(&per_cpu(recycle_list, cpu));
-		seq_printf(seq, "recycle_list[%d]: %d\n", cpu, len);
-		total += len;
-	}
+	for (c = 0; c < SKB_RECYCLE_NR_CLASSES; c++) {
+		for_each_online_cpu(cpu) {
+			p = &per_cpu(recycle_pools, cpu)[c];
+			len = skb_queue_len(&p->list);
+			seq_printf(seq, "recycle_list[%s][%d]: %d\n",
+				   skb_recycle_class_names[c], cpu, len);
+			total += len;
+		}
 
 #ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-	for_each_online_cpu(cpu) {
-		len = skb_queue_len(&per_cpu(recycle_spare_list, cpu));
-		seq_printf(seq, "recycle_spare_list[%d]: %d\n", cpu, len);
-		total += len;
-	}
+		for_each_online_cpu(cpu) {
+			p = &per_cpu(recycle_pools, cpu)[c];
+			len = skb_queue_len(&p->spare);
+			seq_printf(seq, "recycle_spare_list[%s][%d]: %d\n",
+				   skb_recycle_class_names[c], cpu, len);
+			total += len;
+		}
 
-	spin_lock(&glob_recycler.lock);
-	for (i = 0; i < SKB_RECYCLE_MAX_SHARED_POOLS; i++) {
-		len = skb_queue_len(&glob_recycler.pool[i]);
-		seq_printf(seq, "global_list[%d]: %d\n", i, len);
-		total += len;
-	}
-	spin_unlock(&glob_recycler.lock);
+		/* Racy snapshot; good enough for statistics */
+		for_each_online_cpu(cpu) {
+			p = &per_cpu(recycle_pools, cpu)[c];
+			len = 0;
+			tail = ACCESS_ONCE(p->ring.tail);
+			for (i = ACCESS_ONCE(p->ring.head); i != tail; i++)
+				len += p->ring.slot[i &
+					SKB_RECYCLE_MAX_SHARED_POOLS_MASK].qlen;
+			seq_printf(seq, "return_ring[%s][%d]: %d\n",
+				   skb_recycle_class_names[c], cpu, len);
+			total += len;
+		}
 #endif
+	}
 
 	seq_printf(seq, "total: %d\n", total);
 	return 0;
@@ -266,31 +497,61 @@ static const struct file_operations proc_skb_count_fops = {
 	.release = single_release,
 };
 
+/* procfs: stats
+ */
+static int proc_skb_stats_show(struct seq_file *seq, void *v)
+{
+	struct skb_recycle_pool *p;
+	int cpu;
+	int c;
+
+	for (c = 0; c < SKB_RECYCLE_NR_CLASSES; c++) {
+		for_each_online_cpu(cpu) {
+			p = &per_cpu(recycle_pools, cpu)[c];
+			seq_printf(seq, "%s[%d]: depth %d/%d len %u hits %lu "
+				   "misses %lu recycled %lu overflows %lu "
+				   "ring_puts %lu ring_gets %lu grows %lu "
+				   "shrinks %lu\n",
+				   skb_recycle_class_names[c], cpu,
+				   p->depth, p->max_depth,
+				   skb_queue_len(&p->list),
+				   p->stats.hits, p->stats.misses,
+				   p->stats.recycled, p->stats.overflows,
+				   p->stats.ring_puts, p->stats.ring_gets,
+				   p->stats.grows, p->stats.shrinks);
+		}
+	}
+
+	return 0;
+}
+
+static int proc_skb_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, proc_skb_stats_show, PDE(inode)->data);
+}
+
+static const struct file_operations proc_skb_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = proc_skb_stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
 /* procfs: flush
  */
 static void skb_recycler_flush_task(struct work_struct *work)
 {
 	unsigned long flags;
-	struct sk_buff_head *h;
 	struct sk_buff_head tmp;
 
-	skb_queue_head_init(&tmp);
+	__skb_queue_head_init(&tmp);
 
-	h = &get_cpu_var(recycle_list);
 	local_irq_save(flags);
-	skb_queue_splice_init(h, &tmp);
+	skb_recycler_collect(smp_processor_id(), &tmp);
 	local_irq_restore(flags);
-	put_cpu_var(recycle_list);
-	skb_recycler_free_skb(&tmp);
 
-#ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-	h = &get_cpu_var(recycle_spare_list);
-	local_irq_save(flags);
-	skb_queue_splice_init(h, &tmp);
-	local_irq_restore(flags);
-	put_cpu_var(recycle_spare_list);
 	skb_recycler_free_skb(&tmp);
-#endif
 }
 
 static ssize_t proc_skb_flush_write(struct file *file,
@@ -298,22 +559,9 @@ static ssize_t proc_skb_flush_write(struct file *file,
 				    size_t count,
 				    loff_t *ppos)
 {
-#ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-	unsigned int i;
-	unsigned long flags;
-#endif
 	schedule_on_each_cpu(&skb_recycler_flush_task);
 
-#ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-	spin_lock_irqsave(&glob_recycler.lock, flags);
-	for (i = 0; i < SKB_RECYCLE_MAX_SHARED_POOLS; i++)
-		skb_recycler_free_skb(&glob_recycler.pool[i]);
-	glob_recycler.head = 0;
-	glob_recycler.tail = 0;
-	spin_unlock_irqrestore(&glob_recycler.lock, flags);
-#endif
 	return count;
-
 }
 
 static const struct file_operations proc_skb_flush_fops = {
@@ -342,6 +590,8 @@ static ssize_t proc_skb_max_skbs_write(struct file *file,
 {
 	int ret;
 	int max;
+	int cpu;
+	struct skb_recycle_pool *p;
 	char buffer[PROC_NUMBUF];
 
 	memset(buffer, 0, sizeof(buffer));
@@ -350,9 +600,18 @@ static ssize_t proc_skb_max_skbs_write(struct file *file,
 	if (copy_from_user(buffer, buf, count) != 0)
 		return -EFAULT;
 	ret = kstrtoint(strstrip(buffer), 10, &max);
-	if (ret == 0 && max >= 0)
+	if (ret == 0 && max >= 0) {
 		skb_recycle_max_skbs = max;
 
+		/* The pools pick up the new ceiling (and trim themselves
+		 * down to it) at the end of their current window.
+		 */
+		for_each_possible_cpu(cpu) {
+			p = &per_cpu(recycle_pools, cpu)[SKB_RECYCLE_CLASS_MTU];
+			p->max_depth = max;
+		}
+	}
+
 	return count;
 }
 
@@ -424,6 +683,12 @@ static void skb_recycler_init_procfs(void)
 			 &proc_skb_count_fops))
 		pr_err("cannot create proc net skb_recycle held\n");
 
+	if (!proc_create("stats",
+			 S_IRUGO,
+			 proc_net_skbrecycler,
+			 &proc_skb_stats_fops))
+		pr_err("cannot create proc net skb_recycle stats\n");
+
 	if (!proc_create("flush",
 			 S_IWUGO,
 			 proc_net_skbrecycler,
@@ -445,28 +710,23 @@ static void skb_recycler_init_procfs(void)
 #endif
 }
 
-void __init skb_recycler_init() {
+void __init skb_recycler_init(void)
+{
+	struct skb_recycle_pool *p;
 	int cpu;
+	int c;
 
 	for_each_possible_cpu(cpu) {
-		skb_queue_head_init(&per_cpu(recycle_list, cpu));
-	}
-
+		for (c = 0; c < SKB_RECYCLE_NR_CLASSES; c++) {
+			p = &per_cpu(recycle_pools, cpu)[c];
+			skb_queue_head_init(&p->list);
+			p->max_depth = skb_recycle_class_max_skbs(c);
+			p->depth = p->max_depth;
 #ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-	for_each_possible_cpu(cpu) {
-		skb_queue_head_init(&per_cpu(recycle_spare_list, cpu));
-	}
-
-	spin_lock_init(&glob_recycler.lock);
-	{
-		unsigned int i;
-		for (i = 0; i < SKB_RECYCLE_MAX_SHARED_POOLS; i++) {
-			skb_queue_head_init(&glob_recycler.pool[i]);
+			skb_queue_head_init(&p->spare);
+#endif
 		}
-		glob_recycler.head = 0;
-		glob_recycler.tail = 0;
 	}
-#endif
 
 #ifdef CONFIG_SKB_RECYCLER_PREALLOC
 	if (skb_prealloc_init_list())
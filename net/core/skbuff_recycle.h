@@ -44,10 +44,39 @@
 
 
 
+/* Recycled buffers are kept in a few size classes so that small ACK/DNS
+ * buffers, MTU sized RX buffers and jumbo/A-MSDU buffers each find a
+ * suitably sized skb without pinning a 4K buffer for a 64 byte frame.
+ * The MIN size is what an allocation from the class is guaranteed to
+ * hold; the MAX size is the largest buffer we accept back into it.
+ */
+#define SKB_RECYCLE_CLASS_SMALL	0
+#define SKB_RECYCLE_CLASS_MTU	1
+#define SKB_RECYCLE_CLASS_JUMBO	2
+#define SKB_RECYCLE_NR_CLASSES	3
+
+#define SKB_RECYCLE_SMALL_SIZE		512
+#define SKB_RECYCLE_SMALL_MAX_SIZE	(832 - NET_SKB_PAD)
+
 #define SKB_RECYCLE_SIZE	2304
 #define SKB_RECYCLE_MIN_SIZE	SKB_RECYCLE_SIZE
 #define SKB_RECYCLE_MAX_SIZE	(3904 - NET_SKB_PAD)
-#define SKB_RECYCLE_MAX_SKBS    2048	
+
+#define SKB_RECYCLE_JUMBO_SIZE		9216
+#define SKB_RECYCLE_JUMBO_MAX_SIZE	(16192 - NET_SKB_PAD)
+
+#define SKB_RECYCLE_MAX_SKBS    2048
+#define SKB_RECYCLE_SMALL_MAX_SKBS	1024
+#define SKB_RECYCLE_JUMBO_MAX_SKBS	128
+
+/* Adaptive depth: every SKB_RECYCLE_ADAPT_WINDOW operations on a per-CPU
+ * class pool the hit/miss ratio is checked.  More than 1 miss in
+ * 2^SKB_RECYCLE_ADAPT_MISS_SHIFT allocations doubles the depth; a pool
+ * that never dropped below a quarter of its depth is shrunk.
+ */
+#define SKB_RECYCLE_ADAPT_WINDOW	1024
+#define SKB_RECYCLE_ADAPT_MISS_SHIFT	3
+#define SKB_RECYCLE_MIN_DEPTH		32
 
 #define SKB_RECYCLE_SPARE_MAX_SKBS		256
 
@@ -62,15 +91,55 @@
 
 #define SKB_RECYCLE_MAX_SHARED_POOLS_MASK	(SKB_RECYCLE_MAX_SHARED_POOLS - 1)
 
+struct skb_recycle_stats {
+	unsigned long hits;	/* allocations served from the pool */
+	unsigned long misses;	/* allocations that fell back to slab */
+	unsigned long recycled;	/* frees taken back into the pool */
+	unsigned long overflows;	/* frees the pool had no room for */
+	unsigned long ring_gets;	/* batches taken from a return ring */
+	unsigned long ring_puts;	/* batches pushed to our return ring */
+	unsigned long grows;
+	unsigned long shrinks;
+};
+
 #ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
-struct global_recycler {
-	/* Global circular list which holds the shared skb pools */
-	struct sk_buff_head pool[SKB_RECYCLE_MAX_SHARED_POOLS];
-	uint8_t head;		/* head of the circular list */
-	uint8_t tail;		/* tail of the circular list */
-	spinlock_t lock;
+/* A batch of skbs moved between CPUs in one go; first/last/qlen are
+ * exactly what skb_queue_splice() needs to link it into a list.
+ */
+struct skb_recycle_batch {
+	struct sk_buff *first;
+	struct sk_buff *last;
+	__u32 qlen;
 };
+
+/* Per-CPU return ring.  Only the owning CPU produces into it (from the
+ * free path, with interrupts disabled) so tail needs no atomics; any CPU
+ * may consume, claiming a slot with cmpxchg() on head.  head and tail
+ * only ever increase, so a consumer whose slot was reused in the
+ * meantime is guaranteed to lose the cmpxchg().
+ */
+struct skb_recycle_ring {
+	unsigned long head ____cacheline_aligned_in_smp;
+	unsigned long tail ____cacheline_aligned_in_smp;
+	struct skb_recycle_batch slot[SKB_RECYCLE_MAX_SHARED_POOLS];
+};
+#endif
+
+/* Per-CPU, per size class recycle state */
+struct skb_recycle_pool {
+	struct sk_buff_head list;
+	int depth;		/* current adaptive limit on list length */
+	int max_depth;		/* ceiling for depth */
+	unsigned int window;	/* operations in the current window */
+	unsigned int window_allocs;
+	unsigned int window_misses;
+	unsigned int low_water;	/* shortest list length seen in window */
+	struct skb_recycle_stats stats;
+#ifdef CONFIG_SKB_RECYCLER_MULTI_CPU
+	struct sk_buff_head spare;
+	struct skb_recycle_ring ring;
 #endif
+};
 
 static inline void zero_struct(void *v, int size)
 {
@@ -151,6 +220,27 @@ static inline bool consume_skb_can_recycle(const struct sk_buff *skb,
 	return true;
 }
 
+/* Size to allocate for a @length byte request so that the buffer lands
+ * in a recycle class when it is freed.  Lengths that already fit a class,
+ * or that no class takes back, are left alone.
+ */
+static inline unsigned int skb_recycle_alloc_size(unsigned int length)
+{
+#ifdef CONFIG_SKB_RECYCLER
+	if (length <= SKB_RECYCLE_SMALL_SIZE)
+		return SKB_RECYCLE_SMALL_SIZE;
+	if (length <= SKB_RECYCLE_SMALL_MAX_SIZE)
+		return length;
+	if (length <= SKB_RECYCLE_SIZE)
+		return SKB_RECYCLE_SIZE;
+	if (length <= SKB_RECYCLE_MAX_SIZE)
+		return length;
+	if (length <= SKB_RECYCLE_JUMBO_SIZE)
+		return SKB_RECYCLE_JUMBO_SIZE;
+#endif
+	return length;
+}
+
 #ifdef CONFIG_SKB_RECYCLER
 
 void __init skb_recycler_init(void);
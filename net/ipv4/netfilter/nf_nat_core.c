@@ -60,21 +60,38 @@ hash_by_src(const struct net *net, u16 zone,
 	return ((u64)hash * net->ipv4.nat_htable_size) >> 32;
 }
 
+#if defined(CONFIG_IP_NF_TARGET_SNATP2P) || defined(CONFIG_IP_NF_TARGET_SNATP2P_MODULE) || defined(CONFIG_IP_NF_TARGET_HAIRPIN) || defined(CONFIG_IP_NF_TARGET_HAIRPIN_MODULE)
 static int modified_src_occupied(const struct nf_conntrack_tuple *tuple,
 				 const struct nf_conn *conntrack);
 
+/*
+ * P2P mappings are kept in nat_by_modified_source, keyed on their external
+ * endpoint (address, port, protocol), so both the port allocator and the
+ * inbound lookup find a mapping in one chain, whatever the number of
+ * conntracks.
+ */
 static inline unsigned int
-hash_by_dst(const struct net *net, const struct nf_conntrack_tuple *tuple)
+hash_by_mapping(const struct net *net, __be32 ip, __be16 port,
+		u_int8_t protonum)
 {
 	unsigned int hash;
 
-	/* Reply dst, to ensure we map it consistently if poss. */
-	hash = jhash_3words((__force u32)tuple->dst.u3.ip,
-			    (__force u32)tuple->dst.u.all,
-			    tuple->dst.protonum, 0);
+	hash = jhash_3words((__force u32)ip, (__force u32)port, protonum,
+			    nf_conntrack_hash_rnd);
 	return ((u64)hash * net->ipv4.nat_htable_size) >> 32;
 }
 
+/* Tuple of a P2P conntrack going from the remote end to the mapping */
+static inline const struct nf_conntrack_tuple *
+p2p_mapping_tuple(const struct nf_conn *ct)
+{
+	if (ct->status & IPS_SNATP2P_DST)
+		return &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+	else
+		return &ct->tuplehash[IP_CT_DIR_REPLY].tuple;
+}
+#endif
+
 /* Is this tuple already taken? (not by us) */
 int
 nf_nat_used_tuple(const struct nf_conntrack_tuple *tuple,
@@ -170,29 +187,48 @@ find_appropriate_src(struct net *net, u16 zone,
 	return 0;
 }
 
+#if defined(CONFIG_IP_NF_TARGET_SNATP2P) || defined(CONFIG_IP_NF_TARGET_SNATP2P_MODULE) || defined(CONFIG_IP_NF_TARGET_HAIRPIN) || defined(CONFIG_IP_NF_TARGET_HAIRPIN_MODULE)
 static inline int
 same_modified_src(const struct nf_conn *ct,
 		  const struct nf_conntrack_tuple *tuple)
 {
-	const struct nf_conntrack_tuple *t;
-
-	if (ct->status & IPS_SNATP2P_DST)
-		t = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
-	else
-		t = &ct->tuplehash[IP_CT_DIR_REPLY].tuple;
+	const struct nf_conntrack_tuple *t = p2p_mapping_tuple(ct);
 
 	return (t->dst.protonum == tuple->dst.protonum &&
 		t->dst.u3.ip == tuple->src.u3.ip &&
 		t->dst.u.all == tuple->src.u.all);
 }
 
-#if defined(CONFIG_IP_NF_TARGET_SNATP2P) || defined(CONFIG_IP_NF_TARGET_SNATP2P_MODULE) || defined(CONFIG_IP_NF_TARGET_HAIRPIN) || defined(CONFIG_IP_NF_TARGET_HAIRPIN_MODULE)
+/*
+ * Whether the remote end of tuple may come in through the mapping of ct,
+ * under the current sysctl_nat_filtering_behavior.  Checked on lookup, so
+ * the behavior can change at any time.
+ */
+static inline int
+p2p_filter_allows(const struct nf_conn *ct,
+		  const struct nf_conntrack_tuple *tuple)
+{
+	const struct nf_conntrack_tuple *t = p2p_mapping_tuple(ct);
+
+	switch (ACCESS_ONCE(sysctl_nat_filtering_behavior)) {
+	case NF_NAT_FILTERING_OPEN:
+		return 1;
+	case NF_NAT_FILTERING_PORT_RESTRICTED:
+		if (t->src.u.all != tuple->dst.u.all)
+			return 0;
+		/* fall through */
+	default:
+		return t->src.u3.ip == tuple->dst.u3.ip;
+	}
+}
+
 static int
 modified_src_occupied(const struct nf_conntrack_tuple *tuple,
 		      const struct nf_conn *conntrack)
 {
 	struct net *net = nf_ct_net(conntrack);
-	unsigned int h = hash_by_src(net, 0, tuple);
+	unsigned int h = hash_by_mapping(net, tuple->src.u3.ip, tuple->src.u.all,
+					 tuple->dst.protonum);
 	const struct nf_conn_nat *nat;
 	const struct nf_conn *ct;
 	const struct hlist_node *n;
@@ -214,12 +250,18 @@ modified_src_occupied(const struct nf_conntrack_tuple *tuple,
 	return 0;
 }
 
+/*
+ * find_appropriate_p2p_dst()
+ *	Looks up the P2P mapping the reply to tuple would come back through,
+ *	and whether its filtering behavior lets the remote end in.  Lockless.
+ */
 int
 find_appropriate_p2p_dst(struct net *net,
 			 const struct nf_conntrack_tuple *tuple,
 			 struct nf_conntrack_tuple *result)
 {
-	unsigned int h = hash_by_src(net, 0, tuple);
+	unsigned int h = hash_by_mapping(net, tuple->src.u3.ip, tuple->src.u.all,
+					 tuple->dst.protonum);
 	const struct nf_conn_nat *nat;
 	const struct nf_conn *ct;
 	const struct hlist_node *n;
@@ -227,7 +269,9 @@ find_appropriate_p2p_dst(struct net *net,
 	rcu_read_lock();
 	hlist_for_each_entry_rcu(nat, n, &net->ipv4.nat_by_modified_source[h], by_modified_source) {
 		ct = nat->ct;
-		if (same_modified_src(ct, tuple)) {
+		if (same_modified_src(ct, tuple) &&
+		    !test_bit(IPS_DYING_BIT, &ct->status) &&
+		    p2p_filter_allows(ct, tuple)) {
 			nf_ct_invert_tuplepr(result, ct->status & IPS_SNATP2P_DST
 					? &ct->tuplehash[IP_CT_DIR_REPLY].tuple
 					: &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
@@ -460,11 +504,11 @@ nf_nat_setup_info(struct nf_conn *ct,
 
 #if defined(CONFIG_IP_NF_TARGET_SNATP2P) || defined(CONFIG_IP_NF_TARGET_SNATP2P_MODULE) || defined(CONFIG_IP_NF_TARGET_HAIRPIN) || defined(CONFIG_IP_NF_TARGET_HAIRPIN_MODULE)
 	if (have_to_hash_modified) {
+		const struct nf_conntrack_tuple *t = p2p_mapping_tuple(ct);
 		unsigned int dsthash;
 
-		dsthash = hash_by_dst(net, ct->status & IPS_SNATP2P_SRC
-				? &ct->tuplehash[IP_CT_DIR_REPLY].tuple
-				: &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
+		dsthash = hash_by_mapping(net, t->dst.u3.ip, t->dst.u.all,
+					  t->dst.protonum);
 		spin_lock_bh(&nf_nat_lock);
 		nat = nfct_nat(ct);
 		if (maniptype == NF_NAT_MANIP_DST)
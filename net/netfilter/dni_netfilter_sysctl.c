@@ -7,6 +7,7 @@
 #ifdef CONFIG_SYSCTL
 #include <linux/module.h>
 #include <linux/sysctl.h>
+#include <linux/netfilter/nf_nat.h>
 #include <net/netfilter/nf_conntrack.h>
 
 #include <linux/rculist_nulls.h>
@@ -73,84 +74,7 @@ static int proc_flush_conntrack(ctl_table * ctl,
 }
 
 #if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
-#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
-static int reset_single_udp_conntrack_hash(unsigned int old_size,
-					   const int nat_filtering_behavior)
-{
-	int i, bucket;
-	unsigned int hashsize;
-	struct hlist_nulls_head *hash, *old_hash;
-	struct nf_conn *ct;
-
-	if (!old_size)
-		return -EINVAL;
-
-	hashsize = nf_conntrack_htable_size;
-	hash = nf_ct_alloc_hashtable(&hashsize, 1);
-	if (!hash)
-		return -ENOMEM;
-
-	spin_lock_bh(&nf_conntrack_lock);
-	for (i = 0; i < old_size; i++) {
-		while (!hlist_nulls_empty(&single_udp_ct_hash[i])) {
-			ct = hlist_nulls_entry(single_udp_ct_hash[i].first, struct nf_conn, hashnode);
-			hlist_nulls_del_rcu(&ct->hashnode);
-			if (ct->status & IPS_SRC_NAT)
-				bucket = single_udp_hash_conntrack(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
-								   nat_filtering_behavior);
-			else
-				bucket = single_udp_hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple,
-								   nat_filtering_behavior);
-
-			hlist_nulls_add_head_rcu(&ct->hashnode, &hash[bucket]);
-		}
-	}
-
-	old_hash = single_udp_ct_hash;
-	single_udp_ct_hash = hash;
-	spin_unlock_bh(&nf_conntrack_lock);
-
-	nf_ct_free_hashtable(old_hash, old_size);
-	return 0;
-}
-#endif
-
 #if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
-static int reset_conenat_conntrack_hash(unsigned int old_size)
-{
-	int i, bucket;
-	unsigned int hashsize;
-	struct hlist_nulls_head *hash, *old_hash;
-	struct nf_conn *ct;
-
-	if (!old_size)
-		return -EINVAL;
-
-	hashsize = nf_conntrack_htable_size;
-	hash = nf_ct_alloc_hashtable(&hashsize, 1);
-	if (!hash)
-		return -ENOMEM;
-
-	spin_lock_bh(&nf_conntrack_lock);
-	for (i = 0; i < old_size; i++) {
-		while (!hlist_nulls_empty(&conenat_ct_hash[i])) {
-			ct = hlist_nulls_entry(conenat_ct_hash[i].first, struct nf_conn, conenat_hashnode);
-			hlist_nulls_del_rcu(&ct->conenat_hashnode);
-			if (ct->status & IPS_SRC_NAT) {
-				bucket = conenat_hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple);
-				hlist_nulls_add_head_rcu(&ct->conenat_hashnode, &hash[bucket]);
-			}
-		}
-	}
-
-	old_hash = conenat_ct_hash;
-	conenat_ct_hash = hash;
-	spin_unlock_bh(&nf_conntrack_lock);
-
-	nf_ct_free_hashtable(old_hash, old_size);
-	return 0;
-}
-
 static int proc_enable_conenat_fast_search(ctl_table *ctl,
 					   int write,
 					   void __user *buffer, size_t *lenp,
@@ -184,14 +108,11 @@ static int proc_nat_filtering_behavior(ctl_table *ctl,
 	new_type = sysctl_nat_filtering_behavior;
 
 #if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
-#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
-	if (write && (old_type != new_type) && (old_type == 0 || new_type == 0))
-		reset_single_udp_conntrack_hash(nf_conntrack_htable_size, new_type);
-#endif
-
-#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
-	if (write && (old_type != new_type) && (old_type == 0 || new_type == 0))
-		reset_conenat_conntrack_hash(nf_conntrack_htable_size);
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE) || defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+	/* The hashes only tell open mode from the restricted ones */
+	if (write && ((old_type == NF_NAT_FILTERING_OPEN) !=
+		      (new_type == NF_NAT_FILTERING_OPEN)))
+		nf_conntrack_aux_rehash(new_type);
 #endif
 #endif
 
@@ -279,7 +200,7 @@ ctl_table dni_table[] = {
 #endif
 	{
 		.procname       = "nat_filtering_behavior",
-		.data           = &sysctl_nat_filtering_behavior,  /* 0:secured mode, 1: open mode */
+		.data           = &sysctl_nat_filtering_behavior,  /* 0:secured mode, 1: open mode, 2: port restricted mode */
 		.maxlen         = sizeof(unsigned int),
 		.mode           = 0644,
 		.proc_handler   = proc_nat_filtering_behavior,
@@ -32,6 +32,9 @@
 #include <linux/mm.h>
 #include <linux/nsproxy.h>
 #include <linux/rculist_nulls.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
 
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_l3proto.h>
@@ -47,8 +50,13 @@
 #include <net/netfilter/nf_conntrack_timeout.h>
 #include <net/netfilter/nf_conntrack_dscpremark_ext.h>
 #include <net/netfilter/nf_conntrack_vlantag_ext.h>
+#include <net/netfilter/nf_conntrack_layer7.h>
 #include <net/netfilter/nf_nat.h>
 #include <net/netfilter/nf_nat_core.h>
+#ifdef CONFIG_STOPWATCH_NET
+#define __STOPWATCH_USE__
+#endif
+#include <linux/stopwatch.h>
 
 #define NF_CONNTRACK_VERSION	"0.5.0"
 
@@ -57,11 +65,135 @@ int (*nfnetlink_parse_nat_setup_hook)(struct nf_conn *ct,
 				      const struct nlattr *attr) __read_mostly;
 EXPORT_SYMBOL_GPL(nfnetlink_parse_nat_setup_hook);
 
+/*
+ * nf_conntrack_lock only guards expectations and helper assignment.  Hash
+ * chains are guarded by nf_conntrack_locks[bucket % CONNTRACK_LOCKS], the
+ * single UDP and cone NAT chains by nf_conntrack_aux_locks[] the same way,
+ * always taken after the conntrack bucket locks.
+ */
 DEFINE_SPINLOCK(nf_conntrack_lock);
 EXPORT_SYMBOL_GPL(nf_conntrack_lock);
 spinlock_t *nf_conntrack_lock_for_conenat;
 EXPORT_SYMBOL(nf_conntrack_lock_for_conenat);
 
+__cacheline_aligned_in_smp spinlock_t nf_conntrack_locks[CONNTRACK_LOCKS];
+EXPORT_SYMBOL_GPL(nf_conntrack_locks);
+
+#if (defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)) && \
+    (defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE) || \
+     defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH))
+#define NF_CT_AUX_HASH
+static __cacheline_aligned_in_smp spinlock_t nf_conntrack_aux_locks[CONNTRACK_LOCKS];
+
+/* Filtering behavior the single UDP and cone NAT hashes are keyed with */
+static unsigned int nf_ct_aux_behavior;
+#endif
+
+/* Held, with nf_conntrack_locks_all set, to hold off every bucket lock */
+static __cacheline_aligned_in_smp DEFINE_SPINLOCK(nf_conntrack_locks_all_lock);
+static bool nf_conntrack_locks_all;
+
+/* Serializes hash table replacement */
+static DEFINE_MUTEX(nf_conntrack_resize_mutex);
+static unsigned int nf_conntrack_hashsize_min __read_mostly;
+static bool nf_conntrack_autoresize __read_mostly;
+static void nf_conntrack_resize_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(nf_conntrack_resize_work, nf_conntrack_resize_work_fn);
+
+/*
+ * nf_conntrack_lock_stripe()
+ *	Takes a bucket lock, waiting for a whole table operation to finish.
+ *	Only the first of two nested bucket locks may be taken this way.
+ */
+void nf_conntrack_lock_stripe(spinlock_t *lock) __acquires(lock)
+{
+	spin_lock(lock);
+
+	/* Pairs with the barrier in nf_conntrack_all_lock() */
+	smp_mb();
+	if (likely(!ACCESS_ONCE(nf_conntrack_locks_all)))
+		return;
+
+	spin_unlock(lock);
+	spin_lock(&nf_conntrack_locks_all_lock);
+	spin_lock(lock);
+	spin_unlock(&nf_conntrack_locks_all_lock);
+}
+EXPORT_SYMBOL_GPL(nf_conntrack_lock_stripe);
+
+/*
+ * nf_conntrack_all_lock()
+ *	Excludes every bucket lock holder, for rehashing.  BHs must be off.
+ */
+static void nf_conntrack_all_lock(void)
+{
+	int i;
+
+	spin_lock(&nf_conntrack_locks_all_lock);
+	nf_conntrack_locks_all = true;
+
+	/*
+	 * Order the store above against the lock loads below: a stripe
+	 * taker either sees the flag or is seen holding its lock.
+	 */
+	smp_mb();
+
+	for (i = 0; i < CONNTRACK_LOCKS; i++) {
+		spin_unlock_wait(&nf_conntrack_locks[i]);
+#ifdef NF_CT_AUX_HASH
+		spin_unlock_wait(&nf_conntrack_aux_locks[i]);
+#endif
+	}
+
+	/* Chains must not be touched before the holders are gone */
+	smp_mb();
+}
+
+static void nf_conntrack_all_unlock(void)
+{
+	/* Publish the rehashed tables before letting stripe takers in */
+	smp_mb();
+	nf_conntrack_locks_all = false;
+	spin_unlock(&nf_conntrack_locks_all_lock);
+}
+
+static void nf_conntrack_double_unlock(unsigned int h1, unsigned int h2)
+{
+	h1 %= CONNTRACK_LOCKS;
+	h2 %= CONNTRACK_LOCKS;
+	spin_unlock(&nf_conntrack_locks[h1]);
+	if (h1 != h2)
+		spin_unlock(&nf_conntrack_locks[h2]);
+}
+
+/*
+ * nf_conntrack_double_lock()
+ *	Takes the locks of buckets h1 and h2 in address order.  Returns true,
+ *	with nothing held, if the table was replaced since sequence was read
+ *	and the buckets must be computed again.
+ */
+static bool nf_conntrack_double_lock(struct net *net, unsigned int h1,
+				     unsigned int h2, unsigned int sequence)
+{
+	h1 %= CONNTRACK_LOCKS;
+	h2 %= CONNTRACK_LOCKS;
+	if (h1 <= h2) {
+		nf_conntrack_lock_stripe(&nf_conntrack_locks[h1]);
+		if (h1 != h2)
+			spin_lock_nested(&nf_conntrack_locks[h2],
+					 SINGLE_DEPTH_NESTING);
+	} else {
+		nf_conntrack_lock_stripe(&nf_conntrack_locks[h2]);
+		spin_lock_nested(&nf_conntrack_locks[h1],
+				 SINGLE_DEPTH_NESTING);
+	}
+	if (read_seqcount_retry(&net->ct.generation, sequence)) {
+		nf_conntrack_double_unlock(h1, h2);
+		return true;
+	}
+	return false;
+}
+
 unsigned int nf_conntrack_htable_size __read_mostly;
 EXPORT_SYMBOL_GPL(nf_conntrack_htable_size);
 
@@ -74,8 +206,6 @@ EXPORT_PER_CPU_SYMBOL(nf_conntrack_untracked);
 unsigned int nf_conntrack_hash_rnd __read_mostly;
 EXPORT_SYMBOL_GPL(nf_conntrack_hash_rnd);
 
-extern unsigned int sysctl_nat_filtering_behavior;
-
 #if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
 #if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
 struct hlist_nulls_head *single_udp_ct_hash;
@@ -304,11 +434,252 @@ clean_from_lists(struct nf_conn *ct)
 	pr_debug("clean_from_lists(%p)\n", ct);
 	hlist_nulls_del_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode);
 	hlist_nulls_del_rcu(&ct->tuplehash[IP_CT_DIR_REPLY].hnnode);
+}
 
-	/* Destroy all pending expectations */
-	nf_ct_remove_expectations(ct);
+/*
+ * The original tuple links a conntrack into exactly one of: the per-cpu
+ * unconfirmed list, the hash table, the per-cpu dying list.  Templates
+ * are on none of them.  Called with BHs disabled.
+ */
+static void nf_ct_add_to_dying_list(struct nf_conn *ct)
+{
+	struct ct_pcpu *pcpu;
+
+	ct->cpu = smp_processor_id();
+	pcpu = per_cpu_ptr(nf_ct_net(ct)->ct.pcpu_lists, ct->cpu);
+
+	spin_lock(&pcpu->lock);
+	hlist_nulls_add_head(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode,
+			     &pcpu->dying);
+	spin_unlock(&pcpu->lock);
+}
+
+static void nf_ct_add_to_unconfirmed_list(struct nf_conn *ct)
+{
+	struct ct_pcpu *pcpu;
+
+	ct->cpu = smp_processor_id();
+	pcpu = per_cpu_ptr(nf_ct_net(ct)->ct.pcpu_lists, ct->cpu);
+
+	spin_lock(&pcpu->lock);
+	hlist_nulls_add_head(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode,
+			     &pcpu->unconfirmed);
+	spin_unlock(&pcpu->lock);
+}
+
+static void nf_ct_del_from_dying_or_unconfirmed_list(struct nf_conn *ct)
+{
+	struct ct_pcpu *pcpu;
+
+	pcpu = per_cpu_ptr(nf_ct_net(ct)->ct.pcpu_lists, ct->cpu);
+
+	spin_lock(&pcpu->lock);
+	BUG_ON(hlist_nulls_unhashed(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode));
+	hlist_nulls_del_init_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode);
+	spin_unlock(&pcpu->lock);
+}
+
+/*
+ * Conntracks join the eviction list of their class at confirmation, in
+ * confirmation order.  They are not taken off when assured: assured ones
+ * are unlinked when met at the head, a few on each confirmation and the
+ * rest by early_drop(), so both stay O(1).
+ */
+#define NF_CT_LRU_PRUNE		2	/* assured heads unlinked per add */
+#define NF_CT_LRU_SCAN		32	/* entries early_drop() looks at */
+
+static void nf_ct_lru_prune(struct nf_ct_lru *lru, unsigned int n)
+{
+	struct nf_conn *ct;
+
+	while (n-- && !list_empty(&lru->head)) {
+		ct = list_first_entry(&lru->head, struct nf_conn, lru);
+		if (!test_bit(IPS_ASSURED_BIT, &ct->status))
+			break;
+		list_del_init(&ct->lru);
+	}
+}
+
+/* Called with BHs disabled, before ct is in the hash */
+static void nf_ct_lru_add(struct nf_conn *ct, u8 class)
+{
+	struct nf_ct_lru *lru = &nf_ct_net(ct)->ct.lru[class];
+
+	ct->lru_class = class;
+	ct->lru_stamp = jiffies;
+	atomic_inc(&lru->count);
+
+	spin_lock(&lru->lock);
+	list_add_tail(&ct->lru, &lru->head);
+	nf_ct_lru_prune(lru, NF_CT_LRU_PRUNE);
+	spin_unlock(&lru->lock);
+}
+
+/* Called with BHs disabled */
+static void nf_ct_lru_del(struct nf_conn *ct)
+{
+	struct nf_ct_lru *lru;
+
+	if (ct->lru_class == NF_CT_LRU_NONE)
+		return;
+
+	lru = &nf_ct_net(ct)->ct.lru[ct->lru_class];
+	spin_lock(&lru->lock);
+	list_del_init(&ct->lru);
+	spin_unlock(&lru->lock);
+	atomic_dec(&lru->count);
+}
+
+static inline bool nf_ct_lru_evictable(const struct nf_conn *ct)
+{
+#ifdef CONFIG_NF_CONNTRACK_CHECK_TCP_UDP_TIMEOUT_IN_EARLY_DROP
+	if ((nf_ct_protonum(ct) == IPPROTO_TCP ||
+	     nf_ct_protonum(ct) == IPPROTO_UDP) &&
+	    !nf_ct_is_expired(ct))
+		return false;
+#endif
+	return !test_bit(IPS_DYING_BIT, &ct->status);
 }
 
+/*
+ * nf_ct_lru_first()
+ *	Returns the oldest unassured conntrack of a class that may be
+ *	evicted, unlinking the assured ones in front of it.  Called with
+ *	the lock of the class held.
+ */
+static struct nf_conn *nf_ct_lru_first(struct nf_ct_lru *lru)
+{
+	struct nf_conn *ct, *tmp;
+	unsigned int cnt = 0;
+
+	list_for_each_entry_safe(ct, tmp, &lru->head, lru) {
+		if (++cnt > NF_CT_LRU_SCAN)
+			break;
+		if (test_bit(IPS_ASSURED_BIT, &ct->status)) {
+			list_del_init(&ct->lru);
+			continue;
+		}
+		if (nf_ct_lru_evictable(ct))
+			return ct;
+	}
+	return NULL;
+}
+
+/*
+ * nf_ct_lru_quota()
+ *	How many conntracks a class may have, 0 if it has no quota of its own.
+ */
+unsigned int nf_ct_lru_quota(unsigned int class)
+{
+	switch (class) {
+	case NF_CT_LRU_NAT:
+		return nf_conntrack_max;
+#if defined(CONFIG_NF_CONNTRACK_LOCAL_MANAGEMENT)
+	case NF_CT_LRU_LOCAL:
+		return nf_conntrack_local_max;
+	case NF_CT_LRU_TCP_RESERVE:
+		return nf_conntrack_tcp_reserve_max;
+	case NF_CT_LRU_ICMP_RESERVE:
+		return nf_conntrack_icmp_reserve_max;
+#endif
+	default:
+		return 0;
+	}
+}
+
+#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
+static u_int32_t __single_udp_hash_conntrack(const struct nf_conntrack_tuple *tuple,
+					     const int nat_filtering_behavior,
+					     unsigned int size);
+
+/* Direction whose tuple keys ct in the single UDP hash */
+static inline enum ip_conntrack_dir nf_ct_single_udp_dir(const struct nf_conn *ct)
+{
+	return (ct->status & IPS_SRC_NAT) ? IP_CT_DIR_ORIGINAL : IP_CT_DIR_REPLY;
+}
+
+/* Must hold a bucket lock or the generation of init_net */
+static inline unsigned int nf_ct_single_udp_bucket(const struct nf_conn *ct,
+						   unsigned int behavior,
+						   unsigned int size)
+{
+	return __single_udp_hash_conntrack(&ct->tuplehash[nf_ct_single_udp_dir(ct)].tuple,
+					   behavior, size);
+}
+#endif
+
+#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+static u_int32_t __conenat_hash_conntrack(const struct nf_conntrack_tuple *tuple,
+					  unsigned int behavior,
+					  unsigned int size);
+#endif
+#endif
+
+#ifdef NF_CT_AUX_HASH
+/*
+ * nf_ct_aux_lock()
+ *	Locks the single UDP or cone NAT bucket of a conntrack, rechecking
+ *	that the layout did not change meanwhile.  BHs must be off.
+ */
+static spinlock_t *nf_ct_aux_lock(const struct nf_conn *ct,
+				  unsigned int (*bucket)(const struct nf_conn *ct,
+							 unsigned int behavior,
+							 unsigned int size))
+{
+	unsigned int sequence;
+	spinlock_t *lock;
+
+	for (;;) {
+		sequence = read_seqcount_begin(&init_net.ct.generation);
+		lock = &nf_conntrack_aux_locks[bucket(ct, nf_ct_aux_behavior,
+						      init_net.ct.htable_size) %
+					       CONNTRACK_LOCKS];
+		nf_conntrack_lock_stripe(lock);
+		if (!read_seqcount_retry(&init_net.ct.generation, sequence))
+			return lock;
+		spin_unlock(lock);
+	}
+}
+
+#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+static inline unsigned int nf_ct_conenat_bucket(const struct nf_conn *ct,
+						unsigned int behavior,
+						unsigned int size)
+{
+	return __conenat_hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple,
+					behavior, size);
+}
+#endif
+
+/*
+ * nf_ct_del_from_aux_hashes()
+ *	Unlinks a dead conntrack from the single UDP and cone NAT hashes.
+ *	Nothing links it again once it left the conntrack hash, so an
+ *	unlocked unhashed check is enough to skip the locks.
+ */
+static void nf_ct_del_from_aux_hashes(struct nf_conn *ct)
+{
+	spinlock_t *lock;
+
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
+	if (!hlist_nulls_unhashed(&ct->hashnode)) {
+		lock = nf_ct_aux_lock(ct, nf_ct_single_udp_bucket);
+		hlist_nulls_del_init_rcu(&ct->hashnode);
+		spin_unlock(lock);
+	}
+#endif
+
+#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+	if (!hlist_nulls_unhashed(&ct->conenat_hashnode)) {
+		lock = nf_ct_aux_lock(ct, nf_ct_conenat_bucket);
+		hlist_nulls_del_init_rcu(&ct->conenat_hashnode);
+		spin_unlock(lock);
+	}
+#endif
+}
+#endif
+
 static void
 destroy_conntrack(struct nf_conntrack *nfct)
 {
@@ -318,7 +689,6 @@ destroy_conntrack(struct nf_conntrack *nfct)
 
 	pr_debug("destroy_conntrack(%p)\n", ct);
 	NF_CT_ASSERT(atomic_read(&nfct->use) == 0);
-	NF_CT_ASSERT(!timer_pending(&ct->timeout));
 
 	/* To make sure we don't get any weird locking issues here:
 	 * destroy_conntrack() MUST NOT be called with a write lock
@@ -330,48 +700,27 @@ destroy_conntrack(struct nf_conntrack *nfct)
 
 	rcu_read_unlock();
 
-	spin_lock_bh(&nf_conntrack_lock);
-	/* Expectations will have been removed in clean_from_lists,
+	local_bh_disable();
+	/* Expectations will have been removed in nf_ct_delete_from_lists,
 	 * except TFTP can create an expectation on the first packet,
 	 * before connection is in the list, so we need to clean here,
 	 * too. */
-	nf_ct_remove_expectations(ct);
-
-	#if defined(CONFIG_NETFILTER_XT_MATCH_LAYER7) || defined(CONFIG_NETFILTER_XT_MATCH_LAYER7_MODULE)
-	if(ct->layer7.app_proto)
-		kfree(ct->layer7.app_proto);
-	if(ct->layer7.app_data)
-	kfree(ct->layer7.app_data);
-	#endif
-
-#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
-#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
-	if (ct->hashnode.pprev)
-		hlist_nulls_del_rcu(&ct->hashnode);
-#endif
+	if (nfct_help(ct)) {
+		spin_lock(&nf_conntrack_lock);
+		nf_ct_remove_expectations(ct);
+		spin_unlock(&nf_conntrack_lock);
+	}
 
-#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
-	if (ct->conenat_hashnode.pprev)
-		hlist_nulls_del_rcu(&ct->conenat_hashnode);
-#endif
+#ifdef NF_CT_AUX_HASH
+	nf_ct_del_from_aux_hashes(ct);
 #endif
 
-	/* We overload first tuple to link into unconfirmed list. */
-	if (!nf_ct_is_confirmed(ct)) {
-		BUG_ON(hlist_nulls_unhashed(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode));
-		hlist_nulls_del_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode);
-		/*
-		 See ticket R7800-DumaOS ticket #51 for explanation why the
-		 following conditional was added. -@NETDUMA_Iain
-		 */
-		if (ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode.pprev != LIST_POISON2)  {
-			BUG_ON(hlist_nulls_unhashed(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode));
-			hlist_nulls_del_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode);
-		}
-	}
+	if (!hlist_nulls_unhashed(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode))
+		nf_ct_del_from_dying_or_unconfirmed_list(ct);
+	nf_ct_lru_del(ct);
 
 	NF_CT_STAT_INC(net, delete);
-	spin_unlock_bh(&nf_conntrack_lock);
+	local_bh_enable();
 
 	if (ct->master)
 		nf_ct_put(ct->master);
@@ -380,17 +729,38 @@ destroy_conntrack(struct nf_conntrack *nfct)
 	nf_conntrack_free(ct);
 }
 
+/* Moves a confirmed conntrack from the hash table to the dying list */
 void nf_ct_delete_from_lists(struct nf_conn *ct)
 {
 	struct net *net = nf_ct_net(ct);
+	unsigned int hash, repl_hash, sequence;
+	u16 zone = nf_ct_zone(ct);
 
 	nf_ct_helper_destroy(ct);
-	spin_lock_bh(&nf_conntrack_lock);
-	/* Inside lock so preempt is disabled on module removal path.
-	 * Otherwise we can get spurious warnings. */
-	NF_CT_STAT_INC(net, delete_list);
+
+	local_bh_disable();
+	do {
+		sequence = read_seqcount_begin(&net->ct.generation);
+		hash = hash_conntrack(net, zone,
+				      &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
+		repl_hash = hash_conntrack(net, zone,
+					   &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+	} while (nf_conntrack_double_lock(net, hash, repl_hash, sequence));
+
 	clean_from_lists(ct);
-	spin_unlock_bh(&nf_conntrack_lock);
+	nf_conntrack_double_unlock(hash, repl_hash);
+
+	nf_ct_add_to_dying_list(ct);
+
+	/* Destroy all pending expectations */
+	if (nfct_help(ct)) {
+		spin_lock(&nf_conntrack_lock);
+		nf_ct_remove_expectations(ct);
+		spin_unlock(&nf_conntrack_lock);
+	}
+
+	NF_CT_STAT_INC(net, delete_list);
+	local_bh_enable();
 }
 EXPORT_SYMBOL_GPL(nf_ct_delete_from_lists);
 
@@ -409,14 +779,15 @@ static void death_by_event(unsigned long ul_conntrack)
 		add_timer(&ecache->timeout);
 		return;
 	}
-	/* we've got the event delivered, now it's dying */
-	set_bit(IPS_DYING_BIT, &ct->status);
-	spin_lock(&nf_conntrack_lock);
-	hlist_nulls_del(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode);
-	spin_unlock(&nf_conntrack_lock);
+	/* we've got the event delivered, now it can go */
 	nf_ct_put(ct);
 }
 
+/*
+ * nf_ct_insert_dying_list()
+ *	Retries the destroy event of a conntrack nf_ct_delete_from_lists()
+ *	already put on the dying list.
+ */
 void nf_ct_insert_dying_list(struct nf_conn *ct)
 {
 	struct net *net = nf_ct_net(ct);
@@ -424,38 +795,56 @@ void nf_ct_insert_dying_list(struct nf_conn *ct)
 
 	BUG_ON(ecache == NULL);
 
-	/* add this conntrack to the dying list */
-	spin_lock_bh(&nf_conntrack_lock);
-	hlist_nulls_add_head(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode,
-			     &net->ct.dying);
-	spin_unlock_bh(&nf_conntrack_lock);
 	/* set a new timer to retry event delivery */
-	setup_timer(&ct->timeout, death_by_event, (unsigned long)ct);
 	setup_timer(&ecache->timeout, death_by_event, (unsigned long)ct);
+	ecache->timeout.expires = jiffies +
 		(random32() % net->ct.sysctl_events_retry_timeout);
 	add_timer(&ecache->timeout);
 }
 EXPORT_SYMBOL_GPL(nf_ct_insert_dying_list);
 
-static void death_by_timeout(unsigned long ul_conntrack)
+/*
+ * nf_ct_delete()
+ *	Takes a confirmed conntrack out of the hash and drops the reference
+ *	of the table.  Setting the dying bit decides who does it; returns
+ *	false if that was someone else, or if the destroy event has to be
+ *	retried first.
+ */
+bool nf_ct_delete(struct nf_conn *ct, u32 pid, int report)
 {
-	struct nf_conn *ct = (void *)ul_conntrack;
 	struct nf_conn_tstamp *tstamp;
 
+	if (!nf_ct_is_confirmed(ct) ||
+	    test_and_set_bit(IPS_DYING_BIT, &ct->status))
+		return false;
+
 	tstamp = nf_conn_tstamp_find(ct);
 	if (tstamp && tstamp->stop == 0)
 		tstamp->stop = ktime_to_ns(ktime_get_real());
 
-	if (!test_bit(IPS_DYING_BIT, &ct->status) &&
-	    unlikely(nf_conntrack_event(IPCT_DESTROY, ct) < 0)) {
+	if (unlikely(nf_conntrack_event_report(IPCT_DESTROY, ct,
+					       pid, report) < 0)) {
 		/* destroy event was not delivered */
 		nf_ct_delete_from_lists(ct);
 		nf_ct_insert_dying_list(ct);
-		return;
+		return false;
 	}
-	set_bit(IPS_DYING_BIT, &ct->status);
 	nf_ct_delete_from_lists(ct);
 	nf_ct_put(ct);
+	return true;
+}
+EXPORT_SYMBOL_GPL(nf_ct_delete);
+
+/* Kills ct if it is still expired once we hold a reference */
+static void nf_ct_gc_expired(struct nf_conn *ct)
+{
+	if (!atomic_inc_not_zero(&ct->ct_general.use))
+		return;
+
+	if (nf_ct_should_gc(ct))
+		nf_ct_kill(ct);
+
+	nf_ct_put(ct);
 }
 
 /*
@@ -470,17 +859,28 @@ ____nf_conntrack_find(struct net *net, u16 zone,
 		      const struct nf_conntrack_tuple *tuple, u32 hash)
 {
 	struct nf_conntrack_tuple_hash *h;
+	struct hlist_nulls_head *ct_hash;
 	struct hlist_nulls_node *n;
-	unsigned int bucket = hash_bucket(hash, net);
+	unsigned int bucket, hsize;
 
 	/* Disable BHs the entire time since we normally need to disable them
 	 * at least once for the stats anyway.
 	 */
 	local_bh_disable();
 begin:
-	hlist_nulls_for_each_entry_rcu(h, n, &net->ct.hash[bucket], hnnode) {
+	nf_conntrack_get_ht(net, &ct_hash, &hsize);
+	bucket = __hash_bucket(hash, hsize);
+
+	hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[bucket], hnnode) {
+		struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(h);
+
+		if (nf_ct_is_expired(ct)) {
+			nf_ct_gc_expired(ct);
+			continue;
+		}
+
 		if (nf_ct_tuple_equal(tuple, &h->tuple) &&
-		    nf_ct_zone(nf_ct_tuplehash_to_ctrack(h)) == zone) {
+		    nf_ct_zone(ct) == zone) {
 			NF_CT_STAT_INC(net, found);
 			local_bh_enable();
 			return h;
@@ -490,7 +890,8 @@ begin:
 	/*
 	 * if the nulls value we got at the end of this lookup is
 	 * not the expected one, we must restart lookup.
-	 * We probably met an item that was moved to another chain.
+	 * We probably met an item that was moved to another chain,
+	 * or the table was resized under us.
 	 */
 	if (get_nulls_value(n) != bucket) {
 		NF_CT_STAT_INC(net, search_restart);
@@ -569,17 +970,20 @@ static void __nf_conntrack_hash_insert(struct nf_conn *ct,
 #define NAT_LAN_HASH_SIZE       (16)
 #define NAT_LAN_HASH_MASK       (NAT_LAN_HASH_SIZE - 1)
 
+/* Guards nat_lans, nat_lan_max and the lan_hash lists of conntracks */
+static DEFINE_SPINLOCK(nat_lan_lock);
 static struct nf_conn_lan *nat_lan_max;
 static struct list_head nat_lans[NAT_LAN_HASH_SIZE];
 static struct kmem_cache *nf_ct_natlan_cachep;
 
-static noinline int early_drop(struct net *net, unsigned int hash);
+static noinline int early_drop(struct net *net);
 
 static inline unsigned int nat_lan_hash(__u32 addr)
 {
 	return ntohl(addr) & NAT_LAN_HASH_MASK;
 }
 
+/* Called with nat_lan_lock held */
 static int ip_ct_nat_lan_insert(struct nf_conn *ct)
 {
 	__u32 addr;
@@ -625,6 +1029,7 @@ static int ip_ct_nat_lan_insert(struct nf_conn *ct)
 	return 1;
 }
 
+/* Called with nat_lan_lock held */
 static int nf_ct_nat_lan_destroy(struct nf_conn *ct)
 {
 	struct nf_conn_lan *lan;
@@ -633,6 +1038,7 @@ static int nf_ct_nat_lan_destroy(struct nf_conn *ct)
 		return 0;
 
 	list_del(&ct->lan_hash);
+	ct->lan_nat = NULL;
 
 	if (--lan->count <= 0) {
 		NAT_LAN_DEBUGP("%u.%u.%u.%u has no LAN sessions.\n",
@@ -692,8 +1098,12 @@ static int nf_ct_nat_lan_destroy(struct nf_conn *ct)
  *
  * 3. If the new session is a low-priority session, the new session
  * cannot be established.
+ *
+ * Called with nat_lan_lock held.  The session to replace is returned
+ * referenced in *victim, to be killed once the lock is dropped.
  */
-static int remove_lru_low_prio_nat(struct nf_conn_lan *lan)
+static int remove_lru_low_prio_nat(struct nf_conn_lan *lan,
+				   struct nf_conn **victim)
 {
 	struct nf_conn *pos, *ct;
 	extern unsigned int tcp_timeouts[];
@@ -704,7 +1114,7 @@ static int remove_lru_low_prio_nat(struct nf_conn_lan *lan)
 		 *  So only check IPPROTO_TCP now.*/
 		if (pos->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum == IPPROTO_TCP) {
 			if ((pos->proto.tcp.state == TCP_CONNTRACK_ESTABLISHED) &&
-			    ((pos->timeout.expires - jiffies) < (tcp_timeouts[TCP_CONNTRACK_ESTABLISHED] - HIGH_PRIO_IDLE_TIME))) {
+			    (nf_ct_expires(pos) < (tcp_timeouts[TCP_CONNTRACK_ESTABLISHED] - HIGH_PRIO_IDLE_TIME))) {
 				ct = pos;
 				goto ret;
 			}
@@ -729,25 +1139,24 @@ ret:
 	if (unlikely(nf_ct_is_dying(ct) || !atomic_inc_not_zero(&ct->ct_general.use)))
 		return 1;
 
-	if (del_timer(&ct->timeout))
-		death_by_timeout((unsigned long)ct);
-
-	nf_ct_put(ct);
+	*victim = ct;
 	return 1;
 }
 
 static int ip_ct_handle_nat_full(struct nf_conn *ct)
 {
-	int count;
+	int count, ret = 0;
 	__u32 addr;
 	unsigned int hash;
 	struct nf_conn_lan *pos, *lan = NULL;
+	struct nf_conn *victim = NULL;
 
 	addr = (ct->status & IPS_SRC_NAT)
 		? ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip
 		: ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip;
 	hash = nat_lan_hash(addr);
 
+	spin_lock_bh(&nat_lan_lock);
 	list_for_each_entry(pos, &nat_lans[hash], list) {
 		if (pos->addr == addr) {
 			lan = pos;
@@ -759,16 +1168,26 @@ static int ip_ct_handle_nat_full(struct nf_conn *ct)
 		count = lan != NULL ? lan->count : 0;
 
 		if ((nat_lan_max->count - count >= NAT_SESSION_DIFF_NUM) &&
-		    remove_lru_low_prio_nat(nat_lan_max))
-			return 1;
+		    remove_lru_low_prio_nat(nat_lan_max, &victim)) {
+			ret = 1;
+			goto out;
+		}
 	}
 
 	if ((lan != NULL) &&
 	    (ct->status & IPS_NAT_STATIC_HIGH_PRIORITY) &&
-	    remove_lru_low_prio_nat(lan))
-		return 1;
+	    remove_lru_low_prio_nat(lan, &victim))
+		ret = 1;
+out:
+	spin_unlock_bh(&nat_lan_lock);
 
-	return 0;
+	if (victim) {
+		if (nf_ct_kill(victim) && victim->lru_class != NF_CT_LRU_NONE)
+			atomic_inc(&nf_ct_net(victim)->ct.lru[victim->lru_class].evicted);
+		nf_ct_put(victim);
+	}
+
+	return ret;
 }
 
 static int ip_ct_nat_lan_session(struct nf_conn *ct)
@@ -834,7 +1253,116 @@ static void ip_ct_lru_low_prio_update(struct nf_conn *ct)
 
 	/* Move to head of low_prio_lru, and it will not be replaced by new session soon.
 	 * As in function remove_lru_low_prio_nat(), delete form tail of low_prio_lru (low_prio_lru.prev) */
-	list_move(&ct->lan_hash, &lan->low_prio_lru);
+	spin_lock_bh(&nat_lan_lock);
+	if (ct->lan_nat == lan)
+		list_move(&ct->lan_hash, &lan->low_prio_lru);
+	spin_unlock_bh(&nat_lan_lock);
+}
+
+#define NF_CT_ADMIT_NONE	0	/* not charged */
+#define NF_CT_ADMIT_NAT		1	/* charged as a NAT LAN session */
+#define NF_CT_ADMIT_LOCAL	2	/* charged as a local session */
+
+/*
+ * nf_ct_nat_admit()
+ *	Charges a new conntrack to NAT or local session management, making
+ *	room if the table is full.  Runs before confirmation takes any bucket
+ *	lock, as making room kills other conntracks.  Returns what was
+ *	charged, or -1 if the packet must be dropped.
+ */
+static int nf_ct_nat_admit(struct net *net, struct nf_conn *ct, u32 hash)
+{
+	int ret;
+
+	if (!sysctl_enable_nat_management)
+		return NF_CT_ADMIT_NONE;
+
+	if (ip_ct_nat_lan_session(ct)) {
+		if (nf_conntrack_max) {
+			if (unlikely(atomic_read(&net->ct.count) >= nf_conntrack_max) &&
+			    early_drop(net)) {
+				if (net_ratelimit())
+					printk(KERN_WARNING "nf_conntrack: freeing un-assure connection.\n");
+			}
+
+			/* As the dropped connection by early_drop() maybe not the LAN-WAN session,
+			 * so it maybe not be counted, and need to read the ct count again. */
+			if (unlikely(atomic_read(&net->ct.count) >= nf_conntrack_max) &&
+			    (ip_ct_handle_nat_full(ct) == 0)) {
+				atomic_inc(&net->ct.lru[NF_CT_LRU_NAT].refused);
+				if (net_ratelimit())
+					printk(KERN_WARNING "Internet sessions full, dropping packet.\n");
+				return -1;
+			}
+		}
+
+		spin_lock_bh(&nat_lan_lock);
+		ret = ip_ct_nat_lan_insert(ct);
+		spin_unlock_bh(&nat_lan_lock);
+		if (!ret) { /* No memory */
+			atomic_inc(&net->ct.lru[NF_CT_LRU_NAT].refused);
+			return -1;
+		}
+
+		atomic_inc(&net->ct.count);
+		return NF_CT_ADMIT_NAT;
+	}
+
+#if defined(CONFIG_NF_CONNTRACK_LOCAL_MANAGEMENT)
+	if (sysctl_enable_local_management &&
+	    (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num == PF_INET)) {
+		if (nf_conntrack_local_max &&
+		    atomic_read(&nf_conntrack_local_count) >= nf_conntrack_local_max) {
+			if ((ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum == IPPROTO_TCP) &&
+			    nf_conntrack_tcp_reserve_max &&
+			    atomic_read(&nf_conntrack_tcp_reserve_count) < nf_conntrack_tcp_reserve_max) {
+				ct->status |= IPS_CT_TCP_RESERVE;
+				atomic_inc(&nf_conntrack_tcp_reserve_count);
+			} else if ((ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum == IPPROTO_ICMP) &&
+				   nf_conntrack_icmp_reserve_max &&
+				   atomic_read(&nf_conntrack_icmp_reserve_count) < nf_conntrack_icmp_reserve_max) {
+				ct->status |= IPS_CT_ICMP_RESERVE;
+				atomic_inc(&nf_conntrack_icmp_reserve_count);
+			} else {
+				atomic_inc(&net->ct.lru[NF_CT_LRU_LOCAL].refused);
+				if (net_ratelimit())
+					printk(KERN_WARNING "Local sessions full, dropping packet.\n");
+				return -1;
+			}
+		} else
+			atomic_inc(&nf_conntrack_local_count);
+
+		return NF_CT_ADMIT_LOCAL;
+	}
+#endif
+
+	return NF_CT_ADMIT_NONE;
+}
+
+/*
+ * nf_ct_nat_release()
+ *	Gives back what nf_ct_nat_admit() charged for a conntrack.
+ */
+static void nf_ct_nat_release(struct net *net, struct nf_conn *ct)
+{
+	int charged;
+
+	spin_lock_bh(&nat_lan_lock);
+	charged = nf_ct_nat_lan_destroy(ct);
+	spin_unlock_bh(&nat_lan_lock);
+
+	if (charged)
+		atomic_dec(&net->ct.count);
+#if defined(CONFIG_NF_CONNTRACK_LOCAL_MANAGEMENT)
+	else if (sysctl_enable_local_management) {
+		if (ct->status & IPS_CT_ICMP_RESERVE)
+			atomic_dec(&nf_conntrack_icmp_reserve_count);
+		else if (ct->status & IPS_CT_TCP_RESERVE)
+			atomic_dec(&nf_conntrack_tcp_reserve_count);
+		else
+			atomic_dec(&nf_conntrack_local_count);
+	}
+#endif
 }
 #endif
 
@@ -842,18 +1370,21 @@ int
 nf_conntrack_hash_check_insert(struct nf_conn *ct)
 {
 	struct net *net = nf_ct_net(ct);
-	unsigned int hash, repl_hash;
+	unsigned int hash, repl_hash, sequence;
 	struct nf_conntrack_tuple_hash *h;
 	struct hlist_nulls_node *n;
 	u16 zone;
 
 	zone = nf_ct_zone(ct);
-	hash = hash_conntrack(net, zone,
-			      &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
-	repl_hash = hash_conntrack(net, zone,
-				   &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
 
-	spin_lock_bh(&nf_conntrack_lock);
+	local_bh_disable();
+	do {
+		sequence = read_seqcount_begin(&net->ct.generation);
+		hash = hash_conntrack(net, zone,
+				      &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
+		repl_hash = hash_conntrack(net, zone,
+					   &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+	} while (nf_conntrack_double_lock(net, hash, repl_hash, sequence));
 
 	/* See if there's one in the list already, including reverse */
 	hlist_nulls_for_each_entry(h, n, &net->ct.hash[hash], hnnode)
@@ -867,32 +1398,33 @@ nf_conntrack_hash_check_insert(struct nf_conn *ct)
 		    zone == nf_ct_zone(nf_ct_tuplehash_to_ctrack(h)))
 			goto out;
 
-	add_timer(&ct->timeout);
 	nf_conntrack_get(&ct->ct_general);
 	__nf_conntrack_hash_insert(ct, hash, repl_hash);
 	NF_CT_STAT_INC(net, insert);
-	spin_unlock_bh(&nf_conntrack_lock);
+	nf_conntrack_double_unlock(hash, repl_hash);
+	local_bh_enable();
 
 	return 0;
 
 out:
 	NF_CT_STAT_INC(net, insert_failed);
-	spin_unlock_bh(&nf_conntrack_lock);
+	nf_conntrack_double_unlock(hash, repl_hash);
+	local_bh_enable();
 	return -EEXIST;
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_hash_check_insert);
 
 #if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
 #if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
-u_int32_t single_udp_hash_conntrack(const struct nf_conntrack_tuple *tuple,
-				    const int nat_filtering_behavior)
+static u_int32_t __single_udp_hash_conntrack(const struct nf_conntrack_tuple *tuple,
+					     const int nat_filtering_behavior,
+					     unsigned int size)
 {
-	unsigned int size = nf_conntrack_htable_size;
 	unsigned int rnd = nf_conntrack_hash_rnd;
 	unsigned int n;
 	u_int32_t h;
 
-	if (nat_filtering_behavior) {
+	if (nat_filtering_behavior == NF_NAT_FILTERING_OPEN) {
 		/* open mode */
 		n = sizeof(tuple->src) / sizeof(u32);
 	} else {
@@ -904,13 +1436,20 @@ u_int32_t single_udp_hash_conntrack(const struct nf_conntrack_tuple *tuple,
 
 	return ((u64)h * size) >> 32;
 }
+
+u_int32_t single_udp_hash_conntrack(const struct nf_conntrack_tuple *tuple,
+				    const int nat_filtering_behavior)
+{
+	return __single_udp_hash_conntrack(tuple, nat_filtering_behavior,
+					   nf_conntrack_htable_size);
+}
 EXPORT_SYMBOL(single_udp_hash_conntrack);
 
 static inline bool single_udp_hash_tuple_cmp(const struct nf_conntrack_tuple *t1,
 					     const struct nf_conntrack_tuple *t2,
 					     const int nat_filtering_behavior)
 {
-	if (nat_filtering_behavior) {
+	if (nat_filtering_behavior == NF_NAT_FILTERING_OPEN) {
 		/* open mode */
 		return __nf_ct_tuple_src_equal(t1, t2);
 	} else {
@@ -920,51 +1459,117 @@ static inline bool single_udp_hash_tuple_cmp(const struct nf_conntrack_tuple *t1
 	}
 }
 
-void nf_conntrack_single_udp_hash_find_remove(const struct nf_conntrack_tuple *tuple,
-					      const unsigned int hash,
-					      const int nat_filtering_behavior,
-					      const unsigned int nat_type)
+/*
+ * nf_ct_single_udp_eligible()
+ *	Tells whether ct, about to be confirmed, belongs in the single UDP hash.
+ */
+static bool nf_ct_single_udp_eligible(const struct nf_conn *ct)
 {
+	/* Each remote port gets its own conntrack when port restricted */
+	if (ACCESS_ONCE(sysctl_nat_filtering_behavior) ==
+	    NF_NAT_FILTERING_PORT_RESTRICTED)
+		return false;
+
+	if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num != PF_INET ||
+	    ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum != IPPROTO_UDP)
+		return false;
+
+	if (ct->status & IPS_SRC_NAT)
+		return !(ct->status & IPS_DST_NAT);
+
+	return (ct->status & IPS_DST_NAT) &&
+	       (ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip !=
+		ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip);
+}
+
+/*
+ * nf_ct_single_udp_nat_tuple()
+ *	Tuple of ct compared against the single UDP slot for nat_type
+ *	(1 for SNAT, 0 for DNAT), or NULL if ct is not NATed that way.
+ */
+static inline struct nf_conntrack_tuple *
+nf_ct_single_udp_nat_tuple(struct nf_conn *ct, unsigned int nat_type)
+{
+	if ((ct->status & IPS_SRC_NAT) && nat_type == 1)
+		return &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+	if ((ct->status & IPS_DST_NAT) && nat_type == 0)
+		return &ct->tuplehash[IP_CT_DIR_REPLY].tuple;
+	return NULL;
+}
+
+/*
+ * nf_conntrack_single_udp_hash_find_remove()
+ *	Kills the conntrack holding the single UDP slot ct is about to take.
+ *	Must not be called with a bucket lock held.
+ */
+static void nf_conntrack_single_udp_hash_find_remove(const struct nf_conn *ct)
+{
+	const struct nf_conntrack_tuple *tuple;
 	struct nf_conntrack_tuple *h;
+	struct hlist_nulls_head *udp_hash;
 	struct hlist_nulls_node *n;
-	struct nf_conn *ct = NULL, *tmp;
+	struct nf_conn *found = NULL, *tmp;
+	unsigned int sequence, behavior, hash;
+	unsigned int nat_type;
+
+	/* 1 for SNAT, matched on the original tuple, 0 for DNAT */
+	nat_type = nf_ct_single_udp_dir(ct) == IP_CT_DIR_ORIGINAL;
+	tuple = &ct->tuplehash[nf_ct_single_udp_dir(ct)].tuple;
 
 	rcu_read_lock();
-	hlist_nulls_for_each_entry_rcu(tmp, n, &single_udp_ct_hash[hash], hashnode) {
-		if ((tmp->status & IPS_SRC_NAT) && (nat_type == 1))
-			h = &tmp->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
-		else if ((tmp->status & IPS_DST_NAT) && (nat_type == 0))
-			h = &tmp->tuplehash[IP_CT_DIR_REPLY].tuple;
-		else
+begin:
+	do {
+		sequence = read_seqcount_begin(&init_net.ct.generation);
+		udp_hash = single_udp_ct_hash;
+		behavior = nf_ct_aux_behavior;
+		hash = nf_ct_single_udp_bucket(ct, behavior,
+					       init_net.ct.htable_size);
+	} while (read_seqcount_retry(&init_net.ct.generation, sequence));
+
+	hlist_nulls_for_each_entry_rcu(tmp, n, &udp_hash[hash], hashnode) {
+		h = nf_ct_single_udp_nat_tuple(tmp, nat_type);
+		if (!h || !single_udp_hash_tuple_cmp(tuple, h, behavior))
 			continue;
 
-		if (single_udp_hash_tuple_cmp(tuple, h, nat_filtering_behavior))
-			ct = tmp;
+		if (unlikely(nf_ct_is_dying(tmp) ||
+			     !atomic_inc_not_zero(&tmp->ct_general.use)))
+			continue;
 
-		if (ct && unlikely(nf_ct_is_dying(ct) ||
-				   !atomic_inc_not_zero(&ct->ct_general.use)))
-			ct = NULL;
+		/* the entry may have been freed and reused before we
+		 * got the reference, so check it again */
+		h = nf_ct_single_udp_nat_tuple(tmp, nat_type);
+		if (unlikely(!h ||
+			     !single_udp_hash_tuple_cmp(tuple, h, behavior))) {
+			nf_ct_put(tmp);
+			goto begin;
+		}
 
-		if (ct)
-			break;
+		found = tmp;
+		break;
 	}
+	/*
+	 * if the nulls value we got at the end of this lookup is
+	 * not the expected one, we must restart lookup.
+	 */
+	if (!found && get_nulls_value(n) != hash)
+		goto begin;
 	rcu_read_unlock();
 
-	if (ct) {
-		if (del_timer(&ct->timeout))
-			death_by_timeout((unsigned long)ct);
-		nf_ct_put(ct);
+	if (found) {
+		nf_ct_kill(found);
+		nf_ct_put(found);
 	}
 }
 #endif
 
 #if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
-u_int32_t conenat_hash_conntrack(const struct nf_conntrack_tuple *tuple)
+static u_int32_t __conenat_hash_conntrack(const struct nf_conntrack_tuple *tuple,
+					  unsigned int behavior,
+					  unsigned int size)
 {
-	unsigned int size = nf_conntrack_htable_size;
 	u_int32_t h;
 
-	if (sysctl_nat_filtering_behavior) {
+	if (behavior == NF_NAT_FILTERING_OPEN) {
 		/* open mode */
 		h = (__force u32)tuple->dst.u.all;
 
@@ -979,48 +1584,123 @@ u_int32_t conenat_hash_conntrack(const struct nf_conntrack_tuple *tuple)
 		return ((u64)h * size) >> 32;
 	}
 }
+
+u_int32_t conenat_hash_conntrack(const struct nf_conntrack_tuple *tuple)
+{
+	return __conenat_hash_conntrack(tuple, nf_ct_aux_behavior,
+					nf_conntrack_htable_size);
+}
 EXPORT_SYMBOL(conenat_hash_conntrack);
 
+static bool nf_ct_conenat_eligible(const struct nf_conn *ct)
+{
+	return ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num == PF_INET &&
+	       ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum == IPPROTO_UDP &&
+	       (ct->status & IPS_SRC_NAT);
+}
+
+/*
+ * nf_conenat_conntrack_hash_mangement()
+ *	Fills or empties the cone NAT hash after fast search was toggled,
+ *	one bucket lock at a time.
+ */
 void nf_conenat_conntrack_hash_mangement(void)
 {
 	struct nf_conntrack_tuple_hash *h;
+	struct hlist_nulls_node *n;
 	struct nf_conn *ct;
+	spinlock_t *lock, *aux_lock;
 	unsigned int i, conenat_hash;
-	unsigned int enable_conenat_fast_search;
 
-	enable_conenat_fast_search = sysctl_enable_conenat_fast_search;
-	spin_lock_bh(&nf_conntrack_lock);
-	for (i = 0; i < init_net.ct.htable_size; i++) {
-		while (!hlist_nulls_empty(&init_net.ct.hash[i])) {
-			h = hlist_nulls_entry(init_net.ct.hash[i].first,
-					      struct nf_conntrack_tuple_hash, hnnode);
+	if (!sysctl_enable_conenat_fast_search) {
+		for (i = 0; i < init_net.ct.htable_size; i++) {
+			lock = &nf_conntrack_aux_locks[i % CONNTRACK_LOCKS];
+			local_bh_disable();
+			nf_conntrack_lock_stripe(lock);
+			if (i < init_net.ct.htable_size) {
+				while (!hlist_nulls_empty(&conenat_ct_hash[i])) {
+					ct = hlist_nulls_entry(conenat_ct_hash[i].first,
+							       struct nf_conn, conenat_hashnode);
+					hlist_nulls_del_init_rcu(&ct->conenat_hashnode);
+				}
+			}
+			spin_unlock(lock);
+			local_bh_enable();
+		}
+		return;
+	}
 
-			ct = nf_ct_tuplehash_to_ctrack(h);
+	for (i = 0; i < init_net.ct.htable_size; i++) {
+		lock = &nf_conntrack_locks[i % CONNTRACK_LOCKS];
+		local_bh_disable();
+		nf_conntrack_lock_stripe(lock);
+		if (i < init_net.ct.htable_size) {
+			hlist_nulls_for_each_entry(h, n, &init_net.ct.hash[i], hnnode) {
+				if (NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL)
+					continue;
 
-			if (enable_conenat_fast_search) {
-				if ((ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num != PF_INET) ||
-				    (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum != IPPROTO_UDP) ||
-				    !nf_ct_is_confirmed(ct))
+				ct = nf_ct_tuplehash_to_ctrack(h);
+				if (!nf_ct_conenat_eligible(ct) ||
+				    !hlist_nulls_unhashed(&ct->conenat_hashnode))
 					continue;
 
-				if (ct->status & IPS_SRC_NAT) {
-					conenat_hash = conenat_hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple);
-					hlist_nulls_add_head_rcu(&ct->conenat_hashnode, &conenat_ct_hash[conenat_hash]);
-				}
-			} else if (ct->conenat_hashnode.pprev)
-				hlist_nulls_del_rcu(&ct->conenat_hashnode);
+				conenat_hash = nf_ct_conenat_bucket(ct, nf_ct_aux_behavior,
+								    init_net.ct.htable_size);
+				aux_lock = &nf_conntrack_aux_locks[conenat_hash % CONNTRACK_LOCKS];
+				spin_lock(aux_lock);
+				hlist_nulls_add_head_rcu(&ct->conenat_hashnode,
+							 &conenat_ct_hash[conenat_hash]);
+				spin_unlock(aux_lock);
+			}
 		}
+		spin_unlock(lock);
+		local_bh_enable();
 	}
-	spin_unlock_bh(&nf_conntrack_lock);
 }
 #endif
+
+#ifdef NF_CT_AUX_HASH
+/*
+ * nf_ct_add_to_aux_hashes()
+ *	Links a conntrack being confirmed into the single UDP and cone NAT
+ *	hashes.  Its conntrack bucket locks are held, so the layout of the
+ *	auxiliary hashes cannot change underneath.
+ */
+static void nf_ct_add_to_aux_hashes(struct nf_conn *ct)
+{
+	unsigned int size = init_net.ct.htable_size;
+	unsigned int bucket;
+	spinlock_t *lock;
+
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
+	if (nf_ct_single_udp_eligible(ct)) {
+		bucket = nf_ct_single_udp_bucket(ct, nf_ct_aux_behavior, size);
+		lock = &nf_conntrack_aux_locks[bucket % CONNTRACK_LOCKS];
+		spin_lock(lock);
+		hlist_nulls_add_head_rcu(&ct->hashnode, &single_udp_ct_hash[bucket]);
+		spin_unlock(lock);
+	}
 #endif
 
-/* Confirm a connection given skb; places it in hash table */
-int
-__nf_conntrack_confirm(struct sk_buff *skb)
+#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+	if (sysctl_enable_conenat_fast_search && nf_ct_conenat_eligible(ct)) {
+		bucket = nf_ct_conenat_bucket(ct, nf_ct_aux_behavior, size);
+		lock = &nf_conntrack_aux_locks[bucket % CONNTRACK_LOCKS];
+		spin_lock(lock);
+		hlist_nulls_add_head_rcu(&ct->conenat_hashnode, &conenat_ct_hash[bucket]);
+		spin_unlock(lock);
+	}
+#endif
+}
+#endif
+#endif
+
+DEFINE_STOPWATCH(nf_conntrack_confirm);
+
+static inline int
+nf_conntrack_do_confirm(struct sk_buff *skb)
 {
-	unsigned int hash, repl_hash;
+	unsigned int hash, repl_hash, sequence;
 	struct nf_conntrack_tuple_hash *h;
 	struct nf_conn *ct;
 	struct nf_conn_help *help;
@@ -1029,14 +1709,10 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 	enum ip_conntrack_info ctinfo;
 	struct net *net;
 	u16 zone;
-#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
-#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
-	unsigned int nat_filtering_behavior = sysctl_nat_filtering_behavior;
-	unsigned int single_udp_hash;
-#endif
-#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
-	unsigned int conenat_hash;
-#endif
+	u32 raw_hash;
+	unsigned int lru_class = NF_CT_LRU_OTHER;
+#if defined(CONFIG_NF_CONNTRACK_NAT_MANAGEMENT)
+	int admitted;
 #endif
 
 	ct = nf_ct_get(skb, &ctinfo);
@@ -1051,10 +1727,7 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 
 	zone = nf_ct_zone(ct);
 	/* reuse the hash saved before */
-	hash = *(unsigned long *)&ct->tuplehash[IP_CT_DIR_REPLY].hnnode.pprev;
-	hash = hash_bucket(hash, net);
-	repl_hash = hash_conntrack(net, zone,
-				   &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+	raw_hash = *(unsigned long *)&ct->tuplehash[IP_CT_DIR_REPLY].hnnode.pprev;
 
 	/* We're not in hash table, and we refuse to set up related
 	   connections for unconfirmed conns.  But packet copies and
@@ -1066,26 +1739,70 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 	NF_CT_ASSERT(!nf_ct_is_confirmed(ct));
 	pr_debug("Confirming conntrack %p\n", ct);
 
-	spin_lock_bh(&nf_conntrack_lock);
-
-	/* We have to check the DYING flag inside the lock to prevent
-	   a race against nf_ct_get_next_corpse() possibly called from
-	   user context, else we insert an already 'dead' hash, blocking
-	   further use of that particular connection -JM */
-
-	if (unlikely(nf_ct_is_dying(ct))) {
-		spin_unlock_bh(&nf_conntrack_lock);
-		return NF_ACCEPT;
-	}
-
 #if defined(CONFIG_IP_NF_TARGET_SNATP2P) || defined(CONFIG_IP_NF_TARGET_SNATP2P_MODULE) || defined(CONFIG_IP_NF_TARGET_HAIRPIN) || defined(CONFIG_IP_NF_TARGET_HAIRPIN_MODULE)
 	if (sysctl_snatp2p_range_port_full_control &&
 	    (ct->status & IPS_RANGE_PORT_FULL)) {
 		pr_debug("Port conflict, and no port can be chose!\n");
-		goto out;
+		NF_CT_STAT_INC_ATOMIC(net, insert_failed);
+		return NF_DROP;
+	}
+#endif
+
+	/* Making room for ct may kill other conntracks, which takes bucket
+	 * locks, so it is done before we take ours. */
+#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
+	/*  Check single UDP conntrack for all LAN-WAN sessions before conntrack sessions full checking. */
+	if (nf_ct_single_udp_eligible(ct))
+		nf_conntrack_single_udp_hash_find_remove(ct);
+#endif
+#endif
+
+#if defined(CONFIG_NF_CONNTRACK_NAT_MANAGEMENT)
+	admitted = nf_ct_nat_admit(net, ct, raw_hash);
+	if (admitted < 0) {
+		NF_CT_STAT_INC_ATOMIC(net, insert_failed);
+		return NF_DROP;
+	}
+
+	if (admitted == NF_CT_ADMIT_NAT)
+		lru_class = NF_CT_LRU_NAT;
+	else if (admitted == NF_CT_ADMIT_LOCAL) {
+		if (ct->status & IPS_CT_ICMP_RESERVE)
+			lru_class = NF_CT_LRU_ICMP_RESERVE;
+		else if (ct->status & IPS_CT_TCP_RESERVE)
+			lru_class = NF_CT_LRU_TCP_RESERVE;
+		else
+			lru_class = NF_CT_LRU_LOCAL;
 	}
 #endif
 
+	local_bh_disable();
+	do {
+		sequence = read_seqcount_begin(&net->ct.generation);
+		hash = hash_bucket(raw_hash, net);
+		repl_hash = hash_conntrack(net, zone,
+					   &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+	} while (nf_conntrack_double_lock(net, hash, repl_hash, sequence));
+
+	/* Remove from unconfirmed list before checking the DYING flag, to
+	   prevent a race against nf_ct_iterate_cleanup() possibly called
+	   from user context: it either marks us dying while we are still on
+	   the list, or finds us in the hash.  Else we insert an already
+	   'dead' hash, blocking further use of that particular connection. */
+	nf_ct_del_from_dying_or_unconfirmed_list(ct);
+
+	if (unlikely(nf_ct_is_dying(ct))) {
+		nf_ct_add_to_dying_list(ct);
+		nf_conntrack_double_unlock(hash, repl_hash);
+		local_bh_enable();
+#if defined(CONFIG_NF_CONNTRACK_NAT_MANAGEMENT)
+		if (admitted != NF_CT_ADMIT_NONE)
+			nf_ct_nat_release(net, ct);
+#endif
+		return NF_ACCEPT;
+	}
+
 	/* See if there's one in the list already, including reverse:
 	   NAT could have grabbed it without realizing, since we're
 	   not in the hash.  If there is, we lost race. */
@@ -1100,94 +1817,10 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 		    zone == nf_ct_zone(nf_ct_tuplehash_to_ctrack(h)))
 			goto out;
 
-#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
-#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
-	/*  Check single UDP conntrack for all LAN-WAN sessions before conntrack sessions full checking. */
-	if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num == PF_INET &&
-	    ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum == IPPROTO_UDP) {
-		if (ct->status & IPS_SRC_NAT) {
-			if (!(ct->status & IPS_DST_NAT)) {
-				single_udp_hash = single_udp_hash_conntrack(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
-									    nat_filtering_behavior);
-				nf_conntrack_single_udp_hash_find_remove(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
-									 single_udp_hash,
-									 nat_filtering_behavior,
-									 1);
-				hlist_nulls_add_head_rcu(&ct->hashnode, &single_udp_ct_hash[single_udp_hash]);
-			}
-		} else if ((ct->status & IPS_DST_NAT) && (ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip !=
-							  ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip)) {
-			single_udp_hash = single_udp_hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple,
-								    nat_filtering_behavior);
-			nf_conntrack_single_udp_hash_find_remove(&ct->tuplehash[IP_CT_DIR_REPLY].tuple,
-								 single_udp_hash,
-								 nat_filtering_behavior,
-								 0);
-			hlist_nulls_add_head_rcu(&ct->hashnode, &single_udp_ct_hash[single_udp_hash]);
-		}
-	}
-#endif
-#endif
-
-#if defined(CONFIG_NF_CONNTRACK_NAT_MANAGEMENT)
-	if (sysctl_enable_nat_management && ip_ct_nat_lan_session(ct)) {
-		if (nf_conntrack_max) {
-			if (unlikely(atomic_read(&net->ct.count) >= nf_conntrack_max) &&
-			    early_drop(net, hash)) {
-				if (net_ratelimit())
-					printk(KERN_WARNING "nf_conntrack: freeing un-assure connection.\n");
-			}
-
-			/* As the dropped connection by early_drop() maybe not the LAN-WAN session,
-			 * so it maybe not be counted, and need to read the ct count again. */
-			if (unlikely(atomic_read(&net->ct.count) >= nf_conntrack_max) &&
-			    (ip_ct_handle_nat_full(ct) == 0)) {
-				if (net_ratelimit())
-					printk(KERN_WARNING "Internet sessions full, dropping packet.\n");
-				goto out;
-			}
-		}
-
-		if (ip_ct_nat_lan_insert(ct)) /* No memory if failed! */
-			atomic_inc(&net->ct.count);
-		else
-			goto out;
-	}
-
-#if defined(CONFIG_NF_CONNTRACK_LOCAL_MANAGEMENT)
-	else if (sysctl_enable_nat_management && sysctl_enable_local_management &&
-		 (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num == PF_INET)) {
-		if (nf_conntrack_local_max &&
-		    atomic_read(&nf_conntrack_local_count) >= nf_conntrack_local_max) {
-			if ((ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum == IPPROTO_TCP) &&
-			    nf_conntrack_tcp_reserve_max &&
-			    atomic_read(&nf_conntrack_tcp_reserve_count) < nf_conntrack_tcp_reserve_max) {
-				ct->status |= IPS_CT_TCP_RESERVE;
-				atomic_inc(&nf_conntrack_tcp_reserve_count);
-			} else if ((ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum == IPPROTO_ICMP) &&
-				   nf_conntrack_icmp_reserve_max &&
-				   atomic_read(&nf_conntrack_icmp_reserve_count) < nf_conntrack_icmp_reserve_max) {
-				ct->status |= IPS_CT_ICMP_RESERVE;
-				atomic_inc(&nf_conntrack_icmp_reserve_count);
-			} else {
-				if (net_ratelimit())
-					printk(KERN_WARNING "Local sessions full, dropping packet.\n");
-				goto out;
-			}
-		} else
-			atomic_inc(&nf_conntrack_local_count);
-	}
-#endif
-#endif
-
-	/* Remove from unconfirmed list */
-	hlist_nulls_del_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode);
-
-	/* Timer relative to confirmation time, not original
+	/* Timeout is relative to confirmation time, not original
 	   setting time, otherwise we'd get timer wrap in
 	   weird delay cases. */
-	ct->timeout.expires += jiffies;
-	add_timer(&ct->timeout);
+	ct->timeout += nfct_time_stamp;
 	atomic_inc(&ct->ct_general.use);
 	ct->status |= IPS_CONFIRMED;
 
@@ -1204,23 +1837,16 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 	 * guarantee that no other CPU can find the conntrack before the above
 	 * stores are visible.
 	 */
+	nf_ct_lru_add(ct, lru_class);
 	__nf_conntrack_hash_insert(ct, hash, repl_hash);
 	NF_CT_STAT_INC(net, insert);
 
-#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
-#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
-	if (sysctl_enable_conenat_fast_search &&
-	    ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num == PF_INET &&
-	    ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum == IPPROTO_UDP) {
-		if (ct->status & IPS_SRC_NAT) {
-			conenat_hash = conenat_hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple);
-			hlist_nulls_add_head_rcu(&ct->conenat_hashnode, &conenat_ct_hash[conenat_hash]);
-		}
-	}
-#endif
+#ifdef NF_CT_AUX_HASH
+	nf_ct_add_to_aux_hashes(ct);
 #endif
 
-	spin_unlock_bh(&nf_conntrack_lock);
+	nf_conntrack_double_unlock(hash, repl_hash);
+	local_bh_enable();
 
 	help = nfct_help(ct);
 	if (help && help->helper)
@@ -1231,10 +1857,29 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 	return NF_ACCEPT;
 
 out:
+	nf_ct_add_to_dying_list(ct);
 	NF_CT_STAT_INC(net, insert_failed);
-	spin_unlock_bh(&nf_conntrack_lock);
+	nf_conntrack_double_unlock(hash, repl_hash);
+	local_bh_enable();
+#if defined(CONFIG_NF_CONNTRACK_NAT_MANAGEMENT)
+	if (admitted != NF_CT_ADMIT_NONE)
+		nf_ct_nat_release(net, ct);
+#endif
 	return NF_DROP;
 }
+
+/* Confirm a connection given skb; places it in hash table */
+int
+__nf_conntrack_confirm(struct sk_buff *skb)
+{
+	int ret;
+	STOPWATCH_TIMER(t);
+
+	STOPWATCH_TIMER_START(t);
+	ret = nf_conntrack_do_confirm(skb);
+	STOPWATCH_TIMER_STOP(nf_conntrack_confirm, t);
+	return ret;
+}
 EXPORT_SYMBOL_GPL(__nf_conntrack_confirm);
 
 /* Returns true if a connection correspondings to the tuple (required
@@ -1245,17 +1890,26 @@ nf_conntrack_tuple_taken(const struct nf_conntrack_tuple *tuple,
 {
 	struct net *net = nf_ct_net(ignored_conntrack);
 	struct nf_conntrack_tuple_hash *h;
+	struct hlist_nulls_head *ct_hash;
 	struct hlist_nulls_node *n;
 	struct nf_conn *ct;
 	u16 zone = nf_ct_zone(ignored_conntrack);
-	unsigned int hash = hash_conntrack(net, zone, tuple);
+	unsigned int hash, hsize;
 
 	/* Disable BHs the entire time since we need to disable them at
 	 * least once for the stats anyway.
 	 */
 	rcu_read_lock_bh();
-	hlist_nulls_for_each_entry_rcu(h, n, &net->ct.hash[hash], hnnode) {
+	nf_conntrack_get_ht(net, &ct_hash, &hsize);
+	hash = __hash_conntrack(tuple, zone, hsize);
+	hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[hash], hnnode) {
 		ct = nf_ct_tuplehash_to_ctrack(h);
+
+		if (nf_ct_is_expired(ct)) {
+			nf_ct_gc_expired(ct);
+			continue;
+		}
+
 		if (ct != ignored_conntrack &&
 		    nf_ct_tuple_equal(tuple, &h->tuple) &&
 		    nf_ct_zone(ct) == zone) {
@@ -1271,64 +1925,58 @@ nf_conntrack_tuple_taken(const struct nf_conntrack_tuple *tuple,
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_tuple_taken);
 
-#define NF_CT_EVICTION_RANGE	8
-
-/* There's a small race here where we may free a just-assured
-   connection.  Too bad: we're in trouble anyway. */
-static noinline int early_drop(struct net *net, unsigned int hash)
+/*
+ * early_drop()
+ *	Kills the oldest unassured conntrack across the classes, going to
+ *	the reserve classes only when the others have none.
+ */
+static noinline int early_drop(struct net *net)
 {
-	/* Use oldest entry, which is roughly LRU */
-	struct nf_conntrack_tuple_hash *h;
-	struct nf_conn *ct = NULL, *tmp;
-	struct hlist_nulls_node *n;
-	unsigned int i, cnt = 0;
+	struct nf_conn *ct, *victim = NULL;
+	struct nf_ct_lru *lru;
+	unsigned long oldest = 0;
+	int class, best = -1;
 	int dropped = 0;
 
-	rcu_read_lock();
-	for (i = 0; i < net->ct.htable_size; i++) {
-		hlist_nulls_for_each_entry_rcu(h, n, &net->ct.hash[hash],
-					 hnnode) {
-			tmp = nf_ct_tuplehash_to_ctrack(h);
-			if (!test_bit(IPS_ASSURED_BIT, &tmp->status))
-#ifdef CONFIG_NF_CONNTRACK_CHECK_TCP_UDP_TIMEOUT_IN_EARLY_DROP
-				if ((nf_ct_protonum(tmp) != IPPROTO_TCP &&
-				     nf_ct_protonum(tmp) != IPPROTO_UDP) ||
-				    !timer_pending(&tmp->timeout))
-#endif
-			{
-				ct = tmp;
-			}
-			cnt++;
-		}
+	local_bh_disable();
+	for (class = 0; class < NF_CT_LRU_MAX; class++) {
+		if (class == NF_CT_LRU_TCP_RESERVE && best >= 0)
+			break;
 
-		if (ct != NULL) {
-			if (likely(!nf_ct_is_dying(ct) &&
-				   atomic_inc_not_zero(&ct->ct_general.use)))
-				break;
-			else
-				ct = NULL;
+		lru = &net->ct.lru[class];
+		spin_lock(&lru->lock);
+		ct = nf_ct_lru_first(lru);
+		if (ct && (best < 0 || time_before(ct->lru_stamp, oldest))) {
+			best = class;
+			oldest = ct->lru_stamp;
 		}
+		spin_unlock(&lru->lock);
+	}
 
-		if (cnt >= NF_CT_EVICTION_RANGE)
-			break;
-
-		hash = (hash + 1) % net->ct.htable_size;
+	if (best >= 0) {
+		lru = &net->ct.lru[best];
+		spin_lock(&lru->lock);
+		ct = nf_ct_lru_first(lru);
+		if (ct && atomic_inc_not_zero(&ct->ct_general.use)) {
+			/* Keep other CPUs from picking it as well */
+			list_del_init(&ct->lru);
+			victim = ct;
+		}
+		spin_unlock(&lru->lock);
 	}
-	rcu_read_unlock();
+	local_bh_enable();
 
-	if (!ct)
+	if (!victim)
 		return dropped;
 
-	if (del_timer(&ct->timeout)) {
-		death_by_timeout((unsigned long)ct);
-		/* Check if we indeed killed this entry. Reliable event
-		   delivery may have inserted it into the dying list. */
-		if (test_bit(IPS_DYING_BIT, &ct->status)) {
-			dropped = 1;
-			NF_CT_STAT_INC_ATOMIC(net, early_drop);
-		}
+	/* Reliable event delivery may have put it on the dying list
+	   instead, in which case it does not make room yet. */
+	if (nf_ct_delete(victim, 0, 0)) {
+		dropped = 1;
+		atomic_inc(&lru->evicted);
+		NF_CT_STAT_INC_ATOMIC(net, early_drop);
 	}
-	nf_ct_put(ct);
+	nf_ct_put(victim);
 	return dropped;
 }
 
@@ -1347,6 +1995,27 @@ void init_nf_conntrack_hash_rnd(void)
 	cmpxchg(&nf_conntrack_hash_rnd, 0, rand);
 }
 
+/*
+ * nf_conntrack_resize_check()
+ *	Schedules a resize of the init_net hash when the number of conntracks
+ *	outgrows it, or drops well below it.
+ */
+static inline void nf_conntrack_resize_check(struct net *net)
+{
+	unsigned int count, size;
+
+	if (!net_eq(net, &init_net) || !ACCESS_ONCE(nf_conntrack_autoresize))
+		return;
+
+	count = atomic_read(&net->ct.count);
+	size = net->ct.htable_size;
+	if ((count > size && (!nf_conntrack_max || size < nf_conntrack_max)) ||
+	    (count < size / 8 && size > nf_conntrack_hashsize_min)) {
+		if (!delayed_work_pending(&nf_conntrack_resize_work))
+			schedule_delayed_work(&nf_conntrack_resize_work, HZ);
+	}
+}
+
 static struct nf_conn *
 __nf_conntrack_alloc(struct net *net, u16 zone,
 		     const struct nf_conntrack_tuple *orig,
@@ -1372,7 +2041,7 @@ __nf_conntrack_alloc(struct net *net, u16 zone,
 
 	if (nf_conntrack_max &&
 	    unlikely(atomic_read(&net->ct.count) > nf_conntrack_max)) {
-		if (!early_drop(net, hash_bucket(hash, net))) {
+		if (!early_drop(net)) {
 			atomic_dec(&net->ct.count);
 			if (net_ratelimit())
 				printk(KERN_WARNING
@@ -1405,6 +2074,8 @@ __nf_conntrack_alloc(struct net *net, u16 zone,
 	       offsetof(struct nf_conn, proto) -
 	       offsetof(struct nf_conn, tuplehash[IP_CT_DIR_MAX]));
 	spin_lock_init(&ct->lock);
+	INIT_LIST_HEAD(&ct->lru);
+	ct->lru_class = NF_CT_LRU_NONE;
 	ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple = *orig;
 	ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode.pprev = NULL;
 	ct->tuplehash[IP_CT_DIR_REPLY].tuple = *repl;
@@ -1418,8 +2089,6 @@ __nf_conntrack_alloc(struct net *net, u16 zone,
 	ct->conenat_hashnode.pprev = NULL;
 #endif
 #endif
-	/* Don't set timer yet: wait for confirmation */
-	setup_timer(&ct->timeout, death_by_timeout, (unsigned long)ct);
 	write_pnet(&ct->ct_net, net);
 #ifdef CONFIG_NF_CONNTRACK_ZONES
 	if (zone) {
@@ -1436,6 +2105,7 @@ __nf_conntrack_alloc(struct net *net, u16 zone,
 	 */
 	smp_wmb();
 	atomic_set(&ct->ct_general.use, 1);
+	nf_conntrack_resize_check(net);
 	return ct;
 
 #ifdef CONFIG_NF_CONNTRACK_ZONES
@@ -1466,25 +2136,14 @@ void nf_conntrack_free(struct nf_conn *ct)
 #if defined(CONFIG_NF_CONNTRACK_NAT_MANAGEMENT)
 	if (sysctl_enable_nat_management) { 
 		if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num == PF_INET &&
-		    nf_ct_is_confirmed(ct)) {
-			if (nf_ct_nat_lan_destroy(ct))
-				atomic_dec(&net->ct.count);
-#if defined(CONFIG_NF_CONNTRACK_LOCAL_MANAGEMENT)
-			else if (sysctl_enable_local_management) {
-				if (ct->status & IPS_CT_ICMP_RESERVE)
-					atomic_dec(&nf_conntrack_icmp_reserve_count);
-				else if (ct->status & IPS_CT_TCP_RESERVE)
-					atomic_dec(&nf_conntrack_tcp_reserve_count);
-				else
-					atomic_dec(&nf_conntrack_local_count);
-			}
-#endif
-		}
+		    nf_ct_is_confirmed(ct))
+			nf_ct_nat_release(net, ct);
 	} else
 #endif
 	atomic_dec(&net->ct.count);
 	nf_ct_ext_free(ct);
 	kmem_cache_free(net->ct.nf_conntrack_cachep, ct);
+	nf_conntrack_resize_check(net);
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_free);
 
@@ -1536,44 +2195,51 @@ init_conntrack(struct net *net, struct nf_conn *tmpl,
 	nf_ct_tstamp_ext_add(ct, GFP_ATOMIC);
 	nf_ct_dscpremark_ext_add(ct, GFP_ATOMIC);
 	nf_ct_vlantag_ext_add(ct, GFP_ATOMIC);
+	nf_ct_layer7_ext_add(ct, GFP_ATOMIC);
 
 	ecache = tmpl ? nf_ct_ecache_find(tmpl) : NULL;
 	nf_ct_ecache_ext_add(ct, ecache ? ecache->ctmask : 0,
 				 ecache ? ecache->expmask : 0,
 			     GFP_ATOMIC);
 
-	spin_lock_bh(&nf_conntrack_lock);
-	exp = nf_ct_find_expectation(net, zone, tuple);
-	if (exp) {
-		pr_debug("conntrack: expectation arrives ct=%p exp=%p\n",
-			 ct, exp);
-		/* Welcome, Mr. Bond.  We've been expecting you... */
-		__set_bit(IPS_EXPECTED_BIT, &ct->status);
-		ct->master = exp->master;
-		if (exp->helper) {
-			help = nf_ct_helper_ext_add(ct, GFP_ATOMIC);
-			if (help)
-				rcu_assign_pointer(help->helper, exp->helper);
-		}
+	local_bh_disable();
+	exp = NULL;
+	/* The global lock is only needed for expectations these days */
+	if (net->ct.expect_count) {
+		spin_lock(&nf_conntrack_lock);
+		exp = nf_ct_find_expectation(net, zone, tuple);
+		if (exp) {
+			pr_debug("conntrack: expectation arrives ct=%p exp=%p\n",
+				 ct, exp);
+			/* Welcome, Mr. Bond.  We've been expecting you... */
+			__set_bit(IPS_EXPECTED_BIT, &ct->status);
+			ct->master = exp->master;
+			if (exp->helper) {
+				help = nf_ct_helper_ext_add(ct, GFP_ATOMIC);
+				if (help)
+					rcu_assign_pointer(help->helper, exp->helper);
+			}
 
 #ifdef CONFIG_NF_CONNTRACK_MARK
-		ct->mark = exp->master->mark;
+			ct->mark = exp->master->mark;
 #endif
 #ifdef CONFIG_NF_CONNTRACK_SECMARK
-		ct->secmark = exp->master->secmark;
+			ct->secmark = exp->master->secmark;
 #endif
-		nf_conntrack_get(&ct->master->ct_general);
-		NF_CT_STAT_INC(net, expect_new);
-	} else {
+			nf_conntrack_get(&ct->master->ct_general);
+			NF_CT_STAT_INC(net, expect_new);
+		}
+		spin_unlock(&nf_conntrack_lock);
+	}
+	if (!exp) {
 		__nf_ct_try_assign_helper(ct, tmpl, GFP_ATOMIC);
 		NF_CT_STAT_INC(net, new);
 	}
 
 	/* Overload tuple linked list to put us in unconfirmed list. */
-	hlist_nulls_add_head_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode,
-		       &net->ct.unconfirmed);
+	nf_ct_add_to_unconfirmed_list(ct);
 
-	spin_unlock_bh(&nf_conntrack_lock);
+	local_bh_enable();
 
 	if (exp) {
 		if (exp->expectfn)
@@ -1804,28 +2470,28 @@ void __nf_ct_refresh_acct(struct nf_conn *ct,
 			  unsigned long extra_jiffies,
 			  int do_acct)
 {
-	NF_CT_ASSERT(ct->timeout.data == (unsigned long)ct);
 	NF_CT_ASSERT(skb);
 
 	/* Only update if this is not a fixed timeout */
 	if (test_bit(IPS_FIXED_TIMEOUT_BIT, &ct->status))
 		goto acct;
 
-	/* If not in hash table, timer will not be active yet */
+	/* If not in hash table, timeout is relative until confirmation */
 	if (!nf_ct_is_confirmed(ct)) {
-		ct->timeout.expires = extra_jiffies;
+		ct->timeout = extra_jiffies;
 	} else {
-		unsigned long newtime = jiffies + extra_jiffies;
+		u32 newtime = nfct_time_stamp + extra_jiffies;
 
 		/* Only update the timeout if the new timeout is at least
-		   HZ jiffies from the old timeout. Need del_timer for race
-		   avoidance (may already be dying). */
-		if (newtime - ct->timeout.expires >= HZ) {
+		   HZ jiffies from the old timeout, so the cache line is not
+		   dirtied on every packet.  A dying conntrack stays dying
+		   whatever is stored here. */
+		if (newtime - ct->timeout >= HZ) {
 #if defined(CONFIG_NF_CONNTRACK_NAT_MANAGEMENT)
 			if (sysctl_enable_nat_management)
 				ip_ct_lru_low_prio_update(ct);
 #endif
-			mod_timer_pending(&ct->timeout, newtime);
+			ACCESS_ONCE(ct->timeout) = newtime;
 		}
 	}
 
@@ -1858,11 +2524,7 @@ bool __nf_ct_kill_acct(struct nf_conn *ct,
 		}
 	}
 
-	if (del_timer(&ct->timeout)) {
-		ct->timeout.function((unsigned long)ct);
-		return true;
-	}
-	return false;
+	return nf_ct_delete(ct, 0, 0);
 }
 EXPORT_SYMBOL_GPL(__nf_ct_kill_acct);
 
@@ -1948,69 +2610,67 @@ get_next_corpse(struct net *net, int (*iter)(struct nf_conn *i, void *data),
 	struct nf_conntrack_tuple_hash *h;
 	struct nf_conn *ct;
 	struct hlist_nulls_node *n;
+	int cpu;
+	spinlock_t *lockp;
 
-	spin_lock_bh(&nf_conntrack_lock);
 	for (; *bucket < net->ct.htable_size; (*bucket)++) {
-		hlist_nulls_for_each_entry(h, n, &net->ct.hash[*bucket], hnnode) {
+		lockp = &nf_conntrack_locks[*bucket % CONNTRACK_LOCKS];
+		local_bh_disable();
+		nf_conntrack_lock_stripe(lockp);
+		if (*bucket < net->ct.htable_size) {
+			hlist_nulls_for_each_entry(h, n, &net->ct.hash[*bucket], hnnode) {
+				if (NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL)
+					continue;
+				ct = nf_ct_tuplehash_to_ctrack(h);
+				if (iter(ct, data))
+					goto found;
+			}
+		}
+		spin_unlock(lockp);
+		local_bh_enable();
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct ct_pcpu *pcpu = per_cpu_ptr(net->ct.pcpu_lists, cpu);
+
+		spin_lock_bh(&pcpu->lock);
+		hlist_nulls_for_each_entry(h, n, &pcpu->unconfirmed, hnnode) {
 			ct = nf_ct_tuplehash_to_ctrack(h);
 			if (iter(ct, data))
-				goto found;
+				set_bit(IPS_DYING_BIT, &ct->status);
 		}
+		spin_unlock_bh(&pcpu->lock);
 	}
-	hlist_nulls_for_each_entry(h, n, &net->ct.unconfirmed, hnnode) {
-		ct = nf_ct_tuplehash_to_ctrack(h);
-		if (iter(ct, data))
-			set_bit(IPS_DYING_BIT, &ct->status);
-	}
-	spin_unlock_bh(&nf_conntrack_lock);
 	return NULL;
 found:
 	atomic_inc(&ct->ct_general.use);
-	spin_unlock_bh(&nf_conntrack_lock);
+	spin_unlock(lockp);
+	local_bh_enable();
 	return ct;
 }
 
-void nf_ct_iterate_cleanup(struct net *net,
-			   int (*iter)(struct nf_conn *i, void *data),
-			   void *data)
+static void
+__nf_ct_iterate_cleanup(struct net *net,
+			int (*iter)(struct nf_conn *i, void *data),
+			void *data, u32 pid, int report)
 {
 	struct nf_conn *ct;
 	unsigned int bucket = 0;
 
 	while ((ct = get_next_corpse(net, iter, data, &bucket)) != NULL) {
 		/* Time to push up daises... */
-		if (del_timer(&ct->timeout))
-			death_by_timeout((unsigned long)ct);
-		/* ... else the timer will get him soon. */
-
+		nf_ct_delete(ct, pid, report);
 		nf_ct_put(ct);
 	}
 }
-EXPORT_SYMBOL_GPL(nf_ct_iterate_cleanup);
-
-struct __nf_ct_flush_report {
-	u32 pid;
-	int report;
-};
 
-static int kill_report(struct nf_conn *i, void *data)
+void nf_ct_iterate_cleanup(struct net *net,
+			   int (*iter)(struct nf_conn *i, void *data),
+			   void *data)
 {
-	struct __nf_ct_flush_report *fr = (struct __nf_ct_flush_report *)data;
-	struct nf_conn_tstamp *tstamp;
-
-	tstamp = nf_conn_tstamp_find(i);
-	if (tstamp && tstamp->stop == 0)
-		tstamp->stop = ktime_to_ns(ktime_get_real());
-
-	/* If we fail to deliver the event, death_by_timeout() will retry */
-	if (nf_conntrack_event_report(IPCT_DESTROY, i,
-				      fr->pid, fr->report) < 0)
-		return 1;
-
-	/* Avoid the delivery of the destroy event in death_by_timeout(). */
-	set_bit(IPS_DYING_BIT, &i->status);
-	return 1;
+	__nf_ct_iterate_cleanup(net, iter, data, 0, 0);
 }
+EXPORT_SYMBOL_GPL(nf_ct_iterate_cleanup);
 
 static int kill_all(struct nf_conn *i, void *data)
 {
@@ -2023,27 +2683,40 @@ void do_flush_conntrack_table(void)
 }
 
 #if defined(CONFIG_NF_CONNTRACK_NAT_MANAGEMENT)
+/*
+ * reset_nf_conntrack_nat_counts()
+ *	Rebuilds the NAT session accounting after management was toggled.
+ *	Holds off every bucket lock while it walks the table, which is fine
+ *	for an administrative switch.
+ */
 void reset_nf_conntrack_nat_counts(void)
 {
 	struct nf_conntrack_tuple_hash *h;
+	struct hlist_nulls_node *n;
 	struct nf_conn *ct;
 	struct nf_conn_lan *lan;
 	unsigned int enable_nat_management, enable_local_management;
 	unsigned int i, nat_count = 0, local_count = 0;
 
 	enable_nat_management = sysctl_enable_nat_management;
+#if defined(CONFIG_NF_CONNTRACK_LOCAL_MANAGEMENT)
 	enable_local_management = sysctl_enable_local_management;
+#else
+	enable_local_management = 0;
+#endif
 
-	spin_lock_bh(&nf_conntrack_lock);
+	local_bh_disable();
+	nf_conntrack_all_lock();
+	spin_lock(&nat_lan_lock);
 	for (i = 0; i < init_net.ct.htable_size; i++) {
-		while (!hlist_nulls_empty(&init_net.ct.hash[i])) {
-			h = hlist_nulls_entry(init_net.ct.hash[i].first,
-					      struct nf_conntrack_tuple_hash, hnnode);
+		hlist_nulls_for_each_entry(h, n, &init_net.ct.hash[i], hnnode) {
+			if (NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL)
+				continue;
 			ct = nf_ct_tuplehash_to_ctrack(h);
 
 			if (enable_nat_management) {
 				if ((ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num != PF_INET) ||
-				    !nf_ct_is_confirmed(ct))
+				    !nf_ct_is_confirmed(ct) || ct->lan_nat)
 					continue;
 				if(ip_ct_nat_lan_session(ct)) {
 					if (ip_ct_nat_lan_insert(ct))
@@ -2056,6 +2729,7 @@ void reset_nf_conntrack_nat_counts(void)
 					continue;
 
 				list_del(&ct->lan_hash);
+				ct->lan_nat = NULL;
 
 				if (--lan->count <= 0) {
 					NAT_LAN_DEBUGP("%u.%u.%u.%u has no LAN sessions.\n",
@@ -2067,33 +2741,40 @@ void reset_nf_conntrack_nat_counts(void)
 		}
 	}
 
+#if defined(CONFIG_NF_CONNTRACK_LOCAL_MANAGEMENT)
 	if (enable_local_management) {
 		atomic_set(&nf_conntrack_local_count, local_count);
 		atomic_set(&nf_conntrack_icmp_reserve_count, 0);
 		atomic_set(&nf_conntrack_tcp_reserve_count, 0);
-	} else {
+	} else
+#endif
+	if (!enable_nat_management)
 		nat_lan_max = NULL;
-	}
 
 	atomic_set(&init_net.ct.count, nat_count);
-	spin_unlock_bh(&nf_conntrack_lock);
+	spin_unlock(&nat_lan_lock);
+	nf_conntrack_all_unlock();
+	local_bh_enable();
 }
 
 #if defined(CONFIG_NF_CONNTRACK_LOCAL_MANAGEMENT)
 void reset_nf_conntrack_local_counts(void)
 {
-	unsigned int i, local_count = 0;
+	unsigned int i, hsize, local_count = 0;
 	struct nf_conntrack_tuple_hash *h;
+	struct hlist_nulls_head *ct_hash;
+	struct hlist_nulls_node *n;
 	struct nf_conn *ct;
 
 	if (sysctl_enable_local_management) {
 		rcu_read_lock();
-		for (i = 0; i < init_net.ct.htable_size; i++) {
-			while (!hlist_nulls_empty(&init_net.ct.hash[i])) {
-				h = hlist_nulls_entry(init_net.ct.hash[i].first,
-						      struct nf_conntrack_tuple_hash, hnnode);
+		nf_conntrack_get_ht(&init_net, &ct_hash, &hsize);
+		for (i = 0; i < hsize; i++) {
+			hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[i], hnnode) {
+				if (NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL)
+					continue;
 				ct = nf_ct_tuplehash_to_ctrack(h);
-			
+
 				if ((ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num != PF_INET) ||
 				    !(ct->status & IPS_NAT_MASK) ||
 				    !nf_ct_is_confirmed(ct))
@@ -2128,11 +2809,7 @@ EXPORT_SYMBOL_GPL(nf_ct_free_hashtable);
 
 void nf_conntrack_flush_report(struct net *net, u32 pid, int report)
 {
-	struct __nf_ct_flush_report fr = {
-		.pid 	= pid,
-		.report = report,
-	};
-	nf_ct_iterate_cleanup(net, kill_report, &fr);
+	__nf_ct_iterate_cleanup(net, kill_all, NULL, pid, report);
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_flush_report);
 
@@ -2141,14 +2818,19 @@ static void nf_ct_release_dying_list(struct net *net)
 	struct nf_conntrack_tuple_hash *h;
 	struct nf_conn *ct;
 	struct hlist_nulls_node *n;
+	int cpu;
 
-	spin_lock_bh(&nf_conntrack_lock);
-	hlist_nulls_for_each_entry(h, n, &net->ct.dying, hnnode) {
-		ct = nf_ct_tuplehash_to_ctrack(h);
-		/* never fails to remove them, no listeners at this point */
-		nf_ct_kill(ct);
+	for_each_possible_cpu(cpu) {
+		struct ct_pcpu *pcpu = per_cpu_ptr(net->ct.pcpu_lists, cpu);
+
+		spin_lock_bh(&pcpu->lock);
+		hlist_nulls_for_each_entry(h, n, &pcpu->dying, hnnode) {
+			ct = nf_ct_tuplehash_to_ctrack(h);
+			/* never fails to remove them, no listeners at this point */
+			nf_ct_kill(ct);
+		}
+		spin_unlock_bh(&pcpu->lock);
 	}
-	spin_unlock_bh(&nf_conntrack_lock);
 }
 
 static int untrack_refs(void)
@@ -2168,8 +2850,10 @@ static void nf_conntrack_cleanup_init_net(void)
 	while (untrack_refs() > 0)
 		schedule();
 
+	UNREGISTER_STOPWATCH(nf_conntrack_confirm);
 	nf_conntrack_helper_fini();
 	nf_conntrack_proto_fini();
+	nf_conntrack_layer7_ext_fini();
 	nf_conntrack_dscpremark_ext_fini();
 	nf_conntrack_vlantag_ext_fini();
 #if defined(CONFIG_NF_CONNTRACK_NAT_MANAGEMENT)
@@ -2184,6 +2868,7 @@ static void nf_conntrack_cleanup_init_net(void)
 
 static void nf_conntrack_cleanup_net(struct net *net)
 {
+	cancel_delayed_work_sync(&net->ct.gc_work);
  i_see_dead_people:
 	nf_ct_iterate_cleanup(net, kill_all, NULL);
 	nf_ct_release_dying_list(net);
@@ -2192,6 +2877,20 @@ static void nf_conntrack_cleanup_net(struct net *net)
 		goto i_see_dead_people;
 	}
 
+	if (net_eq(net, &init_net))
+		cancel_delayed_work_sync(&nf_conntrack_resize_work);
+
+#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
+	if (net_eq(net, &init_net)) {
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
+		nf_ct_free_hashtable(single_udp_ct_hash, net->ct.htable_size);
+#endif
+#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+		nf_ct_free_hashtable(conenat_ct_hash, net->ct.htable_size);
+#endif
+	}
+#endif
+
 	nf_ct_free_hashtable(net->ct.hash, net->ct.htable_size);
 	nf_conntrack_timeout_fini(net);
 	nf_conntrack_ecache_fini(net);
@@ -2200,6 +2899,7 @@ static void nf_conntrack_cleanup_net(struct net *net)
 	nf_conntrack_expect_fini(net);
 	kmem_cache_destroy(net->ct.nf_conntrack_cachep);
 	kfree(net->ct.slabname);
+	free_percpu(net->ct.pcpu_lists);
 	free_percpu(net->ct.stat);
 }
 
@@ -2207,24 +2907,16 @@ static void nf_conntrack_cleanup_net(struct net *net)
    supposed to kill the mall. */
 void nf_conntrack_cleanup(struct net *net)
 {
-	if (net_eq(net, &init_net))
+	if (net_eq(net, &init_net)) {
 		RCU_INIT_POINTER(ip_ct_attach, NULL);
+		nf_conntrack_autoresize = false;
+	}
 
 	/* This makes sure all current packets have passed through
 	   netfilter framework.  Roll on, two-stage module
 	   delete... */
 	synchronize_net();
 
-#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
-#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
-	nf_ct_free_hashtable(single_udp_ct_hash, net->ct.htable_size);
-#endif
-
-#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
-	nf_ct_free_hashtable(conenat_ct_hash, net->ct.htable_size);
-#endif
-#endif
-
 	nf_conntrack_cleanup_net(net);
 
 	if (net_eq(net, &init_net)) {
@@ -2257,13 +2949,282 @@ void *nf_ct_alloc_hashtable(unsigned int *sizep, int nulls)
 }
 EXPORT_SYMBOL_GPL(nf_ct_alloc_hashtable);
 
-int nf_conntrack_set_hashsize(const char *val, struct kernel_param *kp)
+/*
+ * nf_conntrack_rehash()
+ *	Moves the conntracks of init_net into a table of hashsize buckets,
+ *	and rebuilds the single UDP and cone NAT hashes at that size keyed by
+ *	behavior.  Lookups go on under RCU and may miss an entry while it
+ *	moves; writers wait on the bucket locks and recompute their buckets.
+ *	Called with nf_conntrack_resize_mutex held.
+ */
+static int nf_conntrack_rehash(unsigned int hashsize, unsigned int behavior)
 {
-	int i, bucket;
-	unsigned int hashsize, old_size;
 	struct hlist_nulls_head *hash, *old_hash;
 	struct nf_conntrack_tuple_hash *h;
 	struct nf_conn *ct;
+	unsigned int i, bucket, old_size;
+#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
+	struct hlist_nulls_head *udp_hash, *old_udp_hash;
+#endif
+#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+	struct hlist_nulls_head *cone_hash, *old_cone_hash;
+#endif
+#endif
+
+	old_size = init_net.ct.htable_size;
+	if (hashsize == old_size) {
+		hash = init_net.ct.hash;
+	} else {
+		hash = nf_ct_alloc_hashtable(&hashsize, 1);
+		if (!hash)
+			return -ENOMEM;
+	}
+
+#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
+	udp_hash = nf_ct_alloc_hashtable(&hashsize, 1);
+	if (!udp_hash)
+		goto err_udp_hash;
+#endif
+#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+	cone_hash = nf_ct_alloc_hashtable(&hashsize, 1);
+	if (!cone_hash)
+		goto err_cone_hash;
+#endif
+#endif
+
+	local_bh_disable();
+	nf_conntrack_all_lock();
+	write_seqcount_begin(&init_net.ct.generation);
+
+	old_hash = init_net.ct.hash;
+	if (hash != old_hash) {
+		for (i = 0; i < old_size; i++) {
+			while (!hlist_nulls_empty(&old_hash[i])) {
+				h = hlist_nulls_entry(old_hash[i].first,
+						struct nf_conntrack_tuple_hash, hnnode);
+				ct = nf_ct_tuplehash_to_ctrack(h);
+				hlist_nulls_del_rcu(&h->hnnode);
+				bucket = __hash_conntrack(&h->tuple, nf_ct_zone(ct),
+							  hashsize);
+				hlist_nulls_add_head_rcu(&h->hnnode, &hash[bucket]);
+			}
+		}
+		init_net.ct.htable_size = nf_conntrack_htable_size = hashsize;
+		init_net.ct.hash = hash;
+	}
+
+#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
+	old_udp_hash = single_udp_ct_hash;
+	for (i = 0; i < old_size; i++) {
+		while (!hlist_nulls_empty(&old_udp_hash[i])) {
+			ct = hlist_nulls_entry(old_udp_hash[i].first,
+					       struct nf_conn, hashnode);
+			hlist_nulls_del_rcu(&ct->hashnode);
+			bucket = nf_ct_single_udp_bucket(ct, behavior, hashsize);
+			hlist_nulls_add_head_rcu(&ct->hashnode, &udp_hash[bucket]);
+		}
+	}
+	single_udp_ct_hash = udp_hash;
+#endif
+#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+	old_cone_hash = conenat_ct_hash;
+	for (i = 0; i < old_size; i++) {
+		while (!hlist_nulls_empty(&old_cone_hash[i])) {
+			ct = hlist_nulls_entry(old_cone_hash[i].first,
+					       struct nf_conn, conenat_hashnode);
+			hlist_nulls_del_rcu(&ct->conenat_hashnode);
+			bucket = nf_ct_conenat_bucket(ct, behavior, hashsize);
+			hlist_nulls_add_head_rcu(&ct->conenat_hashnode,
+						 &cone_hash[bucket]);
+		}
+	}
+	conenat_ct_hash = cone_hash;
+#endif
+#endif
+#ifdef NF_CT_AUX_HASH
+	nf_ct_aux_behavior = behavior;
+#endif
+
+	write_seqcount_end(&init_net.ct.generation);
+	nf_conntrack_all_unlock();
+	local_bh_enable();
+
+	/* Wait for lookups still walking the old tables */
+	synchronize_net();
+
+	if (hash != old_hash)
+		nf_ct_free_hashtable(old_hash, old_size);
+#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
+	nf_ct_free_hashtable(old_udp_hash, old_size);
+#endif
+#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+	nf_ct_free_hashtable(old_cone_hash, old_size);
+#endif
+#endif
+	return 0;
+
+#if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
+#if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
+err_cone_hash:
+#endif
+#if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
+	nf_ct_free_hashtable(udp_hash, hashsize);
+err_udp_hash:
+#endif
+	if (hash != init_net.ct.hash)
+		nf_ct_free_hashtable(hash, hashsize);
+	return -ENOMEM;
+#endif
+}
+
+/*
+ * nf_conntrack_hash_resize()
+ *	Resizes the init_net conntrack hash without flushing it.
+ */
+int nf_conntrack_hash_resize(unsigned int hashsize)
+{
+	int ret;
+
+	if (!hashsize)
+		return -EINVAL;
+
+	mutex_lock(&nf_conntrack_resize_mutex);
+#ifdef NF_CT_AUX_HASH
+	ret = nf_conntrack_rehash(hashsize, nf_ct_aux_behavior);
+#else
+	ret = nf_conntrack_rehash(hashsize, 0);
+#endif
+	mutex_unlock(&nf_conntrack_resize_mutex);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(nf_conntrack_hash_resize);
+
+#ifdef NF_CT_AUX_HASH
+/*
+ * nf_conntrack_aux_rehash()
+ *	Rekeys the single UDP and cone NAT hashes for a new NAT filtering
+ *	behavior.
+ */
+int nf_conntrack_aux_rehash(unsigned int nat_filtering_behavior)
+{
+	int ret;
+
+	mutex_lock(&nf_conntrack_resize_mutex);
+	ret = nf_conntrack_rehash(init_net.ct.htable_size,
+				  nat_filtering_behavior);
+	mutex_unlock(&nf_conntrack_resize_mutex);
+
+	return ret;
+}
+EXPORT_SYMBOL(nf_conntrack_aux_rehash);
+#endif
+
+/*
+ * nf_conntrack_resize_work_fn()
+ *	Grows the hash to keep chains short under load, and shrinks it back
+ *	towards the configured size when the load goes away.
+ */
+static void nf_conntrack_resize_work_fn(struct work_struct *work)
+{
+	unsigned int count, size, target;
+
+	mutex_lock(&nf_conntrack_resize_mutex);
+	if (!nf_conntrack_autoresize)
+		goto out;
+
+	count = atomic_read(&init_net.ct.count);
+	size = init_net.ct.htable_size;
+	if (count > size)
+		target = roundup_pow_of_two(2 * count);
+	else if (count < size / 8)
+		target = roundup_pow_of_two(2 * count + 1);
+	else
+		goto out;
+
+	if (nf_conntrack_max && target > nf_conntrack_max)
+		target = nf_conntrack_max;
+	if (target < nf_conntrack_hashsize_min)
+		target = nf_conntrack_hashsize_min;
+	if (target == size)
+		goto out;
+
+	if (nf_conntrack_rehash(target,
+#ifdef NF_CT_AUX_HASH
+				nf_ct_aux_behavior
+#else
+				0
+#endif
+				) == 0)
+		pr_debug("nf_conntrack: %u conntracks, hash resized %u -> %u\n",
+			 count, size, init_net.ct.htable_size);
+out:
+	mutex_unlock(&nf_conntrack_resize_mutex);
+}
+
+/*
+ * Expired conntracks are reaped by lookups that run into them, and by a
+ * GC walking a slice of the hash every GC_INTERVAL, so that the whole
+ * table is seen every GC_MAX_BUCKETS_DIV intervals.  A pass that finds
+ * mostly expired entries, or stops at GC_MAX_EVICTS, goes on at once.
+ */
+#define GC_INTERVAL		HZ
+#define GC_MAX_BUCKETS_DIV	16u
+#define GC_MAX_BUCKETS		8192u
+#define GC_MAX_EVICTS		256u
+
+static void nf_conntrack_gc_work_fn(struct work_struct *work)
+{
+	struct net *net = container_of(to_delayed_work(work), struct net,
+				       ct.gc_work);
+	unsigned int i, goal, buckets = 0, expired = 0, scanned = 0;
+	unsigned long next_run = GC_INTERVAL;
+
+	goal = min(net->ct.htable_size / GC_MAX_BUCKETS_DIV, GC_MAX_BUCKETS);
+	if (!goal)
+		goal = 1;
+	i = net->ct.gc_bucket;
+
+	do {
+		struct nf_conntrack_tuple_hash *h;
+		struct hlist_nulls_head *ct_hash;
+		struct hlist_nulls_node *n;
+		unsigned int hsize;
+		struct nf_conn *ct;
+
+		rcu_read_lock();
+		local_bh_disable();
+		nf_conntrack_get_ht(net, &ct_hash, &hsize);
+		if (++i >= hsize)
+			i = 0;
+
+		hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[i], hnnode) {
+			ct = nf_ct_tuplehash_to_ctrack(h);
+			scanned++;
+			if (nf_ct_is_expired(ct)) {
+				nf_ct_gc_expired(ct);
+				expired++;
+			}
+		}
+		local_bh_enable();
+		rcu_read_unlock();
+		cond_resched();
+	} while (++buckets < goal && expired < GC_MAX_EVICTS);
+
+	net->ct.gc_bucket = i;
+	if (expired == GC_MAX_EVICTS || (scanned && expired * 100 / scanned >= 90))
+		next_run = 0;
+	schedule_delayed_work(&net->ct.gc_work, next_run);
+}
+
+int nf_conntrack_set_hashsize(const char *val, struct kernel_param *kp)
+{
+	unsigned int hashsize;
+	int ret;
 
 	if (current->nsproxy->net_ns != &init_net)
 		return -EOPNOTSUPP;
@@ -2276,36 +3237,11 @@ int nf_conntrack_set_hashsize(const char *val, struct kernel_param *kp)
 	if (!hashsize)
 		return -EINVAL;
 
-	hash = nf_ct_alloc_hashtable(&hashsize, 1);
-	if (!hash)
-		return -ENOMEM;
-
-	/* Lookups in the old hash might happen in parallel, which means we
-	 * might get false negatives during connection lookup. New connections
-	 * created because of a false negative won't make it into the hash
-	 * though since that required taking the lock.
-	 */
-	spin_lock_bh(&nf_conntrack_lock);
-	for (i = 0; i < init_net.ct.htable_size; i++) {
-		while (!hlist_nulls_empty(&init_net.ct.hash[i])) {
-			h = hlist_nulls_entry(init_net.ct.hash[i].first,
-					struct nf_conntrack_tuple_hash, hnnode);
-			ct = nf_ct_tuplehash_to_ctrack(h);
-			hlist_nulls_del_rcu(&h->hnnode);
-			bucket = __hash_conntrack(&h->tuple, nf_ct_zone(ct),
-						  hashsize);
-			hlist_nulls_add_head_rcu(&h->hnnode, &hash[bucket]);
-		}
-	}
-	old_size = init_net.ct.htable_size;
-	old_hash = init_net.ct.hash;
-
-	init_net.ct.htable_size = nf_conntrack_htable_size = hashsize;
-	init_net.ct.hash = hash;
-	spin_unlock_bh(&nf_conntrack_lock);
-
-	nf_ct_free_hashtable(old_hash, old_size);
-	return 0;
+	/* The size asked for is also the floor of automatic resizing */
+	ret = nf_conntrack_hash_resize(hashsize);
+	if (ret == 0)
+		nf_conntrack_hashsize_min = init_net.ct.htable_size;
+	return ret;
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_set_hashsize);
 
@@ -2324,9 +3260,14 @@ EXPORT_SYMBOL_GPL(nf_ct_untracked_status_or);
 static int nf_conntrack_init_init_net(void)
 {
 	int max_factor = 8;
-	int ret, cpu;
-#if defined(CONFIG_NF_CONNTRACK_NAT_MANAGEMENT)
-	int i;
+	int ret, cpu, i;
+
+	for (i = 0; i < CONNTRACK_LOCKS; i++)
+		spin_lock_init(&nf_conntrack_locks[i]);
+#ifdef NF_CT_AUX_HASH
+	for (i = 0; i < CONNTRACK_LOCKS; i++)
+		spin_lock_init(&nf_conntrack_aux_locks[i]);
+	nf_ct_aux_behavior = sysctl_nat_filtering_behavior;
 #endif
 
 	/* Idea from tcp.c: use 1/16384 of memory.  On i386: 32MB
@@ -2390,6 +3331,10 @@ static int nf_conntrack_init_init_net(void)
 	if (ret < 0)
 		goto err_dscpremark_ext;
 
+	ret = nf_conntrack_layer7_ext_init();
+	if (ret < 0)
+		goto err_layer7_ext;
+
 	ret = nf_conntrack_proto_init();
 	if (ret < 0)
 		goto err_proto;
@@ -2411,6 +3356,7 @@ static int nf_conntrack_init_init_net(void)
 	}
 	/*  - and look it like as a confirmed connection */
 	nf_ct_untracked_status_or(IPS_CONFIRMED | IPS_UNTRACKED);
+	REGISTER_STOPWATCH(nf_conntrack_confirm);
 	return 0;
 
 #ifdef CONFIG_NF_CONNTRACK_ZONES
@@ -2420,6 +3366,8 @@ err_extend:
 err_helper:
 	nf_conntrack_proto_fini();
 err_proto:
+	nf_conntrack_layer7_ext_fini();
+err_layer7_ext:
 	nf_conntrack_dscpremark_ext_fini();
 err_dscpremark_ext:
 	nf_conntrack_vlantag_ext_fini();
@@ -2435,11 +3383,38 @@ err_vlantag_ext:
 
 static int nf_conntrack_init_net(struct net *net)
 {
-	int ret;
+	int ret, cpu, i;
+#ifdef NF_CT_AUX_HASH
+	unsigned int aux_size;
+#endif
 
 	atomic_set(&net->ct.count, 0);
-	INIT_HLIST_NULLS_HEAD(&net->ct.unconfirmed, UNCONFIRMED_NULLS_VAL);
-	INIT_HLIST_NULLS_HEAD(&net->ct.dying, DYING_NULLS_VAL);
+	seqcount_init(&net->ct.generation);
+
+	net->ct.pcpu_lists = alloc_percpu(struct ct_pcpu);
+	if (!net->ct.pcpu_lists) {
+		ret = -ENOMEM;
+		goto err_pcpu_lists;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct ct_pcpu *pcpu = per_cpu_ptr(net->ct.pcpu_lists, cpu);
+
+		spin_lock_init(&pcpu->lock);
+		INIT_HLIST_NULLS_HEAD(&pcpu->unconfirmed, UNCONFIRMED_NULLS_VAL);
+		INIT_HLIST_NULLS_HEAD(&pcpu->dying, DYING_NULLS_VAL);
+	}
+
+	for (i = 0; i < NF_CT_LRU_MAX; i++) {
+		struct nf_ct_lru *lru = &net->ct.lru[i];
+
+		spin_lock_init(&lru->lock);
+		INIT_LIST_HEAD(&lru->head);
+		atomic_set(&lru->count, 0);
+		atomic_set(&lru->evicted, 0);
+		atomic_set(&lru->refused, 0);
+	}
+
 	net->ct.stat = alloc_percpu(struct ip_conntrack_stat);
 	if (!net->ct.stat) {
 		ret = -ENOMEM;
@@ -2469,22 +3444,30 @@ static int nf_conntrack_init_net(struct net *net)
 		goto err_hash;
 	}
 
+	/* NAT only runs in init_net, so are the hashes keyed on NAT tuples */
+#ifdef NF_CT_AUX_HASH
+	aux_size = net->ct.htable_size;
+#endif
 #if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
 #if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
-	single_udp_ct_hash = nf_ct_alloc_hashtable(&net->ct.htable_size, 1);
-	if (!single_udp_ct_hash) {
-		ret = -ENOMEM;
-		printk(KERN_ERR "Unable to create single udp conntrack hash\n");
-		goto err_single_udp_hash;
+	if (net_eq(net, &init_net)) {
+		single_udp_ct_hash = nf_ct_alloc_hashtable(&aux_size, 1);
+		if (!single_udp_ct_hash) {
+			ret = -ENOMEM;
+			printk(KERN_ERR "Unable to create single udp conntrack hash\n");
+			goto err_single_udp_hash;
+		}
 	}
 #endif
 
 #if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
-	conenat_ct_hash = nf_ct_alloc_hashtable(&nf_conntrack_htable_size, 1);
-	if (!conenat_ct_hash) {
-		ret = -ENOMEM;
-		printk(KERN_ERR "Unable to create conenat conntrack hash\n");
-		goto err_conenat_hash;
+	if (net_eq(net, &init_net)) {
+		conenat_ct_hash = nf_ct_alloc_hashtable(&aux_size, 1);
+		if (!conenat_ct_hash) {
+			ret = -ENOMEM;
+			printk(KERN_ERR "Unable to create conenat conntrack hash\n");
+			goto err_conenat_hash;
+		}
 	}
 #endif
 #endif
@@ -2508,6 +3491,9 @@ static int nf_conntrack_init_net(struct net *net)
 #ifdef CONFIG_NF_CONNTRACK_CHAIN_EVENTS
 	ATOMIC_INIT_NOTIFIER_HEAD(&net->ct.nf_conntrack_chain);
 #endif
+	net->ct.gc_bucket = 0;
+	INIT_DELAYED_WORK(&net->ct.gc_work, nf_conntrack_gc_work_fn);
+	schedule_delayed_work(&net->ct.gc_work, GC_INTERVAL);
 	return 0;
 
 err_timeout:
@@ -2521,11 +3507,13 @@ err_acct:
 err_expect:
 #if defined(CONFIG_NF_NAT) || defined(CONFIG_NF_NAT_MODULE)
 #if defined(CONFIG_NF_NAT_CONENAT_FAST_SEARCH)
-	nf_ct_free_hashtable(conenat_ct_hash, net->ct.htable_size);
+	if (net_eq(net, &init_net))
+		nf_ct_free_hashtable(conenat_ct_hash, aux_size);
 err_conenat_hash:
 #endif
 #if defined(CONFIG_NF_NAT_SINGLE_UDP_CT_FOR_LAN_WAN_TUPLE)
-	nf_ct_free_hashtable(single_udp_ct_hash, net->ct.htable_size);
+	if (net_eq(net, &init_net))
+		nf_ct_free_hashtable(single_udp_ct_hash, aux_size);
 err_single_udp_hash:
 #endif
 #endif
@@ -2537,6 +3525,8 @@ err_cache:
 err_slabname:
 	free_percpu(net->ct.stat);
 err_stat:
+	free_percpu(net->ct.pcpu_lists);
+err_pcpu_lists:
 	return ret;
 }
 
@@ -2566,6 +3556,10 @@ int nf_conntrack_init(struct net *net)
 
 		/* Howto get NAT offsets */
 		RCU_INIT_POINTER(nf_ct_nat_offset, NULL);
+
+		/* Never shrink below the size set at boot */
+		nf_conntrack_hashsize_min = net->ct.htable_size;
+		nf_conntrack_autoresize = true;
 	}
 	return 0;
 
@@ -0,0 +1,71 @@
+/* layer7 classification state conntrack extension registration. */
+
+#include <linux/netfilter.h>
+#include <linux/kernel.h>
+#include <linux/rcupdate.h>
+#include <linux/export.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_extend.h>
+#include <net/netfilter/nf_conntrack_layer7.h>
+
+int nf_ct_layer7_enabled __read_mostly;
+EXPORT_SYMBOL_GPL(nf_ct_layer7_enabled);
+
+void (*nf_ct_layer7_destroy_hook)(struct nf_conn_layer7 *l7) __read_mostly;
+EXPORT_SYMBOL_GPL(nf_ct_layer7_destroy_hook);
+
+/*
+ * nf_ct_layer7_ext_destroy()
+ *	Lets xt_layer7 reclaim the data buffer of a dying conntrack.
+ */
+static void nf_ct_layer7_ext_destroy(struct nf_conn *ct)
+{
+	struct nf_conn_layer7 *l7 = nf_ct_layer7_find(ct);
+	void (*hook)(struct nf_conn_layer7 *l7);
+
+	if (!l7 || !l7->app_data)
+		return;
+
+	rcu_read_lock();
+	hook = rcu_dereference(nf_ct_layer7_destroy_hook);
+	if (hook)
+		hook(l7);
+	rcu_read_unlock();
+}
+
+/*
+ * layer7 conntrack extension type declaration.
+ */
+static struct nf_ct_ext_type layer7_extend __read_mostly = {
+	.len = sizeof(struct nf_conn_layer7),
+	.align = __alignof__(struct nf_conn_layer7),
+	.destroy = nf_ct_layer7_ext_destroy,
+	.id = NF_CT_EXT_LAYER7,
+};
+
+/*
+ * nf_conntrack_layer7_ext_init()
+ *	Initializes the layer7 conntrack extension.
+ */
+int nf_conntrack_layer7_ext_init(void)
+{
+	int ret;
+
+	ret = nf_ct_extend_register(&layer7_extend);
+	if (ret < 0) {
+		printk("nf_conntrack_layer7: Unable to register extension\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * nf_conntrack_layer7_ext_fini()
+ *	De-initializes the layer7 conntrack extension.
+ */
+void nf_conntrack_layer7_ext_fini(void)
+{
+	nf_ct_extend_unregister(&layer7_extend);
+}
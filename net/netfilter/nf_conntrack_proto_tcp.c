@@ -1127,9 +1127,9 @@ static int tcp_packet(struct nf_conn *ct,
 	    ((master = ct->master) != NULL) &&
 	    (master->status & IPS_ALG_REFRESH) &&
 	    (master->proto.tcp.state == TCP_CONNTRACK_ESTABLISHED) &&
-	    (del_timer(&master->timeout))) {
-		master->timeout.expires = jiffies + tcp_timeouts[TCP_CONNTRACK_ESTABLISHED];
-		add_timer(&master->timeout);
+	    !nf_ct_is_dying(master)) {
+		ACCESS_ONCE(master->timeout) = nfct_time_stamp +
+					       tcp_timeouts[TCP_CONNTRACK_ESTABLISHED];
 	}
 
 	return NF_ACCEPT;
@@ -30,6 +30,7 @@
 #include <net/netfilter/nf_conntrack_acct.h>
 #include <net/netfilter/nf_conntrack_zones.h>
 #include <net/netfilter/nf_conntrack_timestamp.h>
+#include <net/netfilter/nf_conntrack_layer7.h>
 #include <linux/rculist_nulls.h>
 
 MODULE_LICENSE("GPL");
@@ -46,20 +47,22 @@ EXPORT_SYMBOL_GPL(print_tuple);
 
 struct ct_iter_state {
 	struct seq_net_private p;
+	/* Table snapshot, taken again at each ct_seq_start() */
+	struct hlist_nulls_head *hash;
+	unsigned int htable_size;
 	unsigned int bucket;
 	u_int64_t time_now;
 };
 
 static struct hlist_nulls_node *ct_get_first(struct seq_file *seq)
 {
-	struct net *net = seq_file_net(seq);
 	struct ct_iter_state *st = seq->private;
 	struct hlist_nulls_node *n;
 
 	for (st->bucket = 0;
-	     st->bucket < net->ct.htable_size;
+	     st->bucket < st->htable_size;
 	     st->bucket++) {
-		n = rcu_dereference(hlist_nulls_first_rcu(&net->ct.hash[st->bucket]));
+		n = rcu_dereference(hlist_nulls_first_rcu(&st->hash[st->bucket]));
 		if (!is_a_nulls(n))
 			return n;
 	}
@@ -69,18 +72,17 @@ static struct hlist_nulls_node *ct_get_first(struct seq_file *seq)
 static struct hlist_nulls_node *ct_get_next(struct seq_file *seq,
 				      struct hlist_nulls_node *head)
 {
-	struct net *net = seq_file_net(seq);
 	struct ct_iter_state *st = seq->private;
 
 	head = rcu_dereference(hlist_nulls_next_rcu(head));
 	while (is_a_nulls(head)) {
 		if (likely(get_nulls_value(head) == st->bucket)) {
-			if (++st->bucket >= net->ct.htable_size)
+			if (++st->bucket >= st->htable_size)
 				return NULL;
 		}
 		head = rcu_dereference(
 				hlist_nulls_first_rcu(
-					&net->ct.hash[st->bucket]));
+					&st->hash[st->bucket]));
 	}
 	return head;
 }
@@ -102,6 +104,7 @@ static void *ct_seq_start(struct seq_file *seq, loff_t *pos)
 
 	st->time_now = ktime_to_ns(ktime_get_real());
 	rcu_read_lock();
+	nf_conntrack_get_ht(seq_file_net(seq), &st->hash, &st->htable_size);
 	return ct_get_idx(seq, *pos);
 }
 
@@ -168,6 +171,25 @@ ct_show_delta_time(struct seq_file *s, const struct nf_conn *ct)
 }
 #endif
 
+#ifdef CONFIG_NF_CONNTRACK_LAYER7_EXT
+static int ct_show_layer7(struct seq_file *s, const struct nf_conn *ct)
+{
+	struct nf_conn_layer7 *l7 = nf_ct_layer7_find(ct);
+
+	/* app_proto is set once and always NUL terminated */
+	if (l7 && l7->app_proto[0])
+		return seq_printf(s, "l7proto=%.*s ",
+				  NF_CT_LAYER7_PROTO_LEN, l7->app_proto);
+	return 0;
+}
+#else
+static inline int
+ct_show_layer7(struct seq_file *s, const struct nf_conn *ct)
+{
+	return 0;
+}
+#endif
+
 /* return 0 on success, 1 in case of error */
 static int ct_seq_show(struct seq_file *s, void *v)
 {
@@ -194,8 +216,7 @@ static int ct_seq_show(struct seq_file *s, void *v)
 	if (seq_printf(s, "%-8s %u %-8s %u %ld ",
 		       l3proto->name, nf_ct_l3num(ct),
 		       l4proto->name, nf_ct_protonum(ct),
-		       timer_pending(&ct->timeout)
-		       ? (long)(ct->timeout.expires - jiffies)/HZ : 0) != 0)
+		       nf_ct_expires(ct) / HZ) != 0)
 		goto release;
 
 	if (l4proto->print_conntrack && l4proto->print_conntrack(s, ct))
@@ -239,11 +260,8 @@ static int ct_seq_show(struct seq_file *s, void *v)
 	if (ct_show_delta_time(s, ct))
 		goto release;
 
-#if defined(CONFIG_NETFILTER_XT_MATCH_LAYER7) || defined(CONFIG_NETFILTER_XT_MATCH_LAYER7_MODULE)
-	if(ct->layer7.app_proto &&
-           seq_printf(s, "l7proto=%s ", ct->layer7.app_proto))
-		return -ENOSPC;
-#endif
+	if (ct_show_layer7(s, ct))
+		goto release;
 
 	if (seq_printf(s, (ct->status & IPS_NAT_MASK) ? "[NATed] " : "[Local] "))
 		goto release;
@@ -463,6 +481,47 @@ static const struct file_operations ct_cpu_seq_fops = {
 	.release = seq_release_net,
 };
 
+static const char *const ct_lru_class_names[NF_CT_LRU_MAX] = {
+	[NF_CT_LRU_OTHER]		= "other",
+	[NF_CT_LRU_NAT]			= "nat",
+	[NF_CT_LRU_LOCAL]		= "local",
+	[NF_CT_LRU_TCP_RESERVE]		= "tcp_reserve",
+	[NF_CT_LRU_ICMP_RESERVE]	= "icmp_reserve",
+};
+
+static int ct_class_seq_show(struct seq_file *seq, void *v)
+{
+	/* single_open_net() leaves the net itself in private */
+	struct net *net = (struct net *)seq->private;
+	const struct nf_ct_lru *lru;
+	int i;
+
+	seq_printf(seq, "class        count    quota    evicted  refused\n");
+	for (i = 0; i < NF_CT_LRU_MAX; i++) {
+		lru = &net->ct.lru[i];
+		seq_printf(seq, "%-12s %-8u %-8u %-8u %-8u\n",
+			   ct_lru_class_names[i],
+			   atomic_read(&lru->count),
+			   nf_ct_lru_quota(i),
+			   atomic_read(&lru->evicted),
+			   atomic_read(&lru->refused));
+	}
+	return 0;
+}
+
+static int ct_class_seq_open(struct inode *inode, struct file *file)
+{
+	return single_open_net(inode, file, ct_class_seq_show);
+}
+
+static const struct file_operations ct_class_seq_fops = {
+	.owner	 = THIS_MODULE,
+	.open	 = ct_class_seq_open,
+	.read	 = seq_read,
+	.llseek	 = seq_lseek,
+	.release = single_release_net,
+};
+
 static int nf_conntrack_standalone_init_proc(struct net *net)
 {
 	struct proc_dir_entry *pde;
@@ -476,12 +535,19 @@ static int nf_conntrack_standalone_init_proc(struct net *net)
 	if (!pde)
 		goto out_stat_nf_conntrack;
 
+	pde = proc_create("nf_conntrack_class", S_IRUGO, net->proc_net_stat,
+			  &ct_class_seq_fops);
+	if (!pde)
+		goto out_stat_nf_conntrack_class;
+
 	pde = proc_net_fops_create(net, "ip_conntrack_scan", 0440, &internet_file_ops);
 	if (!pde)
 		printk(KERN_WARNING "ip_conntrack: can't create ip_conntrack_scan.\n");
 
 	return 0;
 
+out_stat_nf_conntrack_class:
+	remove_proc_entry("nf_conntrack", net->proc_net_stat);
 out_stat_nf_conntrack:
 	proc_net_remove(net, "nf_conntrack");
 out_nf_conntrack:
@@ -490,6 +556,7 @@ out_nf_conntrack:
 
 static void nf_conntrack_standalone_fini_proc(struct net *net)
 {
+	remove_proc_entry("nf_conntrack_class", net->proc_net_stat);
 	remove_proc_entry("nf_conntrack", net->proc_net_stat);
 	proc_net_remove(net, "nf_conntrack");
 	proc_net_remove(net, "ip_conntrack_scan");
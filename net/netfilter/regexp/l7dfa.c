@@ -0,0 +1,688 @@
+/*
+ * Multi-pattern DFA compiler and scanner for l7-filter.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ * Compilation runs in process context only.  The patterns are parsed
+ * into one Thompson NFA whose match nodes carry the pattern id, the byte
+ * alphabet is reduced to the equivalence classes the character sets of
+ * the NFA can tell apart, and the DFA is built by subset construction.
+ * Every DFA state also contains the start of each pattern, which is what
+ * makes the search unanchored; '^' is only passable in the initial state.
+ */
+
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/sort.h>
+#include <linux/bitmap.h>
+
+#include "l7dfa.h"
+
+enum {
+	L7_NFA_CSET,		/* consume a byte in cset[c] */
+	L7_NFA_SPLIT,		/* epsilon to out and out1 */
+	L7_NFA_EPS,		/* epsilon to out */
+	L7_NFA_BOL,		/* epsilon to out at start of data only */
+	L7_NFA_EOL,		/* epsilon to out at end of data only */
+	L7_NFA_MATCH,		/* pattern c matched */
+};
+
+#define L7_NFA_MAX_DEPTH	64
+#define L7_DFA_HASH_SIZE	1024
+
+struct l7_nfa_node {
+	int type;
+	int c;
+	int out;
+	int out1;
+};
+
+struct l7_nfa {
+	struct l7_nfa_node *node;
+	unsigned int nnodes;
+	unsigned int maxnodes;
+	u32 (*cset)[8];
+	unsigned int ncsets;
+	unsigned int maxcsets;
+	const unsigned char *p;
+	int depth;
+	int err;
+};
+
+/* A partially built NFA: its entry node and the list of dangling exits,
+ * threaded through the unset out/out1 fields themselves. */
+struct l7_frag {
+	int start;
+	int out;
+};
+
+static int *l7_nfa_slot(struct l7_nfa *n, int l)
+{
+	return (l & 1) ? &n->node[l >> 1].out1 : &n->node[l >> 1].out;
+}
+
+static void l7_nfa_patch(struct l7_nfa *n, int l, int target)
+{
+	int next;
+
+	while (l != -1) {
+		next = *l7_nfa_slot(n, l);
+		*l7_nfa_slot(n, l) = target;
+		l = next;
+	}
+}
+
+static int l7_nfa_append(struct l7_nfa *n, int l1, int l2)
+{
+	int l = l1;
+
+	if (l1 == -1)
+		return l2;
+	while (*l7_nfa_slot(n, l) != -1)
+		l = *l7_nfa_slot(n, l);
+	*l7_nfa_slot(n, l) = l2;
+	return l1;
+}
+
+static int l7_nfa_node(struct l7_nfa *n, int type, int c, int out, int out1)
+{
+	struct l7_nfa_node *node;
+
+	if (n->nnodes >= n->maxnodes) {
+		n->err = -ENOSPC;
+		return 0;
+	}
+	node = &n->node[n->nnodes];
+	node->type = type;
+	node->c = c;
+	node->out = out;
+	node->out1 = out1;
+	return n->nnodes++;
+}
+
+static int l7_nfa_cset(struct l7_nfa *n)
+{
+	if (n->ncsets >= n->maxcsets) {
+		n->err = -ENOSPC;
+		return 0;
+	}
+	memset(n->cset[n->ncsets], 0, sizeof(n->cset[0]));
+	return n->ncsets++;
+}
+
+#define L7_CSET_SET(s, c)	((s)[(c) >> 5] |= 1U << ((c) & 31))
+#define L7_CSET_TEST(s, c)	((s)[(c) >> 5] & (1U << ((c) & 31)))
+
+/* A node consuming one byte of @cs, with a dangling exit */
+static struct l7_frag l7_nfa_consume(struct l7_nfa *n, int cs)
+{
+	struct l7_frag f;
+
+	f.start = l7_nfa_node(n, L7_NFA_CSET, cs, -1, -1);
+	f.out = f.start << 1;
+	return f;
+}
+
+static struct l7_frag l7_nfa_reg(struct l7_nfa *n);
+
+static struct l7_frag l7_nfa_class(struct l7_nfa *n)
+{
+	const unsigned char *p = n->p;
+	struct l7_frag f = { 0, -1 };
+	unsigned int c, end;
+	bool negate = false;
+	u32 *s;
+	int cs;
+
+	cs = l7_nfa_cset(n);
+	if (n->err)
+		return f;
+	s = n->cset[cs];
+
+	if (*p == '^') {
+		negate = true;
+		p++;
+	}
+	if (*p == ']' || *p == '-') {
+		L7_CSET_SET(s, *p);
+		p++;
+	}
+	while (*p != '\0' && *p != ']') {
+		if (*p == '-') {
+			p++;
+			if (*p == ']' || *p == '\0') {
+				L7_CSET_SET(s, '-');
+			} else {
+				c = p[-2] + 1;
+				end = *p;
+				if (c > end + 1) {
+					n->err = -EINVAL;
+					return f;
+				}
+				for (; c <= end; c++)
+					L7_CSET_SET(s, c);
+				p++;
+			}
+		} else {
+			L7_CSET_SET(s, *p);
+			p++;
+		}
+	}
+	if (*p != ']') {
+		n->err = -EINVAL;
+		return f;
+	}
+	n->p = p + 1;
+
+	if (negate) {
+		for (c = 0; c < 8; c++)
+			s[c] = ~s[c];
+	}
+	/* Like regexec(), never match the string terminator */
+	s[0] &= ~1U;
+
+	return l7_nfa_consume(n, cs);
+}
+
+static struct l7_frag l7_nfa_atom(struct l7_nfa *n)
+{
+	struct l7_frag f = { 0, -1 };
+	unsigned int c;
+	int cs;
+
+	switch (*n->p) {
+	case '^':
+		n->p++;
+		f.start = l7_nfa_node(n, L7_NFA_BOL, 0, -1, -1);
+		f.out = f.start << 1;
+		break;
+	case '$':
+		n->p++;
+		f.start = l7_nfa_node(n, L7_NFA_EOL, 0, -1, -1);
+		f.out = f.start << 1;
+		break;
+	case '.':
+		n->p++;
+		cs = l7_nfa_cset(n);
+		if (n->err)
+			break;
+		memset(n->cset[cs], 0xff, sizeof(n->cset[0]));
+		n->cset[cs][0] &= ~1U;
+		f = l7_nfa_consume(n, cs);
+		break;
+	case '[':
+		n->p++;
+		f = l7_nfa_class(n);
+		break;
+	case '(':
+		n->p++;
+		if (++n->depth > L7_NFA_MAX_DEPTH) {
+			n->err = -EINVAL;
+			break;
+		}
+		f = l7_nfa_reg(n);
+		n->depth--;
+		if (*n->p != ')')
+			n->err = -EINVAL;
+		else
+			n->p++;
+		break;
+	case '\0':
+	case '|':
+	case ')':
+	case '?':
+	case '+':
+	case '*':
+		n->err = -EINVAL;
+		break;
+	case '\\':
+		n->p++;
+		if (*n->p == '\0') {
+			n->err = -EINVAL;
+			break;
+		}
+		/* fall through */
+	default:
+		c = *n->p++;
+		cs = l7_nfa_cset(n);
+		if (n->err)
+			break;
+		L7_CSET_SET(n->cset[cs], c);
+		f = l7_nfa_consume(n, cs);
+		break;
+	}
+
+	return f;
+}
+
+static struct l7_frag l7_nfa_piece(struct l7_nfa *n)
+{
+	struct l7_frag f = l7_nfa_atom(n);
+	int s;
+
+	while (!n->err && (*n->p == '*' || *n->p == '+' || *n->p == '?')) {
+		s = l7_nfa_node(n, L7_NFA_SPLIT, 0, f.start, -1);
+		if (n->err)
+			break;
+
+		switch (*n->p++) {
+		case '*':
+			l7_nfa_patch(n, f.out, s);
+			f.start = s;
+			f.out = s << 1 | 1;
+			break;
+		case '+':
+			l7_nfa_patch(n, f.out, s);
+			f.out = s << 1 | 1;
+			break;
+		case '?':
+			f.start = s;
+			f.out = l7_nfa_append(n, f.out, s << 1 | 1);
+			break;
+		}
+	}
+
+	return f;
+}
+
+static struct l7_frag l7_nfa_branch(struct l7_nfa *n)
+{
+	struct l7_frag f, g;
+
+	if (*n->p == '\0' || *n->p == '|' || *n->p == ')') {
+		f.start = l7_nfa_node(n, L7_NFA_EPS, 0, -1, -1);
+		f.out = f.start << 1;
+		return f;
+	}
+
+	f = l7_nfa_piece(n);
+	while (!n->err && *n->p != '\0' && *n->p != '|' && *n->p != ')') {
+		g = l7_nfa_piece(n);
+		if (n->err)
+			break;
+		l7_nfa_patch(n, f.out, g.start);
+		f.out = g.out;
+	}
+
+	return f;
+}
+
+static struct l7_frag l7_nfa_reg(struct l7_nfa *n)
+{
+	struct l7_frag f, g;
+	int s;
+
+	f = l7_nfa_branch(n);
+	while (!n->err && *n->p == '|') {
+		n->p++;
+		g = l7_nfa_branch(n);
+		if (n->err)
+			break;
+		s = l7_nfa_node(n, L7_NFA_SPLIT, 0, f.start, g.start);
+		f.start = s;
+		f.out = l7_nfa_append(n, f.out, g.out);
+	}
+
+	return f;
+}
+
+/*
+ * Subset construction
+ */
+
+struct l7_dfa_builder {
+	struct l7_nfa nfa;
+	int *starts;
+	unsigned int nstarts;
+
+	unsigned int *mark;
+	unsigned int stamp;
+	int *stack;
+	int *input;
+	int *set;
+
+	/* DFA states: sorted NFA node sets in one arena */
+	struct {
+		u32 off;
+		u32 len;
+		int next;
+	} *st;
+	unsigned int nstates;
+	int hash[L7_DFA_HASH_SIZE];
+	int *arena;
+	unsigned int arena_len;
+	unsigned int arena_max;
+
+	u8 cls[256];
+	u8 rep[256];
+	unsigned int nclasses;
+	u16 *trans;
+};
+
+static int l7_int_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Epsilon closure of @in into b->set, keeping only the nodes that matter
+ * for the DFA (byte consumers, matches and end anchors), sorted.  @bol and
+ * @eol say whether the '^' and '$' anchors may be crossed. */
+static unsigned int l7_dfa_closure(struct l7_dfa_builder *b, const int *in,
+				   unsigned int nin, bool bol, bool eol)
+{
+	struct l7_nfa_node *node = b->nfa.node;
+	unsigned int sp = 0, nset = 0, i;
+	int x;
+
+	b->stamp++;
+	for (i = 0; i < nin; i++) {
+		if (b->mark[in[i]] != b->stamp) {
+			b->mark[in[i]] = b->stamp;
+			b->stack[sp++] = in[i];
+		}
+	}
+
+	while (sp) {
+		x = b->stack[--sp];
+		switch (node[x].type) {
+		case L7_NFA_EOL:
+			if (eol) {
+				x = node[x].out;
+				break;
+			}
+			/* fall through */
+		case L7_NFA_CSET:
+		case L7_NFA_MATCH:
+			b->set[nset++] = x;
+			continue;
+		case L7_NFA_BOL:
+			if (!bol)
+				continue;
+			/* fall through */
+		case L7_NFA_EPS:
+			x = node[x].out;
+			break;
+		case L7_NFA_SPLIT:
+			if (b->mark[node[x].out1] != b->stamp) {
+				b->mark[node[x].out1] = b->stamp;
+				b->stack[sp++] = node[x].out1;
+			}
+			x = node[x].out;
+			break;
+		}
+		if (b->mark[x] != b->stamp) {
+			b->mark[x] = b->stamp;
+			b->stack[sp++] = x;
+		}
+	}
+
+	sort(b->set, nset, sizeof(int), l7_int_cmp, NULL);
+	return nset;
+}
+
+/* Find or add the state for the node set in b->set */
+static int l7_dfa_state(struct l7_dfa_builder *b, unsigned int nset)
+{
+	u32 h = jhash2((u32 *)b->set, nset, nset) & (L7_DFA_HASH_SIZE - 1);
+	unsigned int i;
+	int *arena;
+
+	for (i = b->hash[h]; i != -1; i = b->st[i].next) {
+		if (b->st[i].len == nset &&
+		    !memcmp(b->arena + b->st[i].off, b->set, nset * sizeof(int)))
+			return i;
+	}
+
+	if (b->nstates >= L7_DFA_MAX_STATES)
+		return -E2BIG;
+
+	if (b->arena_len + nset > b->arena_max) {
+		unsigned int max = max(b->arena_max * 2, b->arena_len + nset);
+
+		arena = vmalloc(max * sizeof(int));
+		if (!arena)
+			return -ENOMEM;
+		memcpy(arena, b->arena, b->arena_len * sizeof(int));
+		vfree(b->arena);
+		b->arena = arena;
+		b->arena_max = max;
+	}
+
+	i = b->nstates++;
+	b->st[i].off = b->arena_len;
+	b->st[i].len = nset;
+	b->st[i].next = b->hash[h];
+	b->hash[h] = i;
+	memcpy(b->arena + b->arena_len, b->set, nset * sizeof(int));
+	b->arena_len += nset;
+
+	return i;
+}
+
+/* Split the byte alphabet into classes no character set distinguishes */
+static void l7_dfa_classes(struct l7_dfa_builder *b)
+{
+	u8 map[512];
+	unsigned int c, i, n;
+
+	memset(b->cls, 0, sizeof(b->cls));
+	b->nclasses = 1;
+
+	for (i = 0; i < b->nfa.ncsets; i++) {
+		memset(map, 0xff, sizeof(map));
+		n = 0;
+		for (c = 0; c < 256; c++) {
+			unsigned int key = b->cls[c] * 2 +
+					   !!L7_CSET_TEST(b->nfa.cset[i], c);
+
+			if (map[key] == 0xff)
+				map[key] = n++;
+			b->cls[c] = map[key];
+		}
+		b->nclasses = n;
+		if (n == 256)
+			break;
+	}
+
+	for (c = 256; c-- > 0; )
+		b->rep[b->cls[c]] = c;
+}
+
+static void l7_dfa_builder_free(struct l7_dfa_builder *b)
+{
+	vfree(b->nfa.node);
+	vfree(b->nfa.cset);
+	vfree(b->starts);
+	vfree(b->mark);
+	vfree(b->stack);
+	vfree(b->input);
+	vfree(b->set);
+	vfree(b->st);
+	vfree(b->arena);
+	vfree(b->trans);
+	kfree(b);
+}
+
+static void l7_dfa_free(struct l7_dfa *dfa)
+{
+	if (!dfa)
+		return;
+	vfree(dfa->trans);
+	vfree(dfa->flags);
+	vfree(dfa->accept);
+	vfree(dfa->eol_accept);
+	kfree(dfa);
+}
+
+/*
+ * l7_dfa_build - compile @npats patterns into one DFA
+ *
+ * Returns NULL if a pattern uses syntax we do not understand or the DFA
+ * would exceed L7_DFA_MAX_STATES; the caller then splits the set or
+ * leaves the pattern to regexec().
+ */
+static struct l7_dfa *l7_dfa_build(const struct l7_dfa_pattern *pats,
+				   unsigned int npats)
+{
+	struct l7_dfa_builder *b;
+	struct l7_dfa *dfa = NULL;
+	struct l7_nfa_node *node;
+	struct l7_frag f;
+	unsigned int total = 0, i, k, nset, nin;
+	int *set, s, x;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return NULL;
+
+	for (i = 0; i < npats; i++)
+		total += strlen(pats[i].regex);
+
+	b->nfa.maxnodes = 2 * total + 2 * npats + 1;
+	b->nfa.maxcsets = total + 1;
+	b->nfa.node = vmalloc(b->nfa.maxnodes * sizeof(*b->nfa.node));
+	b->nfa.cset = vmalloc(b->nfa.maxcsets * sizeof(*b->nfa.cset));
+	b->starts = vmalloc(npats * sizeof(int));
+	if (!b->nfa.node || !b->nfa.cset || !b->starts)
+		goto out;
+
+	for (i = 0; i < npats; i++) {
+		b->nfa.p = (const unsigned char *)pats[i].regex;
+		b->nfa.depth = 0;
+		f = l7_nfa_reg(&b->nfa);
+		if (!b->nfa.err && *b->nfa.p != '\0')
+			b->nfa.err = -EINVAL;	/* unmatched ')' */
+		if (b->nfa.err)
+			goto out;
+		x = l7_nfa_node(&b->nfa, L7_NFA_MATCH, pats[i].id, -1, -1);
+		if (b->nfa.err)
+			goto out;
+		l7_nfa_patch(&b->nfa, f.out, x);
+		b->starts[b->nstarts++] = f.start;
+	}
+
+	node = b->nfa.node;
+	b->mark = vzalloc(b->nfa.nnodes * sizeof(unsigned int));
+	b->stack = vmalloc(b->nfa.nnodes * sizeof(int));
+	b->input = vmalloc((b->nfa.nnodes + npats) * sizeof(int));
+	b->set = vmalloc(b->nfa.nnodes * sizeof(int));
+	b->st = vmalloc(L7_DFA_MAX_STATES * sizeof(*b->st));
+	b->arena_max = 4 * b->nfa.nnodes;
+	b->arena = vmalloc(b->arena_max * sizeof(int));
+	if (!b->mark || !b->stack || !b->input || !b->set || !b->st ||
+	    !b->arena)
+		goto out;
+	memset(b->hash, 0xff, sizeof(b->hash));
+
+	l7_dfa_classes(b);
+	b->trans = vmalloc(L7_DFA_MAX_STATES * b->nclasses * sizeof(u16));
+	if (!b->trans)
+		goto out;
+
+	/* State 0: the initial state, where '^' may be crossed */
+	nset = l7_dfa_closure(b, b->starts, b->nstarts, true, false);
+	if (l7_dfa_state(b, nset) < 0)
+		goto out;
+
+	for (i = 0; i < b->nstates; i++) {
+		for (k = 0; k < b->nclasses; k++) {
+			set = b->arena + b->st[i].off;
+			nin = 0;
+			for (x = 0; x < b->st[i].len; x++) {
+				struct l7_nfa_node *n = &node[set[x]];
+
+				if (n->type == L7_NFA_CSET &&
+				    L7_CSET_TEST(b->nfa.cset[n->c], b->rep[k]))
+					b->input[nin++] = n->out;
+			}
+			memcpy(b->input + nin, b->starts, b->nstarts * sizeof(int));
+			nin += b->nstarts;
+
+			nset = l7_dfa_closure(b, b->input, nin, false, false);
+			s = l7_dfa_state(b, nset);
+			if (s < 0)
+				goto out;
+			b->trans[i * b->nclasses + k] = s;
+		}
+	}
+
+	dfa = kzalloc(sizeof(*dfa), GFP_KERNEL);
+	if (!dfa)
+		goto out;
+	dfa->nstates = b->nstates;
+	dfa->nclasses = b->nclasses;
+	dfa->start = 0;
+	memcpy(dfa->cls, b->cls, sizeof(dfa->cls));
+	dfa->trans = vmalloc(b->nstates * b->nclasses * sizeof(u16));
+	dfa->flags = vzalloc(b->nstates);
+	dfa->accept = vzalloc(b->nstates * sizeof(*dfa->accept));
+	dfa->eol_accept = vzalloc(b->nstates * sizeof(*dfa->eol_accept));
+	if (!dfa->trans || !dfa->flags || !dfa->accept || !dfa->eol_accept) {
+		l7_dfa_free(dfa);
+		dfa = NULL;
+		goto out;
+	}
+	memcpy(dfa->trans, b->trans, b->nstates * b->nclasses * sizeof(u16));
+
+	for (i = 0; i < b->nstates; i++) {
+		set = b->arena + b->st[i].off;
+		nin = 0;
+		for (x = 0; x < b->st[i].len; x++) {
+			if (node[set[x]].type == L7_NFA_MATCH) {
+				__set_bit(node[set[x]].c, dfa->accept[i]);
+				dfa->flags[i] |= L7_DFA_ACCEPT;
+			} else if (node[set[x]].type == L7_NFA_EOL) {
+				b->input[nin++] = node[set[x]].out;
+			}
+		}
+		if (!nin)
+			continue;
+
+		/* What the '$' anchors of this state lead to if the data
+		 * ended here: cross them and look for matches. */
+		nset = l7_dfa_closure(b, b->input, nin, false, true);
+		for (x = 0; x < nset; x++) {
+			if (node[b->set[x]].type != L7_NFA_MATCH)
+				continue;
+			__set_bit(node[b->set[x]].c, dfa->eol_accept[i]);
+			dfa->flags[i] |= L7_DFA_EOL_ACCEPT;
+		}
+	}
+
+out:
+	l7_dfa_builder_free(b);
+	return dfa;
+}
+
+/*
+ * l7_dfa_scan - feed @len bytes of @data through @dfa
+ *
+ * Continues from *state and ORs the ids of every pattern seen matching
+ * into @matched.  The patterns that would match if the data ended after
+ * this chunk ('$' anchors) are ORed into @eol_matched.
+ */
+static void l7_dfa_scan(const struct l7_dfa *dfa, u16 *state,
+			const unsigned char *data, unsigned int len,
+			unsigned long *matched, unsigned long *eol_matched)
+{
+	const u16 *trans = dfa->trans;
+	const u8 *flags = dfa->flags;
+	unsigned int ncls = dfa->nclasses;
+	unsigned int s = *state;
+
+	while (len--) {
+		s = trans[s * ncls + dfa->cls[*data++]];
+		if (unlikely(flags[s] & L7_DFA_ACCEPT))
+			bitmap_or(matched, matched, dfa->accept[s],
+				  L7_MAX_PATTERNS);
+	}
+
+	if (flags[s] & L7_DFA_EOL_ACCEPT)
+		bitmap_or(eol_matched, eol_matched, dfa->eol_accept[s],
+			  L7_MAX_PATTERNS);
+	*state = s;
+}
@@ -0,0 +1,56 @@
+/*
+ * Multi-pattern DFA for l7-filter.
+ *
+ * All layer7 patterns currently in use are compiled together into a
+ * small number of DFAs (subset construction over one Thompson NFA per
+ * group), so that the application data of a connection is scanned once,
+ * byte by byte, whatever the number of rules.  Scanning is incremental:
+ * the DFA states are kept per connection and only newly appended data
+ * is fed through them.
+ *
+ * The accepted syntax is the one of the Spencer regexp code next to this
+ * file: literals, '.', [...] and [^...] with ranges, '\' escapes, '*',
+ * '+', '?', '|', '(...)', and the '^'/'$' anchors.
+ */
+
+#ifndef L7DFA_H
+#define L7DFA_H
+
+#include <net/netfilter/nf_conntrack_layer7.h>
+
+/* Pattern ids a DFA can report; patterns beyond use regexec() */
+#define L7_MAX_PATTERNS		NF_CT_LAYER7_MAX_PATTERNS
+#define L7_PATTERN_LONGS	BITS_TO_LONGS(L7_MAX_PATTERNS)
+
+/* Patterns are packed into DFAs of at most this many states; a pattern
+ * that does not fit in a DFA on its own is left to regexec(). */
+#define L7_DFA_MAX_STATES	1024
+#define L7_DFA_MAX_GROUPS	NF_CT_LAYER7_MAX_GROUPS
+
+#define L7_DFA_ACCEPT		0x01	/* some pattern matched here */
+#define L7_DFA_EOL_ACCEPT	0x02	/* ... or would, if data ended here */
+
+struct l7_dfa {
+	unsigned int nstates;
+	unsigned int nclasses;
+	u16 start;			/* state before the first byte */
+	u8 cls[256];			/* byte -> equivalence class */
+	u16 *trans;			/* [nstates][nclasses] */
+	u8 *flags;			/* [nstates] L7_DFA_* */
+	unsigned long (*accept)[L7_PATTERN_LONGS];
+	unsigned long (*eol_accept)[L7_PATTERN_LONGS];
+};
+
+struct l7_dfa_pattern {
+	const char *regex;
+	unsigned int id;
+};
+
+static struct l7_dfa *l7_dfa_build(const struct l7_dfa_pattern *pats,
+				   unsigned int npats);
+static void l7_dfa_free(struct l7_dfa *dfa);
+static void l7_dfa_scan(const struct l7_dfa *dfa, u16 *state,
+			const unsigned char *data, unsigned int len,
+			unsigned long *matched, unsigned long *eol_matched);
+
+#endif
@@ -17,6 +17,14 @@
 */
 
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/rculist.h>
+#include <linux/workqueue.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
 #include <linux/version.h>
 #include <net/ip.h>
 #include <net/tcp.h>
@@ -29,12 +37,14 @@
 #include <net/netfilter/nf_conntrack_extend.h>
 #include <net/netfilter/nf_conntrack_acct.h>
 #endif
+#include <net/netfilter/nf_conntrack_layer7.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_layer7.h>
 #include <linux/ctype.h>
 #include <linux/proc_fs.h>
 
 #include "regexp/regexp.c"
+#include "regexp/l7dfa.c"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Matthew Strait <quadong@users.sf.net>, Ethan Sommer <sommere@users.sf.net>");
@@ -55,13 +65,76 @@ MODULE_PARM_DESC(maxdatalen, "maximum bytes of data looked at by l7-filter");
 This can be modified through /proc/net/layer7_numpackets */
 static int num_packets = 10;
 
-static struct pattern_cache {
+/* Connections that can keep their data for patterns left to regexec().
+The buffers are allocated when the module loads. */
+static int databufs = 64;
+module_param(databufs, int, 0444);
+MODULE_PARM_DESC(databufs, "connections that can keep data for regexec() patterns");
+
+/* Every distinct regex used by a rule.  Patterns with an id are compiled
+together into the DFAs of l7_dfa_set; all of them keep their Spencer
+program so a rule still works while the DFAs are being rebuilt or when
+its pattern does not fit in one.  The table is walked under RCU and
+changed under l7_pattern_mutex, which also protects refcnt. */
+struct l7_pattern {
+	struct hlist_node hnode;
 	char * regex_string;
-	regexp * pattern;
-	struct pattern_cache * next;
-} * first_pattern_cache = NULL;
+	regexp * pattern;	/* NULL if it failed to compile */
+	int id;			/* bit in the DFA match maps, or -1 */
+	unsigned int refcnt;	/* rules using it */
+};
+
+#define L7_PATTERN_HASH_BITS	6
+
+static struct hlist_head l7_pattern_hash[1 << L7_PATTERN_HASH_BITS];
+static DEFINE_MUTEX(l7_pattern_mutex);
+static DECLARE_BITMAP(l7_pattern_ids, L7_MAX_PATTERNS);
+
+/* The compiled pattern set.  Each set has its own gen, so that the scan
+state of a connection can tell when it was made against another set. */
+struct l7_dfa_set {
+	unsigned int gen;
+	unsigned int ngroups;
+	bool need_data;		/* some pattern is left to regexec() */
+	struct l7_dfa * group[L7_DFA_MAX_GROUPS];
+	u8 group_of[L7_MAX_PATTERNS];
+	struct l7_pattern * pat[L7_MAX_PATTERNS];	/* NULL: not in a DFA */
+};
+
+static struct l7_dfa_set __rcu * l7_dfa_set;
+static unsigned int l7_dfa_set_gen;
+
+/* Rules usually come in batches (iptables-restore), so give the rebuild
+a moment to see all of them. */
+#define L7_REBUILD_DELAY	(HZ / 10)
+
+static void l7_rebuild(struct work_struct *work);
+static DECLARE_DELAYED_WORK(l7_rebuild_work, l7_rebuild);
+static int l7_patterns_dirty;	/* a pattern came or went */
 
-DEFINE_SPINLOCK(l7_lock);
+/* Rules are matched to their pattern through a small per-CPU cache keyed
+by the rule's matchinfo (each CPU has its own copy of the ruleset).  Any
+rule insertion or removal bumps l7_rules_gen, which invalidates it. */
+#define L7_RULE_CACHE_BITS	6
+
+struct l7_rule_cache {
+	const struct xt_layer7_info * info;
+	struct l7_pattern * pat;
+	unsigned int gen;
+};
+
+static DEFINE_PER_CPU(struct l7_rule_cache [1 << L7_RULE_CACHE_BITS],
+		      l7_rule_cache);
+static atomic_t l7_rules_gen = ATOMIC_INIT(0);
+
+/* maxdatalen bytes per CPU to clean up the data of the current packet */
+static DEFINE_PER_CPU(unsigned char *, l7_scratch);
+
+/* Pool of maxdatalen sized app_data buffers */
+static char * l7_bufs;
+static char ** l7_buf_free;
+static unsigned int l7_buf_nfree;
+static DEFINE_SPINLOCK(l7_buf_lock);
 
 static int total_acct_packets(struct nf_conn *ct)
 {
@@ -79,133 +152,347 @@ static int total_acct_packets(struct nf_conn *ct)
 #endif
 }
 
-#ifdef CONFIG_IP_NF_MATCH_LAYER7_DEBUG
-/* Converts an unfriendly string into a friendly one by
-replacing unprintables with periods and all whitespace with " ". */
-static char * friendly_print(unsigned char * s)
+/* Strip nulls and make everything lower case (our regex lib doesn't do
+case insensitivity) in up to @room bytes of @app_data, writing them
+NUL terminated to @target.  Return number of bytes written. */
+static int add_datastr(char *target, int room, char *app_data, int len)
 {
-	char * f = kmalloc(strlen(s) + 1, GFP_ATOMIC);
-	int i;
+	int length = 0, i;
 
-	if(!f) {
-		if (net_ratelimit())
-			printk(KERN_ERR "layer7: out of memory in "
-					"friendly_print, bailing.\n");
-		return NULL;
+ 	for(i = 0; i < room && i < len; i++) {
+		if(app_data[i] != '\0') {
+			/* the kernel version of tolower mungs 'upper ascii' */
+			target[length] =
+				isascii(app_data[i])? 
+					tolower(app_data[i]) : app_data[i];
+			length++;
+		}
 	}
+	target[length] = '\0';
 
-	for(i = 0; i < strlen(s); i++){
-		if(isprint(s[i]) && s[i] < 128)	f[i] = s[i];
-		else if(isspace(s[i]))		f[i] = ' ';
-		else 				f[i] = '.';
-	}
-	f[i] = '\0';
-	return f;
+	return length;
 }
 
-static char dec2hex(int i)
+static struct hlist_head * l7_pattern_bucket(const char * regex_string)
 {
-	switch (i) {
-		case 0 ... 9:
-			return (i + '0');
-			break;
-		case 10 ... 15:
-			return (i - 10 + 'a');
-			break;
-		default:
-			if (net_ratelimit())
-				printk("layer7: Problem in dec2hex\n");
-			return '\0';
+	u32 hash = jhash(regex_string, strlen(regex_string), 0);
+
+	return &l7_pattern_hash[hash & ((1 << L7_PATTERN_HASH_BITS) - 1)];
+}
+
+static struct l7_pattern * l7_pattern_find(const char * regex_string)
+{
+	struct l7_pattern * pat;
+	struct hlist_node * n;
+
+	hlist_for_each_entry_rcu(pat, n, l7_pattern_bucket(regex_string),
+				 hnode) {
+		if (!strcmp(pat->regex_string, regex_string))
+			return pat;
 	}
+	return NULL;
 }
 
-static char * hex_print(unsigned char * s)
+/* Take a reference on the pattern of a new rule, compiling it the first
+time it is seen.  Process context, under l7_pattern_mutex. */
+static struct l7_pattern * l7_pattern_get(const char * regex_string,
+                                          const char * protocol)
 {
-	char * g = kmalloc(strlen(s)*3 + 1, GFP_ATOMIC);
-	int i;
+	struct l7_pattern * pat;
+	int len;
 
-	if(!g) {
-	       if (net_ratelimit())
-			printk(KERN_ERR "layer7: out of memory in hex_print, "
-					"bailing.\n");
-	       return NULL;
+	pat = l7_pattern_find(regex_string);
+	if (pat) {
+		pat->refcnt++;
+		return pat;
+	}
+
+	pat = kzalloc(sizeof(*pat), GFP_KERNEL);
+	if (!pat)
+		return NULL;
+	pat->regex_string = kstrdup(regex_string, GFP_KERNEL);
+	if (!pat->regex_string) {
+		kfree(pat);
+		return NULL;
 	}
 
-	for(i = 0; i < strlen(s); i++) {
-		g[i*3    ] = dec2hex(s[i]/16);
-		g[i*3 + 1] = dec2hex(s[i]%16);
-		g[i*3 + 2] = ' ';
+	len = strlen(regex_string);
+	DPRINTK("About to compile this: \"%s\"\n", regex_string);
+	pat->pattern = regcomp(pat->regex_string, &len);
+	if (!pat->pattern) {
+		printk(KERN_ERR "layer7: Error compiling regexp "
+				"\"%s\" (%s)\n", regex_string, protocol);
+		/* the rule stays, but never matches */
+		pat->id = -1;
+	} else {
+		pat->id = find_first_zero_bit(l7_pattern_ids, L7_MAX_PATTERNS);
+		if (pat->id < L7_MAX_PATTERNS)
+			__set_bit(pat->id, l7_pattern_ids);
+		else
+			pat->id = -1;
 	}
-	g[i*3] = '\0';
 
-	return g;
+	pat->refcnt = 1;
+	hlist_add_head_rcu(&pat->hnode, l7_pattern_bucket(regex_string));
+	return pat;
+}
+
+static void l7_pattern_free(struct l7_pattern * pat)
+{
+	kfree(pat->pattern);
+	kfree(pat->regex_string);
+	kfree(pat);
+}
+
+/* Find the pattern of a rule from the packet path.  Under RCU. */
+static struct l7_pattern * l7_rule_pattern(const struct xt_layer7_info * info)
+{
+	struct l7_rule_cache * c;
+	unsigned int gen = atomic_read(&l7_rules_gen);
+
+	c = &__get_cpu_var(l7_rule_cache)[hash_ptr((void *)info,
+						   L7_RULE_CACHE_BITS)];
+	if (c->info != info || c->gen != gen) {
+		c->pat = l7_pattern_find(info->pattern);
+		c->info = info;
+		c->gen = gen;
+	}
+	return c->pat;
 }
-#endif // DEBUG
 
-/* Use instead of regcomp.  As we expect to be seeing the same regexps over and
-over again, it make sense to cache the results. */
-static regexp * compile_and_cache(const char * regex_string, 
-                                  const char * protocol)
+/* Greedily pack the patterns with an id into as few DFAs as possible.  A
+pattern that does not fit in a DFA on its own is left to regexec(). */
+static struct l7_dfa_set * l7_dfa_set_build(void)
 {
-	struct pattern_cache * node               = first_pattern_cache;
-	struct pattern_cache * last_pattern_cache = first_pattern_cache;
-	struct pattern_cache * tmp;
-	unsigned int len;
+	struct l7_dfa_pattern * pats;
+	struct l7_dfa_set * set;
+	struct l7_dfa * dfa, * cur = NULL;
+	struct l7_pattern * pat;
+	struct hlist_node * n;
+	unsigned int npats = 0, i;
+
+	set = kzalloc(sizeof(*set), GFP_KERNEL);
+	pats = kmalloc(L7_MAX_PATTERNS * sizeof(*pats), GFP_KERNEL);
+	if (!set || !pats) {
+		kfree(set);
+		kfree(pats);
+		return NULL;
+	}
+	set->gen = ++l7_dfa_set_gen;
+
+	/* pats[0..npats) are the patterns of the group being filled */
+	for (i = 0; i < ARRAY_SIZE(l7_pattern_hash); i++) {
+		hlist_for_each_entry(pat, n, &l7_pattern_hash[i], hnode) {
+			if (!pat->refcnt || !pat->pattern)
+				continue;
+			if (pat->id < 0 ||
+			    set->ngroups == L7_DFA_MAX_GROUPS) {
+				set->need_data = true;
+				continue;
+			}
 
-	while (node != NULL) {
-		if (!strcmp(node->regex_string, regex_string))
-		return node->pattern;
+			pats[npats].regex = pat->regex_string;
+			pats[npats].id = pat->id;
+			dfa = l7_dfa_build(pats, npats + 1);
+			if (!dfa && npats) {
+				/* full: close the group, start a new one */
+				set->group[set->ngroups++] = cur;
+				cur = NULL;
+				pats[0] = pats[npats];
+				npats = 0;
+				if (set->ngroups < L7_DFA_MAX_GROUPS)
+					dfa = l7_dfa_build(pats, 1);
+			}
+			if (!dfa) {
+				DPRINTK("layer7: \"%s\" is left to regexec\n",
+					pat->regex_string);
+				set->need_data = true;
+				continue;
+			}
 
-		last_pattern_cache = node;/* points at the last non-NULL node */
-		node = node->next;
+			l7_dfa_free(cur);
+			cur = dfa;
+			set->pat[pat->id] = pat;
+			set->group_of[pat->id] = set->ngroups;
+			npats++;
+		}
 	}
+	if (cur)
+		set->group[set->ngroups++] = cur;
 
-	/* If we reach the end of the list, then we have not yet cached
-	   the pattern for this regex. Let's do that now.
-	   Be paranoid about running out of memory to avoid list corruption. */
-	tmp = kmalloc(sizeof(struct pattern_cache), GFP_ATOMIC);
+	kfree(pats);
+	return set;
+}
 
-	if(!tmp) {
-		if (net_ratelimit())
-			printk(KERN_ERR "layer7: out of memory in "
-					"compile_and_cache, bailing.\n");
-		return NULL;
+static void l7_dfa_set_free(struct l7_dfa_set * set)
+{
+	unsigned int i;
+
+	if (!set)
+		return;
+	for (i = 0; i < set->ngroups; i++)
+		l7_dfa_free(set->group[i]);
+	kfree(set);
+}
+
+/* Recompile the pattern set after rules came or went, and forget the
+patterns no rule uses any more. */
+static void l7_rebuild(struct work_struct *work)
+{
+	struct l7_dfa_set * set, * old;
+	struct l7_pattern * pat;
+	struct hlist_node * n, * tmp;
+	HLIST_HEAD(dead);
+	bool empty = true;
+	unsigned int i;
+
+	mutex_lock(&l7_pattern_mutex);
+
+	if (!l7_patterns_dirty) {
+		mutex_unlock(&l7_pattern_mutex);
+		return;
+	}
+	l7_patterns_dirty = 0;
+
+	for (i = 0; i < ARRAY_SIZE(l7_pattern_hash); i++) {
+		hlist_for_each_entry_safe(pat, n, tmp, &l7_pattern_hash[i],
+					  hnode) {
+			if (pat->refcnt) {
+				empty = false;
+				continue;
+			}
+			hlist_del_rcu(&pat->hnode);
+			hlist_add_head(&pat->hnode, &dead);
+			/* readers of the old set compare pointers, not ids */
+			if (pat->id >= 0)
+				__clear_bit(pat->id, l7_pattern_ids);
+		}
 	}
+	/* stale rule cache entries may still point at the dead ones */
+	if (!hlist_empty(&dead))
+		atomic_inc(&l7_rules_gen);
 
-	tmp->regex_string  = kmalloc(strlen(regex_string) + 1, GFP_ATOMIC);
-	tmp->pattern = NULL;
-	tmp->next = NULL;
+	set = empty ? NULL : l7_dfa_set_build();
+	old = rcu_dereference_protected(l7_dfa_set,
+					lockdep_is_held(&l7_pattern_mutex));
+	rcu_assign_pointer(l7_dfa_set, set);
 
-	if(!tmp->regex_string) {
-		if (net_ratelimit())
-			printk(KERN_ERR "layer7: out of memory in "
-					"compile_and_cache, bailing.\n");
-		kfree(tmp);
-		return NULL;
+	mutex_unlock(&l7_pattern_mutex);
+
+	synchronize_rcu();
+
+	l7_dfa_set_free(old);
+	hlist_for_each_entry_safe(pat, n, tmp, &dead, hnode)
+		l7_pattern_free(pat);
+}
+
+static char * l7_buf_get(void)
+{
+	char * buf = NULL;
+
+	spin_lock_bh(&l7_buf_lock);
+	if (l7_buf_nfree)
+		buf = l7_buf_free[--l7_buf_nfree];
+	spin_unlock_bh(&l7_buf_lock);
+
+	return buf;
+}
+
+static void l7_buf_put(char * buf)
+{
+	spin_lock_bh(&l7_buf_lock);
+	l7_buf_free[l7_buf_nfree++] = buf;
+	spin_unlock_bh(&l7_buf_lock);
+}
+
+/* Extension destructor hook: the conntrack is going away */
+static void l7_ct_destroy(struct nf_conn_layer7 * l7)
+{
+	l7_buf_put(l7->app_data);
+	l7->app_data = NULL;
+}
+
+/* Feed new data of a connection through the DFAs of @set.  If the set
+changed since the last packet, start over from the data kept so far;
+without it, earlier packets are lost to the new set.  Under RCU and the
+lock of the master conntrack. */
+static void l7_ct_scan(struct nf_conn_layer7 * l7, struct l7_dfa_set * set,
+                       const unsigned char * data, unsigned int len)
+{
+	unsigned int i;
+
+	if (!set)
+		return;
+
+	if (l7->scan_gen != set->gen) {
+		bitmap_zero(l7->matched, L7_MAX_PATTERNS);
+		bitmap_zero(l7->eol_matched, L7_MAX_PATTERNS);
+		for (i = 0; i < set->ngroups; i++)
+			l7->state[i] = set->group[i]->start;
+		l7->scan_gen = set->gen;
+		if (l7->app_data && l7->app_data_len)
+			l7_ct_scan(l7, set, l7->app_data, l7->app_data_len);
 	}
 
-	/* Ok.  The new node is all ready now. */
-	node = tmp;
+	if (!len)
+		return;
 
-	if(first_pattern_cache == NULL) /* list is empty */
-		first_pattern_cache = node; /* make node the beginning */
-	else
-		last_pattern_cache->next = node; /* attach node to the end */
+	/* '$' only matches at the end of the data seen so far */
+	bitmap_zero(l7->eol_matched, L7_MAX_PATTERNS);
+	for (i = 0; i < set->ngroups; i++)
+		l7_dfa_scan(set->group[i], &l7->state[i], data, len,
+			    l7->matched, l7->eol_matched);
+}
 
-	/* copy the string and compile the regex */
-	len = strlen(regex_string);
-	DPRINTK("About to compile this: \"%s\"\n", regex_string);
-	node->pattern = regcomp((char *)regex_string, &len);
-	if ( !node->pattern ) {
-		if (net_ratelimit())
-			printk(KERN_ERR "layer7: Error compiling regexp "
-					"\"%s\" (%s)\n", 
-					regex_string, protocol);
-		/* pattern is now cached as NULL, so we won't try again. */
+/* Does the application data of a connection match @pat?  Its data is
+fed through the DFAs once per packet for all patterns, so this is a bit
+test unless the pattern is left to regexec(), which runs over the data
+kept for the connection or else over the current packet (@data). */
+static int l7_ct_match(struct nf_conn_layer7 * l7, struct l7_dfa_set * set,
+                       struct l7_pattern * pat,
+                       char * data, unsigned int len)
+{
+	unsigned char * scratch;
+
+	if (pat->id >= 0 && set && set->pat[pat->id] == pat) {
+		if (l7->scan_gen != set->gen)
+			l7_ct_scan(l7, set, NULL, 0);
+		return test_bit(pat->id, l7->matched) ||
+		       test_bit(pat->id, l7->eol_matched);
 	}
 
-	strcpy(node->regex_string, regex_string);
-	return node->pattern;
+	if (!pat->pattern)
+		return 0;
+
+	/* regexec() keeps its state on the stack; concurrent calls only
+	race on the submatch pointers in the program, which we never use */
+	if (l7->app_data)
+		return regexec(pat->pattern, l7->app_data);
+
+	scratch = __this_cpu_read(l7_scratch);
+	add_datastr(scratch, maxdatalen - 1, data, len);
+	return regexec(pat->pattern, scratch);
+}
+
+/* Same, for a single packet's data in info->pkt mode */
+static int l7_pkt_match(struct l7_dfa_set * set, struct l7_pattern * pat,
+                        unsigned char * data, unsigned int len)
+{
+	struct l7_dfa * dfa;
+	DECLARE_BITMAP(matched, L7_MAX_PATTERNS);
+	DECLARE_BITMAP(eol_matched, L7_MAX_PATTERNS);
+	u16 state;
+
+	if (pat->id < 0 || !set || set->pat[pat->id] != pat)
+		return pat->pattern && regexec(pat->pattern, data);
+
+	dfa = set->group[set->group_of[pat->id]];
+	bitmap_zero(matched, L7_MAX_PATTERNS);
+	bitmap_zero(eol_matched, L7_MAX_PATTERNS);
+	state = dfa->start;
+	l7_dfa_scan(dfa, &state, data, len, matched, eol_matched);
+
+	return test_bit(pat->id, matched) || test_bit(pat->id, eol_matched);
 }
 
 static int can_handle(const struct sk_buff *skb)
@@ -246,101 +533,64 @@ static int app_data_offset(const struct sk_buff *skb)
 	}
 }
 
+static int l7_proto_eq(const char * app_proto, const char * protocol)
+{
+	return !strncmp(app_proto, protocol, NF_CT_LAYER7_PROTO_LEN - 1);
+}
+
 /* handles whether there's a match when we aren't appending data anymore */
 static int match_no_append(struct nf_conn * conntrack, 
-                           struct nf_conn * master_conntrack, 
-                           enum ip_conntrack_info ctinfo,
-                           enum ip_conntrack_info master_ctinfo,
+                           struct nf_conn_layer7 * l7,
                            const struct xt_layer7_info * info)
 {
+	struct nf_conn_layer7 * child;
+
 	/* If we're in here, throw the app data away */
-	if(master_conntrack->layer7.app_data != NULL) {
-
-	#ifdef CONFIG_IP_NF_MATCH_LAYER7_DEBUG
-		if(!master_conntrack->layer7.app_proto) {
-			char * f = 
-			  friendly_print(master_conntrack->layer7.app_data);
-			char * g = 
-			  hex_print(master_conntrack->layer7.app_data);
-			DPRINTK("\nl7-filter gave up after %d bytes "
-				"(%d packets):\n%s\n",
-				strlen(f), total_acct_packets(master_conntrack), f);
-			kfree(f);
-			DPRINTK("In hex: %s\n", g);
-			kfree(g);
+	if(l7->app_data != NULL) {
+
+	#ifdef CONFIG_NETFILTER_XT_MATCH_LAYER7_DEBUG
+		if(!l7->app_proto[0]) {
+			DPRINTK("\nl7-filter gave up after %d bytes:\n",
+				l7->app_data_len);
+			print_hex_dump_bytes("layer7: ", DUMP_PREFIX_OFFSET,
+					     l7->app_data, l7->app_data_len);
 		}
 	#endif
 
-		kfree(master_conntrack->layer7.app_data);
-		master_conntrack->layer7.app_data = NULL; /* don't free again */
+		l7_buf_put(l7->app_data);
+		l7->app_data = NULL; /* don't free again */
 	}
 
-	if(master_conntrack->layer7.app_proto){
+	if(l7->app_proto[0]){
 		/* Here child connections set their .app_proto (for /proc) */
-		if(!conntrack->layer7.app_proto) {
-			conntrack->layer7.app_proto = 
-			  kmalloc(strlen(master_conntrack->layer7.app_proto)+1, 
-			    GFP_ATOMIC);
-			if(!conntrack->layer7.app_proto){
-				if (net_ratelimit())
-					printk(KERN_ERR "layer7: out of memory "
-							"in match_no_append, "
-							"bailing.\n");
-				return 1;
-			}
-			strcpy(conntrack->layer7.app_proto, 
-				master_conntrack->layer7.app_proto);
-		}
+		child = nf_ct_layer7_find(conntrack);
+		if(child && !child->app_proto[0])
+			memcpy(child->app_proto, l7->app_proto,
+			       NF_CT_LAYER7_PROTO_LEN);
 
-		return (!strcmp(master_conntrack->layer7.app_proto, 
-				info->protocol));
+		return l7_proto_eq(l7->app_proto, info->protocol);
 	}
 	else {
 		/* If not classified, set to "unknown" to distinguish from
 		connections that are still being tested. */
-		master_conntrack->layer7.app_proto = 
-			kmalloc(strlen("unknown")+1, GFP_ATOMIC);
-		if(!master_conntrack->layer7.app_proto){
-			if (net_ratelimit())
-				printk(KERN_ERR "layer7: out of memory in "
-						"match_no_append, bailing.\n");
-			return 1;
-		}
-		strcpy(master_conntrack->layer7.app_proto, "unknown");
+		strcpy(l7->app_proto, "unknown");
 		return 0;
 	}
 }
 
 /* add the new app data to the conntrack.  Return number of bytes added. */
-static int add_datastr(char *target, int offset, char *app_data, int len)
-{
-	int length = 0, i;
-	if (!target) return 0;
-
-	/* Strip nulls. Make everything lower case (our regex lib doesn't
-	do case insensitivity).  Add it to the end of the current data. */
- 	for(i = 0; i < maxdatalen-offset-1 && i < len; i++) {
-		if(app_data[i] != '\0') {
-			/* the kernel version of tolower mungs 'upper ascii' */
-			target[length+offset] =
-				isascii(app_data[i])? 
-					tolower(app_data[i]) : app_data[i];
-			length++;
-		}
-	}
-	target[length+offset] = '\0';
-
-	return length;
-}
-
-/* add the new app data to the conntrack.  Return number of bytes added. */
-static int add_data(struct nf_conn * master_conntrack,
+static int add_data(struct nf_conn_layer7 * l7, struct l7_dfa_set * set,
                     char * app_data, int appdatalen)
 {
+	unsigned char * scratch = __this_cpu_read(l7_scratch);
 	int length;
 
-	length = add_datastr(master_conntrack->layer7.app_data, master_conntrack->layer7.app_data_len, app_data, appdatalen);
-	master_conntrack->layer7.app_data_len += length;
+	length = add_datastr(scratch, maxdatalen - l7->app_data_len - 1,
+			     app_data, appdatalen);
+	if (l7->app_data)
+		memcpy(l7->app_data + l7->app_data_len, scratch, length + 1);
+	l7_ct_scan(l7, set, scratch, length);
+	l7->app_data_len += length;
 
 	return length;
 }
@@ -441,26 +691,23 @@ match(const struct sk_buff *skbin,
 
 	enum ip_conntrack_info master_ctinfo, ctinfo;
 	struct nf_conn *master_conntrack, *conntrack;
-	unsigned char *app_data, *tmp_data;
+	struct nf_conn_layer7 *l7;
+	unsigned char *app_data;
 	unsigned int pattern_result, appdatalen;
-	regexp * comppattern;
-
-	/* Be paranoid/incompetent - lock the entire match function. */
-	spin_lock_bh(&l7_lock);
+	struct l7_pattern * pat;
+	struct l7_dfa_set * set;
 
 	if(!can_handle(skb)){
 		DPRINTK("layer7: This is some protocol I can't handle.\n");
-		spin_unlock_bh(&l7_lock);
 		return info->invert;
 	}
 
 	/* Treat parent & all its children together as one connection, except
-	for the purpose of setting conntrack->layer7.app_proto in the actual
-	connection. This makes /proc/net/ip_conntrack more satisfying. */
+	for the purpose of setting app_proto in the actual connection. This
+	makes /proc/net/ip_conntrack more satisfying. */
 	if(!(conntrack = nf_ct_get(skb, &ctinfo)) ||
 	   !(master_conntrack=nf_ct_get(skb,&master_ctinfo))){
 		DPRINTK("layer7: couldn't get conntrack.\n");
-		spin_unlock_bh(&l7_lock);
 		return info->invert;
 	}
 
@@ -468,12 +715,22 @@ match(const struct sk_buff *skbin,
 	while (master_ct(master_conntrack) != NULL)
 		master_conntrack = master_ct(master_conntrack);
 
+	/* Connections that predate the module have no layer7 state */
+	if(!(l7 = nf_ct_layer7_find(master_conntrack))){
+		DPRINTK("layer7: no layer7 state in conntrack.\n");
+		return info->invert;
+	}
+
+	/* The layer7 state of a connection and of all its children is
+	protected by the lock of the master; connections are classified
+	in parallel. */
+	spin_lock_bh(&master_conntrack->lock);
+
 	/* if we've classified it or seen too many packets */
 	if(!info->pkt && (total_acct_packets(master_conntrack) > num_packets ||
-	   master_conntrack->layer7.app_proto)) {
+	   l7->app_proto[0])) {
 
-		pattern_result = match_no_append(conntrack, master_conntrack, 
-						 ctinfo, master_ctinfo, info);
+		pattern_result = match_no_append(conntrack, l7, info);
 
 		/* skb->cb[0] == seen. Don't do things twice if there are 
 		multiple l7 rules. I'm not sure that using cb for this purpose 
@@ -482,7 +739,7 @@ match(const struct sk_buff *skbin,
 		else in the skbs that make it here. */
 		skb->cb[0] = 1; /* marking it seen here's probably irrelevant */
 
-		spin_unlock_bh(&l7_lock);
+		spin_unlock_bh(&master_conntrack->lock);
 		return (pattern_result ^ info->invert);
 	}
 
@@ -491,7 +748,7 @@ match(const struct sk_buff *skbin,
 			if (net_ratelimit())
 				printk(KERN_ERR "layer7: failed to linearize "
 						"packet, bailing.\n");
-			spin_unlock_bh(&l7_lock);
+			spin_unlock_bh(&master_conntrack->lock);
 			return info->invert;
 		}
 	}
@@ -500,59 +757,40 @@ match(const struct sk_buff *skbin,
 	app_data = skb->data + app_data_offset(skb);
 	appdatalen = skb_tail_pointer(skb) - app_data;
 
-	/* the return value gets checked later, when we're ready to use it */
-	comppattern = compile_and_cache(info->pattern, info->protocol);
+	rcu_read_lock();
+
+	/* NULL only if checkentry ran out of memory */
+	pat = l7_rule_pattern(info);
+	set = rcu_dereference(l7_dfa_set);
 
 	if (info->pkt) {
-		tmp_data = kmalloc(maxdatalen, GFP_ATOMIC);
-		if(!tmp_data){
-			if (net_ratelimit())
-				printk(KERN_ERR "layer7: out of memory in match, bailing.\n");
-			return info->invert;
-		}
+		unsigned char *tmp_data = __this_cpu_read(l7_scratch);
 
-		tmp_data[0] = '\0';
-		add_datastr(tmp_data, 0, app_data, appdatalen);
-		pattern_result = ((comppattern && regexec(comppattern, tmp_data)) ? 1 : 0);
+		appdatalen = add_datastr(tmp_data, maxdatalen - 1, app_data,
+					 appdatalen);
+		pattern_result = (pat && l7_pkt_match(set, pat, tmp_data, appdatalen)) ? 1 : 0;
 
-		kfree(tmp_data);
-		tmp_data = NULL;
-		spin_unlock_bh(&l7_lock);
+		rcu_read_unlock();
+		spin_unlock_bh(&master_conntrack->lock);
 
 		return (pattern_result ^ info->invert);
 	}
 
-	/* On the first packet of a connection, allocate space for app data */
+	/* On the first packet of a connection, take a buffer to keep the
+	app data in if some pattern has to go through regexec() */
 	if(total_acct_packets(master_conntrack) == 1 && !skb->cb[0] && 
-	   !master_conntrack->layer7.app_data){
-		master_conntrack->layer7.app_data = 
-			kmalloc(maxdatalen, GFP_ATOMIC);
-		if(!master_conntrack->layer7.app_data){
-			if (net_ratelimit())
-				printk(KERN_ERR "layer7: out of memory in "
-						"match, bailing.\n");
-			spin_unlock_bh(&l7_lock);
-			return info->invert;
-		}
-
-		master_conntrack->layer7.app_data[0] = '\0';
-	}
-
-	/* Can be here, but unallocated, if numpackets is increased near
-	the beginning of a connection */
-	if(master_conntrack->layer7.app_data == NULL){
-		spin_unlock_bh(&l7_lock);
-		return info->invert; /* unmatched */
-	}
+	   !l7->app_data && (!set || set->need_data))
+		l7->app_data = l7_buf_get();
 
 	if(!skb->cb[0]){
 		int newbytes;
-		newbytes = add_data(master_conntrack, app_data, appdatalen);
+		newbytes = add_data(l7, set, app_data, appdatalen);
 
 		if(newbytes == 0) { /* didn't add any data */
 			skb->cb[0] = 1;
 			/* Didn't match before, not going to match now */
-			spin_unlock_bh(&l7_lock);
+			rcu_read_unlock();
+			spin_unlock_bh(&master_conntrack->lock);
 			return info->invert;
 		}
 	}
@@ -568,24 +806,15 @@ match(const struct sk_buff *skbin,
 		DPRINTK("layer7: matched unset: not yet classified "
 			"(%d/%d packets)\n",
                         total_acct_packets(master_conntrack), num_packets);
-	/* If the regexp failed to compile, don't bother running it */
-	} else if(comppattern && 
-		  regexec(comppattern, master_conntrack->layer7.app_data)){
+	} else if(pat && l7_ct_match(l7, set, pat, app_data, appdatalen)){
 		DPRINTK("layer7: matched %s\n", info->protocol);
 		pattern_result = 1;
 	} else pattern_result = 0;
 
+	rcu_read_unlock();
+
 	if(pattern_result == 1) {
-		master_conntrack->layer7.app_proto = 
-			kmalloc(strlen(info->protocol)+1, GFP_ATOMIC);
-		if(!master_conntrack->layer7.app_proto){
-			if (net_ratelimit())
-				printk(KERN_ERR "layer7: out of memory in "
-						"match, bailing.\n");
-			spin_unlock_bh(&l7_lock);
-			return (pattern_result ^ info->invert);
-		}
-		strcpy(master_conntrack->layer7.app_proto, info->protocol);
+		strlcpy(l7->app_proto, info->protocol, NF_CT_LAYER7_PROTO_LEN);
 	} else if(pattern_result > 1) { /* cleanup from "unset" */
 		pattern_result = 1;
 	}
@@ -593,10 +822,42 @@ match(const struct sk_buff *skbin,
 	/* mark the packet seen */
 	skb->cb[0] = 1;
 
-	spin_unlock_bh(&l7_lock);
+	spin_unlock_bh(&master_conntrack->lock);
 	return (pattern_result ^ info->invert);
 }
 
+/* Reference the pattern of a rule being added.  Process context. */
+static int l7_rule_add(const struct xt_layer7_info * info)
+{
+	struct l7_pattern * pat;
+
+	mutex_lock(&l7_pattern_mutex);
+	pat = l7_pattern_get(info->pattern, info->protocol);
+	if (pat && pat->refcnt == 1)
+		l7_patterns_dirty = 1;
+	/* the new rule may reuse the matchinfo address of an old one */
+	atomic_inc(&l7_rules_gen);
+	mutex_unlock(&l7_pattern_mutex);
+
+	if (!pat)
+		return -ENOMEM;
+	schedule_delayed_work(&l7_rebuild_work, L7_REBUILD_DELAY);
+	return 0;
+}
+
+static void l7_rule_del(const struct xt_layer7_info * info)
+{
+	struct l7_pattern * pat;
+
+	mutex_lock(&l7_pattern_mutex);
+	pat = l7_pattern_find(info->pattern);
+	if (pat && !--pat->refcnt)
+		l7_patterns_dirty = 1;
+	mutex_unlock(&l7_pattern_mutex);
+
+	schedule_delayed_work(&l7_rebuild_work, L7_REBUILD_DELAY);
+}
+
 // load nf_conntrack_ipv4
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
 static int
@@ -606,6 +867,8 @@ static bool
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 28)
 check(const struct xt_mtchk_param *par)
 {
+	const struct xt_layer7_info * info = par->matchinfo;
+
         if (nf_ct_l3proto_try_module_get(par->match->family) < 0) {
                 printk(KERN_WARNING "can't load conntrack support for "
                                     "proto=%d\n", par->match->family);
@@ -614,6 +877,8 @@ check(const char *tablename, const void *inf,
 		 const struct xt_match *match, void *matchinfo,
 		 unsigned int hook_mask)
 {
+	const struct xt_layer7_info * info = matchinfo;
+
         if (nf_ct_l3proto_try_module_get(match->family) < 0) {
                 printk(KERN_WARNING "can't load conntrack support for "
                                     "proto=%d\n", match->family);
@@ -621,11 +886,15 @@ check(const char *tablename, const void *inf,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
 		return -EINVAL;
 	}
+	if (l7_rule_add(info) < 0) {
+		nf_ct_l3proto_module_put(par->match->family);
+		return -ENOMEM;
+	}
 	return 0;
 #else
                 return 0;
         }
-	return 1;
+	return l7_rule_add(info) == 0;
 #endif
 }
 
@@ -633,11 +902,13 @@ check(const char *tablename, const void *inf,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 28)
 	static void destroy(const struct xt_mtdtor_param *par)
 	{
+		l7_rule_del(par->matchinfo);
 		nf_ct_l3proto_module_put(par->match->family);
 	}
 #else
 	static void destroy(const struct xt_match *match, void *matchinfo)
 	{
+		l7_rule_del(matchinfo);
 		nf_ct_l3proto_module_put(match->family);
 	}
 #endif
@@ -673,11 +944,58 @@ static void layer7_init_proc(void)
 	}
 }
 
+static void l7_free_buffers(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu(l7_scratch, cpu));
+	vfree(l7_bufs);
+	kfree(l7_buf_free);
+}
+
+static int l7_alloc_buffers(void)
+{
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(l7_scratch, cpu) = kmalloc(maxdatalen, GFP_KERNEL);
+		if (!per_cpu(l7_scratch, cpu))
+			return -ENOMEM;
+	}
+
+	if (!databufs)
+		return 0;
+	l7_bufs = vmalloc(databufs * maxdatalen);
+	l7_buf_free = kmalloc(databufs * sizeof(*l7_buf_free), GFP_KERNEL);
+	if (!l7_bufs || !l7_buf_free)
+		return -ENOMEM;
+	for (i = 0; i < databufs; i++)
+		l7_buf_free[i] = l7_bufs + i * maxdatalen;
+	l7_buf_nfree = databufs;
+
+	return 0;
+}
+
+/* Forget the app data of connections before the pool goes away */
+static int l7_ct_release(struct nf_conn *ct, void *data)
+{
+	struct nf_conn_layer7 * l7 = nf_ct_layer7_find(ct);
+
+	if (l7)
+		l7->app_data = NULL;
+	return 0;
+}
+
 static int __init xt_layer7_init(void)
 {
+	int ret;
+
 	need_conntrack();
 
-	layer7_init_proc();
+	/* conntracks may still carry scan state from a previous load */
+	l7_dfa_set_gen = get_random_int();
+
 	if(maxdatalen < 1) {
 		printk(KERN_WARNING "layer7: maxdatalen can't be < 1, "
 			"using 1\n");
@@ -690,14 +1008,47 @@ static int __init xt_layer7_init(void)
 			"using 65536\n");
 		maxdatalen = 65536;
 	}
-	return xt_register_matches(xt_layer7_match,
-				   ARRAY_SIZE(xt_layer7_match));
+	if(databufs < 0)
+		databufs = 0;
+
+	ret = l7_alloc_buffers();
+	if (ret < 0) {
+		printk(KERN_ERR "layer7: out of memory for data buffers\n");
+		l7_free_buffers();
+		return ret;
+	}
+
+	rcu_assign_pointer(nf_ct_layer7_destroy_hook, l7_ct_destroy);
+	nf_ct_layer7_enabled = 1;
+
+	layer7_init_proc();
+	ret = xt_register_matches(xt_layer7_match,
+				  ARRAY_SIZE(xt_layer7_match));
+	if (ret < 0) {
+		layer7_cleanup_proc();
+		nf_ct_layer7_enabled = 0;
+		RCU_INIT_POINTER(nf_ct_layer7_destroy_hook, NULL);
+		synchronize_rcu();
+		l7_free_buffers();
+	}
+	return ret;
 }
 
 static void __exit xt_layer7_fini(void)
 {
 	layer7_cleanup_proc();
 	xt_unregister_matches(xt_layer7_match, ARRAY_SIZE(xt_layer7_match));
+
+	/* no rules are left, so this frees every pattern */
+	cancel_delayed_work_sync(&l7_rebuild_work);
+	l7_patterns_dirty = 1;
+	l7_rebuild(NULL);
+
+	nf_ct_layer7_enabled = 0;
+	RCU_INIT_POINTER(nf_ct_layer7_destroy_hook, NULL);
+	synchronize_rcu();
+	nf_ct_iterate_cleanup(&init_net, l7_ct_release, NULL);
+	l7_free_buffers();
 }
 
 module_init(xt_layer7_init);
@@ -15,6 +15,7 @@
 #define DEBUG
 
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/module.h>
 #include <linux/netfilter/x_tables.h>
@@ -135,6 +136,13 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
  * Notice how sock_tag_list_lock is held sometimes when uid_tag_data_tree_lock
  * is acquired.
  *
+ * The packet path (qtaguid_mt() and below) takes none of them, other than
+ * tag_stat_list_lock the first time a tag shows up on an interface:
+ * iface_stat_list, sock_tag_hash, tag_counter_set_hash and each
+ * iface_stat->tag_stat_hash are walked under RCU, and the counters they
+ * lead to are per CPU. Writers keep the hashes in step with the matching
+ * rb-trees under the locks above and free entries after a grace period.
+ *
  * Call tree with all lock holders as of 2012-04-27:
  *
  * iface_stat_fmt_proc_read()
@@ -189,15 +197,8 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
  * qtaguid_mt()
  *   account_for_uid()
  *     if_tag_stat_update()
- *       get_sock_stat()
- *         sock_tag_list_lock
- *       struct iface_stat->tag_stat_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *       struct iface_stat->tag_stat_list_lock (new tags only)
+ *         (struct iface_stat->tag_stat_tree)
  *
  *
  * qtaguid_ctrl_parse()
@@ -227,9 +228,15 @@ static DEFINE_SPINLOCK(iface_stat_list_lock);
 
 static struct rb_root sock_tag_tree = RB_ROOT;
 static DEFINE_SPINLOCK(sock_tag_list_lock);
+/* Retagging updates sock_tag.tag in place, which isn't atomic. */
+static seqcount_t sock_tag_seq = SEQCNT_ZERO;
+#define SOCK_TAG_HASH_BITS 8
+static struct hlist_head sock_tag_hash[1 << SOCK_TAG_HASH_BITS];
 
 static struct rb_root tag_counter_set_tree = RB_ROOT;
 static DEFINE_SPINLOCK(tag_counter_set_list_lock);
+#define TAG_COUNTER_SET_HASH_BITS 6
+static struct hlist_head tag_counter_set_hash[1 << TAG_COUNTER_SET_HASH_BITS];
 
 static struct rb_root uid_tag_data_tree = RB_ROOT;
 static DEFINE_SPINLOCK(uid_tag_data_tree_lock);
@@ -419,6 +426,22 @@ static void sock_tag_tree_insert(struct sock_tag *data, struct rb_root *root)
 	rb_insert_color(&data->sock_node, root);
 }
 
+/* Caller must hold sock_tag_list_lock */
+static void sock_tag_link(struct sock_tag *st_entry)
+{
+	sock_tag_tree_insert(st_entry, &sock_tag_tree);
+	hlist_add_head_rcu(&st_entry->sock_hnode,
+			   &sock_tag_hash[hash_ptr(st_entry->sk,
+						   SOCK_TAG_HASH_BITS)]);
+}
+
+/* Caller must hold sock_tag_list_lock */
+static void sock_tag_unlink(struct sock_tag *st_entry)
+{
+	rb_erase(&st_entry->sock_node, &sock_tag_tree);
+	hlist_del_rcu(&st_entry->sock_hnode);
+}
+
 static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 {
 	struct rb_node *node;
@@ -435,7 +458,7 @@ static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 			 get_uid_from_tag(st_entry->tag));
 		rb_erase(&st_entry->sock_node, st_to_free_tree);
 		sockfd_put(st_entry->socket);
-		kfree(st_entry);
+		kfree_rcu(st_entry, rcu);
 	}
 }
 
@@ -750,23 +773,30 @@ static int get_active_counter_set(tag_t tag)
 {
 	int active_set = 0;
 	struct tag_counter_set *tcs;
+	struct hlist_node *node;
 
 	MT_DEBUG("qtaguid: get_active_counter_set(tag=0x%llx)"
 		 " (uid=%u)\n",
 		 tag, get_uid_from_tag(tag));
 	/* For now we only handle UID tags for active sets */
 	tag = get_utag_from_tag(tag);
-	spin_lock_bh(&tag_counter_set_list_lock);
-	tcs = tag_counter_set_tree_search(&tag_counter_set_tree, tag);
-	if (tcs)
-		active_set = tcs->active_set;
-	spin_unlock_bh(&tag_counter_set_list_lock);
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(tcs, node,
+		&tag_counter_set_hash[hash_64(tag, TAG_COUNTER_SET_HASH_BITS)],
+		hnode) {
+		if (tcs->tn.tag == tag) {
+			active_set = ACCESS_ONCE(tcs->active_set);
+			break;
+		}
+	}
+	rcu_read_unlock();
 	return active_set;
 }
 
 /*
  * Find the entry for tracking the specified interface.
- * Caller must hold iface_stat_list_lock
+ * Caller must hold iface_stat_list_lock or rcu_read_lock; entries are
+ * never removed from the list.
  */
 static struct iface_stat *get_iface_entry(const char *ifname)
 {
@@ -779,7 +809,7 @@ static struct iface_stat *get_iface_entry(const char *ifname)
 	}
 
 	/* Iterate over interfaces */
-	list_for_each_entry(iface_entry, &iface_stat_list, list) {
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
 		if (!strcmp(ifname, iface_entry->ifname))
 			goto done;
 	}
@@ -788,6 +818,32 @@ done:
 	return iface_entry;
 }
 
+/*
+ * Sum the per-CPU skb totals into entry->totals_via_skb.
+ * Caller must hold iface_stat_list_lock
+ */
+static void iface_stat_fold_skb_totals(struct iface_stat *entry)
+{
+	struct byte_packet_counters snap[IFS_MAX_DIRECTIONS];
+	unsigned int start;
+	int cpu, dir;
+
+	memset(entry->totals_via_skb, 0, sizeof(entry->totals_via_skb));
+	for_each_possible_cpu(cpu) {
+		const struct iface_stat_cpu *c = &entry->cpu_totals[cpu];
+
+		do {
+			start = u64_stats_fetch_begin_bh(&c->syncp);
+			memcpy(snap, c->totals_via_skb, sizeof(snap));
+		} while (u64_stats_fetch_retry_bh(&c->syncp, start));
+
+		for (dir = 0; dir < IFS_MAX_DIRECTIONS; dir++) {
+			entry->totals_via_skb[dir].bytes += snap[dir].bytes;
+			entry->totals_via_skb[dir].packets += snap[dir].packets;
+		}
+	}
+}
+
 static int iface_stat_fmt_proc_read(char *page, char **num_items_returned,
 				    off_t items_to_skip, int char_count,
 				    int *eof, void *data)
@@ -866,6 +922,7 @@ static int iface_stat_fmt_proc_read(char *page, char **num_items_returned,
 				stats->tx_bytes, stats->tx_packets
 				);
 		} else {
+			iface_stat_fold_skb_totals(iface_entry);
 			len = snprintf(
 				outp, char_count,
 				"%s "
@@ -974,6 +1031,16 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 		kfree(new_iface);
 		return NULL;
 	}
+	new_iface->cpu_totals = kcalloc(nr_cpu_ids,
+					sizeof(*new_iface->cpu_totals),
+					GFP_ATOMIC);
+	if (new_iface->cpu_totals == NULL) {
+		pr_err("qtaguid: iface_stat: create(%s): "
+		       "counters alloc failed\n", net_dev->name);
+		kfree(new_iface->ifname);
+		kfree(new_iface);
+		return NULL;
+	}
 	spin_lock_init(&new_iface->tag_stat_list_lock);
 	new_iface->tag_stat_tree = RB_ROOT;
 	_iface_stat_set_active(new_iface, net_dev, true);
@@ -987,6 +1054,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 		pr_err("qtaguid: iface_stat: create(%s): "
 		       "work alloc failed\n", new_iface->ifname);
 		_iface_stat_set_active(new_iface, net_dev, false);
+		kfree(new_iface->cpu_totals);
 		kfree(new_iface->ifname);
 		kfree(new_iface);
 		return NULL;
@@ -994,7 +1062,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	isw->iface_entry = new_iface;
 	INIT_WORK(&isw->iface_work, iface_create_proc_worker);
 	schedule_work(&isw->iface_work);
-	list_add(&new_iface->list, &iface_stat_list);
+	list_add_rcu(&new_iface->list, &iface_stat_list);
 	return new_iface;
 }
 
@@ -1186,16 +1254,36 @@ static struct sock_tag *get_sock_stat_nl(const struct sock *sk)
 	return sock_tag_tree_search(&sock_tag_tree, sk);
 }
 
-static struct sock_tag *get_sock_stat(const struct sock *sk)
+/*
+ * Look up the tag on a socket without sock_tag_list_lock.
+ * Caller must hold rcu_read_lock.
+ */
+static bool get_sock_tag(const struct sock *sk, tag_t *tag)
 {
 	struct sock_tag *sock_tag_entry;
-	MT_DEBUG("qtaguid: get_sock_stat(sk=%p)\n", sk);
+	struct hlist_node *node;
+	unsigned int seq;
+	bool found;
+
+	MT_DEBUG("qtaguid: get_sock_tag(sk=%p)\n", sk);
 	if (!sk)
-		return NULL;
-	spin_lock_bh(&sock_tag_list_lock);
-	sock_tag_entry = get_sock_stat_nl(sk);
-	spin_unlock_bh(&sock_tag_list_lock);
-	return sock_tag_entry;
+		return false;
+
+	do {
+		seq = read_seqcount_begin(&sock_tag_seq);
+		found = false;
+		hlist_for_each_entry_rcu(sock_tag_entry, node,
+			&sock_tag_hash[hash_ptr(sk, SOCK_TAG_HASH_BITS)],
+			sock_hnode) {
+			if (sock_tag_entry->sk == sk) {
+				*tag = sock_tag_entry->tag;
+				found = true;
+				break;
+			}
+		}
+	} while (read_seqcount_retry(&sock_tag_seq, seq));
+
+	return found;
 }
 
 static int ipx_proto(const struct sk_buff *skb,
@@ -1302,6 +1390,7 @@ static void iface_stat_update_from_skb(const struct sk_buff *skb,
 				       struct xt_action_param *par)
 {
 	struct iface_stat *entry;
+	struct iface_stat_cpu *c;
 	const struct net_device *el_dev;
 	enum ifs_tx_rx direction = par->in ? IFS_RX : IFS_TX;
 	int bytes = skb->len;
@@ -1336,60 +1425,145 @@ static void iface_stat_update_from_skb(const struct sk_buff *skb,
 			 par->family, proto);
 	}
 
-	spin_lock_bh(&iface_stat_list_lock);
+	rcu_read_lock();
 	entry = get_iface_entry(el_dev->name);
 	if (entry == NULL) {
 		IF_DEBUG("qtaguid: iface_stat: %s(%s): not tracked\n",
 			 __func__, el_dev->name);
-		spin_unlock_bh(&iface_stat_list_lock);
+		rcu_read_unlock();
 		return;
 	}
 
 	IF_DEBUG("qtaguid: %s(%s): entry=%p\n", __func__,
 		 el_dev->name, entry);
 
-	entry->totals_via_skb[direction].bytes += bytes;
-	entry->totals_via_skb[direction].packets++;
-	spin_unlock_bh(&iface_stat_list_lock);
+	local_bh_disable();
+	c = &entry->cpu_totals[smp_processor_id()];
+	u64_stats_update_begin(&c->syncp);
+	c->totals_via_skb[direction].bytes += bytes;
+	c->totals_via_skb[direction].packets++;
+	u64_stats_update_end(&c->syncp);
+	local_bh_enable();
+	rcu_read_unlock();
+}
+
+static void
+data_counters_cpu_update(struct data_counters_cpu *c, int set,
+			 enum ifs_tx_rx direction, int proto, int bytes)
+{
+	u64_stats_update_begin(&c->syncp);
+	data_counters_update(&c->dc, set, direction, proto, bytes);
+	u64_stats_update_end(&c->syncp);
 }
 
 static void tag_stat_update(struct tag_stat *tag_entry,
 			enum ifs_tx_rx direction, int proto, int bytes)
 {
 	int active_set;
+	int cpu;
+
 	active_set = get_active_counter_set(tag_entry->tn.tag);
 	MT_DEBUG("qtaguid: tag_stat_update(tag=0x%llx (uid=%u) set=%d "
 		 "dir=%d proto=%d bytes=%d)\n",
 		 tag_entry->tn.tag, get_uid_from_tag(tag_entry->tn.tag),
 		 active_set, direction, proto, bytes);
-	data_counters_update(&tag_entry->counters, active_set, direction,
-			     proto, bytes);
-	if (tag_entry->parent_counters)
-		data_counters_update(tag_entry->parent_counters, active_set,
-				     direction, proto, bytes);
+	local_bh_disable();
+	cpu = smp_processor_id();
+	data_counters_cpu_update(&tag_entry->cpu_counters[cpu], active_set,
+				 direction, proto, bytes);
+	if (tag_entry->parent)
+		data_counters_cpu_update(&tag_entry->parent->cpu_counters[cpu],
+					 active_set, direction, proto, bytes);
+	local_bh_enable();
+}
+
+/*
+ * Sum the per-CPU counters into tag_entry->counters.
+ * iface_entry->tag_stat_list_lock should be held.
+ */
+static void tag_stat_fold(struct tag_stat *tag_entry)
+{
+	const int n = sizeof(struct data_counters) /
+		      sizeof(struct byte_packet_counters);
+	struct byte_packet_counters *sum = &tag_entry->counters.bpc[0][0][0];
+	struct data_counters snap;
+	unsigned int start;
+	int cpu, i;
+
+	memset(&tag_entry->counters, 0, sizeof(tag_entry->counters));
+	for_each_possible_cpu(cpu) {
+		const struct data_counters_cpu *c =
+			&tag_entry->cpu_counters[cpu];
+
+		do {
+			start = u64_stats_fetch_begin_bh(&c->syncp);
+			snap = c->dc;
+		} while (u64_stats_fetch_retry_bh(&c->syncp, start));
+
+		for (i = 0; i < n; i++) {
+			sum[i].bytes += (&snap.bpc[0][0][0])[i].bytes;
+			sum[i].packets += (&snap.bpc[0][0][0])[i].packets;
+		}
+	}
+}
+
+static void tag_stat_free_rcu(struct rcu_head *head)
+{
+	struct tag_stat *tag_entry = container_of(head, struct tag_stat, rcu);
+
+	kfree(tag_entry->cpu_counters);
+	kfree(tag_entry);
+}
+
+/* Caller must hold rcu_read_lock or iface_entry->tag_stat_list_lock */
+static struct tag_stat *tag_stat_hash_search(struct iface_stat *iface_entry,
+					     tag_t tag)
+{
+	struct tag_stat *tag_entry;
+	struct hlist_node *node;
+
+	hlist_for_each_entry_rcu(tag_entry, node,
+		&iface_entry->tag_stat_hash[hash_64(tag, TAG_STAT_HASH_BITS)],
+		hnode) {
+		if (tag_entry->tn.tag == tag)
+			return tag_entry;
+	}
+	return NULL;
 }
 
 /*
  * Create a new entry for tracking the specified {acct_tag,uid_tag} within
- * the interface.
+ * the interface, charging @parent too if it is an acct_tag based one.
  * iface_entry->tag_stat_list_lock should be held.
  */
 static struct tag_stat *create_if_tag_stat(struct iface_stat *iface_entry,
-					   tag_t tag)
+					   tag_t tag, struct tag_stat *parent)
 {
 	struct tag_stat *new_tag_stat_entry = NULL;
 	IF_DEBUG("qtaguid: iface_stat: %s(): ife=%p tag=0x%llx"
 		 " (uid=%u)\n", __func__,
 		 iface_entry, tag, get_uid_from_tag(tag));
 	new_tag_stat_entry = kzalloc(sizeof(*new_tag_stat_entry), GFP_ATOMIC);
-	if (!new_tag_stat_entry) {
-		pr_err("qtaguid: iface_stat: tag stat alloc failed\n");
-		goto done;
+	if (!new_tag_stat_entry)
+		goto err;
+	new_tag_stat_entry->cpu_counters =
+		kcalloc(nr_cpu_ids, sizeof(*new_tag_stat_entry->cpu_counters),
+			GFP_ATOMIC);
+	if (!new_tag_stat_entry->cpu_counters) {
+		kfree(new_tag_stat_entry);
+		goto err;
 	}
 	new_tag_stat_entry->tn.tag = tag;
+	new_tag_stat_entry->parent = parent;
 	tag_stat_tree_insert(new_tag_stat_entry, &iface_entry->tag_stat_tree);
-done:
+	hlist_add_head_rcu(&new_tag_stat_entry->hnode,
+			   &iface_entry->tag_stat_hash[hash_64(tag,
+						TAG_STAT_HASH_BITS)]);
 	return new_tag_stat_entry;
+
+err:
+	pr_err("qtaguid: iface_stat: tag stat alloc failed\n");
+	return NULL;
 }
 
 static void if_tag_stat_update(const char *ifname, uid_t uid,
@@ -1397,22 +1571,20 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 			       int proto, int bytes)
 {
 	struct tag_stat *tag_stat_entry;
+	struct tag_stat *parent;
 	tag_t tag, acct_tag;
 	tag_t uid_tag;
-	struct data_counters *uid_tag_counters;
-	struct sock_tag *sock_tag_entry;
 	struct iface_stat *iface_entry;
-	struct tag_stat *new_tag_stat = NULL;
 	MT_DEBUG("qtaguid: if_tag_stat_update(ifname=%s "
 		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
 		 ifname, uid, sk, direction, proto, bytes);
 
-
+	rcu_read_lock();
 	iface_entry = get_iface_entry(ifname);
 	if (!iface_entry) {
 		pr_err("qtaguid: iface_stat: stat_update() %s not found\n",
 		       ifname);
-		return;
+		goto out;
 	}
 	/* It is ok to process data when an iface_entry is inactive */
 
@@ -1423,66 +1595,48 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	 * Look for a tagged sock.
 	 * It will have an acct_uid.
 	 */
-	sock_tag_entry = get_sock_stat(sk);
-	if (sock_tag_entry) {
-		tag = sock_tag_entry->tag;
-		acct_tag = get_atag_from_tag(tag);
-		uid_tag = get_utag_from_tag(tag);
-	} else {
-		acct_tag = make_atag_from_value(0);
-		tag = combine_atag_with_uid(acct_tag, uid);
-		uid_tag = make_tag_from_uid(uid);
-	}
+	if (!get_sock_tag(sk, &tag))
+		tag = combine_atag_with_uid(make_atag_from_value(0), uid);
+	acct_tag = get_atag_from_tag(tag);
+	uid_tag = get_utag_from_tag(tag);
 	MT_DEBUG("qtaguid: iface_stat: stat_update(): "
 		 " looking for tag=0x%llx (uid=%u) in ife=%p\n",
 		 tag, get_uid_from_tag(tag), iface_entry);
-	/* Loop over tag list under this interface for {acct_tag,uid_tag} */
-	spin_lock_bh(&iface_entry->tag_stat_list_lock);
 
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      tag);
-	if (tag_stat_entry) {
-		/*
-		 * Updating the {acct_tag, uid_tag} entry handles both stats:
-		 * {0, uid_tag} will also get updated.
-		 */
+	/*
+	 * Updating the {acct_tag, uid_tag} entry handles both stats:
+	 * {0, uid_tag} will also get updated.
+	 */
+	tag_stat_entry = tag_stat_hash_search(iface_entry, tag);
+	if (likely(tag_stat_entry)) {
 		tag_stat_update(tag_stat_entry, direction, proto, bytes);
-		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
-		return;
+		goto out;
 	}
 
-	/* Loop over tag list under this interface for {0,uid_tag} */
+	/* First time this tag is seen on the interface, create it */
+	spin_lock_bh(&iface_entry->tag_stat_list_lock);
 	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      uid_tag);
+					      tag);
 	if (!tag_stat_entry) {
-		/* Here: the base uid_tag did not exist */
-		/*
-		 * No parent counters. So
-		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
-		 */
-		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag);
-		uid_tag_counters = &new_tag_stat->counters;
-	} else {
-		uid_tag_counters = &tag_stat_entry->counters;
-	}
-
-	if (acct_tag) {
-		/* Create the child {acct_tag, uid_tag} and hook up parent. */
-		new_tag_stat = create_if_tag_stat(iface_entry, tag);
-		new_tag_stat->parent_counters = uid_tag_counters;
-	} else {
-		/*
-		 * For new_tag_stat to be still NULL here would require:
-		 *  {0, uid_tag} exists
-		 *  and {acct_tag, uid_tag} doesn't exist
-		 *  AND acct_tag == 0.
-		 * Impossible. This reassures us that new_tag_stat
-		 * below will always be assigned.
-		 */
-		BUG_ON(!new_tag_stat);
+		parent = NULL;
+		if (acct_tag) {
+			/* The child {acct_tag, uid_tag} needs its parent. */
+			parent = tag_stat_tree_search(
+				&iface_entry->tag_stat_tree, uid_tag);
+			if (!parent)
+				parent = create_if_tag_stat(iface_entry,
+							    uid_tag, NULL);
+		}
+		if (!acct_tag || parent)
+			tag_stat_entry = create_if_tag_stat(iface_entry, tag,
+							    parent);
 	}
-	tag_stat_update(new_tag_stat, direction, proto, bytes);
 	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+
+	if (tag_stat_entry)
+		tag_stat_update(tag_stat_entry, direction, proto, bytes);
+out:
+	rcu_read_unlock();
 }
 
 static int iface_netdev_event_handler(struct notifier_block *nb,
@@ -2094,7 +2248,7 @@ static int ctrl_cmd_delete(const char *input)
 			 input, st_entry->tag, entry_uid);
 
 		if (!acct_tag || st_entry->tag == tag) {
-			rb_erase(&st_entry->sock_node, &sock_tag_tree);
+			sock_tag_unlink(st_entry);
 			/* Can't sockfd_put() within spinlock, do it later. */
 			sock_tag_tree_insert(st_entry, &st_to_free_tree);
 			tr_entry = lookup_tag_ref(st_entry->tag, NULL);
@@ -2127,7 +2281,8 @@ static int ctrl_cmd_delete(const char *input)
 			 get_uid_from_tag(tcs_entry->tn.tag),
 			 tcs_entry->active_set);
 		rb_erase(&tcs_entry->tn.node, &tag_counter_set_tree);
-		kfree(tcs_entry);
+		hlist_del_rcu(&tcs_entry->hnode);
+		kfree_rcu(tcs_entry, rcu);
 	}
 	spin_unlock_bh(&tag_counter_set_list_lock);
 
@@ -2158,7 +2313,8 @@ static int ctrl_cmd_delete(const char *input)
 					 entry_uid);
 				rb_erase(&ts_entry->tn.node,
 					 &iface_entry->tag_stat_tree);
-				kfree(ts_entry);
+				hlist_del_rcu(&ts_entry->hnode);
+				call_rcu(&ts_entry->rcu, tag_stat_free_rcu);
 			}
 		}
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
@@ -2241,6 +2397,9 @@ static int ctrl_cmd_counter_set(const char *input)
 		}
 		tcs->tn.tag = tag;
 		tag_counter_set_tree_insert(tcs, &tag_counter_set_tree);
+		hlist_add_head_rcu(&tcs->hnode,
+				   &tag_counter_set_hash[hash_64(tag,
+						TAG_COUNTER_SET_HASH_BITS)]);
 		CT_DEBUG("qtaguid: ctrl_counterset(%s): added tcs tag=0x%llx "
 			 "(uid=%u) set=%d\n",
 			 input, tag, get_uid_from_tag(tag), counter_set);
@@ -2341,7 +2500,9 @@ static int ctrl_cmd_tag(const char *input)
 		BUG_ON(IS_ERR_OR_NULL(prev_tag_ref_entry));
 		BUG_ON(prev_tag_ref_entry->num_sock_tags <= 0);
 		prev_tag_ref_entry->num_sock_tags--;
+		write_seqcount_begin(&sock_tag_seq);
 		sock_tag_entry->tag = full_tag;
+		write_seqcount_end(&sock_tag_seq);
 	} else {
 		CT_DEBUG("qtaguid: ctrl_tag(%s): newtag for sk=%p\n",
 			 input, el_socket->sk);
@@ -2380,7 +2541,7 @@ static int ctrl_cmd_tag(const char *input)
 				 &pqd_entry->sock_tag_list);
 		spin_unlock_bh(&uid_tag_data_tree_lock);
 
-		sock_tag_tree_insert(sock_tag_entry, &sock_tag_tree);
+		sock_tag_link(sock_tag_entry);
 		atomic64_inc(&qtu_events.sockets_tagged);
 	}
 	spin_unlock_bh(&sock_tag_list_lock);
@@ -2446,7 +2607,7 @@ static int ctrl_cmd_untag(const char *input)
 	 * The socket already belongs to the current process
 	 * so it can do whatever it wants to it.
 	 */
-	rb_erase(&sock_tag_entry->sock_node, &sock_tag_tree);
+	sock_tag_unlink(sock_tag_entry);
 
 	tag_ref_entry = lookup_tag_ref(sock_tag_entry->tag, &utd_entry);
 	BUG_ON(!tag_ref_entry);
@@ -2483,7 +2644,7 @@ static int ctrl_cmd_untag(const char *input)
 		 atomic_long_read(&el_socket->file->f_count) - 1);
 	sockfd_put(el_socket);
 
-	kfree(sock_tag_entry);
+	kfree_rcu(sock_tag_entry, rcu);
 	atomic64_inc(&qtu_events.sockets_untagged);
 
 	return 0;
@@ -2715,6 +2876,7 @@ static int qtaguid_stats_proc_read(char *page, char **num_items_returned,
 		     node;
 		     node = rb_next(node)) {
 			ppi.ts_entry = rb_entry(node, struct tag_stat, tn.node);
+			tag_stat_fold(ppi.ts_entry);
 			if (!pp_sets(&ppi)) {
 				spin_unlock_bh(
 					&ppi.iface_entry->tag_stat_list_lock);
@@ -2847,7 +3009,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 		tr->num_sock_tags--;
 		free_tag_ref_from_utd_entry(tr, utd_entry);
 
-		rb_erase(&st_entry->sock_node, &sock_tag_tree);
+		sock_tag_unlink(st_entry);
 		list_del(&st_entry->list);
 		/* Can't sockfd_put() within spinlock, do it later. */
 		sock_tag_tree_insert(st_entry, &st_to_free_tree);
@@ -11,8 +11,11 @@
 #define __XT_QTAGUID_INTERNAL_H__
 
 #include <linux/types.h>
+#include <linux/cache.h>
 #include <linux/rbtree.h>
+#include <linux/rculist.h>
 #include <linux/spinlock_types.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/workqueue.h>
 
 /* Iface handling */
@@ -179,6 +182,24 @@ struct data_counters {
 	struct byte_packet_counters bpc[IFS_MAX_COUNTER_SETS][IFS_MAX_DIRECTIONS][IFS_MAX_PROTOS];
 };
 
+/*
+ * One CPU's share of a set of counters. The packet path only ever touches
+ * its own CPU's copy, with BHs disabled; readers fold all of them.
+ * These are allocated as nr_cpu_ids sized arrays rather than with
+ * alloc_percpu() because new tags show up in atomic context.
+ */
+struct data_counters_cpu {
+	struct data_counters dc;
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
+struct iface_stat_cpu {
+	struct byte_packet_counters totals_via_skb[IFS_MAX_DIRECTIONS];
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
+#define TAG_STAT_HASH_BITS 5
+
 /* Generic X based nodes used as a base for rb_tree ops */
 struct tag_node {
 	struct rb_node node;
@@ -187,12 +208,16 @@ struct tag_node {
 
 struct tag_stat {
 	struct tag_node tn;
+	struct hlist_node hnode;  /* in iface_stat.tag_stat_hash */
+	struct rcu_head rcu;
+	/* Sum of cpu_counters, only refreshed when the stats are read */
 	struct data_counters counters;
+	struct data_counters_cpu *cpu_counters;
 	/*
 	 * If this tag is acct_tag based, we need to count against the
 	 * matching parent uid_tag.
 	 */
-	struct data_counters *parent_counters;
+	struct tag_stat *parent;
 };
 
 struct iface_stat {
@@ -203,7 +228,9 @@ struct iface_stat {
 	struct net_device *net_dev;
 
 	struct byte_packet_counters totals_via_dev[IFS_MAX_DIRECTIONS];
+	/* Sum of cpu_totals, only refreshed when the stats are read */
 	struct byte_packet_counters totals_via_skb[IFS_MAX_DIRECTIONS];
+	struct iface_stat_cpu *cpu_totals;
 	/*
 	 * We keep the last_known, because some devices reset their counters
 	 * just before NETDEV_UP, while some will reset just before
@@ -219,6 +246,8 @@ struct iface_stat {
 	struct proc_dir_entry *proc_ptr;
 
 	struct rb_root tag_stat_tree;
+	/* Same entries as tag_stat_tree, for lockless lookups by tag */
+	struct hlist_head tag_stat_hash[1 << TAG_STAT_HASH_BITS];
 	spinlock_t tag_stat_list_lock;
 };
 
@@ -236,6 +265,8 @@ struct iface_stat_work {
  */
 struct sock_tag {
 	struct rb_node sock_node;
+	struct hlist_node sock_hnode;  /* in sock_tag_hash */
+	struct rcu_head rcu;
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;
@@ -281,6 +312,8 @@ struct qtaguid_event_counts {
 /* Track the set active_set for the given tag. */
 struct tag_counter_set {
 	struct tag_node tn;
+	struct hlist_node hnode;  /* in tag_counter_set_hash */
+	struct rcu_head rcu;
 	int active_set;
 };
 
@@ -23,6 +23,12 @@
 typedef bool (*offload_vlantag_get_target_info_t)(struct nf_conn *ct, u_int16_t *imask, u_int16_t *itag, u_int16_t *omask, u_int16_t *oval);
 typedef bool (*offload_dscpremark_get_target_info_t)(struct nf_conn *ct, u_int8_t *imask, u_int8_t *itag, u_int8_t *omask, u_int8_t *oval);
 
+/*
+ * Fast NAT receive hook in __netif_receive_skb(); returns non-zero if the
+ * packet was consumed.
+ */
+extern int (*athrs_fast_nat_recv)(struct sk_buff *skb) __rcu;
+
 #ifdef CONFIG_NET_OFFLOAD
 extern bool offload_vlantag_get_target_info(struct nf_conn *ct, u_int16_t *imask, u_int16_t *itag, u_int16_t *omask, u_int16_t *oval);
 extern bool offload_dscpremark_get_target_info(struct nf_conn *ct, u_int8_t *imask, u_int8_t *itag, u_int8_t *omask, u_int8_t *oval);
@@ -0,0 +1,821 @@
+/*
+ **************************************************************************
+ * Copyright (c) 2014, The Linux Foundation. All rights reserved.
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all copies.
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ **************************************************************************
+ */
+
+/*
+ * Conntrack based software flow offload.
+ *
+ * Forwarded IPv4 TCP/UDP packets of established, assured connections are
+ * learnt at the end of POST_ROUTING: the packet's ingress 5-tuple, the
+ * NAT translation conntrack applied to it, the route and the QoS remark
+ * results are cached in a per-flow entry.  Later packets of the flow are
+ * picked up in __netif_receive_skb() through the fast NAT receive hook,
+ * rewritten in place and handed to the neighbour output of the cached
+ * route, bypassing ip_rcv, the netfilter hooks and ip_forward.
+ *
+ * Anything unusual (IP options, fragments, TCP SYN/FIN/RST, packets that
+ * need fragmenting, connections with helpers) is left to the slow path,
+ * which keeps conntrack state authoritative.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/if_vlan.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/jhash.h>
+#include <linux/slab.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <net/ip.h>
+#include <net/route.h>
+#include <net/neighbour.h>
+#include <net/dsfield.h>
+#include <net/checksum.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_core.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+#include <net/netfilter/nf_conntrack_acct.h>
+#include <net/netfilter/nf_conntrack_l4proto.h>
+#include <net/netfilter/nf_conntrack_timeout.h>
+#include <linux/netfilter/xt_dscp.h>
+#include "offload.h"
+
+#define OFFLOAD_FLOW_HASH_BITS		10
+#define OFFLOAD_FLOW_HASH_SIZE		(1 << OFFLOAD_FLOW_HASH_BITS)
+#define OFFLOAD_FLOW_MAX		8192
+#define OFFLOAD_FLOW_IDLE_TIMEOUT	(30 * HZ)
+#define OFFLOAD_FLOW_GC_INTERVAL	HZ
+
+#define OFFLOAD_FLOW_FLAG_XLATE_SRC	0x01
+#define OFFLOAD_FLOW_FLAG_XLATE_DST	0x02
+#define OFFLOAD_FLOW_FLAG_DSCP_REMARK	0x04
+#define OFFLOAD_FLOW_FLAG_VLAN_REMARK	0x08
+
+/*
+ * struct offload_flow
+ *	One direction of an offloaded connection.
+ */
+struct offload_flow {
+	struct hlist_node hnode;
+	struct rcu_head rcu;
+
+	/*
+	 * Match: the packet as it arrives on the ingress interface.
+	 */
+	__be32 saddr;
+	__be32 daddr;
+	__be16 sport;
+	__be16 dport;
+	u8 protocol;
+	int iif;
+
+	/*
+	 * Action: the packet as it leaves after NAT.
+	 */
+	u32 flags;
+	__be32 xlate_saddr;
+	__be32 xlate_daddr;
+	__be16 xlate_sport;
+	__be16 xlate_dport;
+	u8 dscp_imask;
+	u8 dscp_itag;
+	u8 dscp_omask;
+	u8 dscp_oval;
+	u32 mark;
+	u32 priority;
+	unsigned int mtu;
+	struct dst_entry *dst;
+
+	struct nf_conn *ct;
+	enum ip_conntrack_info ctinfo;
+	unsigned long ct_timeout;
+
+	unsigned long last_used;
+	unsigned long packets;
+	unsigned long bytes;
+};
+
+struct offload_fastpath_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long creates;
+	unsigned long create_fails;
+	unsigned long evictions;
+};
+
+static struct hlist_head offload_flow_hash[OFFLOAD_FLOW_HASH_SIZE];
+static DEFINE_SPINLOCK(offload_flow_lock);
+static unsigned int offload_flow_count;
+static u32 offload_flow_hash_rnd __read_mostly;
+static struct kmem_cache *offload_flow_cache __read_mostly;
+static struct timer_list offload_flow_gc_timer;
+static DEFINE_PER_CPU(struct offload_fastpath_stats, offload_stats);
+
+static int offload_fastpath_max_flows __read_mostly = OFFLOAD_FLOW_MAX;
+module_param_named(max_flows, offload_fastpath_max_flows, int, 0644);
+MODULE_PARM_DESC(max_flows, "Maximum number of offloaded flows");
+
+/*
+ * offload_flow_hash_key()
+ *	Hash a 5-tuple into the flow table.
+ */
+static inline unsigned int offload_flow_hash_key(__be32 saddr, __be32 daddr,
+						 __be16 sport, __be16 dport,
+						 u8 protocol)
+{
+	return jhash_3words((__force u32)saddr, (__force u32)daddr,
+			    ((__force u32)sport << 16 | (__force u32)dport) ^ protocol,
+			    offload_flow_hash_rnd) & (OFFLOAD_FLOW_HASH_SIZE - 1);
+}
+
+/*
+ * offload_flow_find()
+ *	Find a flow by its ingress 5-tuple.  Called under RCU or the table lock.
+ */
+static struct offload_flow *offload_flow_find(__be32 saddr, __be32 daddr,
+					      __be16 sport, __be16 dport,
+					      u8 protocol, int iif)
+{
+	struct offload_flow *flow;
+	struct hlist_node *n;
+	unsigned int hash;
+
+	hash = offload_flow_hash_key(saddr, daddr, sport, dport, protocol);
+	hlist_for_each_entry_rcu(flow, n, &offload_flow_hash[hash], hnode) {
+		if (flow->saddr == saddr && flow->daddr == daddr &&
+		    flow->sport == sport && flow->dport == dport &&
+		    flow->protocol == protocol && flow->iif == iif)
+			return flow;
+	}
+
+	return NULL;
+}
+
+/*
+ * offload_flow_free_rcu()
+ *	Release the references held by a flow once no reader can see it.
+ */
+static void offload_flow_free_rcu(struct rcu_head *head)
+{
+	struct offload_flow *flow = container_of(head, struct offload_flow, rcu);
+
+	dst_release(flow->dst);
+	nf_ct_put(flow->ct);
+	kmem_cache_free(offload_flow_cache, flow);
+}
+
+/*
+ * offload_flow_remove()
+ *	Unlink a flow.  Called with offload_flow_lock held.
+ */
+static void offload_flow_remove(struct offload_flow *flow)
+{
+	hlist_del_rcu(&flow->hnode);
+	offload_flow_count--;
+	this_cpu_inc(offload_stats.evictions);
+	call_rcu(&flow->rcu, offload_flow_free_rcu);
+}
+
+/*
+ * offload_flow_stale()
+ *	Returns true if the connection or the route behind a flow went away.
+ */
+static inline bool offload_flow_stale(struct offload_flow *flow)
+{
+	struct nf_conn *ct = flow->ct;
+	struct dst_entry *dst = flow->dst;
+
+	if (unlikely(nf_ct_is_dying(ct)))
+		return true;
+
+	if (flow->protocol == IPPROTO_TCP &&
+	    unlikely(ct->proto.tcp.state != TCP_CONNTRACK_ESTABLISHED))
+		return true;
+
+	if (unlikely(dst->obsolete > 0))
+		return true;
+
+	if (dst->obsolete && !dst->ops->check(dst, 0))
+		return true;
+
+	return false;
+}
+
+/*
+ * offload_fastpath_recv()
+ *	Fast NAT receive hook, called from __netif_receive_skb().
+ *	Returns 1 if the packet was forwarded, 0 to continue with the slow path.
+ */
+static int offload_fastpath_recv(struct sk_buff *skb)
+{
+	struct offload_flow *flow;
+	struct iphdr *iph;
+	struct tcphdr *th = NULL;
+	struct udphdr *uh = NULL;
+	struct dst_entry *dst;
+	struct neighbour *neigh;
+	__sum16 *l4_check;
+	unsigned int tot_len;
+	unsigned int l4_len;
+	__be16 sport, dport;
+	u8 tos;
+
+	if (skb->protocol != htons(ETH_P_IP) || skb->pkt_type != PACKET_HOST)
+		return 0;
+
+	if (vlan_tx_tag_present(skb))
+		return 0;
+
+	if (unlikely(!pskb_may_pull(skb, sizeof(struct iphdr))))
+		return 0;
+
+	iph = (struct iphdr *)skb->data;
+	if (iph->version != 4 || iph->ihl != 5 || ip_is_fragment(iph) ||
+	    iph->ttl <= 1)
+		return 0;
+
+	tot_len = ntohs(iph->tot_len);
+	if (unlikely(tot_len < sizeof(struct iphdr) || skb->len < tot_len))
+		return 0;
+
+	switch (iph->protocol) {
+	case IPPROTO_TCP:
+		l4_len = sizeof(struct tcphdr);
+		break;
+	case IPPROTO_UDP:
+		l4_len = sizeof(struct udphdr);
+		break;
+	default:
+		return 0;
+	}
+
+	if (unlikely(!pskb_may_pull(skb, sizeof(struct iphdr) + l4_len)))
+		return 0;
+
+	iph = (struct iphdr *)skb->data;
+	if (unlikely(ip_fast_csum((u8 *)iph, iph->ihl)))
+		return 0;
+
+	if (iph->protocol == IPPROTO_TCP) {
+		th = (struct tcphdr *)(skb->data + sizeof(struct iphdr));
+
+		/*
+		 * Connection state changes must be seen by conntrack.
+		 */
+		if (tcp_flag_word(th) & (TCP_FLAG_SYN | TCP_FLAG_FIN | TCP_FLAG_RST))
+			return 0;
+
+		sport = th->source;
+		dport = th->dest;
+	} else {
+		uh = (struct udphdr *)(skb->data + sizeof(struct iphdr));
+		sport = uh->source;
+		dport = uh->dest;
+	}
+
+	flow = offload_flow_find(iph->saddr, iph->daddr, sport, dport,
+				 iph->protocol, skb->skb_iif);
+	if (!flow) {
+		this_cpu_inc(offload_stats.misses);
+		return 0;
+	}
+
+	if (unlikely(offload_flow_stale(flow) || tot_len > flow->mtu)) {
+		this_cpu_inc(offload_stats.misses);
+		return 0;
+	}
+
+	dst = flow->dst;
+	neigh = dst_get_neighbour_noref(dst);
+	if (unlikely(!neigh))
+		return 0;
+
+	/*
+	 * From here on the packet is ours; everything that can send it
+	 * back to the slow path has been checked above.
+	 */
+	if (unlikely(pskb_trim_rcsum(skb, tot_len)))
+		return 0;
+
+	if (unlikely(!skb_make_writable(skb, sizeof(struct iphdr) + l4_len)))
+		return 0;
+
+	if (unlikely(skb_cow_head(skb, LL_RESERVED_SPACE(dst->dev))))
+		return 0;
+
+	iph = (struct iphdr *)skb->data;
+	if (th) {
+		th = (struct tcphdr *)(skb->data + sizeof(struct iphdr));
+		l4_check = &th->check;
+	} else {
+		uh = (struct udphdr *)(skb->data + sizeof(struct iphdr));
+		l4_check = uh->check ? &uh->check : NULL;
+	}
+
+	if (flow->flags & OFFLOAD_FLOW_FLAG_XLATE_SRC) {
+		if (l4_check) {
+			inet_proto_csum_replace4(l4_check, skb, iph->saddr,
+						 flow->xlate_saddr, 1);
+			inet_proto_csum_replace2(l4_check, skb, sport,
+						 flow->xlate_sport, 0);
+		}
+		csum_replace4(&iph->check, iph->saddr, flow->xlate_saddr);
+		iph->saddr = flow->xlate_saddr;
+		if (th)
+			th->source = flow->xlate_sport;
+		else
+			uh->source = flow->xlate_sport;
+	}
+
+	if (flow->flags & OFFLOAD_FLOW_FLAG_XLATE_DST) {
+		if (l4_check) {
+			inet_proto_csum_replace4(l4_check, skb, iph->daddr,
+						 flow->xlate_daddr, 1);
+			inet_proto_csum_replace2(l4_check, skb, dport,
+						 flow->xlate_dport, 0);
+		}
+		csum_replace4(&iph->check, iph->daddr, flow->xlate_daddr);
+		iph->daddr = flow->xlate_daddr;
+		if (th)
+			th->dest = flow->xlate_dport;
+		else
+			uh->dest = flow->xlate_dport;
+	}
+
+	if (uh && l4_check && !*l4_check)
+		*l4_check = CSUM_MANGLED_0;
+
+	if (flow->flags & OFFLOAD_FLOW_FLAG_DSCP_REMARK) {
+		tos = ipv4_get_dsfield(iph);
+		if ((tos & flow->dscp_imask) == flow->dscp_itag)
+			ipv4_change_dsfield(iph, (__u8)(~XT_DSCP_MASK),
+					    (tos & flow->dscp_omask) | flow->dscp_oval);
+	}
+
+	ip_decrease_ttl(iph);
+
+	flow->last_used = jiffies;
+	flow->packets++;
+	flow->bytes += tot_len;
+	this_cpu_inc(offload_stats.hits);
+
+	/*
+	 * Keep conntrack alive and its counters right, and leave the
+	 * connection attached so that egress classifiers still see it.
+	 */
+	nf_ct_refresh_acct(flow->ct, flow->ctinfo, skb, flow->ct_timeout);
+	nf_conntrack_put(skb->nfct);
+	nf_conntrack_get(&flow->ct->ct_general);
+	skb->nfct = &flow->ct->ct_general;
+	skb->nfctinfo = flow->ctinfo;
+
+	skb->mark = flow->mark;
+	skb->priority = flow->priority;
+	skb->dev = dst->dev;
+	skb_dst_set_noref(skb, dst);
+	skb_reset_network_header(skb);
+
+	neigh_output(neigh, skb);
+	return 1;
+}
+
+/*
+ * offload_flow_ct_timeout()
+ *	Timeout conntrack itself gives a packet of this established
+ *	connection, honouring a timeout policy attached to it.
+ */
+static unsigned long offload_flow_ct_timeout(struct nf_conn *ct)
+{
+	struct nf_conntrack_l4proto *l4proto;
+	struct nf_conn_timeout *timeout_ext;
+	unsigned int *timeouts;
+
+	timeout_ext = nf_ct_timeout_find(ct);
+	if (timeout_ext) {
+		timeouts = NF_CT_TIMEOUT_EXT_DATA(timeout_ext);
+	} else {
+		l4proto = __nf_ct_l4proto_find(nf_ct_l3num(ct),
+					       nf_ct_protonum(ct));
+		timeouts = l4proto->get_timeouts(nf_ct_net(ct));
+	}
+
+	if (nf_ct_protonum(ct) == IPPROTO_TCP)
+		return timeouts[TCP_CONNTRACK_ESTABLISHED];
+
+	if (test_bit(IPS_SEEN_REPLY_BIT, &ct->status))
+		return timeouts[UDP_CT_REPLIED];
+	return timeouts[UDP_CT_UNREPLIED];
+}
+
+/*
+ * offload_flow_learn()
+ *	POST_ROUTING hook: offload the connection of a forwarded packet
+ *	once conntrack considers it established.
+ */
+static unsigned int offload_flow_learn(unsigned int hooknum,
+				       struct sk_buff *skb,
+				       const struct net_device *in,
+				       const struct net_device *out,
+				       int (*okfn)(struct sk_buff *))
+{
+	struct nf_conntrack_tuple *orig, *reply;
+	struct offload_flow *flow;
+	struct nf_conn_help *help;
+	enum ip_conntrack_info ctinfo;
+	enum ip_conntrack_dir dir;
+	struct dst_entry *dst = skb_dst(skb);
+	struct rtable *rt = (struct rtable *)dst;
+	struct nf_conn *ct;
+	struct iphdr *iph = ip_hdr(skb);
+	u16 vimask, vitag, vomask, voval;
+	unsigned int hash;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (!ct || nf_ct_is_untracked(ct))
+		return NF_ACCEPT;
+
+	if (ctinfo != IP_CT_ESTABLISHED && ctinfo != IP_CT_ESTABLISHED_REPLY)
+		return NF_ACCEPT;
+
+	if (!test_bit(IPS_ASSURED_BIT, &ct->status) ||
+	    test_bit(IPS_SEQ_ADJUST_BIT, &ct->status) || nf_ct_is_dying(ct))
+		return NF_ACCEPT;
+
+	help = nfct_help(ct);
+	if (help && rcu_access_pointer(help->helper))
+		return NF_ACCEPT;
+
+	if (!skb->skb_iif || !dst || dst->xfrm || iph->ihl != 5)
+		return NF_ACCEPT;
+
+	if (rt->rt_flags & (RTCF_LOCAL | RTCF_BROADCAST | RTCF_MULTICAST))
+		return NF_ACCEPT;
+
+#ifdef CONFIG_BRIDGE_NETFILTER
+	if (skb->nf_bridge)
+		return NF_ACCEPT;
+#endif
+
+	switch (nf_ct_protonum(ct)) {
+	case IPPROTO_TCP:
+		if (ct->proto.tcp.state != TCP_CONNTRACK_ESTABLISHED)
+			return NF_ACCEPT;
+		break;
+	case IPPROTO_UDP:
+		break;
+	default:
+		return NF_ACCEPT;
+	}
+
+	if (nf_ct_expires(ct) <= 0)
+		return NF_ACCEPT;
+
+	dir = CTINFO2DIR(ctinfo);
+	orig = &ct->tuplehash[dir].tuple;
+	reply = &ct->tuplehash[!dir].tuple;
+
+	/*
+	 * Sanity check: NAT must have produced exactly the inverse of the
+	 * reply tuple, otherwise we do not understand this packet.
+	 */
+	if (iph->saddr != reply->dst.u3.ip || iph->daddr != reply->src.u3.ip)
+		return NF_ACCEPT;
+
+	rcu_read_lock_bh();
+	flow = offload_flow_find(orig->src.u3.ip, orig->dst.u3.ip,
+				 orig->src.u.all, orig->dst.u.all,
+				 orig->dst.protonum, skb->skb_iif);
+	rcu_read_unlock_bh();
+	if (flow)
+		return NF_ACCEPT;
+
+	flow = kmem_cache_zalloc(offload_flow_cache, GFP_ATOMIC);
+	if (!flow) {
+		this_cpu_inc(offload_stats.create_fails);
+		return NF_ACCEPT;
+	}
+
+	flow->saddr = orig->src.u3.ip;
+	flow->daddr = orig->dst.u3.ip;
+	flow->sport = orig->src.u.all;
+	flow->dport = orig->dst.u.all;
+	flow->protocol = orig->dst.protonum;
+	flow->iif = skb->skb_iif;
+
+	flow->xlate_saddr = reply->dst.u3.ip;
+	flow->xlate_sport = reply->dst.u.all;
+	flow->xlate_daddr = reply->src.u3.ip;
+	flow->xlate_dport = reply->src.u.all;
+	if (flow->xlate_saddr != flow->saddr || flow->xlate_sport != flow->sport)
+		flow->flags |= OFFLOAD_FLOW_FLAG_XLATE_SRC;
+	if (flow->xlate_daddr != flow->daddr || flow->xlate_dport != flow->dport)
+		flow->flags |= OFFLOAD_FLOW_FLAG_XLATE_DST;
+
+	if (offload_dscpremark_get_target_info(ct, &flow->dscp_imask,
+					       &flow->dscp_itag,
+					       &flow->dscp_omask,
+					       &flow->dscp_oval))
+		flow->flags |= OFFLOAD_FLOW_FLAG_DSCP_REMARK;
+
+	/*
+	 * The VLAN remark result is the priority the VLANTAG target left in
+	 * skb->priority, which is cached below along with the mark.
+	 */
+	if (offload_vlantag_get_target_info(ct, &vimask, &vitag, &vomask, &voval))
+		flow->flags |= OFFLOAD_FLOW_FLAG_VLAN_REMARK;
+
+	flow->mark = skb->mark;
+	flow->priority = skb->priority;
+	flow->mtu = dst_mtu(dst);
+	flow->dst = dst_clone(dst);
+	flow->ct = ct;
+	nf_conntrack_get(&ct->ct_general);
+	flow->ctinfo = ctinfo;
+	flow->ct_timeout = offload_flow_ct_timeout(ct);
+	flow->last_used = jiffies;
+
+	/*
+	 * Conntrack no longer sees every segment of this connection, so
+	 * its window tracking must not drop the ones it still does see.
+	 */
+	if (flow->protocol == IPPROTO_TCP) {
+		spin_lock_bh(&ct->lock);
+		ct->proto.tcp.seen[0].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+		ct->proto.tcp.seen[1].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+		spin_unlock_bh(&ct->lock);
+	}
+
+	hash = offload_flow_hash_key(flow->saddr, flow->daddr, flow->sport,
+				     flow->dport, flow->protocol);
+
+	spin_lock_bh(&offload_flow_lock);
+	if (offload_flow_count >= offload_fastpath_max_flows ||
+	    offload_flow_find(flow->saddr, flow->daddr, flow->sport,
+			      flow->dport, flow->protocol, flow->iif)) {
+		spin_unlock_bh(&offload_flow_lock);
+		this_cpu_inc(offload_stats.create_fails);
+		dst_release(flow->dst);
+		nf_ct_put(ct);
+		kmem_cache_free(offload_flow_cache, flow);
+		return NF_ACCEPT;
+	}
+	hlist_add_head_rcu(&flow->hnode, &offload_flow_hash[hash]);
+	offload_flow_count++;
+	this_cpu_inc(offload_stats.creates);
+	spin_unlock_bh(&offload_flow_lock);
+
+	return NF_ACCEPT;
+}
+
+/*
+ * offload_flow_flush()
+ *	Remove all flows, or only the ones using a given device.
+ */
+static void offload_flow_flush(const struct net_device *dev)
+{
+	struct offload_flow *flow;
+	struct hlist_node *n, *tmp;
+	unsigned int i;
+
+	spin_lock_bh(&offload_flow_lock);
+	for (i = 0; i < OFFLOAD_FLOW_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(flow, n, tmp, &offload_flow_hash[i], hnode) {
+			if (!dev || flow->dst->dev == dev ||
+			    flow->iif == dev->ifindex)
+				offload_flow_remove(flow);
+		}
+	}
+	spin_unlock_bh(&offload_flow_lock);
+}
+
+/*
+ * offload_flow_gc()
+ *	Periodically drop flows that are stale or idle.
+ */
+static void offload_flow_gc(unsigned long data)
+{
+	struct offload_flow *flow;
+	struct hlist_node *n, *tmp;
+	unsigned int i;
+
+	spin_lock(&offload_flow_lock);
+	for (i = 0; i < OFFLOAD_FLOW_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(flow, n, tmp, &offload_flow_hash[i], hnode) {
+			if (offload_flow_stale(flow) ||
+			    time_after(jiffies, flow->last_used +
+						OFFLOAD_FLOW_IDLE_TIMEOUT))
+				offload_flow_remove(flow);
+		}
+	}
+	spin_unlock(&offload_flow_lock);
+
+	mod_timer(&offload_flow_gc_timer, jiffies + OFFLOAD_FLOW_GC_INTERVAL);
+}
+
+/*
+ * offload_fastpath_netdev_event()
+ *	Drop the flows of an interface going down.
+ */
+static int offload_fastpath_netdev_event(struct notifier_block *this,
+					 unsigned long event, void *ptr)
+{
+	struct net_device *dev = ptr;
+
+	switch (event) {
+	case NETDEV_DOWN:
+	case NETDEV_UNREGISTER:
+	case NETDEV_CHANGEMTU:
+	case NETDEV_CHANGEADDR:
+		offload_flow_flush(dev);
+		break;
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block offload_fastpath_netdev_notifier = {
+	.notifier_call = offload_fastpath_netdev_event,
+};
+
+/*
+ * offload_fastpath_seq_show()
+ *	/proc/net/offload_fastpath: statistics followed by the flow table.
+ */
+static int offload_fastpath_seq_show(struct seq_file *seq, void *v)
+{
+	struct offload_fastpath_stats stats;
+	struct offload_flow *flow;
+	struct hlist_node *n;
+	unsigned int i;
+	int cpu;
+
+	memset(&stats, 0, sizeof(stats));
+	for_each_possible_cpu(cpu) {
+		struct offload_fastpath_stats *s = &per_cpu(offload_stats, cpu);
+
+		stats.hits += s->hits;
+		stats.misses += s->misses;
+		stats.creates += s->creates;
+		stats.create_fails += s->create_fails;
+		stats.evictions += s->evictions;
+	}
+
+	seq_printf(seq, "flows: %u hits: %lu misses: %lu creates: %lu "
+		   "create_fails: %lu evictions: %lu\n",
+		   offload_flow_count, stats.hits, stats.misses,
+		   stats.creates, stats.create_fails, stats.evictions);
+
+	rcu_read_lock_bh();
+	for (i = 0; i < OFFLOAD_FLOW_HASH_SIZE; i++) {
+		hlist_for_each_entry_rcu(flow, n, &offload_flow_hash[i], hnode) {
+			seq_printf(seq, "proto=%u iif=%d src=%pI4:%u dst=%pI4:%u "
+				   "xsrc=%pI4:%u xdst=%pI4:%u dev=%s flags=%x "
+				   "mark=%x prio=%x packets=%lu bytes=%lu\n",
+				   flow->protocol, flow->iif,
+				   &flow->saddr, ntohs(flow->sport),
+				   &flow->daddr, ntohs(flow->dport),
+				   &flow->xlate_saddr, ntohs(flow->xlate_sport),
+				   &flow->xlate_daddr, ntohs(flow->xlate_dport),
+				   flow->dst->dev->name, flow->flags,
+				   flow->mark, flow->priority,
+				   flow->packets, flow->bytes);
+		}
+	}
+	rcu_read_unlock_bh();
+
+	return 0;
+}
+
+static int offload_fastpath_seq_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, offload_fastpath_seq_show, NULL);
+}
+
+/*
+ * offload_fastpath_seq_write()
+ *	Any write flushes the flow table.
+ */
+static ssize_t offload_fastpath_seq_write(struct file *file,
+					  const char __user *buf,
+					  size_t count, loff_t *ppos)
+{
+	offload_flow_flush(NULL);
+	return count;
+}
+
+static const struct file_operations offload_fastpath_fops = {
+	.owner		= THIS_MODULE,
+	.open		= offload_fastpath_seq_open,
+	.read		= seq_read,
+	.write		= offload_fastpath_seq_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static struct nf_hook_ops offload_fastpath_ops __read_mostly = {
+	.hook		= offload_flow_learn,
+	.owner		= THIS_MODULE,
+	.pf		= NFPROTO_IPV4,
+	.hooknum	= NF_INET_POST_ROUTING,
+	.priority	= NF_IP_PRI_LAST,
+};
+
+/*
+ * offload_fastpath_init()
+ *	Module init function.
+ */
+static int __init offload_fastpath_init(void)
+{
+	int ret;
+
+	offload_flow_cache = kmem_cache_create("offload_flow",
+					       sizeof(struct offload_flow),
+					       0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!offload_flow_cache)
+		return -ENOMEM;
+
+	get_random_bytes(&offload_flow_hash_rnd, sizeof(offload_flow_hash_rnd));
+
+	if (!proc_create("offload_fastpath", S_IRUGO | S_IWUSR,
+			 init_net.proc_net, &offload_fastpath_fops)) {
+		ret = -ENOMEM;
+		goto err_proc;
+	}
+
+	ret = register_netdevice_notifier(&offload_fastpath_netdev_notifier);
+	if (ret)
+		goto err_notifier;
+
+	ret = nf_register_hook(&offload_fastpath_ops);
+	if (ret)
+		goto err_hook;
+
+	setup_timer(&offload_flow_gc_timer, offload_flow_gc, 0);
+	mod_timer(&offload_flow_gc_timer, jiffies + OFFLOAD_FLOW_GC_INTERVAL);
+
+	/*
+	 * The receive hook is a single pointer; refuse to load on top of
+	 * another fast path.
+	 */
+	if (cmpxchg((int (**)(struct sk_buff *))&athrs_fast_nat_recv,
+		    NULL, offload_fastpath_recv) != NULL) {
+		ret = -EBUSY;
+		goto err_busy;
+	}
+
+	return 0;
+
+err_busy:
+	del_timer_sync(&offload_flow_gc_timer);
+	nf_unregister_hook(&offload_fastpath_ops);
+err_hook:
+	unregister_netdevice_notifier(&offload_fastpath_netdev_notifier);
+err_notifier:
+	remove_proc_entry("offload_fastpath", init_net.proc_net);
+err_proc:
+	kmem_cache_destroy(offload_flow_cache);
+	return ret;
+}
+
+/*
+ * offload_fastpath_exit()
+ *	Module exit function.
+ */
+static void __exit offload_fastpath_exit(void)
+{
+	RCU_INIT_POINTER(athrs_fast_nat_recv, NULL);
+	synchronize_net();
+
+	nf_unregister_hook(&offload_fastpath_ops);
+	del_timer_sync(&offload_flow_gc_timer);
+	unregister_netdevice_notifier(&offload_fastpath_netdev_notifier);
+	remove_proc_entry("offload_fastpath", init_net.proc_net);
+
+	offload_flow_flush(NULL);
+	rcu_barrier();
+	kmem_cache_destroy(offload_flow_cache);
+}
+
+module_init(offload_fastpath_init);
+module_exit(offload_fastpath_exit);
+
+MODULE_DESCRIPTION("Conntrack based software flow offload");
+MODULE_LICENSE("Dual BSD/GPL");
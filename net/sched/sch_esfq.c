@@ -51,6 +51,9 @@
 #include <net/sock.h>
 #include <net/pkt_sched.h>
 #include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <net/codel.h>
 #ifdef CONFIG_NET_SCH_ESFQ_NFCT
 #include <net/netfilter/nf_conntrack.h>
 #endif
@@ -68,19 +71,32 @@
 	ctorigsrc:	original source IP address
 	ctrepldst:	reply destination IP address
 	ctreplsrc:	reply source IP
+	ctid:		conntrack entry of the packet
+	rxhash:		skb->rxhash, as set by the driver or RPS
 
-*/
+	The last two reuse what was already worked out for the packet
+	instead of hashing its headers again.
 
-#define ESFQ_HEAD 0
-#define ESFQ_TAIL 1
+	Flows are allocated when their first packet arrives and freed
+	once they have been idle for a round, so "flows" only bounds how
+	many can exist at a time; past that, packets share a flow of their
+	hash bucket.  Flows are served deficit round robin, new ones first,
+	as in sch_fq_codel.c, and may each run CoDel on their queue.
+*/
 
-/* This type should contain at least SFQ_DEPTH*2 values */
-typedef unsigned int esfq_index;
+/* Upper bound of the flows option */
+#define ESFQ_MAX_FLOWS	65536
 
-struct esfq_head
+struct esfq_flow
 {
-	esfq_index	next;
-	esfq_index	prev;
+	struct sk_buff		*head;
+	struct sk_buff		*tail;
+	struct hlist_node	hnode;		/* in ht[key & (hash_divisor-1)] */
+	struct list_head	flowchain;	/* in new_flows or old_flows */
+	u32			key;
+	u32			backlog;	/* bytes queued */
+	int			deficit;
+	struct codel_vars	cvars;
 };
 
 struct esfq_sched_data
@@ -89,23 +105,29 @@ struct esfq_sched_data
 	int		perturb_period;
 	unsigned	quantum;	/* Allotment per round: MUST BE >= MTU */
 	int		limit;
-	unsigned	depth;
+	unsigned	depth;		/* Maximal number of flows */
 	unsigned	hash_divisor;
 	unsigned	hash_kind;
+	u32		flags;
+	struct codel_params cparams;
 /* Variables */
 	struct timer_list perturb_timer;
 	int		perturbation;
-	esfq_index	tail;		/* Index of current slot in round */
-	esfq_index	max_depth;	/* Maximal depth */
-
-	esfq_index	*ht;			/* Hash table */
-	esfq_index	*next;			/* Active slots link */
-	short		*allot;			/* Current allotment per slot */
-	unsigned short	*hash;			/* Hash value indexed by slots */
-	struct sk_buff_head	*qs;		/* Slot queue */
-	struct esfq_head	*dep;		/* Linked list of slots, indexed by depth */
+	unsigned	nr_flows;	/* allocated flows */
+
+	struct hlist_head	*ht;		/* Hash table of flows */
+	struct list_head	new_flows;	/* flows that just became active */
+	struct list_head	old_flows;	/* other active flows */
+	struct esfq_flow	overflow;	/* when no flow can be allocated */
+
+	struct codel_stats	cstats;
+	u32		new_flow_count;
+	u32		drop_overlimit;
+	u32		codel_drops;
 };
 
+static struct kmem_cache *esfq_flow_cachep __read_mostly;
+
 /* This contains the info we will hash. */
 struct esfq_packet_info
 {
@@ -119,28 +141,34 @@ struct esfq_packet_info
 	u32	mark;		/* netfilter mark (fwmark) */
 };
 
-static __inline__ unsigned esfq_jhash_1word(struct esfq_sched_data *q,u32 a)
+static __inline__ u32 esfq_jhash_1word(struct esfq_sched_data *q,u32 a)
 {
-	return jhash_1word(a, q->perturbation) & (q->hash_divisor-1);
+	return jhash_1word(a, q->perturbation);
 }
 
-static __inline__ unsigned esfq_jhash_2words(struct esfq_sched_data *q, u32 a, u32 b)
+static __inline__ u32 esfq_jhash_2words(struct esfq_sched_data *q, u32 a, u32 b)
 {
-	return jhash_2words(a, b, q->perturbation) & (q->hash_divisor-1);
+	return jhash_2words(a, b, q->perturbation);
 }
 
-static __inline__ unsigned esfq_jhash_3words(struct esfq_sched_data *q, u32 a, u32 b, u32 c)
+static __inline__ u32 esfq_jhash_3words(struct esfq_sched_data *q, u32 a, u32 b, u32 c)
 {
-	return jhash_3words(a, b, c, q->perturbation) & (q->hash_divisor-1);
+	return jhash_3words(a, b, c, q->perturbation);
 }
 
-static unsigned esfq_hash(struct esfq_sched_data *q, struct sk_buff *skb)
+/* Flow key of a packet; its bucket is key & (hash_divisor-1) */
+static u32 esfq_hash(struct esfq_sched_data *q, struct sk_buff *skb)
 {
 	struct esfq_packet_info info;
 #ifdef CONFIG_NET_SCH_ESFQ_NFCT
 	enum ip_conntrack_info ctinfo;
 	struct nf_conn *ct = nf_ct_get(skb, &ctinfo);
+
+	if (q->hash_kind == TCA_SFQ_HASH_CTID && ct && !nf_ct_is_untracked(ct))
+		return esfq_jhash_1word(q, (u32)(unsigned long)ct);
 #endif
+	if (q->hash_kind == TCA_SFQ_HASH_RXHASH)
+		return esfq_jhash_1word(q, skb_get_rxhash(skb));
 
 	switch (skb->protocol) {
 	case __constant_htons(ETH_P_IP):
@@ -191,7 +219,7 @@ static unsigned esfq_hash(struct esfq_sched_data *q, struct sk_buff *skb)
 	info.ctreplsrc = info.dst;
 	info.ctrepldst = info.src;
 	/* collect conntrack info */
-	if (ct && ct != &nf_conntrack_untracked) {
+	if (ct && !nf_ct_is_untracked(ct)) {
 		if (skb->protocol == __constant_htons(ETH_P_IP)) {
 			info.ctorigsrc = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
 			info.ctorigdst = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip;
@@ -233,6 +261,9 @@ static unsigned esfq_hash(struct esfq_sched_data *q, struct sk_buff *skb)
 			return esfq_jhash_1word(q, info.ctorigsrc);
 		return esfq_jhash_1word(q, info.ctreplsrc);
 	}
+	case TCA_SFQ_HASH_CTID:
+		/* untracked: share the classic hash */
+		break;
 #endif
 	default:
 		if (net_ratelimit())
@@ -241,215 +272,248 @@ static unsigned esfq_hash(struct esfq_sched_data *q, struct sk_buff *skb)
 	return esfq_jhash_3words(q, info.dst, info.src, info.proto);
 }
 
-static inline void esfq_link(struct esfq_sched_data *q, esfq_index x)
+/* remove one skb from head of flow queue */
+static inline struct sk_buff *esfq_dequeue_head(struct esfq_flow *flow)
+{
+	struct sk_buff *skb = flow->head;
+
+	flow->head = skb->next;
+	skb->next = NULL;
+	return skb;
+}
+
+/* add skb to flow queue (tail add) */
+static inline void esfq_queue_add(struct esfq_flow *flow, struct sk_buff *skb)
 {
-	esfq_index p, n;
-	int d = q->qs[x].qlen + q->depth;
-
-	p = d;
-	n = q->dep[d].next;
-	q->dep[x].next = n;
-	q->dep[x].prev = p;
-	q->dep[p].next = q->dep[n].prev = x;
+	if (flow->head == NULL)
+		flow->head = skb;
+	else
+		flow->tail->next = skb;
+	flow->tail = skb;
+	skb->next = NULL;
 }
 
-static inline void esfq_dec(struct esfq_sched_data *q, esfq_index x)
+static struct esfq_flow *esfq_flow_lookup(struct esfq_sched_data *q, u32 key)
 {
-	esfq_index p, n;
+	struct hlist_head *head = &q->ht[key & (q->hash_divisor-1)];
+	struct esfq_flow *flow;
+	struct hlist_node *n;
 
-	n = q->dep[x].next;
-	p = q->dep[x].prev;
-	q->dep[p].next = n;
-	q->dep[n].prev = p;
+	hlist_for_each_entry(flow, n, head, hnode) {
+		if (flow->key == key)
+			return flow;
+	}
 
-	if (n == p && q->max_depth == q->qs[x].qlen + 1)
-		q->max_depth--;
+	if (q->nr_flows < q->depth) {
+		flow = kmem_cache_alloc(esfq_flow_cachep, GFP_ATOMIC);
+		if (flow) {
+			flow->head = NULL;
+			flow->key = key;
+			flow->backlog = 0;
+			INIT_LIST_HEAD(&flow->flowchain);
+			hlist_add_head(&flow->hnode, head);
+			q->nr_flows++;
+			return flow;
+		}
+	}
 
-	esfq_link(q, x);
+	/* Out of flows: collide like SFQ would, or share the spare one */
+	if (!hlist_empty(head))
+		return hlist_entry(head->first, struct esfq_flow, hnode);
+	return &q->overflow;
 }
 
-static inline void esfq_inc(struct esfq_sched_data *q, esfq_index x)
+/* Called once the flow is empty and off the active lists */
+static void esfq_flow_free(struct esfq_sched_data *q, struct esfq_flow *flow)
 {
-	esfq_index p, n;
-	int d;
-
-	n = q->dep[x].next;
-	p = q->dep[x].prev;
-	q->dep[p].next = n;
-	q->dep[n].prev = p;
-	d = q->qs[x].qlen;
-	if (q->max_depth < d)
-		q->max_depth = d;
-
-	esfq_link(q, x);
+	if (flow == &q->overflow)
+		return;
+
+	hlist_del(&flow->hnode);
+	kmem_cache_free(esfq_flow_cachep, flow);
+	q->nr_flows--;
 }
 
-static unsigned int esfq_drop(struct Qdisc *sch)
+/* Drops a packet of the fattest flow, which is returned, or NULL */
+static struct esfq_flow *__esfq_drop(struct Qdisc *sch, unsigned int *lenp)
 {
 	struct esfq_sched_data *q = qdisc_priv(sch);
-	esfq_index d = q->max_depth;
+	struct esfq_flow *flow, *fat = NULL;
 	struct sk_buff *skb;
 	unsigned int len;
 
-	/* Queue is full! Find the longest slot and
-	   drop a packet from it */
+	/* Queue is full! Find the fattest flow and drop a packet
+	   from it.  Only active flows hold packets. */
+	list_for_each_entry(flow, &q->new_flows, flowchain)
+		if (!fat || flow->backlog > fat->backlog)
+			fat = flow;
+	list_for_each_entry(flow, &q->old_flows, flowchain)
+		if (!fat || flow->backlog > fat->backlog)
+			fat = flow;
 
-	if (d > 1) {
-		esfq_index x = q->dep[d+q->depth].next;
-		skb = q->qs[x].prev;
-		len = skb->len;
-		__skb_unlink(skb, &q->qs[x]);
-		kfree_skb(skb);
-		esfq_dec(q, x);
-		sch->q.qlen--;
-		sch->qstats.drops++;
-		sch->qstats.backlog -= len;
-		return len;
-	}
+	if (!fat || !fat->head)
+		return NULL;
 
-	if (d == 1) {
-		/* It is difficult to believe, but ALL THE SLOTS HAVE LENGTH 1. */
-		d = q->next[q->tail];
-		q->next[q->tail] = q->next[d];
-		q->allot[q->next[d]] += q->quantum;
-		skb = q->qs[d].prev;
-		len = skb->len;
-		__skb_unlink(skb, &q->qs[d]);
-		kfree_skb(skb);
-		esfq_dec(q, d);
-		sch->q.qlen--;
-		q->ht[q->hash[d]] = q->depth;
-		sch->qstats.drops++;
-		sch->qstats.backlog -= len;
-		return len;
-	}
+	skb = esfq_dequeue_head(fat);
+	len = qdisc_pkt_len(skb);
+	fat->backlog -= len;
+	kfree_skb(skb);
+	sch->q.qlen--;
+	sch->qstats.drops++;
+	sch->qstats.backlog -= len;
+	*lenp = len;
+	return fat;
+}
 
-	return 0;
+static unsigned int esfq_drop(struct Qdisc *sch)
+{
+	unsigned int len = 0;
+
+	__esfq_drop(sch, &len);
+	return len;
 }
 
-static void esfq_q_enqueue(struct sk_buff *skb, struct esfq_sched_data *q, unsigned int end)
+static struct esfq_flow *esfq_q_enqueue(struct sk_buff *skb, struct esfq_sched_data *q)
 {
-	unsigned hash = esfq_hash(q, skb);
-	unsigned depth = q->depth;
-	esfq_index x;
-
-	x = q->ht[hash];
-	if (x == depth) {
-		q->ht[hash] = x = q->dep[depth].next;
-		q->hash[x] = hash;
-	}
+	struct esfq_flow *flow = esfq_flow_lookup(q, esfq_hash(q, skb));
 
-	if (end == ESFQ_TAIL)
-		__skb_queue_tail(&q->qs[x], skb);
-	else
-		__skb_queue_head(&q->qs[x], skb);
-
-	esfq_inc(q, x);
-	if (q->qs[x].qlen == 1) {		/* The flow is new */
-		if (q->tail == depth) {	/* It is the first flow */
-			q->tail = x;
-			q->next[x] = x;
-			q->allot[x] = q->quantum;
-		} else {
-			q->next[x] = q->next[q->tail];
-			q->next[q->tail] = x;
-			q->tail = x;
-		}
+	esfq_queue_add(flow, skb);
+	flow->backlog += qdisc_pkt_len(skb);
+
+	if (list_empty(&flow->flowchain)) {	/* The flow is new */
+		list_add_tail(&flow->flowchain, &q->new_flows);
+		codel_vars_init(&flow->cvars);
+		q->new_flow_count++;
+		flow->deficit = q->quantum;
 	}
+	return flow;
 }
 
 static int esfq_enqueue(struct sk_buff *skb, struct Qdisc* sch)
 {
 	struct esfq_sched_data *q = qdisc_priv(sch);
-	esfq_q_enqueue(skb, q, ESFQ_TAIL);
-	sch->qstats.backlog += skb->len;
-	if (++sch->q.qlen < q->limit-1) {
-		sch->bstats.bytes += skb->len;
-		sch->bstats.packets++;
-		return 0;
-	}
+	struct esfq_flow *flow;
+	unsigned int len;
 
-	sch->qstats.drops++;
-	esfq_drop(sch);
-	return NET_XMIT_CN;
+	codel_set_enqueue_time(skb);
+	flow = esfq_q_enqueue(skb, q);
+	sch->qstats.backlog += qdisc_pkt_len(skb);
+	if (++sch->q.qlen < q->limit)
+		return NET_XMIT_SUCCESS;
+
+	q->drop_overlimit++;
+	/* Return Congestion Notification only if we dropped a packet
+	 * from this flow.
+	 */
+	if (__esfq_drop(sch, &len) == flow)
+		return NET_XMIT_CN;
+
+	/* As we dropped a packet, better let upper stack know this */
+	qdisc_tree_decrease_qlen(sch, 1);
+	return NET_XMIT_SUCCESS;
 }
 
-static struct sk_buff *esfq_peek(struct Qdisc* sch)
+/* Takes the next packet of the flow owning vars, for codel_dequeue().
+ * Backlog is left to the caller. */
+static struct sk_buff *esfq_flow_dequeue(struct codel_vars *vars, struct Qdisc *sch)
 {
-	struct esfq_sched_data *q = qdisc_priv(sch);
-	esfq_index a;
-
-	/* No active slots */
-	if (q->tail == q->depth)
-		return NULL;
+	struct esfq_flow *flow = container_of(vars, struct esfq_flow, cvars);
+	struct sk_buff *skb = NULL;
 
-	a = q->next[q->tail];
-	return skb_peek(&q->qs[a]);
+	if (flow->head) {
+		skb = esfq_dequeue_head(flow);
+		flow->backlog -= qdisc_pkt_len(skb);
+		sch->q.qlen--;
+	}
+	return skb;
 }
 
-static struct sk_buff *esfq_q_dequeue(struct esfq_sched_data *q)
+static struct sk_buff *esfq_dequeue(struct Qdisc* sch)
 {
+	struct esfq_sched_data *q = qdisc_priv(sch);
+	struct esfq_flow *flow;
+	struct list_head *head;
 	struct sk_buff *skb;
-	unsigned depth = q->depth;
-	esfq_index a, old_a;
-
-	/* No active slots */
-	if (q->tail == depth)
-		return NULL;
+	u32 prev_drop_count;
+
+begin:
+	head = &q->new_flows;
+	if (list_empty(head)) {
+		head = &q->old_flows;
+		if (list_empty(head))
+			return NULL;
+	}
+	flow = list_first_entry(head, struct esfq_flow, flowchain);
 
-	a = old_a = q->next[q->tail];
+	if (flow->deficit <= 0) {
+		flow->deficit += q->quantum;
+		list_move_tail(&flow->flowchain, &q->old_flows);
+		goto begin;
+	}
 
-	/* Grab packet */
-	skb = __skb_dequeue(&q->qs[a]);
-	esfq_dec(q, a);
+	if (q->flags & TC_ESFQ_CODEL) {
+		prev_drop_count = q->cstats.drop_count;
+		skb = codel_dequeue(sch, &q->cparams, &flow->cvars, &q->cstats,
+				    esfq_flow_dequeue);
+		q->codel_drops += q->cstats.drop_count - prev_drop_count;
+	} else {
+		skb = esfq_flow_dequeue(&flow->cvars, sch);
+		if (skb)
+			sch->qstats.backlog -= qdisc_pkt_len(skb);
+	}
 
-	/* Is the slot empty? */
-	if (q->qs[a].qlen == 0) {
-		q->ht[q->hash[a]] = depth;
-		a = q->next[a];
-		if (a == old_a) {
-			q->tail = depth;
-			return skb;
+	if (!skb) {
+		/* force a pass through old_flows to prevent starvation */
+		if ((head == &q->new_flows) && !list_empty(&q->old_flows))
+			list_move_tail(&flow->flowchain, &q->old_flows);
+		else {
+			list_del_init(&flow->flowchain);
+			esfq_flow_free(q, flow);
 		}
-		q->next[q->tail] = a;
-		q->allot[a] += q->quantum;
-	} else if ((q->allot[a] -= skb->len) <= 0) {
-		q->tail = a;
-		a = q->next[a];
-		q->allot[a] += q->quantum;
+		goto begin;
+	}
+	qdisc_bstats_update(sch, skb);
+	flow->deficit -= qdisc_pkt_len(skb);
+	/* We cant call qdisc_tree_decrease_qlen() if our qlen is 0,
+	 * or HTB crashes. Defer it for next round.
+	 */
+	if (q->cstats.drop_count && sch->q.qlen) {
+		qdisc_tree_decrease_qlen(sch, q->cstats.drop_count);
+		q->cstats.drop_count = 0;
 	}
-
 	return skb;
 }
 
-static struct sk_buff *esfq_dequeue(struct Qdisc* sch)
+/* Unlinks every queued packet onto list, freeing all flows */
+static void esfq_q_purge(struct esfq_sched_data *q, struct sk_buff_head *list)
 {
-	struct esfq_sched_data *q = qdisc_priv(sch);
-	struct sk_buff *skb;
+	struct esfq_flow *flow, *next;
+	struct list_head *heads[] = { &q->new_flows, &q->old_flows };
+	int i;
 
-	skb = esfq_q_dequeue(q);
-	if (skb == NULL)
-		return NULL;
-	sch->q.qlen--;
-	sch->qstats.backlog -= skb->len;
-	return skb;
+	for (i = 0; i < ARRAY_SIZE(heads); i++) {
+		list_for_each_entry_safe(flow, next, heads[i], flowchain) {
+			while (flow->head)
+				__skb_queue_tail(list, esfq_dequeue_head(flow));
+			flow->backlog = 0;
+			list_del_init(&flow->flowchain);
+			esfq_flow_free(q, flow);
+		}
+	}
 }
 
 static void esfq_q_destroy(struct esfq_sched_data *q)
 {
+	struct sk_buff_head list;
+
 	del_timer(&q->perturb_timer);
-	if(q->ht)
+	if (q->ht) {
+		__skb_queue_head_init(&list);
+		esfq_q_purge(q, &list);
+		__skb_queue_purge(&list);
 		kfree(q->ht);
-	if(q->dep)
-		kfree(q->dep);
-	if(q->next)
-		kfree(q->next);
-	if(q->allot)
-		kfree(q->allot);
-	if(q->hash)
-		kfree(q->hash);
-	if(q->qs)
-		kfree(q->qs);
+		q->ht = NULL;
+	}
 }
 
 static void esfq_destroy(struct Qdisc *sch)
@@ -461,10 +525,14 @@ static void esfq_destroy(struct Qdisc *sch)
 
 static void esfq_reset(struct Qdisc* sch)
 {
-	struct sk_buff *skb;
+	struct esfq_sched_data *q = qdisc_priv(sch);
+	struct sk_buff_head list;
 
-	while ((skb = esfq_dequeue(sch)) != NULL)
-		kfree_skb(skb);
+	__skb_queue_head_init(&list);
+	esfq_q_purge(q, &list);
+	__skb_queue_purge(&list);
+	sch->q.qlen = 0;
+	sch->qstats.backlog = 0;
 }
 
 static void esfq_perturbation(unsigned long arg)
@@ -488,6 +556,7 @@ static unsigned int esfq_check_hash(unsigned int kind)
 	case TCA_SFQ_HASH_CTREPLDST:
 	case TCA_SFQ_HASH_CTREPLSRC:
 	case TCA_SFQ_HASH_CTNATCHG:
+	case TCA_SFQ_HASH_CTID:
 #ifndef CONFIG_NET_SCH_ESFQ_NFCT
 	{
 		if (net_ratelimit())
@@ -499,6 +568,7 @@ static unsigned int esfq_check_hash(unsigned int kind)
 	case TCA_SFQ_HASH_DST:
 	case TCA_SFQ_HASH_SRC:
 	case TCA_SFQ_HASH_FWMARK:
+	case TCA_SFQ_HASH_RXHASH:
 		return kind;
 	default:
 	{
@@ -512,72 +582,61 @@ static unsigned int esfq_check_hash(unsigned int kind)
 static int esfq_q_init(struct esfq_sched_data *q, struct nlattr *opt)
 {
 	struct tc_esfq_qopt *ctl = nla_data(opt);
-	esfq_index p = ~0U/2;
+	struct tc_esfq_qopt_v1 *ctl_v1 = NULL;
 	int i;
 
 	if (opt && opt->nla_len < nla_attr_size(sizeof(*ctl)))
 		return -EINVAL;
+	if (opt && opt->nla_len >= nla_attr_size(sizeof(*ctl_v1)))
+		ctl_v1 = nla_data(opt);
 
 	q->perturbation = 0;
 	q->hash_kind = TCA_SFQ_HASH_CLASSIC;
-	q->max_depth = 0;
+	q->flags = 0;
+	codel_params_init(&q->cparams);
 	if (opt == NULL) {
 		q->perturb_period = 0;
 		q->hash_divisor = 1024;
-		q->tail = q->limit = q->depth = 128;
+		q->limit = q->depth = 128;
 
 	} else {
-		struct tc_esfq_qopt *ctl = nla_data(opt);
 		if (ctl->quantum)
 			q->quantum = ctl->quantum;
 		q->perturb_period = ctl->perturb_period*HZ;
 		q->hash_divisor = ctl->divisor ? : 1024;
-		q->tail = q->limit = q->depth = ctl->flows ? : 128;
+		q->depth = ctl->flows ? : 128;
 
-		if ( q->depth > p - 1 )
+		if (q->depth > ESFQ_MAX_FLOWS || !is_power_of_2(q->hash_divisor))
 			return -EINVAL;
 
-		if (ctl->limit)
-			q->limit = min_t(u32, ctl->limit, q->depth);
+		q->limit = ctl->limit ? : q->depth;
 
 		if (ctl->hash_kind) {
 			q->hash_kind = esfq_check_hash(ctl->hash_kind);
 		}
 	}
 
-	q->ht = kmalloc(q->hash_divisor*sizeof(esfq_index), GFP_KERNEL);
+	if (ctl_v1) {
+		q->flags = ctl_v1->flags;
+		if (ctl_v1->target)
+			q->cparams.target = ((u64)ctl_v1->target * NSEC_PER_USEC) >> CODEL_SHIFT;
+		if (ctl_v1->interval)
+			q->cparams.interval = ((u64)ctl_v1->interval * NSEC_PER_USEC) >> CODEL_SHIFT;
+		q->cparams.ecn = !!(q->flags & TC_ESFQ_ECN);
+	}
+
+	q->ht = kmalloc(q->hash_divisor*sizeof(struct hlist_head), GFP_KERNEL);
 	if (!q->ht)
-		goto err_case;
-	q->dep = kmalloc((1+q->depth*2)*sizeof(struct esfq_head), GFP_KERNEL);
-	if (!q->dep)
-		goto err_case;
-	q->next = kmalloc(q->depth*sizeof(esfq_index), GFP_KERNEL);
-	if (!q->next)
-		goto err_case;
-	q->allot = kmalloc(q->depth*sizeof(short), GFP_KERNEL);
-	if (!q->allot)
-		goto err_case;
-	q->hash = kmalloc(q->depth*sizeof(unsigned short), GFP_KERNEL);
-	if (!q->hash)
-		goto err_case;
-	q->qs = kmalloc(q->depth*sizeof(struct sk_buff_head), GFP_KERNEL);
-	if (!q->qs)
-		goto err_case;
+		return -ENOBUFS;
 
 	for (i=0; i< q->hash_divisor; i++)
-		q->ht[i] = q->depth;
-	for (i=0; i<q->depth; i++) {
-		skb_queue_head_init(&q->qs[i]);
-		q->dep[i+q->depth].next = i+q->depth;
-		q->dep[i+q->depth].prev = i+q->depth;
-	}
-
-	for (i=0; i<q->depth; i++)
-		esfq_link(q, i);
+		INIT_HLIST_HEAD(&q->ht[i]);
+	INIT_LIST_HEAD(&q->new_flows);
+	INIT_LIST_HEAD(&q->old_flows);
+	q->overflow.head = NULL;
+	q->overflow.backlog = 0;
+	INIT_LIST_HEAD(&q->overflow.flowchain);
 	return 0;
-err_case:
-	esfq_q_destroy(q);
-	return -ENOBUFS;
 }
 
 static int esfq_init(struct Qdisc *sch, struct nlattr *opt)
@@ -586,12 +645,14 @@ static int esfq_init(struct Qdisc *sch, struct nlattr *opt)
 	int err;
 
 	q->quantum = psched_mtu(qdisc_dev(sch)); /* default */
-	if ((err = esfq_q_init(q, opt)))
-		return err;
-
+	codel_stats_init(&q->cstats);
 	init_timer(&q->perturb_timer);
 	q->perturb_timer.data = (unsigned long)sch;
 	q->perturb_timer.function = esfq_perturbation;
+
+	if ((err = esfq_q_init(q, opt)))
+		return err;
+
 	if (q->perturb_period) {
 		q->perturb_timer.expires = jiffies + q->perturb_period;
 		add_timer(&q->perturb_timer);
@@ -604,7 +665,9 @@ static int esfq_change(struct Qdisc *sch, struct nlattr *opt)
 {
 	struct esfq_sched_data *q = qdisc_priv(sch);
 	struct esfq_sched_data new;
+	struct sk_buff_head list;
 	struct sk_buff *skb;
+	unsigned int dropped = 0;
 	int err;
 
 	/* set up new queue */
@@ -613,13 +676,12 @@ static int esfq_change(struct Qdisc *sch, struct nlattr *opt)
 	if ((err = esfq_q_init(&new, opt)))
 		return err;
 
-	/* copy all packets from the old queue to the new queue */
+	/* take all packets out of the old flows */
+	__skb_queue_head_init(&list);
 	sch_tree_lock(sch);
-	while ((skb = esfq_q_dequeue(q)) != NULL)
-		esfq_q_enqueue(skb, &new, ESFQ_TAIL);
-
-	/* clean up the old queue */
-	esfq_q_destroy(q);
+	del_timer(&q->perturb_timer);
+	esfq_q_purge(q, &list);
+	kfree(q->ht);
 
 	/* copy elements of the new queue into the old queue */
 	q->perturb_period = new.perturb_period;
@@ -628,21 +690,29 @@ static int esfq_change(struct Qdisc *sch, struct nlattr *opt)
 	q->depth          = new.depth;
 	q->hash_divisor   = new.hash_divisor;
 	q->hash_kind      = new.hash_kind;
-	q->tail           = new.tail;
-	q->max_depth      = new.max_depth;
-	q->ht    = new.ht;
-	q->dep   = new.dep;
-	q->next  = new.next;
-	q->allot = new.allot;
-	q->hash  = new.hash;
-	q->qs    = new.qs;
+	q->flags          = new.flags;
+	q->cparams        = new.cparams;
+	q->ht             = new.ht;
+	INIT_LIST_HEAD(&q->new_flows);
+	INIT_LIST_HEAD(&q->old_flows);
+	INIT_LIST_HEAD(&q->overflow.flowchain);
+	if (!q->perturb_period)
+		q->perturbation = 0;
+
+	/* and back into flows of the new hash, keeping their enqueue time */
+	while ((skb = __skb_dequeue(&list)) != NULL)
+		esfq_q_enqueue(skb, q);
+
+	while (sch->q.qlen > q->limit) {
+		esfq_drop(sch);
+		dropped++;
+	}
+	qdisc_tree_decrease_qlen(sch, dropped);
 
 	/* finish up */
 	if (q->perturb_period) {
 		q->perturb_timer.expires = jiffies + q->perturb_period;
 		add_timer(&q->perturb_timer);
-	} else {
-		q->perturbation = 0;
 	}
 	sch_tree_unlock(sch);
 	return 0;
@@ -652,15 +722,20 @@ static int esfq_dump(struct Qdisc *sch, struct sk_buff *skb)
 {
 	struct esfq_sched_data *q = qdisc_priv(sch);
 	unsigned char *b = skb_tail_pointer(skb);
-	struct tc_esfq_qopt opt;
+	struct tc_esfq_qopt_v1 opt;
 
-	opt.quantum = q->quantum;
-	opt.perturb_period = q->perturb_period/HZ;
+	memset(&opt, 0, sizeof(opt));
+	opt.v0.quantum = q->quantum;
+	opt.v0.perturb_period = q->perturb_period/HZ;
 
-	opt.limit = q->limit;
-	opt.divisor = q->hash_divisor;
-	opt.flows = q->depth;
-	opt.hash_kind = q->hash_kind;
+	opt.v0.limit = q->limit;
+	opt.v0.divisor = q->hash_divisor;
+	opt.v0.flows = q->depth;
+	opt.v0.hash_kind = q->hash_kind;
+
+	opt.flags = q->flags;
+	opt.target = codel_time_to_us(q->cparams.target);
+	opt.interval = codel_time_to_us(q->cparams.interval);
 
 	NLA_PUT(skb, TCA_OPTIONS, sizeof(opt), &opt);
 
@@ -671,6 +746,20 @@ nla_put_failure:
 	return -1;
 }
 
+static int esfq_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct esfq_sched_data *q = qdisc_priv(sch);
+	struct tc_esfq_xstats st = {
+		.flows		= q->nr_flows,
+		.new_flow_count	= q->new_flow_count,
+		.drop_overlimit	= q->drop_overlimit,
+		.codel_drops	= q->codel_drops,
+		.ecn_mark	= q->cstats.ecn_mark,
+	};
+
+	return gnet_stats_copy_app(d, &st, sizeof(st));
+}
+
 static struct Qdisc_ops esfq_qdisc_ops =
 {
 	.next		=	NULL,
@@ -679,23 +768,34 @@ static struct Qdisc_ops esfq_qdisc_ops =
 	.priv_size	=	sizeof(struct esfq_sched_data),
 	.enqueue	=	esfq_enqueue,
 	.dequeue	=	esfq_dequeue,
-	.peek		=	esfq_peek,
+	.peek		=	qdisc_peek_dequeued,
 	.drop		=	esfq_drop,
 	.init		=	esfq_init,
 	.reset		=	esfq_reset,
 	.destroy	=	esfq_destroy,
 	.change		=	esfq_change,
 	.dump		=	esfq_dump,
+	.dump_stats	=	esfq_dump_stats,
 	.owner		=	THIS_MODULE,
 };
 
 static int __init esfq_module_init(void)
 {
-	return register_qdisc(&esfq_qdisc_ops);
+	int err;
+
+	esfq_flow_cachep = KMEM_CACHE(esfq_flow, 0);
+	if (!esfq_flow_cachep)
+		return -ENOMEM;
+
+	err = register_qdisc(&esfq_qdisc_ops);
+	if (err)
+		kmem_cache_destroy(esfq_flow_cachep);
+	return err;
 }
 static void __exit esfq_module_exit(void)
 {
 	unregister_qdisc(&esfq_qdisc_ops);
+	kmem_cache_destroy(esfq_flow_cachep);
 }
 module_init(esfq_module_init)
 module_exit(esfq_module_exit)
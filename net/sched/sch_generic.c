@@ -27,6 +27,20 @@
 #include <linux/slab.h>
 #include <net/pkt_sched.h>
 #include <net/dst.h>
+#ifdef CONFIG_STOPWATCH_NET
+#define __STOPWATCH_USE__
+#endif
+#include <linux/stopwatch.h>
+
+DEFINE_STOPWATCH(qdisc_dequeue);
+
+#ifdef __STOPWATCH_USE__
+static int __init qdisc_stopwatch_init(void)
+{
+	return REGISTER_STOPWATCH(qdisc_dequeue);
+}
+subsys_initcall(qdisc_stopwatch_init);
+#endif
 
 /* Main transmission queue. */
 
@@ -174,9 +188,12 @@ static inline int qdisc_restart(struct Qdisc *q)
 	struct net_device *dev;
 	spinlock_t *root_lock;
 	struct sk_buff *skb;
+	STOPWATCH_TIMER(t);
 
 	/* Dequeue packet */
+	STOPWATCH_TIMER_START(t);
 	skb = dequeue_skb(q);
+	STOPWATCH_TIMER_STOP(qdisc_dequeue, t);
 	if (unlikely(!skb))
 		return 0;
 	WARN_ON_ONCE(skb_dst_is_noref(skb));